@@ -0,0 +1,402 @@
+#include "AnnexBRewriter.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define ANNEXB_REWRITER_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#define SIMD_TARGET_AVX2
+#else
+#include <immintrin.h>
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// HEVC NAL unit types of the parameter sets
+static const uint8_t NAL_VPS = 32;
+static const uint8_t NAL_SPS = 33;
+static const uint8_t NAL_PPS = 34;
+
+static size_t scanScalar(const uint8_t* pData, size_t uiLength, size_t uiPos)
+{
+  // the third byte of a start code is 1: anything above it rules out three positions at once
+  size_t i = uiPos;
+  while (i + 2 < uiLength)
+  {
+    if (pData[i + 2] > 1) i += 3;
+    else if (pData[i + 2] == 1 && pData[i + 1] == 0 && pData[i] == 0) return i;
+    else ++i;
+  }
+  return uiLength;
+}
+
+#ifdef ANNEXB_REWRITER_X86
+
+static inline unsigned countTrailingZeros(unsigned uiMask)
+{
+#if defined(_MSC_VER)
+  unsigned long ulIndex;
+  _BitScanForward(&ulIndex, uiMask);
+  return static_cast<unsigned>(ulIndex);
+#else
+  return static_cast<unsigned>(__builtin_ctz(uiMask));
+#endif
+}
+
+static size_t scanSse2(const uint8_t* pData, size_t uiLength, size_t uiPos)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  size_t i = uiPos;
+  for (; i + 18 <= uiLength; i += 16)
+  {
+    const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pData + i));
+    const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pData + i + 1));
+    const __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pData + i + 2));
+    const __m128i match = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)), _mm_cmpeq_epi8(b2, one));
+    const unsigned uiMask = static_cast<unsigned>(_mm_movemask_epi8(match));
+    if (uiMask) return i + countTrailingZeros(uiMask);
+  }
+  return scanScalar(pData, uiLength, i);
+}
+
+SIMD_TARGET_AVX2 static size_t scanAvx2(const uint8_t* pData, size_t uiLength, size_t uiPos)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+  size_t i = uiPos;
+  for (; i + 34 <= uiLength; i += 32)
+  {
+    const __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pData + i));
+    const __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pData + i + 1));
+    const __m256i b2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pData + i + 2));
+    const __m256i match = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)), _mm256_cmpeq_epi8(b2, one));
+    const unsigned uiMask = static_cast<unsigned>(_mm256_movemask_epi8(match));
+    if (uiMask) return i + countTrailingZeros(uiMask);
+  }
+  return scanScalar(pData, uiLength, i);
+}
+#endif
+
+AnnexBRewriter::AnnexBRewriter()
+  :m_eInstructionSet(IS_SCALAR),
+  m_pScanKernel(&scanScalar)
+{
+  setInstructionSet(detectInstructionSet());
+}
+
+void AnnexBRewriter::setInstructionSet(InstructionSet eInstructionSet)
+{
+  m_eInstructionSet = std::min(eInstructionSet, detectInstructionSet());
+  switch (m_eInstructionSet)
+  {
+#ifdef ANNEXB_REWRITER_X86
+  case IS_AVX2:
+    m_pScanKernel = &scanAvx2;
+    break;
+  case IS_SSE2:
+    m_pScanKernel = &scanSse2;
+    break;
+#endif
+  default:
+    m_eInstructionSet = IS_SCALAR;
+    m_pScanKernel = &scanScalar;
+    break;
+  }
+}
+
+AnnexBRewriter::InstructionSet AnnexBRewriter::detectInstructionSet()
+{
+#ifdef ANNEXB_REWRITER_X86
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  const int iMaxLeaf = info[0];
+  __cpuid(info, 1);
+  const bool bSse2 = (info[3] & (1 << 26)) != 0;
+  const bool bOsAvx = ((info[2] & (1 << 27)) != 0) && ((info[2] & (1 << 28)) != 0) && ((_xgetbv(0) & 0x6) == 0x6);
+  bool bAvx2 = false;
+  if (bOsAvx && iMaxLeaf >= 7)
+  {
+    __cpuidex(info, 7, 0);
+    bAvx2 = (info[1] & (1 << 5)) != 0;
+  }
+#else
+  __builtin_cpu_init();
+  const bool bSse2 = __builtin_cpu_supports("sse2") != 0;
+  const bool bAvx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+  if (bAvx2 && bSse2) return IS_AVX2;
+  if (bSse2) return IS_SSE2;
+#endif
+  return IS_SCALAR;
+}
+
+const char* AnnexBRewriter::toString(InstructionSet eInstructionSet)
+{
+  switch (eInstructionSet)
+  {
+  case IS_AVX2:
+    return "avx2";
+  case IS_SSE2:
+    return "sse2";
+  default:
+    return "scalar";
+  }
+}
+
+static inline void writeLength(uint8_t* p, size_t uiLength)
+{
+  p[0] = static_cast<uint8_t>(uiLength >> 24);
+  p[1] = static_cast<uint8_t>(uiLength >> 16);
+  p[2] = static_cast<uint8_t>(uiLength >> 8);
+  p[3] = static_cast<uint8_t>(uiLength);
+}
+
+bool AnnexBRewriter::isLengthPrefixed(const uint8_t* pData, size_t uiLength)
+{
+  size_t uiPos = 0;
+  while (uiPos + LENGTH_SIZE < uiLength)
+  {
+    const size_t uiNal = (static_cast<size_t>(pData[uiPos]) << 24) | (pData[uiPos + 1] << 16) | (pData[uiPos + 2] << 8) | pData[uiPos + 3];
+    // a NAL unit has a 2 byte header with the forbidden_zero_bit clear
+    if (uiNal < 2 || (pData[uiPos + LENGTH_SIZE] & 0x80)) return false;
+    uiPos += LENGTH_SIZE + uiNal;
+  }
+  return uiPos == uiLength && uiLength > 0;
+}
+
+bool AnnexBRewriter::toLengthPrefixed(uint8_t* pData, size_t uiLength, size_t uiCapacity, size_t& uiNewLength)
+{
+  if (isLengthPrefixed(pData, uiLength))
+  {
+    uiNewLength = uiLength;
+    return true;
+  }
+  // only leading_zero_8bits may come before the first start code
+  size_t uiPos = findStartCode(pData, uiLength, 0);
+  if (uiPos == uiLength || std::find_if(pData, pData + uiPos, [](uint8_t uiByte) { return uiByte != 0; }) != pData + uiPos)
+  {
+    m_sLastError = "Access unit of " + std::to_string(uiLength) + " bytes does not start with a start code";
+    return false;
+  }
+
+  m_vNals.clear();
+  size_t uiNewOffset = 0;
+  while (uiPos < uiLength)
+  {
+    const size_t uiPayload = uiPos + 3;
+    const size_t uiNext = findStartCode(pData, uiLength, uiPayload);
+    // trailing_zero_8bits and the first byte of a 4 byte start code are not part of the NAL unit
+    size_t uiEnd = uiNext;
+    while (uiEnd > uiPayload && pData[uiEnd - 1] == 0) --uiEnd;
+    uiNewOffset += LENGTH_SIZE;
+    const Nal nal = { uiPayload, uiNewOffset, uiEnd - uiPayload };
+    m_vNals.push_back(nal);
+    uiNewOffset += nal.uiLength;
+    uiPos = uiNext;
+  }
+  if (uiNewOffset > uiCapacity)
+  {
+    m_sLastError = "Length-prefixed access unit of " + std::to_string(uiNewOffset) + " bytes exceeds buffer of " + std::to_string(uiCapacity);
+    return false;
+  }
+
+  // NAL units that keep their place or move down are done front to back, those that move up
+  // back to front, so that no NAL unit is overwritten before it has been moved
+  for (size_t i = 0; i < m_vNals.size(); ++i)
+  {
+    const Nal& nal = m_vNals[i];
+    if (nal.uiNewOffset > nal.uiOffset) continue;
+    if (nal.uiNewOffset < nal.uiOffset) memmove(pData + nal.uiNewOffset, pData + nal.uiOffset, nal.uiLength);
+    writeLength(pData + nal.uiNewOffset - LENGTH_SIZE, nal.uiLength);
+  }
+  for (size_t i = m_vNals.size(); i-- > 0;)
+  {
+    const Nal& nal = m_vNals[i];
+    if (nal.uiNewOffset <= nal.uiOffset) continue;
+    memmove(pData + nal.uiNewOffset, pData + nal.uiOffset, nal.uiLength);
+    writeLength(pData + nal.uiNewOffset - LENGTH_SIZE, nal.uiLength);
+  }
+  uiNewLength = uiNewOffset;
+  return true;
+}
+
+/// NAL units that belong to the picture before them: suffix SEI, end of sequence and bitstream, filler data
+static bool isSuffixNal(uint8_t uiType)
+{
+  return (uiType >= 36 && uiType <= 38) || uiType == 40;
+}
+
+void AnnexBRewriter::findSliceEnds(const uint8_t* pData, size_t uiLength, bool bLengthPrefixed, std::vector<size_t>& vEnds) const
+{
+  vEnds.clear();
+  bool bSlice = false;
+  // a group ends before the first NAL unit after a slice segment that is neither a slice
+  // segment nor a suffix NAL unit, which starts the next group
+  forEachNal(pData, uiLength, bLengthPrefixed, [&](size_t uiStart, size_t uiPayload, size_t)
+  {
+    const uint8_t uiType = (pData[uiPayload] >> 1) & 0x3F;
+    if (bSlice && !isSuffixNal(uiType))
+    {
+      vEnds.push_back(uiStart);
+      bSlice = false;
+    }
+    if (uiType < 32) bSlice = true;
+  });
+  vEnds.push_back(uiLength);
+}
+
+/// Strips the start code of an Annex B NAL unit
+static std::string toBareNal(const std::string& sNal)
+{
+  size_t uiStart = 0;
+  while (uiStart < sNal.length() && sNal[uiStart] == 0) ++uiStart;
+  if (uiStart >= 2 && uiStart < sNal.length() && sNal[uiStart] == 1) return sNal.substr(uiStart + 1);
+  return sNal;
+}
+
+/// Reads the RBSP of a NAL unit, i.e. without its emulation prevention bytes
+class RbspReader
+{
+public:
+  explicit RbspReader(const std::string& sNal)
+    :m_uiBit(0)
+  {
+    int iZeros = 0;
+    for (size_t i = 0; i < sNal.length(); ++i)
+    {
+      const uint8_t uiByte = static_cast<uint8_t>(sNal[i]);
+      if (iZeros >= 2 && uiByte == 3)
+      {
+        iZeros = 0;
+        continue;
+      }
+      iZeros = uiByte == 0 ? iZeros + 1 : 0;
+      m_vRbsp.push_back(uiByte);
+    }
+  }
+
+  bool hasBits(size_t uiBits) const { return m_uiBit + uiBits <= m_vRbsp.size() * 8; }
+  const uint8_t* getBytes() const { return m_vRbsp.empty() ? NULL : &m_vRbsp[0]; }
+
+  uint32_t readBits(unsigned uiBits)
+  {
+    uint32_t uiValue = 0;
+    for (unsigned i = 0; i < uiBits; ++i, ++m_uiBit)
+    {
+      const uint8_t uiByte = m_uiBit / 8 < m_vRbsp.size() ? m_vRbsp[m_uiBit / 8] : 0;
+      uiValue = (uiValue << 1) | ((uiByte >> (7 - m_uiBit % 8)) & 1);
+    }
+    return uiValue;
+  }
+
+  void skipBits(size_t uiBits) { m_uiBit += uiBits; }
+
+  uint32_t readUe()
+  {
+    unsigned uiZeros = 0;
+    while (hasBits(1) && readBits(1) == 0 && uiZeros < 32) ++uiZeros;
+    return ((1u << uiZeros) - 1) + readBits(uiZeros);
+  }
+
+private:
+  std::vector<uint8_t> m_vRbsp;
+  size_t m_uiBit;
+};
+
+static void appendNalArray(std::string& sHvcc, uint8_t uiType, const std::string& sNal)
+{
+  // array_completeness: every parameter set of the stream is in the record
+  sHvcc += static_cast<char>(0x80 | uiType);
+  sHvcc += static_cast<char>(0);
+  sHvcc += static_cast<char>(1);
+  sHvcc += static_cast<char>(sNal.length() >> 8);
+  sHvcc += static_cast<char>(sNal.length() & 0xFF);
+  sHvcc += sNal;
+}
+
+bool AnnexBRewriter::buildHvcc(const std::string& sVps, const std::string& sSps, const std::string& sPps, std::string& sHvcc, unsigned& uiProfile, unsigned& uiLevel)
+{
+  const std::string sBareVps = toBareNal(sVps);
+  const std::string sBareSps = toBareNal(sSps);
+  const std::string sBarePps = toBareNal(sPps);
+  if (sBareVps.length() < 3 || sBareSps.length() < 3 || sBarePps.length() < 3 ||
+    ((sBareSps[0] >> 1) & 0x3F) != NAL_SPS)
+  {
+    return false;
+  }
+
+  // seq_parameter_set_rbsp after the 2 byte NAL unit header
+  RbspReader sps(sBareSps);
+  sps.skipBits(16);
+  sps.skipBits(4);
+  const uint32_t uiMaxSubLayersMinus1 = sps.readBits(3);
+  const uint32_t uiTemporalIdNesting = sps.readBits(1);
+  // general_profile_space to general_level_idc are byte aligned: 12 bytes copied as they are
+  if (!sps.hasBits(96)) return false;
+  const uint8_t* pProfileTierLevel = sps.getBytes() + 3;
+  sps.skipBits(96);
+  uiProfile = pProfileTierLevel[0] & 0x1F;
+  uiLevel = pProfileTierLevel[11];
+  bool bSubLayerProfile[8] = { false };
+  bool bSubLayerLevel[8] = { false };
+  for (uint32_t i = 0; i < uiMaxSubLayersMinus1; ++i)
+  {
+    bSubLayerProfile[i] = sps.readBits(1) != 0;
+    bSubLayerLevel[i] = sps.readBits(1) != 0;
+  }
+  if (uiMaxSubLayersMinus1 > 0)
+  {
+    sps.skipBits(2 * (8 - uiMaxSubLayersMinus1));
+  }
+  for (uint32_t i = 0; i < uiMaxSubLayersMinus1; ++i)
+  {
+    if (bSubLayerProfile[i]) sps.skipBits(88);
+    if (bSubLayerLevel[i]) sps.skipBits(8);
+  }
+  sps.readUe();
+  const uint32_t uiChromaFormat = sps.readUe();
+  if (uiChromaFormat == 3) sps.skipBits(1);
+  sps.readUe();
+  sps.readUe();
+  if (sps.readBits(1))
+  {
+    // conformance window offsets
+    sps.readUe();
+    sps.readUe();
+    sps.readUe();
+    sps.readUe();
+  }
+  const uint32_t uiBitDepthLumaMinus8 = sps.readUe();
+  const uint32_t uiBitDepthChromaMinus8 = sps.readUe();
+  if (!sps.hasBits(0) || uiChromaFormat > 3 || uiBitDepthLumaMinus8 > 7 || uiBitDepthChromaMinus8 > 7)
+  {
+    return false;
+  }
+
+  sHvcc.clear();
+  // configurationVersion
+  sHvcc += static_cast<char>(1);
+  sHvcc.append(reinterpret_cast<const char*>(pProfileTierLevel), 12);
+  // min_spatial_segmentation_idc and parallelismType unknown
+  sHvcc += static_cast<char>(0xF0);
+  sHvcc += static_cast<char>(0x00);
+  sHvcc += static_cast<char>(0xFC);
+  sHvcc += static_cast<char>(0xFC | uiChromaFormat);
+  sHvcc += static_cast<char>(0xF8 | uiBitDepthLumaMinus8);
+  sHvcc += static_cast<char>(0xF8 | uiBitDepthChromaMinus8);
+  // avgFrameRate unknown
+  sHvcc += static_cast<char>(0);
+  sHvcc += static_cast<char>(0);
+  // constantFrameRate 0, numTemporalLayers, temporalIdNested, lengthSizeMinusOne
+  sHvcc += static_cast<char>(((uiMaxSubLayersMinus1 + 1) << 3) | (uiTemporalIdNesting << 2) | (LENGTH_SIZE - 1));
+  // numOfArrays
+  sHvcc += static_cast<char>(3);
+  appendNalArray(sHvcc, NAL_VPS, sBareVps);
+  appendNalArray(sHvcc, NAL_SPS, sBareSps);
+  appendNalArray(sHvcc, NAL_PPS, sBarePps);
+  return true;
+}
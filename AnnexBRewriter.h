@@ -0,0 +1,122 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Turns Annex B access units into the 4 byte length-prefixed NAL units of HVC1 in place,
+ * and builds the hvcC record (HEVCDecoderConfigurationRecord, ISO/IEC 14496-15) that
+ * describes such a stream.
+ *
+ * Start codes are found by a kernel selected at runtime: the SSE2 and AVX2 kernels test 16 or
+ * 32 positions per step for 00 00 01, the scalar kernel finds the same positions. A NAL unit
+ * behind a 4 byte start code keeps its place and only the start code is overwritten. Behind a
+ * 3 byte start code, as x265 writes for every NAL unit but the first of an access unit and the
+ * parameter sets, it moves up by one byte for each such start code before it.
+ */
+class AnnexBRewriter
+{
+public:
+  enum InstructionSet
+  {
+    IS_SCALAR = 0,
+    IS_SSE2 = 1,
+    IS_AVX2 = 2
+  };
+
+  static const unsigned LENGTH_SIZE = 4;
+
+  AnnexBRewriter();
+
+  void setInstructionSet(InstructionSet eInstructionSet);
+  InstructionSet getInstructionSet() const { return m_eInstructionSet; }
+  static InstructionSet detectInstructionSet();
+  static const char* toString(InstructionSet eInstructionSet);
+
+  /// Offset of the first 00 00 01 at or after uiPos, uiLength if there is none
+  size_t findStartCode(const uint8_t* pData, size_t uiLength, size_t uiPos) const
+  {
+    return m_pScanKernel(pData, uiLength, uiPos);
+  }
+
+  /**
+   * @brief Rewrites the access unit in pData to length-prefixed NAL units.
+   * @param uiCapacity Bytes available at pData: the result may be longer than uiLength.
+   * @param uiNewLength The length of the rewritten access unit.
+   * @return false if the data is not Annex B or does not fit. See getLastError(). Data that is
+   * already length-prefixed is left as it is.
+   */
+  bool toLengthPrefixed(uint8_t* pData, size_t uiLength, size_t uiCapacity, size_t& uiNewLength);
+
+  /**
+   * @brief Calls visit(uiStart, uiPayload, uiEnd) for each NAL unit of an Annex B or length-prefixed
+   * access unit: uiStart is the offset of its start code or length, [uiPayload, uiEnd) the NAL
+   * unit itself with its header and without trailing zeros.
+   */
+  template <typename Visitor>
+  void forEachNal(const uint8_t* pData, size_t uiLength, bool bLengthPrefixed, Visitor visit) const
+  {
+    if (bLengthPrefixed)
+    {
+      size_t uiPos = 0;
+      while (uiPos + LENGTH_SIZE < uiLength)
+      {
+        const size_t uiNal = (static_cast<size_t>(pData[uiPos]) << 24) | (pData[uiPos + 1] << 16) | (pData[uiPos + 2] << 8) | pData[uiPos + 3];
+        if (uiNal > uiLength - uiPos - LENGTH_SIZE) break;
+        visit(uiPos, uiPos + LENGTH_SIZE, uiPos + LENGTH_SIZE + uiNal);
+        uiPos += LENGTH_SIZE + uiNal;
+      }
+      return;
+    }
+    size_t uiPos = findStartCode(pData, uiLength, 0);
+    while (uiPos + 3 < uiLength)
+    {
+      const size_t uiPayload = uiPos + 3;
+      const size_t uiNext = findStartCode(pData, uiLength, uiPayload);
+      // trailing_zero_8bits and the zero_byte of a 4 byte start code are not part of the NAL unit
+      size_t uiEnd = uiNext;
+      while (uiEnd > uiPayload && pData[uiEnd - 1] == 0) --uiEnd;
+      // the zero_byte goes with the NAL unit it introduces
+      visit(uiPos > 0 && pData[uiPos - 1] == 0 ? uiPos - 1 : uiPos, uiPayload, uiEnd);
+      uiPos = uiNext;
+    }
+  }
+
+  /**
+   * @brief Splits an access unit into groups of NAL units that can be sent on their own: each
+   * slice segment with the NAL units before it and the suffix NAL units after it.
+   * @param vEnds The offset behind each group. Holds uiLength alone if there is one group or
+   * no NAL unit was found.
+   */
+  void findSliceEnds(const uint8_t* pData, size_t uiLength, bool bLengthPrefixed, std::vector<size_t>& vEnds) const;
+
+  /// true if 4 byte lengths split pData into NAL units that cover it exactly
+  static bool isLengthPrefixed(const uint8_t* pData, size_t uiLength);
+
+  /**
+   * @brief Builds the hvcC record from Annex B or bare parameter sets.
+   * @param uiProfile, uiLevel general_profile_idc and general_level_idc of the SPS.
+   * @return false if a parameter set is missing or the SPS cannot be parsed.
+   */
+  static bool buildHvcc(const std::string& sVps, const std::string& sSps, const std::string& sPps, std::string& sHvcc, unsigned& uiProfile, unsigned& uiLevel);
+
+  const std::string& getLastError() const { return m_sLastError; }
+
+  typedef size_t (*ScanKernel)(const uint8_t* pData, size_t uiLength, size_t uiPos);
+
+private:
+  struct Nal
+  {
+    /// offsets of the payload before and after the rewrite
+    size_t uiOffset;
+    size_t uiNewOffset;
+    size_t uiLength;
+  };
+
+  InstructionSet m_eInstructionSet;
+  ScanKernel m_pScanKernel;
+  /// reused from one access unit to the next
+  std::vector<Nal> m_vNals;
+  std::string m_sLastError;
+};
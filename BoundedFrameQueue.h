@@ -0,0 +1,187 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+
+/**
+ * @brief What BoundedFrameQueue::push does when the queue is full.
+ */
+enum QueueOverflowPolicy
+{
+  /// wait for the consumer to make space
+  QOP_BLOCK,
+  /// evict the oldest queued frame
+  QOP_DROP_OLDEST,
+  /// reject the frame being pushed
+  QOP_DROP_NEWEST
+};
+
+inline bool parseQueueOverflowPolicy(const std::string& sPolicy, QueueOverflowPolicy& ePolicy)
+{
+  if (sPolicy == "block") ePolicy = QOP_BLOCK;
+  else if (sPolicy == "drop_oldest") ePolicy = QOP_DROP_OLDEST;
+  else if (sPolicy == "drop_newest") ePolicy = QOP_DROP_NEWEST;
+  else return false;
+  return true;
+}
+
+/**
+ * @brief Fixed capacity FIFO between a producer and a single consumer thread.
+ *
+ * The queue does not own its items: frames that are evicted or rejected are handed
+ * back to the caller of push() who must release them.
+ */
+template <typename T>
+class BoundedFrameQueue
+{
+public:
+  enum PushResult
+  {
+    PR_QUEUED,
+    /// the item was queued and the oldest item was returned in evicted
+    PR_QUEUED_EVICTED,
+    /// the queue was full and the item was not queued
+    PR_REJECTED,
+    /// the queue has been closed and the item was not queued
+    PR_CLOSED
+  };
+
+  BoundedFrameQueue()
+    :m_uiCapacity(1), m_ePolicy(QOP_BLOCK), m_bClosed(true), m_bBusy(false)
+  {
+  }
+
+  /// Empties the queue and accepts new items. Must not be called while items are queued.
+  void open(unsigned uiCapacity, QueueOverflowPolicy ePolicy)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_uiCapacity = uiCapacity ? uiCapacity : 1;
+    m_ePolicy = ePolicy;
+    m_bClosed = false;
+  }
+
+  /// Wakes up all waiting threads. push() and pop() fail from now on.
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_bClosed = true;
+    m_cvNotEmpty.notify_all();
+    m_cvNotFull.notify_all();
+    m_cvIdle.notify_all();
+  }
+
+  PushResult push(const T& item, T& evicted)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_ePolicy == QOP_BLOCK)
+    {
+      m_cvNotFull.wait(lock, [this]() { return m_bClosed || m_queue.size() < m_uiCapacity; });
+    }
+    if (m_bClosed) return PR_CLOSED;
+
+    PushResult eResult = PR_QUEUED;
+    if (m_queue.size() >= m_uiCapacity)
+    {
+      if (m_ePolicy == QOP_DROP_NEWEST) return PR_REJECTED;
+      evicted = m_queue.front().item;
+      m_queue.pop_front();
+      eResult = PR_QUEUED_EVICTED;
+    }
+    m_queue.push_back(Entry(item));
+    m_cvNotEmpty.notify_one();
+    return eResult;
+  }
+
+  /**
+   * @brief Blocks until an item is available.
+   * @param uiWaitUs Set to the time the item spent in the queue in microseconds.
+   * @return false if the queue was closed.
+   */
+  bool pop(T& item, uint64_t& uiWaitUs)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_bBusy = false;
+    if (m_queue.empty()) m_cvIdle.notify_all();
+    m_cvNotEmpty.wait(lock, [this]() { return m_bClosed || !m_queue.empty(); });
+    if (m_bClosed) return false;
+
+    item = m_queue.front().item;
+    uiWaitUs = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - m_queue.front().tQueued).count();
+    m_queue.pop_front();
+    m_bBusy = true;
+    m_cvNotFull.notify_one();
+    return true;
+  }
+
+  /**
+   * @brief Takes an item without waiting, for consumers that are scheduled per item.
+   * The consumer calls finish() once it is done with the item.
+   */
+  bool tryPop(T& item, uint64_t& uiWaitUs)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_bClosed || m_queue.empty()) return false;
+
+    item = m_queue.front().item;
+    uiWaitUs = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - m_queue.front().tQueued).count();
+    m_queue.pop_front();
+    m_bBusy = true;
+    m_cvNotFull.notify_one();
+    return true;
+  }
+
+  /// Marks the item taken by tryPop() as done
+  void finish()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_bBusy = false;
+    if (m_queue.empty()) m_cvIdle.notify_all();
+  }
+
+  /// Blocks until the queue is empty and the consumer has finished the last item it popped
+  void waitUntilIdle()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cvIdle.wait(lock, [this]() { return m_bClosed || (m_queue.empty() && !m_bBusy); });
+  }
+
+  /// Removes all queued items so that the caller can release them
+  template <typename Container>
+  void drain(Container& items)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& entry : m_queue) items.push_back(entry.item);
+    m_queue.clear();
+    m_cvNotFull.notify_all();
+    if (!m_bBusy) m_cvIdle.notify_all();
+  }
+
+  unsigned size() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return static_cast<unsigned>(m_queue.size());
+  }
+
+private:
+  typedef std::chrono::steady_clock Clock;
+  struct Entry
+  {
+    explicit Entry(const T& t) :item(t), tQueued(Clock::now()) {}
+    T item;
+    Clock::time_point tQueued;
+  };
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_cvNotEmpty;
+  std::condition_variable m_cvNotFull;
+  std::condition_variable m_cvIdle;
+  std::deque<Entry> m_queue;
+  unsigned m_uiCapacity;
+  QueueOverflowPolicy m_ePolicy;
+  bool m_bClosed;
+  /// true while the consumer works on an item it popped
+  bool m_bBusy;
+};
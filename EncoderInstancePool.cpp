@@ -0,0 +1,154 @@
+#include "EncoderInstancePool.h"
+#include <X265v2/X265v2.h>
+#include <CodecUtils/ICodecv2.h>
+
+EncoderInstancePool& EncoderInstancePool::getInstance()
+{
+  static EncoderInstancePool pool;
+  return pool;
+}
+
+EncoderInstancePool::EncoderInstancePool()
+  :m_uiIdle(0), m_uiCapacity(0), m_uiUsers(0), m_ullHits(0), m_ullMisses(0)
+{
+}
+
+EncoderInstancePool::~EncoderInstancePool()
+{
+  // removeUser() closed the encoders of the filters: any left behind are reclaimed by the OS
+}
+
+void EncoderInstancePool::setCapacity(unsigned uiCapacity)
+{
+  std::vector<PooledEncoder> vClosing;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_uiCapacity = uiCapacity;
+    vClosing = trim(uiCapacity);
+  }
+  // closing x265 waits for its threads: not while holding the lock
+  for (PooledEncoder& encoder : vClosing)
+  {
+    close(encoder);
+  }
+}
+
+unsigned EncoderInstancePool::getCapacity() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_uiCapacity;
+}
+
+bool EncoderInstancePool::acquire(const std::string& sProfile, PooledEncoder& encoder)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::unordered_map<std::string, std::vector<PooledEncoder> >::iterator it = m_mIdle.find(sProfile);
+  if (it == m_mIdle.end() || it->second.empty())
+  {
+    ++m_ullMisses;
+    return false;
+  }
+  encoder = it->second.back();
+  it->second.pop_back();
+  --m_uiIdle;
+  ++m_ullHits;
+  return true;
+}
+
+bool EncoderInstancePool::release(const std::string& sProfile, PooledEncoder& encoder)
+{
+  if (!encoder.pCodec)
+  {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_uiIdle < m_uiCapacity)
+    {
+      m_mIdle[sProfile].push_back(encoder);
+      ++m_uiIdle;
+      encoder = PooledEncoder();
+      return true;
+    }
+  }
+  close(encoder);
+  return false;
+}
+
+void EncoderInstancePool::clear()
+{
+  std::vector<PooledEncoder> vClosing;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    vClosing = trim(0);
+  }
+  for (PooledEncoder& encoder : vClosing)
+  {
+    close(encoder);
+  }
+}
+
+void EncoderInstancePool::addUser()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  ++m_uiUsers;
+}
+
+void EncoderInstancePool::removeUser()
+{
+  std::vector<PooledEncoder> vClosing;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_uiUsers > 0 && --m_uiUsers == 0)
+    {
+      vClosing = trim(0);
+    }
+  }
+  for (PooledEncoder& encoder : vClosing)
+  {
+    close(encoder);
+  }
+}
+
+unsigned EncoderInstancePool::getIdleCount() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_uiIdle;
+}
+
+unsigned EncoderInstancePool::getIdleCount(const std::string& sProfile) const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::unordered_map<std::string, std::vector<PooledEncoder> >::const_iterator it = m_mIdle.find(sProfile);
+  return it == m_mIdle.end() ? 0 : static_cast<unsigned>(it->second.size());
+}
+
+void EncoderInstancePool::close(PooledEncoder& encoder)
+{
+  FramePlaneArena::getInstance().release(encoder.planes);
+  if (encoder.pCodec)
+  {
+    encoder.pCodec->Close();
+    X265v2Factory factory;
+    factory.ReleaseCodecInstance(encoder.pCodec);
+  }
+  encoder = PooledEncoder();
+}
+
+std::vector<PooledEncoder> EncoderInstancePool::trim(unsigned uiCapacity)
+{
+  std::vector<PooledEncoder> vRemoved;
+  std::unordered_map<std::string, std::vector<PooledEncoder> >::iterator it = m_mIdle.begin();
+  while (m_uiIdle > uiCapacity && it != m_mIdle.end())
+  {
+    // the most recently added encoders of each profile go first
+    while (m_uiIdle > uiCapacity && !it->second.empty())
+    {
+      vRemoved.push_back(it->second.back());
+      it->second.pop_back();
+      --m_uiIdle;
+    }
+    it = it->second.empty() ? m_mIdle.erase(it) : ++it;
+  }
+  return vRemoved;
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "FramePlaneArena.h"
+
+class ICodecv2;
+
+/**
+ * @brief An open codec instance kept by EncoderInstancePool, with what its owner found out
+ * while configuring it, so that it can be used without touching the codec again.
+ */
+struct PooledEncoder
+{
+  PooledEncoder()
+    :pCodec(NULL), bStridedInput(false), bKeyframes(false), bCtuHints(false)
+  {
+  }
+
+  ICodecv2* pCodec;
+  /// the conversion planes the codec was configured for, NULL pointers if it reads samples in place
+  FramePlanes planes;
+  /// Annex B parameter sets the codec returned when it was opened
+  std::string sVps;
+  std::string sSps;
+  std::string sPps;
+  bool bStridedInput;
+  bool bKeyframes;
+  bool bCtuHints;
+};
+
+/**
+ * @brief Process-wide pool of opened encoders, keyed by a profile string that describes
+ * everything the encoder was configured with.
+ *
+ * Opening x265 allocates its lookahead, reference pictures and thread pool, which dominates
+ * the time to start a channel. Encoders are put into the pool ahead of time for the profiles
+ * that are expected, or when their filter goes away, and a filter that needs an encoder of the
+ * same profile takes one in constant time instead of opening its own. Encoders given back
+ * must have been restarted so that they begin a new stream. The pool is empty and keeps
+ * nothing until a capacity is set, and is emptied when the last filter goes away.
+ */
+class EncoderInstancePool
+{
+public:
+  static EncoderInstancePool& getInstance();
+
+  /// Idle encoders kept over all profiles. Lowering it closes the encoders that no longer fit.
+  void setCapacity(unsigned uiCapacity);
+  unsigned getCapacity() const;
+
+  /// Takes an idle encoder opened for sProfile. Returns false if there is none.
+  bool acquire(const std::string& sProfile, PooledEncoder& encoder);
+  /**
+   * @brief Keeps encoder as an idle encoder of sProfile. If the pool is full the encoder is
+   * closed and its planes go back to FramePlaneArena. encoder is cleared either way.
+   * @return true if the encoder was kept.
+   */
+  bool release(const std::string& sProfile, PooledEncoder& encoder);
+  /// Closes all idle encoders
+  void clear();
+  /// Called by each filter that uses the pool when it is created
+  void addUser();
+  /**
+   * @brief Called by each filter that uses the pool when it goes away. The last one closes the
+   * idle encoders: the destructor runs during static destruction, possibly under the loader
+   * lock and after FramePlaneArena, where closing x265 is not safe.
+   */
+  void removeUser();
+
+  unsigned getIdleCount() const;
+  unsigned getIdleCount(const std::string& sProfile) const;
+  /// Encoders handed out by acquire() since the process started
+  uint64_t getHitCount() const { return m_ullHits; }
+  /// acquire() calls that found no encoder of the profile
+  uint64_t getMissCount() const { return m_ullMisses; }
+
+  /// Closes the codec and frees the codec instance and the planes of encoder
+  static void close(PooledEncoder& encoder);
+
+private:
+  EncoderInstancePool();
+  ~EncoderInstancePool();
+  EncoderInstancePool(const EncoderInstancePool&);
+  EncoderInstancePool& operator=(const EncoderInstancePool&);
+
+  /// Removes idle encoders until at most uiCapacity are left and returns them. Called with m_mutex held.
+  std::vector<PooledEncoder> trim(unsigned uiCapacity);
+
+  mutable std::mutex m_mutex;
+  std::unordered_map<std::string, std::vector<PooledEncoder> > m_mIdle;
+  unsigned m_uiIdle;
+  unsigned m_uiCapacity;
+  unsigned m_uiUsers;
+  std::atomic<uint64_t> m_ullHits;
+  std::atomic<uint64_t> m_ullMisses;
+};
@@ -0,0 +1,180 @@
+#include "FramePlaneArena.h"
+#include <cstdlib>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// buffers from this size on are worth backing with large pages
+static const size_t LARGE_PAGE_THRESHOLD = 2 * 1024 * 1024;
+
+static size_t alignUp(size_t uiValue, size_t uiAlignment)
+{
+  return (uiValue + uiAlignment - 1) / uiAlignment * uiAlignment;
+}
+
+FramePlaneArena& FramePlaneArena::getInstance()
+{
+  static FramePlaneArena arena;
+  return arena;
+}
+
+FramePlaneArena::FramePlaneArena()
+  :m_ullAllocations(0), m_ullLargePageAllocations(0), m_ullReuses(0)
+{
+  m_vFree.reserve(MAX_FREE_BLOCKS);
+}
+
+FramePlaneArena::~FramePlaneArena()
+{
+  for (const Block& block : m_vFree)
+  {
+    deallocate(block);
+  }
+}
+
+FramePlanes FramePlaneArena::acquire(int iWidth, int iHeight, bool bPadded)
+{
+  const int iUvWidth = (iWidth + 1) / 2;
+  const int iUvHeight = (iHeight + 1) / 2;
+  FramePlanes planes;
+  planes.iYStride = bPadded ? static_cast<int>(alignUp(iWidth, ALIGNMENT)) : iWidth;
+  planes.iUvStride = bPadded ? static_cast<int>(alignUp(iUvWidth, ALIGNMENT)) : iUvWidth;
+  const size_t uiYSize = static_cast<size_t>(planes.iYStride) * iHeight;
+  const size_t uiUvSize = static_cast<size_t>(planes.iUvStride) * iUvHeight;
+  // padded planes also start on a boundary
+  const size_t uiUOffset = bPadded ? alignUp(uiYSize, ALIGNMENT) : uiYSize;
+  const size_t uiVOffset = bPadded ? alignUp(uiUOffset + uiUvSize, ALIGNMENT) : uiUOffset + uiUvSize;
+  const size_t uiSize = uiVOffset + uiUvSize;
+
+  Block block = { NULL, 0, false };
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // the smallest free buffer that fits and does not waste more than the picture needs
+    size_t uiBest = m_vFree.size();
+    for (size_t i = 0; i < m_vFree.size(); ++i)
+    {
+      if (m_vFree[i].uiCapacity >= uiSize && m_vFree[i].uiCapacity <= 2 * uiSize &&
+        (uiBest == m_vFree.size() || m_vFree[i].uiCapacity < m_vFree[uiBest].uiCapacity))
+      {
+        uiBest = i;
+      }
+    }
+    if (uiBest < m_vFree.size())
+    {
+      block = m_vFree[uiBest];
+      m_vFree.erase(m_vFree.begin() + uiBest);
+      ++m_ullReuses;
+    }
+  }
+  if (!block.p)
+  {
+    if (!allocate(uiSize, block))
+    {
+      return FramePlanes();
+    }
+    // outside m_mutex: the counters are atomic
+    m_ullAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (block.bLargePages) m_ullLargePageAllocations.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  planes.pBlock = block.p;
+  planes.uiCapacity = block.uiCapacity;
+  planes.bLargePages = block.bLargePages;
+  planes.pY = static_cast<uint8_t*>(block.p);
+  planes.pU = planes.pY + uiUOffset;
+  planes.pV = planes.pY + uiVOffset;
+  planes.uiSize = static_cast<unsigned>(uiSize);
+  return planes;
+}
+
+void FramePlaneArena::release(FramePlanes& planes)
+{
+  if (!planes.pBlock)
+  {
+    return;
+  }
+  const Block block = { planes.pBlock, planes.uiCapacity, planes.bLargePages };
+  planes = FramePlanes();
+  Block evicted = { NULL, 0, false };
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_vFree.size() >= MAX_FREE_BLOCKS)
+    {
+      // the buffer returned longest ago is the least likely to be asked for again
+      evicted = m_vFree.front();
+      m_vFree.erase(m_vFree.begin());
+    }
+    m_vFree.push_back(block);
+  }
+  if (evicted.p)
+  {
+    deallocate(evicted);
+  }
+}
+
+bool FramePlaneArena::allocate(size_t uiSize, Block& block)
+{
+  block.bLargePages = false;
+#if defined(_WIN32)
+  const size_t uiLargePage = GetLargePageMinimum();
+  if (uiLargePage && uiSize >= LARGE_PAGE_THRESHOLD)
+  {
+    // fails without SeLockMemoryPrivilege or when physical memory is too fragmented
+    const size_t uiCapacity = alignUp(uiSize, uiLargePage);
+    block.p = VirtualAlloc(NULL, uiCapacity, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    if (block.p)
+    {
+      block.uiCapacity = uiCapacity;
+      block.bLargePages = true;
+      return true;
+    }
+  }
+  block.p = _aligned_malloc(uiSize, ALIGNMENT);
+  block.uiCapacity = uiSize;
+  return block.p != NULL;
+#else
+  if (uiSize >= LARGE_PAGE_THRESHOLD)
+  {
+    const size_t uiCapacity = alignUp(uiSize, LARGE_PAGE_THRESHOLD);
+    if (posix_memalign(&block.p, LARGE_PAGE_THRESHOLD, uiCapacity) == 0)
+    {
+      block.uiCapacity = uiCapacity;
+#ifdef MADV_HUGEPAGE
+      block.bLargePages = madvise(block.p, uiCapacity, MADV_HUGEPAGE) == 0;
+#endif
+      return true;
+    }
+    block.p = NULL;
+  }
+  if (posix_memalign(&block.p, ALIGNMENT, uiSize) != 0)
+  {
+    block.p = NULL;
+    return false;
+  }
+  block.uiCapacity = uiSize;
+  return true;
+#endif
+}
+
+void FramePlaneArena::deallocate(const Block& block)
+{
+#if defined(_WIN32)
+  if (block.bLargePages)
+  {
+    VirtualFree(block.p, 0, MEM_RELEASE);
+  }
+  else
+  {
+    _aligned_free(block.p);
+  }
+#else
+  std::free(block.p);
+#endif
+}
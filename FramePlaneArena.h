@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief I420 planes handed out by FramePlaneArena. All pointers are NULL if none were acquired.
+ */
+struct FramePlanes
+{
+  FramePlanes()
+    :pY(NULL), pU(NULL), pV(NULL), iYStride(0), iUvStride(0), uiSize(0), pBlock(NULL), uiCapacity(0), bLargePages(false)
+  {
+  }
+
+  uint8_t* pY;
+  uint8_t* pU;
+  uint8_t* pV;
+  int iYStride;
+  int iUvStride;
+  /// bytes from pY to the end of the V plane
+  unsigned uiSize;
+  /// the allocation the planes live in
+  void* pBlock;
+  size_t uiCapacity;
+  bool bLargePages;
+};
+
+/**
+ * @brief Process-wide pool of 64-byte aligned buffers for uncompressed pictures.
+ *
+ * Buffers are allocated when a picture format is negotiated and given back to the pool when
+ * the format changes or the filter goes away, so reconnecting and other filter instances of
+ * the same or a slightly smaller picture size reuse them. Buffers of 2 MB and more are backed
+ * by large pages where the OS grants them: on Windows this needs the "Lock pages in memory"
+ * privilege, elsewhere transparent huge pages are requested. The pool keeps a few free
+ * buffers and releases the rest.
+ */
+class FramePlaneArena
+{
+public:
+  static const unsigned ALIGNMENT = 64;
+
+  static FramePlaneArena& getInstance();
+
+  /**
+   * @brief Hands out the planes of an iWidth x iHeight I420 picture.
+   * @param bPadded true to start every row of every plane on an ALIGNMENT boundary. Otherwise
+   * the planes are packed like a contiguous I420 picture of getPackedI420Size() bytes.
+   * @return Planes with NULL pointers if memory ran out.
+   */
+  FramePlanes acquire(int iWidth, int iHeight, bool bPadded);
+  /// Gives the buffer of planes back to the pool and clears planes. Does nothing for NULL planes.
+  void release(FramePlanes& planes);
+
+  /// Buffers allocated from the OS since the process started
+  uint64_t getAllocationCount() const { return m_ullAllocations; }
+  /// Buffers allocated with large pages since the process started
+  uint64_t getLargePageAllocationCount() const { return m_ullLargePageAllocations; }
+  /// Buffers handed out again without an allocation
+  uint64_t getReuseCount() const { return m_ullReuses; }
+
+private:
+  FramePlaneArena();
+  ~FramePlaneArena();
+  FramePlaneArena(const FramePlaneArena&);
+  FramePlaneArena& operator=(const FramePlaneArena&);
+
+  struct Block
+  {
+    void* p;
+    size_t uiCapacity;
+    bool bLargePages;
+  };
+
+  static bool allocate(size_t uiSize, Block& block);
+  static void deallocate(const Block& block);
+
+  /// free buffers kept for reuse
+  static const size_t MAX_FREE_BLOCKS = 8;
+
+  std::mutex m_mutex;
+  std::vector<Block> m_vFree;
+  /// atomic since allocations are counted without m_mutex
+  std::atomic<uint64_t> m_ullAllocations;
+  std::atomic<uint64_t> m_ullLargePageAllocations;
+  std::atomic<uint64_t> m_ullReuses;
+};
@@ -0,0 +1,417 @@
+#include "H265RtpPacketizer.h"
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+static const size_t NO_FRAGMENT = static_cast<size_t>(-1);
+// the payload header of an FU is followed by the FU header
+static const unsigned FU_HEADER_SIZE = 3;
+// sizes in an AP are 16 bits
+static const unsigned MAX_PACKET_SIZE = 65535;
+static const unsigned MIN_PACKET_SIZE = 64;
+
+static inline void writeUint16(uint8_t* p, unsigned uiValue)
+{
+  p[0] = static_cast<uint8_t>(uiValue >> 8);
+  p[1] = static_cast<uint8_t>(uiValue);
+}
+
+static inline void writeUint32(uint8_t* p, uint32_t uiValue)
+{
+  p[0] = static_cast<uint8_t>(uiValue >> 24);
+  p[1] = static_cast<uint8_t>(uiValue >> 16);
+  p[2] = static_cast<uint8_t>(uiValue >> 8);
+  p[3] = static_cast<uint8_t>(uiValue);
+}
+
+static inline uint32_t readUint32(const uint8_t* p)
+{
+  return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+RtpPacketRing::RtpPacketRing()
+  :m_uiSlotSize(0), m_uiFront(0), m_uiCount(0)
+{
+}
+
+void RtpPacketRing::allocate(unsigned uiSlots, unsigned uiSlotSize)
+{
+  m_vStorage.assign(static_cast<size_t>(uiSlots) * uiSlotSize, 0);
+  m_vLengths.assign(uiSlots, 0);
+  m_uiSlotSize = uiSlotSize;
+  clear();
+}
+
+void RtpPacketRing::grow(unsigned uiSlots)
+{
+  if (uiSlots <= m_vLengths.size())
+  {
+    return;
+  }
+  // the packets move to the first slots in order
+  std::vector<uint8_t> vStorage(static_cast<size_t>(uiSlots) * m_uiSlotSize, 0);
+  std::vector<unsigned> vLengths(uiSlots, 0);
+  for (unsigned i = 0; i < m_uiCount; ++i)
+  {
+    const uint8_t* pPacket = getPacket(i, vLengths[i]);
+    memcpy(&vStorage[static_cast<size_t>(i) * m_uiSlotSize], pPacket, vLengths[i]);
+  }
+  m_vStorage.swap(vStorage);
+  m_vLengths.swap(vLengths);
+  m_uiFront = 0;
+}
+
+uint8_t* RtpPacketRing::reserve()
+{
+  if (isFull())
+  {
+    return NULL;
+  }
+  const size_t uiSlot = (m_uiFront + m_uiCount) % m_vLengths.size();
+  return &m_vStorage[uiSlot * m_uiSlotSize];
+}
+
+void RtpPacketRing::commit(unsigned uiLength)
+{
+  const size_t uiSlot = (m_uiFront + m_uiCount) % m_vLengths.size();
+  m_vLengths[uiSlot] = uiLength;
+  ++m_uiCount;
+}
+
+const uint8_t* RtpPacketRing::getPacket(unsigned i, unsigned& uiLength) const
+{
+  const size_t uiSlot = (m_uiFront + i) % m_vLengths.size();
+  uiLength = m_vLengths[uiSlot];
+  return &m_vStorage[uiSlot * m_uiSlotSize];
+}
+
+void RtpPacketRing::pop(unsigned uiCount)
+{
+  uiCount = (std::min)(uiCount, m_uiCount);
+  if (uiCount)
+  {
+    m_uiFront = static_cast<unsigned>((m_uiFront + uiCount) % m_vLengths.size());
+    m_uiCount -= uiCount;
+  }
+}
+
+void RtpPacketRing::truncate(unsigned uiCount)
+{
+  m_uiCount = (std::min)(uiCount, m_uiCount);
+}
+
+H265RtpPacketizer::H265RtpPacketizer()
+  :m_uiMaxPacketSize(1200), m_uiPayloadType(96), m_usSequence(0), m_uiSsrc(0), m_uiTimestampOffset(0),
+  m_ullSingle(0), m_ullAggregation(0), m_ullFragments(0)
+{
+}
+
+void H265RtpPacketizer::reset(unsigned uiMaxPacketSize, uint8_t uiPayloadType)
+{
+  m_uiMaxPacketSize = (std::max)(MIN_PACKET_SIZE, (std::min)(uiMaxPacketSize, MAX_PACKET_SIZE));
+  m_uiPayloadType = uiPayloadType & 0x7F;
+  // RFC 3550: the initial sequence number and timestamp are random
+  std::random_device random;
+  m_usSequence = static_cast<uint16_t>(random());
+  m_uiSsrc = random();
+  m_uiTimestampOffset = random();
+  m_ullSingle = 0;
+  m_ullAggregation = 0;
+  m_ullFragments = 0;
+}
+
+bool H265RtpPacketizer::packetize(const uint8_t* pData, size_t uiLength, bool bLengthPrefixed, uint32_t uiTimestamp, RtpPacketRing& ring)
+{
+  m_vNals.clear();
+  m_scanner.forEachNal(pData, uiLength, bLengthPrefixed, [&](size_t, size_t uiPayload, size_t uiEnd)
+  {
+    // shorter than a NAL unit header
+    if (uiEnd - uiPayload < 2) return;
+    const Nal nal = { pData + uiPayload, uiEnd - uiPayload };
+    m_vNals.push_back(nal);
+  });
+
+  const uint32_t uiRtpTimestamp = uiTimestamp + m_uiTimestampOffset;
+  const size_t uiMaxPayload = m_uiMaxPacketSize - RTP_HEADER_SIZE;
+  // to take the access unit back out if it does not fit
+  const unsigned uiRingCount = ring.getCount();
+  const uint16_t usSequence = m_usSequence;
+  const uint64_t ullSingle = m_ullSingle;
+  const uint64_t ullAggregation = m_ullAggregation;
+  const uint64_t ullFragments = m_ullFragments;
+  size_t i = 0;
+  while (i < m_vNals.size())
+  {
+    // the NAL units from i on that fit one AP together with its payload header
+    size_t uiAggregated = 2;
+    size_t uiEnd = i;
+    while (uiEnd < m_vNals.size() && uiAggregated + 2 + m_vNals[uiEnd].uiLength <= uiMaxPayload)
+    {
+      uiAggregated += 2 + m_vNals[uiEnd].uiLength;
+      ++uiEnd;
+    }
+    bool bWritten = false;
+    if (uiEnd - i >= 2)
+    {
+      bWritten = writeAggregation(i, uiEnd, uiRtpTimestamp, uiEnd == m_vNals.size(), ring);
+      i = uiEnd;
+    }
+    else
+    {
+      const Nal& nal = m_vNals[i];
+      const bool bLast = ++i == m_vNals.size();
+      bWritten = nal.uiLength <= uiMaxPayload ? writeSingle(nal, uiRtpTimestamp, bLast, ring) : writeFragments(nal, uiRtpTimestamp, bLast, ring);
+    }
+    if (!bWritten)
+    {
+      // a receiver would wait for the marker of a partial access unit: none of it is sent
+      ring.truncate(uiRingCount);
+      m_usSequence = usSequence;
+      m_ullSingle = ullSingle;
+      m_ullAggregation = ullAggregation;
+      m_ullFragments = ullFragments;
+      return false;
+    }
+  }
+  return true;
+}
+
+uint8_t* H265RtpPacketizer::beginPacket(RtpPacketRing& ring, uint32_t uiTimestamp)
+{
+  uint8_t* p = ring.reserve();
+  if (!p)
+  {
+    return NULL;
+  }
+  // version 2, no padding, extension or CSRCs; the marker is set by the caller
+  p[0] = 0x80;
+  p[1] = m_uiPayloadType;
+  writeUint16(p + 2, m_usSequence++);
+  writeUint32(p + 4, uiTimestamp);
+  writeUint32(p + 8, m_uiSsrc);
+  return p;
+}
+
+bool H265RtpPacketizer::writeSingle(const Nal& nal, uint32_t uiTimestamp, bool bLast, RtpPacketRing& ring)
+{
+  uint8_t* p = beginPacket(ring, uiTimestamp);
+  if (!p)
+  {
+    return false;
+  }
+  if (bLast) p[1] |= 0x80;
+  memcpy(p + RTP_HEADER_SIZE, nal.p, nal.uiLength);
+  ring.commit(static_cast<unsigned>(RTP_HEADER_SIZE + nal.uiLength));
+  ++m_ullSingle;
+  return true;
+}
+
+bool H265RtpPacketizer::writeAggregation(size_t uiFirst, size_t uiEnd, uint32_t uiTimestamp, bool bLast, RtpPacketRing& ring)
+{
+  uint8_t* p = beginPacket(ring, uiTimestamp);
+  if (!p)
+  {
+    return false;
+  }
+  if (bLast) p[1] |= 0x80;
+  // F is set if any aggregated NAL unit has it, LayerId and TID are the lowest of them
+  uint8_t uiF = 0;
+  unsigned uiLayerId = 63;
+  unsigned uiTid = 7;
+  size_t uiPos = RTP_HEADER_SIZE + 2;
+  for (size_t i = uiFirst; i < uiEnd; ++i)
+  {
+    const Nal& nal = m_vNals[i];
+    uiF |= nal.p[0] & 0x80;
+    uiLayerId = (std::min)(uiLayerId, static_cast<unsigned>(((nal.p[0] & 1) << 5) | (nal.p[1] >> 3)));
+    uiTid = (std::min)(uiTid, static_cast<unsigned>(nal.p[1] & 7));
+    writeUint16(p + uiPos, static_cast<unsigned>(nal.uiLength));
+    memcpy(p + uiPos + 2, nal.p, nal.uiLength);
+    uiPos += 2 + nal.uiLength;
+  }
+  p[RTP_HEADER_SIZE] = static_cast<uint8_t>(uiF | (NAL_AP << 1) | (uiLayerId >> 5));
+  p[RTP_HEADER_SIZE + 1] = static_cast<uint8_t>(((uiLayerId & 0x1F) << 3) | uiTid);
+  ring.commit(static_cast<unsigned>(uiPos));
+  ++m_ullAggregation;
+  return true;
+}
+
+bool H265RtpPacketizer::writeFragments(const Nal& nal, uint32_t uiTimestamp, bool bLast, RtpPacketRing& ring)
+{
+  const size_t uiMaxFragment = m_uiMaxPacketSize - RTP_HEADER_SIZE - FU_HEADER_SIZE;
+  const uint8_t uiType = (nal.p[0] >> 1) & 0x3F;
+  // the NAL unit header is carried in the payload and FU headers
+  size_t uiPos = 2;
+  while (uiPos < nal.uiLength)
+  {
+    const size_t uiFragment = (std::min)(uiMaxFragment, nal.uiLength - uiPos);
+    const bool bStart = uiPos == 2;
+    const bool bEnd = uiPos + uiFragment == nal.uiLength;
+    uint8_t* p = beginPacket(ring, uiTimestamp);
+    if (!p)
+    {
+      return false;
+    }
+    if (bEnd && bLast) p[1] |= 0x80;
+    p[RTP_HEADER_SIZE] = static_cast<uint8_t>((nal.p[0] & 0x81) | (NAL_FU << 1));
+    p[RTP_HEADER_SIZE + 1] = nal.p[1];
+    p[RTP_HEADER_SIZE + 2] = static_cast<uint8_t>((bStart ? 0x80 : 0) | (bEnd ? 0x40 : 0) | uiType);
+    memcpy(p + RTP_HEADER_SIZE + FU_HEADER_SIZE, nal.p + uiPos, uiFragment);
+    ring.commit(static_cast<unsigned>(RTP_HEADER_SIZE + FU_HEADER_SIZE + uiFragment));
+    ++m_ullFragments;
+    uiPos += uiFragment;
+  }
+  return true;
+}
+
+H265RtpDepacketizer::H265RtpDepacketizer()
+  :m_uiTimestamp(0), m_uiCompleteTimestamp(0), m_usNextSequence(0), m_bStarted(false), m_bBroken(false),
+  m_uiFragmentStart(NO_FRAGMENT), m_ullDropped(0)
+{
+}
+
+void H265RtpDepacketizer::appendNal(const uint8_t* p, size_t uiLength)
+{
+  uint8_t length[AnnexBRewriter::LENGTH_SIZE];
+  writeUint32(length, static_cast<uint32_t>(uiLength));
+  m_vAccessUnit.insert(m_vAccessUnit.end(), length, length + AnnexBRewriter::LENGTH_SIZE);
+  m_vAccessUnit.insert(m_vAccessUnit.end(), p, p + uiLength);
+}
+
+void H265RtpDepacketizer::fail(const std::string& sError)
+{
+  m_sLastError = sError;
+  m_bBroken = true;
+}
+
+bool H265RtpDepacketizer::addPacket(const uint8_t* pPacket, size_t uiLength)
+{
+  if (uiLength < H265RtpPacketizer::RTP_HEADER_SIZE || (pPacket[0] >> 6) != 2)
+  {
+    fail("Not an RTP packet");
+    return false;
+  }
+  const bool bMarker = (pPacket[1] & 0x80) != 0;
+  const uint16_t usSequence = static_cast<uint16_t>((pPacket[2] << 8) | pPacket[3]);
+  const uint32_t uiTimestamp = readUint32(pPacket + 4);
+  size_t uiPayload = H265RtpPacketizer::RTP_HEADER_SIZE + 4 * (pPacket[0] & 0x0F);
+  if ((pPacket[0] & 0x20) && uiLength > uiPayload)
+  {
+    // padding: its length is in the last byte
+    const size_t uiPadding = pPacket[uiLength - 1];
+    if (uiPadding > uiLength - uiPayload)
+    {
+      fail("RTP padding longer than the payload");
+      return false;
+    }
+    uiLength -= uiPadding;
+  }
+  if ((pPacket[0] & 0x10) && uiPayload + 4 <= uiLength)
+  {
+    uiPayload += 4 + 4 * ((pPacket[uiPayload + 2] << 8) | pPacket[uiPayload + 3]);
+  }
+
+  if (m_bStarted && usSequence != m_usNextSequence)
+  {
+    fail("Lost packets before sequence number " + std::to_string(usSequence));
+  }
+  m_usNextSequence = static_cast<uint16_t>(usSequence + 1);
+  m_bStarted = true;
+  if ((!m_vAccessUnit.empty() || m_bBroken) && uiTimestamp != m_uiTimestamp)
+  {
+    // the marker packet of the previous access unit was lost
+    ++m_ullDropped;
+    m_vAccessUnit.clear();
+    m_uiFragmentStart = NO_FRAGMENT;
+    m_bBroken = false;
+  }
+  m_uiTimestamp = uiTimestamp;
+
+  if (uiPayload + 2 > uiLength)
+  {
+    fail("RTP packet without a payload header");
+  }
+  else
+  {
+    const uint8_t* p = pPacket + uiPayload;
+    const size_t uiSize = uiLength - uiPayload;
+    const uint8_t uiType = (p[0] >> 1) & 0x3F;
+    if (uiType != H265RtpPacketizer::NAL_FU && m_uiFragmentStart != NO_FRAGMENT)
+    {
+      fail("FU without an end");
+      m_uiFragmentStart = NO_FRAGMENT;
+    }
+    if (uiType == H265RtpPacketizer::NAL_AP)
+    {
+      size_t uiPos = 2;
+      while (uiPos + 2 <= uiSize)
+      {
+        const size_t uiNal = (p[uiPos] << 8) | p[uiPos + 1];
+        if (uiPos + 2 + uiNal > uiSize)
+        {
+          fail("Truncated AP");
+          break;
+        }
+        appendNal(p + uiPos + 2, uiNal);
+        uiPos += 2 + uiNal;
+      }
+    }
+    else if (uiType == H265RtpPacketizer::NAL_FU)
+    {
+      if (uiSize <= 3)
+      {
+        fail("Empty FU");
+      }
+      else
+      {
+        const bool bStart = (p[2] & 0x80) != 0;
+        const bool bEnd = (p[2] & 0x40) != 0;
+        if (bStart)
+        {
+          if (m_uiFragmentStart != NO_FRAGMENT) fail("FU without an end");
+          // rebuild the NAL unit header from the payload and FU headers
+          const uint8_t header[2] = { static_cast<uint8_t>((p[0] & 0x81) | ((p[2] & 0x3F) << 1)), p[1] };
+          m_uiFragmentStart = m_vAccessUnit.size();
+          appendNal(header, 2);
+        }
+        if (m_uiFragmentStart == NO_FRAGMENT)
+        {
+          fail("FU without a start");
+        }
+        else
+        {
+          m_vAccessUnit.insert(m_vAccessUnit.end(), p + 3, p + uiSize);
+          if (bEnd)
+          {
+            const size_t uiNal = m_vAccessUnit.size() - m_uiFragmentStart - AnnexBRewriter::LENGTH_SIZE;
+            writeUint32(&m_vAccessUnit[m_uiFragmentStart], static_cast<uint32_t>(uiNal));
+            m_uiFragmentStart = NO_FRAGMENT;
+          }
+        }
+      }
+    }
+    else
+    {
+      appendNal(p, uiSize);
+    }
+  }
+
+  if (!bMarker)
+  {
+    return false;
+  }
+  const bool bComplete = !m_bBroken && m_uiFragmentStart == NO_FRAGMENT && !m_vAccessUnit.empty();
+  if (bComplete)
+  {
+    m_vComplete.swap(m_vAccessUnit);
+    m_uiCompleteTimestamp = uiTimestamp;
+  }
+  else
+  {
+    ++m_ullDropped;
+  }
+  m_vAccessUnit.clear();
+  m_uiFragmentStart = NO_FRAGMENT;
+  m_bBroken = false;
+  return bComplete;
+}
@@ -0,0 +1,151 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "AnnexBRewriter.h"
+
+/**
+ * @brief Preallocated ring of RTP packets of at most getSlotSize() bytes each. The packetizer
+ * writes packets at the back, the sink sends and removes them from the front. Not thread-safe:
+ * both run on the encoding thread.
+ */
+class RtpPacketRing
+{
+public:
+  RtpPacketRing();
+
+  /// Allocates uiSlots packets of uiSlotSize bytes and empties the ring
+  void allocate(unsigned uiSlots, unsigned uiSlotSize);
+  /// Grows the ring to uiSlots packets, keeping the packets in it. Does nothing if it is as large already.
+  void grow(unsigned uiSlots);
+
+  unsigned getSlotSize() const { return m_uiSlotSize; }
+  unsigned getSlots() const { return static_cast<unsigned>(m_vLengths.size()); }
+  unsigned getCount() const { return m_uiCount; }
+  bool isFull() const { return m_uiCount == m_vLengths.size(); }
+
+  /// The slot the next packet is written to, NULL if the ring is full
+  uint8_t* reserve();
+  /// Adds the packet written to the slot of the last reserve()
+  void commit(unsigned uiLength);
+
+  /// Packet i counted from the front
+  const uint8_t* getPacket(unsigned i, unsigned& uiLength) const;
+  /// Removes uiCount packets from the front
+  void pop(unsigned uiCount);
+  /// Removes packets from the back until uiCount are left
+  void truncate(unsigned uiCount);
+  void clear() { m_uiFront = 0; m_uiCount = 0; }
+
+private:
+  std::vector<uint8_t> m_vStorage;
+  std::vector<unsigned> m_vLengths;
+  unsigned m_uiSlotSize;
+  unsigned m_uiFront;
+  unsigned m_uiCount;
+};
+
+/**
+ * @brief RTP payloader for H.265 (RFC 7798) without DONL fields, i.e. sprop-max-don-diff=0.
+ *
+ * NAL units are taken from Annex B or length-prefixed access units as the encoder wrote them.
+ * Consecutive NAL units that fit a packet together go into an aggregation packet (AP), a NAL
+ * unit that fits alone into a single NAL unit packet, and larger NAL units are split into
+ * fragmentation units (FU). The marker bit is set on the last packet of an access unit.
+ */
+class H265RtpPacketizer
+{
+public:
+  static const unsigned RTP_HEADER_SIZE = 12;
+  /// HEVC NAL unit types of the payload structures
+  static const uint8_t NAL_AP = 48;
+  static const uint8_t NAL_FU = 49;
+
+  H265RtpPacketizer();
+
+  /**
+   * @brief Starts a new stream: a random SSRC, sequence number and timestamp offset.
+   * @param uiMaxPacketSize Largest RTP packet including its header, e.g. the path MTU less
+   * the IP and UDP headers. The ring's slots must be at least as large.
+   */
+  void reset(unsigned uiMaxPacketSize, uint8_t uiPayloadType);
+
+  /**
+   * @brief Packetizes an access unit into ring.
+   * @param uiTimestamp 90 kHz RTP timestamp of the picture, before the random offset is added.
+   * @return false if the ring ran full. The packets of the access unit are taken out of the
+   * ring again and the sequence number is rolled back, so that no partial access unit is sent.
+   */
+  bool packetize(const uint8_t* pData, size_t uiLength, bool bLengthPrefixed, uint32_t uiTimestamp, RtpPacketRing& ring);
+
+  uint32_t getSsrc() const { return m_uiSsrc; }
+  /// added to the timestamps given to packetize()
+  uint32_t getTimestampOffset() const { return m_uiTimestampOffset; }
+  uint64_t getSinglePackets() const { return m_ullSingle; }
+  uint64_t getAggregationPackets() const { return m_ullAggregation; }
+  uint64_t getFragmentationUnits() const { return m_ullFragments; }
+
+private:
+  struct Nal
+  {
+    const uint8_t* p;
+    size_t uiLength;
+  };
+
+  uint8_t* beginPacket(RtpPacketRing& ring, uint32_t uiTimestamp);
+  bool writeSingle(const Nal& nal, uint32_t uiTimestamp, bool bLast, RtpPacketRing& ring);
+  bool writeAggregation(size_t uiFirst, size_t uiEnd, uint32_t uiTimestamp, bool bLast, RtpPacketRing& ring);
+  bool writeFragments(const Nal& nal, uint32_t uiTimestamp, bool bLast, RtpPacketRing& ring);
+
+  AnnexBRewriter m_scanner;
+  unsigned m_uiMaxPacketSize;
+  uint8_t m_uiPayloadType;
+  uint16_t m_usSequence;
+  uint32_t m_uiSsrc;
+  uint32_t m_uiTimestampOffset;
+  /// NAL units of the access unit being packetized, reused
+  std::vector<Nal> m_vNals;
+  uint64_t m_ullSingle;
+  uint64_t m_ullAggregation;
+  uint64_t m_ullFragments;
+};
+
+/**
+ * @brief Rebuilds length-prefixed access units from the packets of H265RtpPacketizer, to check
+ * round trips. An access unit with a sequence gap or a broken FU is dropped.
+ */
+class H265RtpDepacketizer
+{
+public:
+  H265RtpDepacketizer();
+
+  /**
+   * @brief Adds the next received packet.
+   * @return true if the packet completed an access unit: see getAccessUnit().
+   */
+  bool addPacket(const uint8_t* pPacket, size_t uiLength);
+
+  /// The last completed access unit as 4 byte length-prefixed NAL units
+  const std::vector<uint8_t>& getAccessUnit() const { return m_vComplete; }
+  uint32_t getTimestamp() const { return m_uiCompleteTimestamp; }
+  uint64_t getDroppedAccessUnits() const { return m_ullDropped; }
+  const std::string& getLastError() const { return m_sLastError; }
+
+private:
+  void appendNal(const uint8_t* p, size_t uiLength);
+  void fail(const std::string& sError);
+
+  std::vector<uint8_t> m_vAccessUnit;
+  std::vector<uint8_t> m_vComplete;
+  uint32_t m_uiTimestamp;
+  uint32_t m_uiCompleteTimestamp;
+  uint16_t m_usNextSequence;
+  bool m_bStarted;
+  /// set after a loss until the next access unit starts
+  bool m_bBroken;
+  /// offset of the length of the NAL unit an FU is being added to, or SIZE_MAX
+  size_t m_uiFragmentStart;
+  uint64_t m_ullDropped;
+  std::string m_sLastError;
+};
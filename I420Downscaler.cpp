@@ -0,0 +1,264 @@
+#include "I420Downscaler.h"
+#include <algorithm>
+#include <cstring>
+#include "SimdRgb24ToI420Converter.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define SIMD_DOWNSCALER_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#define SIMD_TARGET_SSE2
+#define SIMD_TARGET_AVX2
+#else
+#define SIMD_TARGET_SSE2 __attribute__((target("sse2")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// bilinear weights are Q8
+static const int WEIGHT_ONE = 256;
+
+/// Averages 2x2 blocks of columns [iStart, iDstWidth) of a pair of rows
+static void boxRowScalar(const uint8_t* pRow0, const uint8_t* pRow1, uint8_t* pDst, int iStart, int iDstWidth)
+{
+  for (int x = iStart; x < iDstWidth; ++x)
+  {
+    pDst[x] = static_cast<uint8_t>((pRow0[2 * x] + pRow0[2 * x + 1] + pRow1[2 * x] + pRow1[2 * x + 1] + 2) >> 2);
+  }
+}
+
+/// pRow = pRow0 * (256 - iFraction) + pRow1 * iFraction for columns [iStart, iWidth)
+static void blendRowScalar(const uint8_t* pRow0, const uint8_t* pRow1, int iFraction, uint16_t* pRow, int iStart, int iWidth)
+{
+  for (int x = iStart; x < iWidth; ++x)
+  {
+    pRow[x] = static_cast<uint16_t>(pRow0[x] * (WEIGHT_ONE - iFraction) + pRow1[x] * iFraction);
+  }
+}
+
+#ifdef SIMD_DOWNSCALER_X86
+/// Sums of horizontal byte pairs of a row pair plus rounding, as 16 bit lanes
+SIMD_TARGET_SSE2 static inline __m128i boxSumsSse2(__m128i row0, __m128i row1)
+{
+  const __m128i mask = _mm_set1_epi16(0xFF);
+  const __m128i sum0 = _mm_add_epi16(_mm_and_si128(row0, mask), _mm_srli_epi16(row0, 8));
+  const __m128i sum1 = _mm_add_epi16(_mm_and_si128(row1, mask), _mm_srli_epi16(row1, 8));
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(sum0, sum1), _mm_set1_epi16(2)), 2);
+}
+
+SIMD_TARGET_SSE2 static int boxRowSse2(const uint8_t* pRow0, const uint8_t* pRow1, uint8_t* pDst, int iDstWidth)
+{
+  int x = 0;
+  for (; x + 16 <= iDstWidth; x += 16)
+  {
+    const __m128i lo = boxSumsSse2(_mm_loadu_si128((const __m128i*)(pRow0 + 2 * x)), _mm_loadu_si128((const __m128i*)(pRow1 + 2 * x)));
+    const __m128i hi = boxSumsSse2(_mm_loadu_si128((const __m128i*)(pRow0 + 2 * x + 16)), _mm_loadu_si128((const __m128i*)(pRow1 + 2 * x + 16)));
+    _mm_storeu_si128((__m128i*)(pDst + x), _mm_packus_epi16(lo, hi));
+  }
+  return x;
+}
+
+SIMD_TARGET_SSE2 static int blendRowSse2(const uint8_t* pRow0, const uint8_t* pRow1, int iFraction, uint16_t* pRow, int iWidth)
+{
+  // the products do not fit a signed 16 bit lane but their sum fits an unsigned one
+  const __m128i weight0 = _mm_set1_epi16(static_cast<short>(WEIGHT_ONE - iFraction));
+  const __m128i weight1 = _mm_set1_epi16(static_cast<short>(iFraction));
+  const __m128i zero = _mm_setzero_si128();
+  int x = 0;
+  for (; x + 16 <= iWidth; x += 16)
+  {
+    const __m128i row0 = _mm_loadu_si128((const __m128i*)(pRow0 + x));
+    const __m128i row1 = _mm_loadu_si128((const __m128i*)(pRow1 + x));
+    const __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(row0, zero), weight0), _mm_mullo_epi16(_mm_unpacklo_epi8(row1, zero), weight1));
+    const __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(row0, zero), weight0), _mm_mullo_epi16(_mm_unpackhi_epi8(row1, zero), weight1));
+    _mm_storeu_si128((__m128i*)(pRow + x), lo);
+    _mm_storeu_si128((__m128i*)(pRow + x + 8), hi);
+  }
+  return x;
+}
+
+SIMD_TARGET_AVX2 static inline __m256i boxSumsAvx2(__m256i row0, __m256i row1)
+{
+  const __m256i mask = _mm256_set1_epi16(0xFF);
+  const __m256i sum0 = _mm256_add_epi16(_mm256_and_si256(row0, mask), _mm256_srli_epi16(row0, 8));
+  const __m256i sum1 = _mm256_add_epi16(_mm256_and_si256(row1, mask), _mm256_srli_epi16(row1, 8));
+  return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(sum0, sum1), _mm256_set1_epi16(2)), 2);
+}
+
+SIMD_TARGET_AVX2 static int boxRowAvx2(const uint8_t* pRow0, const uint8_t* pRow1, uint8_t* pDst, int iDstWidth)
+{
+  int x = 0;
+  for (; x + 32 <= iDstWidth; x += 32)
+  {
+    const __m256i lo = boxSumsAvx2(_mm256_loadu_si256((const __m256i*)(pRow0 + 2 * x)), _mm256_loadu_si256((const __m256i*)(pRow1 + 2 * x)));
+    const __m256i hi = boxSumsAvx2(_mm256_loadu_si256((const __m256i*)(pRow0 + 2 * x + 32)), _mm256_loadu_si256((const __m256i*)(pRow1 + 2 * x + 32)));
+    // packus works per 128 bit lane: put the quadwords back in order
+    _mm256_storeu_si256((__m256i*)(pDst + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8));
+  }
+  return x;
+}
+
+SIMD_TARGET_AVX2 static int blendRowAvx2(const uint8_t* pRow0, const uint8_t* pRow1, int iFraction, uint16_t* pRow, int iWidth)
+{
+  const __m256i weight0 = _mm256_set1_epi16(static_cast<short>(WEIGHT_ONE - iFraction));
+  const __m256i weight1 = _mm256_set1_epi16(static_cast<short>(iFraction));
+  int x = 0;
+  for (; x + 16 <= iWidth; x += 16)
+  {
+    const __m256i row0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pRow0 + x)));
+    const __m256i row1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pRow1 + x)));
+    _mm256_storeu_si256((__m256i*)(pRow + x), _mm256_add_epi16(_mm256_mullo_epi16(row0, weight0), _mm256_mullo_epi16(row1, weight1)));
+  }
+  return x;
+}
+#endif
+
+/// Q8 position in the source of the centre of each destination sample
+static void computeTaps(int iSrcSize, int iDstSize, std::vector<int>& vIndex, std::vector<uint16_t>& vFraction)
+{
+  vIndex.resize(iDstSize);
+  vFraction.resize(iDstSize);
+  for (int i = 0; i < iDstSize; ++i)
+  {
+    const int64_t iPos = ((2 * static_cast<int64_t>(i) + 1) * iSrcSize * WEIGHT_ONE) / (2 * iDstSize) - WEIGHT_ONE / 2;
+    int iIndex = static_cast<int>((std::max)(iPos, static_cast<int64_t>(0)) >> 8);
+    int iFraction = static_cast<int>((std::max)(iPos, static_cast<int64_t>(0)) & (WEIGHT_ONE - 1));
+    if (iIndex >= iSrcSize - 1)
+    {
+      // last sample: interpolate towards itself
+      iIndex = (std::max)(iSrcSize - 2, 0);
+      iFraction = iSrcSize > 1 ? WEIGHT_ONE : 0;
+    }
+    vIndex[i] = iIndex;
+    vFraction[i] = static_cast<uint16_t>(iFraction);
+  }
+}
+
+I420Downscaler::I420Downscaler(int iSrcWidth, int iSrcHeight, int iDstWidth, int iDstHeight)
+  :m_iSrcWidth(iSrcWidth),
+  m_iSrcHeight(iSrcHeight),
+  m_iDstWidth(iDstWidth),
+  m_iDstHeight(iDstHeight),
+  m_iInstructionSet(SimdRgb24ToI420Converter::detectInstructionSet())
+{
+}
+
+unsigned I420Downscaler::getDstSize() const
+{
+  return m_iDstWidth * m_iDstHeight + 2 * (((m_iDstWidth + 1) / 2) * ((m_iDstHeight + 1) / 2));
+}
+
+const char* I420Downscaler::getKernelName() const
+{
+#ifdef SIMD_DOWNSCALER_X86
+  if (m_iInstructionSet >= SimdRgb24ToI420Converter::IS_AVX2) return "avx2";
+  if (m_iInstructionSet >= SimdRgb24ToI420Converter::IS_SSE41) return "sse2";
+#endif
+  return "scalar";
+}
+
+void I420Downscaler::scale(const uint8_t* pY, int iYStride, const uint8_t* pU, const uint8_t* pV, int iUvStride, uint8_t* pDst)
+{
+  const int iSrcUvWidth = (m_iSrcWidth + 1) / 2;
+  const int iSrcUvHeight = (m_iSrcHeight + 1) / 2;
+  const int iDstUvWidth = (m_iDstWidth + 1) / 2;
+  const int iDstUvHeight = (m_iDstHeight + 1) / 2;
+  uint8_t* pDstU = pDst + m_iDstWidth * m_iDstHeight;
+  uint8_t* pDstV = pDstU + iDstUvWidth * iDstUvHeight;
+  scalePlane(Plane(pY, iYStride, m_iSrcWidth, m_iSrcHeight), pDst, m_iDstWidth, m_iDstHeight, m_vLumaBoxBuffers, m_lumaTaps);
+  scalePlane(Plane(pU, iUvStride, iSrcUvWidth, iSrcUvHeight), pDstU, iDstUvWidth, iDstUvHeight, m_vChromaBoxBuffers, m_chromaTaps);
+  scalePlane(Plane(pV, iUvStride, iSrcUvWidth, iSrcUvHeight), pDstV, iDstUvWidth, iDstUvHeight, m_vChromaBoxBuffers, m_chromaTaps);
+}
+
+void I420Downscaler::scalePlane(const Plane& src, uint8_t* pDst, int iDstWidth, int iDstHeight, std::vector<uint8_t>* pBoxBuffers, Taps& taps)
+{
+  Plane current = src;
+  int iBuffer = 0;
+  // halve with the box filter while the picture is at least twice the target size
+  while (current.iWidth >= 2 * iDstWidth && current.iHeight >= 2 * iDstHeight)
+  {
+    const int iWidth = current.iWidth / 2;
+    const int iHeight = current.iHeight / 2;
+    if (iWidth == iDstWidth && iHeight == iDstHeight)
+    {
+      boxHalve(current, pDst);
+      return;
+    }
+    std::vector<uint8_t>& vBuffer = pBoxBuffers[iBuffer];
+    iBuffer ^= 1;
+    vBuffer.resize(iWidth * iHeight);
+    boxHalve(current, &vBuffer[0]);
+    current = Plane(&vBuffer[0], iWidth, iWidth, iHeight);
+  }
+  if (current.iWidth == iDstWidth && current.iHeight == iDstHeight)
+  {
+    for (int y = 0; y < iDstHeight; ++y)
+    {
+      memcpy(pDst + y * iDstWidth, current.pData + y * current.iStride, iDstWidth);
+    }
+    return;
+  }
+  bilinear(current, pDst, iDstWidth, iDstHeight, taps);
+}
+
+void I420Downscaler::boxHalve(const Plane& src, uint8_t* pDst) const
+{
+  const int iDstWidth = src.iWidth / 2;
+  const int iDstHeight = src.iHeight / 2;
+  for (int y = 0; y < iDstHeight; ++y)
+  {
+    const uint8_t* pRow0 = src.pData + 2 * y * src.iStride;
+    const uint8_t* pRow1 = pRow0 + src.iStride;
+    uint8_t* pDstRow = pDst + y * iDstWidth;
+    int x = 0;
+#ifdef SIMD_DOWNSCALER_X86
+    if (m_iInstructionSet >= SimdRgb24ToI420Converter::IS_AVX2) x = boxRowAvx2(pRow0, pRow1, pDstRow, iDstWidth);
+    else if (m_iInstructionSet >= SimdRgb24ToI420Converter::IS_SSE41) x = boxRowSse2(pRow0, pRow1, pDstRow, iDstWidth);
+#endif
+    boxRowScalar(pRow0, pRow1, pDstRow, x, iDstWidth);
+  }
+}
+
+void I420Downscaler::bilinear(const Plane& src, uint8_t* pDst, int iDstWidth, int iDstHeight, Taps& taps)
+{
+  if (taps.iSrcWidth != src.iWidth || taps.iSrcHeight != src.iHeight || taps.iDstWidth != iDstWidth || taps.iDstHeight != iDstHeight)
+  {
+    // the sizes are the same for every frame: only the first one computes them
+    computeTaps(src.iWidth, iDstWidth, taps.vX, taps.vXFraction);
+    computeTaps(src.iHeight, iDstHeight, taps.vY, taps.vYFraction);
+    taps.iSrcWidth = src.iWidth;
+    taps.iSrcHeight = src.iHeight;
+    taps.iDstWidth = iDstWidth;
+    taps.iDstHeight = iDstHeight;
+  }
+  // one extra column so that the last tap can read its right neighbour
+  m_vRow.resize(src.iWidth + 1);
+  const int* pY = &taps.vY[0];
+  const uint16_t* pYFraction = &taps.vYFraction[0];
+
+  for (int y = 0; y < iDstHeight; ++y)
+  {
+    const uint8_t* pRow0 = src.pData + pY[y] * src.iStride;
+    const uint8_t* pRow1 = src.pData + (std::min)(pY[y] + 1, src.iHeight - 1) * src.iStride;
+    const int iFraction = pYFraction[y];
+    int x = 0;
+#ifdef SIMD_DOWNSCALER_X86
+    if (m_iInstructionSet >= SimdRgb24ToI420Converter::IS_AVX2) x = blendRowAvx2(pRow0, pRow1, iFraction, &m_vRow[0], src.iWidth);
+    else if (m_iInstructionSet >= SimdRgb24ToI420Converter::IS_SSE41) x = blendRowSse2(pRow0, pRow1, iFraction, &m_vRow[0], src.iWidth);
+#endif
+    blendRowScalar(pRow0, pRow1, iFraction, &m_vRow[0], x, src.iWidth);
+    m_vRow[src.iWidth] = m_vRow[src.iWidth - 1];
+
+    // locals: byte stores could alias the vectors' data pointers otherwise
+    const uint16_t* pRow = &m_vRow[0];
+    const int* pX = &taps.vX[0];
+    const uint16_t* pXFraction = &taps.vXFraction[0];
+    uint8_t* pDstRow = pDst + y * iDstWidth;
+    for (int i = 0; i < iDstWidth; ++i)
+    {
+      const uint32_t uiLeft = pRow[pX[i]];
+      const uint32_t uiRight = pRow[pX[i] + 1];
+      pDstRow[i] = static_cast<uint8_t>((uiLeft * (WEIGHT_ONE - pXFraction[i]) + uiRight * pXFraction[i] + (1 << 15)) >> 16);
+    }
+  }
+}
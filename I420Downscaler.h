@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Scales an I420 picture down to a smaller packed I420 picture.
+ *
+ * Each halving of the picture is a 2x2 box filter and the remaining factor, below 2, is
+ * bilinear, so that 1080p to 360p does not alias. The box filter and the vertical pass of
+ * the bilinear filter are vectorised with SSE2 or AVX2 where available, and every kernel
+ * gives the same output as the scalar code.
+ */
+class I420Downscaler
+{
+public:
+  I420Downscaler(int iSrcWidth, int iSrcHeight, int iDstWidth, int iDstHeight);
+
+  int getDstWidth() const { return m_iDstWidth; }
+  int getDstHeight() const { return m_iDstHeight; }
+  /// Size of the packed I420 output
+  unsigned getDstSize() const;
+
+  /// Restricts the kernels to SSE2 or scalar code, e.g. to compare them
+  void setMaxInstructionSet(int iInstructionSet) { m_iInstructionSet = iInstructionSet; }
+  /// "avx2", "sse2" or "scalar"
+  const char* getKernelName() const;
+
+  /**
+   * @brief Scales the source planes into pDst, which must hold getDstSize() bytes.
+   * Not thread safe: intermediate rows are kept in the object.
+   */
+  void scale(const uint8_t* pY, int iYStride, const uint8_t* pU, const uint8_t* pV, int iUvStride, uint8_t* pDst);
+
+private:
+  struct Plane
+  {
+    Plane() :pData(NULL), iStride(0), iWidth(0), iHeight(0) {}
+    Plane(const uint8_t* p, int s, int w, int h) :pData(p), iStride(s), iWidth(w), iHeight(h) {}
+    const uint8_t* pData;
+    int iStride;
+    int iWidth;
+    int iHeight;
+  };
+
+  /// Source positions of the bilinear pass, computed once for the sizes they were made for
+  struct Taps
+  {
+    Taps() :iSrcWidth(0), iSrcHeight(0), iDstWidth(0), iDstHeight(0) {}
+    int iSrcWidth;
+    int iSrcHeight;
+    int iDstWidth;
+    int iDstHeight;
+    std::vector<int> vX;
+    std::vector<uint16_t> vXFraction;
+    std::vector<int> vY;
+    std::vector<uint16_t> vYFraction;
+  };
+
+  void scalePlane(const Plane& src, uint8_t* pDst, int iDstWidth, int iDstHeight, std::vector<uint8_t>* pBoxBuffers, Taps& taps);
+  void boxHalve(const Plane& src, uint8_t* pDst) const;
+  void bilinear(const Plane& src, uint8_t* pDst, int iDstWidth, int iDstHeight, Taps& taps);
+
+  int m_iSrcWidth;
+  int m_iSrcHeight;
+  int m_iDstWidth;
+  int m_iDstHeight;
+  /// SimdRgb24ToI420Converter::InstructionSet that the kernels may use
+  int m_iInstructionSet;
+  /// results of the 2x2 box passes, two per plane type
+  std::vector<uint8_t> m_vLumaBoxBuffers[2];
+  std::vector<uint8_t> m_vChromaBoxBuffers[2];
+  /// one row of the vertical bilinear pass
+  std::vector<uint16_t> m_vRow;
+  Taps m_lumaTaps;
+  Taps m_chromaTaps;
+};
@@ -0,0 +1,153 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * @brief Describes where the visible picture lives inside an uncompressed input sample.
+ *
+ * Built from the negotiated format: biWidth gives the row pitch (which may be wider than
+ * the picture), rcSource the visible rectangle. Offsets are in bytes from the start of the
+ * sample to the first visible sample of each plane.
+ */
+struct InputPictureLayout
+{
+  enum Format
+  {
+    FMT_I420,
+    FMT_RGB24
+  };
+
+  Format eFormat;
+  /// visible picture size
+  int iWidth;
+  int iHeight;
+  /// buffer dimensions from the bitmap header
+  int iBufferWidth;
+  int iBufferHeight;
+  int iYStride;
+  int iUvStride;
+  unsigned uiYOffset;
+  unsigned uiUOffset;
+  unsigned uiVOffset;
+  /// RGB24 only: rows are stored bottom-up
+  bool bBottomUp;
+  /// smallest sample that contains every visible row
+  unsigned uiMinSampleSize;
+
+  InputPictureLayout()
+    :eFormat(FMT_I420), iWidth(0), iHeight(0), iBufferWidth(0), iBufferHeight(0),
+    iYStride(0), iUvStride(0), uiYOffset(0), uiUOffset(0), uiVOffset(0),
+    bBottomUp(false), uiMinSampleSize(0), m_iLeft(0), m_iTop(0)
+  {
+  }
+
+  /**
+   * @brief Layout of an I420 sample. A crop rectangle of all zeros means the full buffer.
+   * Crop coordinates are rounded down to even values so that chroma stays aligned.
+   */
+  static InputPictureLayout forI420(int iBitmapWidth, int iBitmapHeight, int iLeft, int iTop, int iRight, int iBottom)
+  {
+    InputPictureLayout layout;
+    layout.eFormat = FMT_I420;
+    layout.iBufferWidth = iBitmapWidth;
+    layout.iBufferHeight = std::abs(iBitmapHeight);
+    layout.applyCrop(iLeft & ~1, iTop & ~1, iRight, iBottom);
+    layout.iYStride = layout.iBufferWidth;
+    layout.iUvStride = (layout.iBufferWidth + 1) / 2;
+    const unsigned uiYSize = layout.iYStride * layout.iBufferHeight;
+    const unsigned uiUvSize = layout.iUvStride * ((layout.iBufferHeight + 1) / 2);
+    const unsigned uiUvCropOffset = (layout.m_iTop / 2) * layout.iUvStride + layout.m_iLeft / 2;
+    layout.uiYOffset = layout.m_iTop * layout.iYStride + layout.m_iLeft;
+    layout.uiUOffset = uiYSize + uiUvCropOffset;
+    layout.uiVOffset = uiYSize + uiUvSize + uiUvCropOffset;
+    layout.uiMinSampleSize = layout.uiVOffset + ((layout.iHeight + 1) / 2 - 1) * layout.iUvStride + (layout.iWidth + 1) / 2;
+    return layout;
+  }
+
+  /**
+   * @brief Layout of an RGB24 DIB. Positive heights are bottom-up.
+   */
+  static InputPictureLayout forRgb24(int iBitmapWidth, int iBitmapHeight, int iLeft, int iTop, int iRight, int iBottom)
+  {
+    InputPictureLayout layout;
+    layout.eFormat = FMT_RGB24;
+    layout.iBufferWidth = iBitmapWidth;
+    layout.iBufferHeight = std::abs(iBitmapHeight);
+    layout.bBottomUp = iBitmapHeight > 0;
+    layout.applyCrop(iLeft, iTop, iRight, iBottom);
+    // DIB rows are padded to a multiple of 4 bytes
+    layout.iYStride = ((iBitmapWidth * 3) + 3) & ~3;
+    // offset of the lowest row in memory that belongs to the picture
+    const int iFirstRow = layout.bBottomUp ? layout.iBufferHeight - (layout.m_iTop + layout.iHeight) : layout.m_iTop;
+    layout.uiYOffset = iFirstRow * layout.iYStride + layout.m_iLeft * 3;
+    layout.uiMinSampleSize = layout.uiYOffset + (layout.iHeight - 1) * layout.iYStride + layout.iWidth * 3;
+    return layout;
+  }
+
+  /// Size of the picture once packed into a contiguous I420 buffer
+  unsigned getPackedI420Size() const
+  {
+    return iWidth * iHeight + 2 * (((iWidth + 1) / 2) * ((iHeight + 1) / 2));
+  }
+
+  /// true if samples of both layouts are read the same way
+  bool operator==(const InputPictureLayout& other) const
+  {
+    return eFormat == other.eFormat && iWidth == other.iWidth && iHeight == other.iHeight &&
+      iBufferWidth == other.iBufferWidth && iBufferHeight == other.iBufferHeight &&
+      iYStride == other.iYStride && iUvStride == other.iUvStride && uiYOffset == other.uiYOffset &&
+      uiUOffset == other.uiUOffset && uiVOffset == other.uiVOffset && bBottomUp == other.bBottomUp;
+  }
+
+  /**
+   * @brief true if an I420 sample already has the layout of a packed I420 picture, i.e.
+   * it can be handed to the encoder as is.
+   */
+  bool isPackedI420() const
+  {
+    return eFormat == FMT_I420 && iWidth == iBufferWidth && iHeight == iBufferHeight;
+  }
+
+  /**
+   * @brief Copies the visible I420 picture into a packed buffer of getPackedI420Size() bytes.
+   */
+  void packI420(const uint8_t* pSample, uint8_t* pDest) const
+  {
+    copyPlane(pSample + uiYOffset, iYStride, pDest, iWidth, iWidth, iHeight);
+    const int iUvWidth = (iWidth + 1) / 2;
+    const int iUvHeight = (iHeight + 1) / 2;
+    uint8_t* pU = pDest + iWidth * iHeight;
+    uint8_t* pV = pU + iUvWidth * iUvHeight;
+    copyPlane(pSample + uiUOffset, iUvStride, pU, iUvWidth, iUvWidth, iUvHeight);
+    copyPlane(pSample + uiVOffset, iUvStride, pV, iUvWidth, iUvWidth, iUvHeight);
+  }
+
+  static void copyPlane(const uint8_t* pSrc, int iSrcStride, uint8_t* pDest, int iDestStride, int iWidth, int iHeight)
+  {
+    for (int y = 0; y < iHeight; ++y)
+    {
+      memcpy(pDest + y * iDestStride, pSrc + y * iSrcStride, iWidth);
+    }
+  }
+
+private:
+  void applyCrop(int iLeft, int iTop, int iRight, int iBottom)
+  {
+    // An empty rectangle means the whole buffer
+    if (iRight <= iLeft || iBottom <= iTop || iRight > iBufferWidth || iBottom > iBufferHeight)
+    {
+      iLeft = 0;
+      iTop = 0;
+      iRight = iBufferWidth;
+      iBottom = iBufferHeight;
+    }
+    m_iLeft = iLeft;
+    m_iTop = iTop;
+    iWidth = iRight - iLeft;
+    iHeight = iBottom - iTop;
+  }
+
+  int m_iLeft;
+  int m_iTop;
+};
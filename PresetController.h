@@ -0,0 +1,130 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief Picks the x265 speed preset that keeps the time spent per frame within a share
+ * of the frame interval.
+ *
+ * Frame times are averaged over windows of one second of frames. A window over budget
+ * switches to the next faster preset straight away. The next slower preset is only tried
+ * after several consecutive windows below a lower threshold, so that the level does not
+ * oscillate around the budget.
+ */
+class PresetController
+{
+public:
+  /// x265 presets from fastest to slowest. The index is the level.
+  static const unsigned LEVELS = 10;
+
+  static const char* toPreset(unsigned uiLevel)
+  {
+    static const char* const PRESETS[LEVELS] =
+    {
+      "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow", "placebo"
+    };
+    return uiLevel < LEVELS ? PRESETS[uiLevel] : "";
+  }
+
+  /// Returns false if sPreset is not an x265 preset
+  static bool toLevel(const std::string& sPreset, unsigned& uiLevel)
+  {
+    for (unsigned i = 0; i < LEVELS; ++i)
+    {
+      if (sPreset == toPreset(i))
+      {
+        uiLevel = i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  PresetController()
+    :m_uiFastest(0), m_uiSlowest(LEVELS - 1), m_uiLevel(LEVELS - 1), m_uiBudgetPct(80),
+    m_uiWindowFrames(30), m_uiFrames(0), m_ullWindowUs(0), m_ullWindowIntervalUs(0),
+    m_uiQuietWindows(0), m_uiLoadPct(0)
+  {
+  }
+
+  /**
+   * @brief Starts at the slowest allowed preset.
+   * @param uiBudgetPct Share of the frame interval that the encoder may take.
+   * @param uiWindowFrames Frames per decision, normally the frame rate.
+   */
+  void reset(unsigned uiFastest, unsigned uiSlowest, unsigned uiBudgetPct, unsigned uiWindowFrames)
+  {
+    m_uiFastest = uiFastest < LEVELS ? uiFastest : LEVELS - 1;
+    m_uiSlowest = uiSlowest < m_uiFastest ? m_uiFastest : (uiSlowest < LEVELS ? uiSlowest : LEVELS - 1);
+    m_uiLevel = m_uiSlowest;
+    m_uiBudgetPct = uiBudgetPct ? uiBudgetPct : 1;
+    m_uiWindowFrames = uiWindowFrames ? uiWindowFrames : 1;
+    m_uiFrames = 0;
+    m_ullWindowUs = 0;
+    m_ullWindowIntervalUs = 0;
+    m_uiQuietWindows = 0;
+    m_uiLoadPct = 0;
+  }
+
+  /**
+   * @brief Adds the time taken by one frame.
+   * @return -1 if the preset should become faster, 1 if slower, 0 to keep it. getLevel() has
+   * the new level.
+   */
+  int addFrame(uint64_t ullFrameUs, uint64_t ullIntervalUs)
+  {
+    m_ullWindowUs += ullFrameUs;
+    m_ullWindowIntervalUs += ullIntervalUs;
+    if (++m_uiFrames < m_uiWindowFrames)
+    {
+      return 0;
+    }
+    m_uiLoadPct = m_ullWindowIntervalUs ? static_cast<unsigned>(100 * m_ullWindowUs / m_ullWindowIntervalUs) : 0;
+    m_uiFrames = 0;
+    m_ullWindowUs = 0;
+    m_ullWindowIntervalUs = 0;
+
+    if (m_uiLoadPct > m_uiBudgetPct)
+    {
+      m_uiQuietWindows = 0;
+      if (m_uiLevel > m_uiFastest)
+      {
+        --m_uiLevel;
+        return -1;
+      }
+      return 0;
+    }
+    // a slower preset costs up to twice as much: only step down with room to spare
+    if (m_uiLoadPct * 100 < m_uiBudgetPct * SLOWER_THRESHOLD_PCT)
+    {
+      if (++m_uiQuietWindows >= SLOWER_AFTER_WINDOWS && m_uiLevel < m_uiSlowest)
+      {
+        m_uiQuietWindows = 0;
+        ++m_uiLevel;
+        return 1;
+      }
+      return 0;
+    }
+    m_uiQuietWindows = 0;
+    return 0;
+  }
+
+  unsigned getLevel() const { return m_uiLevel; }
+  /// Time per frame as a percentage of the frame interval over the last window
+  unsigned getLoadPct() const { return m_uiLoadPct; }
+
+private:
+  static const unsigned SLOWER_THRESHOLD_PCT = 50;
+  static const unsigned SLOWER_AFTER_WINDOWS = 3;
+
+  unsigned m_uiFastest;
+  unsigned m_uiSlowest;
+  unsigned m_uiLevel;
+  unsigned m_uiBudgetPct;
+  unsigned m_uiWindowFrames;
+  unsigned m_uiFrames;
+  uint64_t m_ullWindowUs;
+  uint64_t m_ullWindowIntervalUs;
+  unsigned m_uiQuietWindows;
+  unsigned m_uiLoadPct;
+};
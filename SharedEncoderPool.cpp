@@ -0,0 +1,134 @@
+#include "SharedEncoderPool.h"
+
+SharedEncoderPool& SharedEncoderPool::getInstance()
+{
+  static SharedEncoderPool pool;
+  return pool;
+}
+
+SharedEncoderPool::SharedEncoderPool()
+  :m_uiNextChannel(0), m_bStopping(false)
+{
+}
+
+SharedEncoderPool::~SharedEncoderPool()
+{
+  stopWorkers();
+}
+
+unsigned SharedEncoderPool::addChannel(const Job& job, unsigned uiThreads)
+{
+  std::lock_guard<std::mutex> lockLifecycle(m_mutexLifecycle);
+  unsigned uiChannel = 0;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uiChannel = m_uiNextChannel++;
+    m_mChannels[uiChannel].job = job;
+  }
+  if (m_vThreads.empty())
+  {
+    if (uiThreads == 0)
+    {
+      uiThreads = std::thread::hardware_concurrency();
+      if (uiThreads == 0) uiThreads = 1;
+    }
+    for (unsigned i = 0; i < uiThreads; ++i)
+    {
+      m_vThreads.push_back(std::thread(&SharedEncoderPool::workerLoop, this));
+    }
+  }
+  return uiChannel;
+}
+
+void SharedEncoderPool::removeChannel(unsigned uiChannel)
+{
+  std::lock_guard<std::mutex> lockLifecycle(m_mutexLifecycle);
+  bool bLastChannel = false;
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::map<unsigned, Channel>::iterator it = m_mChannels.find(uiChannel);
+    if (it == m_mChannels.end()) return;
+    it->second.dDeadlines.clear();
+    m_cvJobDone.wait(lock, [it]() { return !it->second.bRunning; });
+    m_mChannels.erase(it);
+    bLastChannel = m_mChannels.empty();
+  }
+  if (bLastChannel)
+  {
+    stopWorkers();
+  }
+}
+
+void SharedEncoderPool::submit(unsigned uiChannel, const Clock::time_point& tDeadline)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::map<unsigned, Channel>::iterator it = m_mChannels.find(uiChannel);
+  if (it == m_mChannels.end()) return;
+  it->second.dDeadlines.push_back(tDeadline);
+  m_cvWork.notify_one();
+}
+
+unsigned SharedEncoderPool::getThreadCount() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return static_cast<unsigned>(m_vThreads.size());
+}
+
+void SharedEncoderPool::stopWorkers()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_bStopping = true;
+    m_cvWork.notify_all();
+  }
+  for (std::thread& thread : m_vThreads)
+  {
+    thread.join();
+  }
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_vThreads.clear();
+  m_bStopping = false;
+}
+
+void SharedEncoderPool::workerLoop()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true)
+  {
+    // earliest deadline first among the channels that are not being served
+    std::map<unsigned, Channel>::iterator itNext = m_mChannels.end();
+    for (std::map<unsigned, Channel>::iterator it = m_mChannels.begin(); it != m_mChannels.end(); ++it)
+    {
+      if (it->second.bRunning || it->second.dDeadlines.empty()) continue;
+      if (itNext == m_mChannels.end() || it->second.dDeadlines.front() < itNext->second.dDeadlines.front())
+      {
+        itNext = it;
+      }
+    }
+    if (m_bStopping)
+    {
+      return;
+    }
+    if (itNext == m_mChannels.end())
+    {
+      m_cvWork.wait(lock);
+      continue;
+    }
+
+    Channel& channel = itNext->second;
+    channel.dDeadlines.pop_front();
+    channel.bRunning = true;
+    // the channel stays in the map until its job is done: removeChannel waits for it
+    Job job = channel.job;
+    lock.unlock();
+    job();
+    lock.lock();
+    channel.bRunning = false;
+    m_cvJobDone.notify_all();
+    // the channel may have more work that other workers skipped while it was running
+    if (!channel.dDeadlines.empty())
+    {
+      m_cvWork.notify_one();
+    }
+  }
+}
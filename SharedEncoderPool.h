@@ -0,0 +1,67 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Process-wide worker threads shared by all encoder channels.
+ *
+ * Each channel submits one job per queued picture together with the time the picture has
+ * to be encoded by. Workers always run the job with the earliest deadline, so a channel
+ * that falls behind is served first, and never run two jobs of one channel at once, so
+ * each channel's pictures are encoded in order. The workers are started with the first
+ * channel and stopped with the last.
+ */
+class SharedEncoderPool
+{
+public:
+  typedef std::chrono::steady_clock Clock;
+  typedef std::function<void()> Job;
+
+  static SharedEncoderPool& getInstance();
+
+  /**
+   * @brief Registers a channel that runs job once per submit().
+   * @param uiThreads Worker threads to start if this is the first channel, 0 for one per CPU.
+   * Ignored while the workers are running.
+   */
+  unsigned addChannel(const Job& job, unsigned uiThreads);
+  /// Waits for a running job of the channel and drops the channel's outstanding jobs
+  void removeChannel(unsigned uiChannel);
+  /// Schedules one run of the channel's job
+  void submit(unsigned uiChannel, const Clock::time_point& tDeadline);
+
+  unsigned getThreadCount() const;
+
+private:
+  SharedEncoderPool();
+  ~SharedEncoderPool();
+  SharedEncoderPool(const SharedEncoderPool&);
+  SharedEncoderPool& operator=(const SharedEncoderPool&);
+
+  struct Channel
+  {
+    Channel() :bRunning(false) {}
+    Job job;
+    std::deque<Clock::time_point> dDeadlines;
+    bool bRunning;
+  };
+
+  void workerLoop();
+  void stopWorkers();
+
+  /// serialises starting and stopping the workers
+  std::mutex m_mutexLifecycle;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_cvWork;
+  std::condition_variable m_cvJobDone;
+  std::map<unsigned, Channel> m_mChannels;
+  unsigned m_uiNextChannel;
+  std::vector<std::thread> m_vThreads;
+  bool m_bStopping;
+};
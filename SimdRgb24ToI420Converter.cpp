@@ -0,0 +1,403 @@
+#include "SimdRgb24ToI420Converter.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define SIMD_CONVERTER_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#define SIMD_TARGET_SSE41
+#define SIMD_TARGET_AVX2
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define SIMD_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Fixed point (Q15) coefficients. DIB pixels are stored as B, G, R.
+// Y = 0.299R + 0.587G + 0.114B
+// U = -0.147R - 0.289G + 0.436B + 128
+// V = 0.615R - 0.515G - 0.100B + 128
+// Chroma is computed from the sum of a 2x2 block, hence the extra 2 bits of shift.
+static const int Y_R = 9798;
+static const int Y_G = 19235;
+static const int Y_B = 3735;
+static const int U_R = -4817;
+static const int U_G = -9470;
+static const int U_B = 14287;
+static const int V_R = 20152;
+static const int V_G = -16876;
+static const int V_B = -3276;
+static const int Y_ROUND = 1 << 14;
+static const int Y_SHIFT = 15;
+static const int C_OFFSET = (128 << 17) + (1 << 16);
+static const int C_SHIFT = 17;
+
+/// Packs two 16 bit coefficients for _mm_madd_epi16: iLow multiplies the even lanes
+static inline int packCoefficients(int iLow, int iHigh)
+{
+  return static_cast<int>((static_cast<unsigned>(iHigh) << 16) | (static_cast<unsigned>(iLow) & 0xFFFF));
+}
+
+static inline uint8_t clampToByte(int iValue)
+{
+  return static_cast<uint8_t>(iValue < 0 ? 0 : (iValue > 255 ? 255 : iValue));
+}
+
+static inline uint8_t toY(int b, int g, int r)
+{
+  return static_cast<uint8_t>((Y_R * r + Y_G * g + Y_B * b + Y_ROUND) >> Y_SHIFT);
+}
+
+/**
+ * Converts columns [iStart, iWidth) of a pair of rows. Used on its own and to finish
+ * the columns that the vector kernels leave over.
+ */
+static void convertRowPairScalar(const uint8_t* pRgb0, const uint8_t* pRgb1, uint8_t* pY0, uint8_t* pY1, uint8_t* pU, uint8_t* pV, int iStart, int iWidth)
+{
+  for (int x = iStart; x < iWidth; x += 2)
+  {
+    const uint8_t* p00 = pRgb0 + 3 * x;
+    const uint8_t* p10 = pRgb1 + 3 * x;
+    // replicate the last column for odd widths
+    const int iNext = (x + 1 < iWidth) ? 3 : 0;
+    const uint8_t* p01 = p00 + iNext;
+    const uint8_t* p11 = p10 + iNext;
+
+    pY0[x] = toY(p00[0], p00[1], p00[2]);
+    pY1[x] = toY(p10[0], p10[1], p10[2]);
+    if (iNext)
+    {
+      pY0[x + 1] = toY(p01[0], p01[1], p01[2]);
+      pY1[x + 1] = toY(p11[0], p11[1], p11[2]);
+    }
+
+    const int bs = p00[0] + p01[0] + p10[0] + p11[0];
+    const int gs = p00[1] + p01[1] + p10[1] + p11[1];
+    const int rs = p00[2] + p01[2] + p10[2] + p11[2];
+    pU[x >> 1] = clampToByte((U_R * rs + U_G * gs + U_B * bs + C_OFFSET) >> C_SHIFT);
+    pV[x >> 1] = clampToByte((V_R * rs + V_G * gs + V_B * bs + C_OFFSET) >> C_SHIFT);
+  }
+}
+
+static void rowPairScalar(const uint8_t* pRgb0, const uint8_t* pRgb1, uint8_t* pY0, uint8_t* pY1, uint8_t* pU, uint8_t* pV, int iWidth)
+{
+  convertRowPairScalar(pRgb0, pRgb1, pY0, pY1, pU, pV, 0, iWidth);
+}
+
+#ifdef SIMD_CONVERTER_X86
+
+// Shuffle masks that widen one channel of 8 BGR pixels to 16 bit lanes. The pixels are
+// read with two overlapping loads: LO at byte 0 supplies pixels 0-3, HI at byte 8 pixels 4-7.
+#define SHUF_LO(c) 3*0+c, -128, 3*1+c, -128, 3*2+c, -128, 3*3+c, -128, -128, -128, -128, -128, -128, -128, -128, -128
+#define SHUF_HI(c) -128, -128, -128, -128, -128, -128, -128, -128, 3*4+c-8, -128, 3*5+c-8, -128, 3*6+c-8, -128, 3*7+c-8, -128
+
+SIMD_TARGET_SSE41 static inline void loadBgr8Sse41(const uint8_t* pRgb, __m128i& b, __m128i& g, __m128i& r)
+{
+  const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pRgb));
+  const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pRgb + 8));
+  b = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(SHUF_LO(0))), _mm_shuffle_epi8(hi, _mm_setr_epi8(SHUF_HI(0))));
+  g = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(SHUF_LO(1))), _mm_shuffle_epi8(hi, _mm_setr_epi8(SHUF_HI(1))));
+  r = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(SHUF_LO(2))), _mm_shuffle_epi8(hi, _mm_setr_epi8(SHUF_HI(2))));
+}
+
+/// Returns 8 luma values in the low 8 bytes
+SIMD_TARGET_SSE41 static inline __m128i lumaSse41(__m128i b, __m128i g, __m128i r)
+{
+  const __m128i coeffRg = _mm_set1_epi32(packCoefficients(Y_R, Y_G));
+  const __m128i coeffB1 = _mm_set1_epi32(packCoefficients(Y_B, Y_ROUND));
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i rgLo = _mm_unpacklo_epi16(r, g);
+  const __m128i rgHi = _mm_unpackhi_epi16(r, g);
+  const __m128i b1Lo = _mm_unpacklo_epi16(b, one);
+  const __m128i b1Hi = _mm_unpackhi_epi16(b, one);
+  __m128i yLo = _mm_add_epi32(_mm_madd_epi16(rgLo, coeffRg), _mm_madd_epi16(b1Lo, coeffB1));
+  __m128i yHi = _mm_add_epi32(_mm_madd_epi16(rgHi, coeffRg), _mm_madd_epi16(b1Hi, coeffB1));
+  yLo = _mm_srai_epi32(yLo, Y_SHIFT);
+  yHi = _mm_srai_epi32(yHi, Y_SHIFT);
+  const __m128i y16 = _mm_packs_epi32(yLo, yHi);
+  return _mm_packus_epi16(y16, y16);
+}
+
+/// Returns 4 chroma values in the low 4 bytes computed from 4 pairs of 2x2 sums
+SIMD_TARGET_SSE41 static inline __m128i chromaSse41(__m128i bs, __m128i gs, __m128i rs, int iCoeffR, int iCoeffG, int iCoeffB)
+{
+  const __m128i coeffRg = _mm_set1_epi32(packCoefficients(iCoeffR, iCoeffG));
+  const __m128i rg = _mm_unpacklo_epi16(rs, gs);
+  const __m128i b32 = _mm_cvtepu16_epi32(bs);
+  __m128i c = _mm_add_epi32(_mm_madd_epi16(rg, coeffRg), _mm_mullo_epi32(b32, _mm_set1_epi32(iCoeffB)));
+  c = _mm_srai_epi32(_mm_add_epi32(c, _mm_set1_epi32(C_OFFSET)), C_SHIFT);
+  const __m128i c16 = _mm_packs_epi32(c, c);
+  return _mm_packus_epi16(c16, c16);
+}
+
+SIMD_TARGET_SSE41 static void rowPairSse41(const uint8_t* pRgb0, const uint8_t* pRgb1, uint8_t* pY0, uint8_t* pY1, uint8_t* pU, uint8_t* pV, int iWidth)
+{
+  int x = 0;
+  for (; x + 8 <= iWidth; x += 8)
+  {
+    __m128i b0, g0, r0, b1, g1, r1;
+    loadBgr8Sse41(pRgb0 + 3 * x, b0, g0, r0);
+    loadBgr8Sse41(pRgb1 + 3 * x, b1, g1, r1);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(pY0 + x), lumaSse41(b0, g0, r0));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(pY1 + x), lumaSse41(b1, g1, r1));
+
+    // vertical then horizontal sums of the 2x2 blocks
+    const __m128i bv = _mm_add_epi16(b0, b1);
+    const __m128i gv = _mm_add_epi16(g0, g1);
+    const __m128i rv = _mm_add_epi16(r0, r1);
+    const __m128i bs = _mm_hadd_epi16(bv, bv);
+    const __m128i gs = _mm_hadd_epi16(gv, gv);
+    const __m128i rs = _mm_hadd_epi16(rv, rv);
+    const int u = _mm_cvtsi128_si32(chromaSse41(bs, gs, rs, U_R, U_G, U_B));
+    const int v = _mm_cvtsi128_si32(chromaSse41(bs, gs, rs, V_R, V_G, V_B));
+    memcpy(pU + (x >> 1), &u, 4);
+    memcpy(pV + (x >> 1), &v, 4);
+  }
+  convertRowPairScalar(pRgb0, pRgb1, pY0, pY1, pU, pV, x, iWidth);
+}
+
+SIMD_TARGET_AVX2 static inline void loadBgr16Avx2(const uint8_t* pRgb, __m256i& b, __m256i& g, __m256i& r)
+{
+  // low lane: pixels 0-7, high lane: pixels 8-15
+  const __m256i lo = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pRgb))),
+                                             _mm_loadu_si128(reinterpret_cast<const __m128i*>(pRgb + 24)), 1);
+  const __m256i hi = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pRgb + 8))),
+                                             _mm_loadu_si128(reinterpret_cast<const __m128i*>(pRgb + 32)), 1);
+  b = _mm256_or_si256(_mm256_shuffle_epi8(lo, _mm256_setr_epi8(SHUF_LO(0), SHUF_LO(0))), _mm256_shuffle_epi8(hi, _mm256_setr_epi8(SHUF_HI(0), SHUF_HI(0))));
+  g = _mm256_or_si256(_mm256_shuffle_epi8(lo, _mm256_setr_epi8(SHUF_LO(1), SHUF_LO(1))), _mm256_shuffle_epi8(hi, _mm256_setr_epi8(SHUF_HI(1), SHUF_HI(1))));
+  r = _mm256_or_si256(_mm256_shuffle_epi8(lo, _mm256_setr_epi8(SHUF_LO(2), SHUF_LO(2))), _mm256_shuffle_epi8(hi, _mm256_setr_epi8(SHUF_HI(2), SHUF_HI(2))));
+}
+
+/// Returns 16 luma values in the low 128 bits
+SIMD_TARGET_AVX2 static inline __m128i lumaAvx2(__m256i b, __m256i g, __m256i r)
+{
+  const __m256i coeffRg = _mm256_set1_epi32(packCoefficients(Y_R, Y_G));
+  const __m256i coeffB1 = _mm256_set1_epi32(packCoefficients(Y_B, Y_ROUND));
+  const __m256i one = _mm256_set1_epi16(1);
+  __m256i yLo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(r, g), coeffRg), _mm256_madd_epi16(_mm256_unpacklo_epi16(b, one), coeffB1));
+  __m256i yHi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(r, g), coeffRg), _mm256_madd_epi16(_mm256_unpackhi_epi16(b, one), coeffB1));
+  yLo = _mm256_srai_epi32(yLo, Y_SHIFT);
+  yHi = _mm256_srai_epi32(yHi, Y_SHIFT);
+  const __m256i y16 = _mm256_packs_epi32(yLo, yHi);
+  const __m256i y8 = _mm256_permute4x64_epi64(_mm256_packus_epi16(y16, y16), 0x08);
+  return _mm256_castsi256_si128(y8);
+}
+
+/// Returns 8 chroma values in the low 8 bytes computed from 8 pairs of 2x2 sums
+SIMD_TARGET_AVX2 static inline __m128i chromaAvx2(__m256i bs, __m256i gs, __m256i rs, int iCoeffR, int iCoeffG, int iCoeffB)
+{
+  const __m256i coeffRg = _mm256_set1_epi32(packCoefficients(iCoeffR, iCoeffG));
+  const __m256i rg = _mm256_unpacklo_epi16(rs, gs);
+  const __m256i b32 = _mm256_unpacklo_epi16(bs, _mm256_setzero_si256());
+  __m256i c = _mm256_add_epi32(_mm256_madd_epi16(rg, coeffRg), _mm256_mullo_epi32(b32, _mm256_set1_epi32(iCoeffB)));
+  c = _mm256_srai_epi32(_mm256_add_epi32(c, _mm256_set1_epi32(C_OFFSET)), C_SHIFT);
+  const __m256i c16 = _mm256_packs_epi32(c, c);
+  const __m256i c8 = _mm256_packus_epi16(c16, c16);
+  return _mm_unpacklo_epi32(_mm256_castsi256_si128(c8), _mm256_extracti128_si256(c8, 1));
+}
+
+SIMD_TARGET_AVX2 static void rowPairAvx2(const uint8_t* pRgb0, const uint8_t* pRgb1, uint8_t* pY0, uint8_t* pY1, uint8_t* pU, uint8_t* pV, int iWidth)
+{
+  int x = 0;
+  for (; x + 16 <= iWidth; x += 16)
+  {
+    __m256i b0, g0, r0, b1, g1, r1;
+    loadBgr16Avx2(pRgb0 + 3 * x, b0, g0, r0);
+    loadBgr16Avx2(pRgb1 + 3 * x, b1, g1, r1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pY0 + x), lumaAvx2(b0, g0, r0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pY1 + x), lumaAvx2(b1, g1, r1));
+
+    const __m256i bv = _mm256_add_epi16(b0, b1);
+    const __m256i gv = _mm256_add_epi16(g0, g1);
+    const __m256i rv = _mm256_add_epi16(r0, r1);
+    const __m256i bs = _mm256_hadd_epi16(bv, bv);
+    const __m256i gs = _mm256_hadd_epi16(gv, gv);
+    const __m256i rs = _mm256_hadd_epi16(rv, rv);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(pU + (x >> 1)), chromaAvx2(bs, gs, rs, U_R, U_G, U_B));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(pV + (x >> 1)), chromaAvx2(bs, gs, rs, V_R, V_G, V_B));
+  }
+  // finish with the 8 pixel kernel and then the scalar one
+  rowPairSse41(pRgb0 + 3 * x, pRgb1 + 3 * x, pY0 + x, pY1 + x, pU + (x >> 1), pV + (x >> 1), iWidth - x);
+}
+
+#undef SHUF_LO
+#undef SHUF_HI
+#endif
+
+SimdRgb24ToI420Converter::SimdRgb24ToI420Converter(int iWidth, int iHeight)
+  :m_iWidth(iWidth),
+  m_iHeight(iHeight),
+  m_bFlip(false),
+  m_eInstructionSet(IS_SCALAR),
+  m_pKernel(&rowPairScalar)
+{
+  setInstructionSet(detectInstructionSet());
+}
+
+unsigned SimdRgb24ToI420Converter::getI420Size() const
+{
+  const unsigned uiChromaSize = ((m_iWidth + 1) / 2) * ((m_iHeight + 1) / 2);
+  return m_iWidth * m_iHeight + 2 * uiChromaSize;
+}
+
+void SimdRgb24ToI420Converter::setInstructionSet(InstructionSet eInstructionSet)
+{
+  m_eInstructionSet = std::min(eInstructionSet, detectInstructionSet());
+  switch (m_eInstructionSet)
+  {
+#ifdef SIMD_CONVERTER_X86
+  case IS_AVX2:
+    m_pKernel = &rowPairAvx2;
+    break;
+  case IS_SSE41:
+    m_pKernel = &rowPairSse41;
+    break;
+#endif
+  default:
+    m_eInstructionSet = IS_SCALAR;
+    m_pKernel = &rowPairScalar;
+    break;
+  }
+}
+
+SimdRgb24ToI420Converter::InstructionSet SimdRgb24ToI420Converter::detectInstructionSet()
+{
+#ifdef SIMD_CONVERTER_X86
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  const int iMaxLeaf = info[0];
+  __cpuid(info, 1);
+  const bool bSse41 = (info[2] & (1 << 19)) != 0;
+  const bool bOsAvx = ((info[2] & (1 << 27)) != 0) && ((info[2] & (1 << 28)) != 0) && ((_xgetbv(0) & 0x6) == 0x6);
+  bool bAvx2 = false;
+  if (bOsAvx && iMaxLeaf >= 7)
+  {
+    __cpuidex(info, 7, 0);
+    bAvx2 = (info[1] & (1 << 5)) != 0;
+  }
+#else
+  __builtin_cpu_init();
+  const bool bSse41 = __builtin_cpu_supports("sse4.1") != 0;
+  const bool bAvx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+  if (bAvx2 && bSse41) return IS_AVX2;
+  if (bSse41) return IS_SSE41;
+#endif
+  return IS_SCALAR;
+}
+
+const char* SimdRgb24ToI420Converter::toString(InstructionSet eInstructionSet)
+{
+  switch (eInstructionSet)
+  {
+  case IS_AVX2:
+    return "avx2";
+  case IS_SSE41:
+    return "sse4.1";
+  default:
+    return "scalar";
+  }
+}
+
+bool SimdRgb24ToI420Converter::checkBufferSizes(unsigned uiRgbSize, int iRgbStride, unsigned uiYuvSize)
+{
+  if (uiRgbSize < static_cast<unsigned>(iRgbStride * (m_iHeight - 1) + 3 * m_iWidth))
+  {
+    m_sLastError = "RGB24 buffer too small: " + std::to_string(uiRgbSize);
+    return false;
+  }
+  if (uiYuvSize < getI420Size())
+  {
+    m_sLastError = "I420 buffer too small: " + std::to_string(uiYuvSize);
+    return false;
+  }
+  return true;
+}
+
+bool SimdRgb24ToI420Converter::convert(const uint8_t* pRgb, unsigned uiRgbSize, int iRgbStride, uint8_t* pYuv, unsigned uiYuvSize)
+{
+  if (!checkBufferSizes(uiRgbSize, iRgbStride, uiYuvSize))
+  {
+    return false;
+  }
+  const int iUvStride = (m_iWidth + 1) / 2;
+  uint8_t* pU = pYuv + m_iWidth * m_iHeight;
+  uint8_t* pV = pU + iUvStride * ((m_iHeight + 1) / 2);
+  convert(pRgb, iRgbStride, pYuv, m_iWidth, pU, pV, iUvStride);
+  return true;
+}
+
+void SimdRgb24ToI420Converter::convert(const uint8_t* pRgb, int iRgbStride, uint8_t* pY, int iYStride, uint8_t* pU, uint8_t* pV, int iUvStride) const
+{
+  // walk the source from the last row when flipping
+  const uint8_t* pRow = m_bFlip ? pRgb + (m_iHeight - 1) * iRgbStride : pRgb;
+  const int iStep = m_bFlip ? -iRgbStride : iRgbStride;
+
+  for (int y = 0; y < m_iHeight; y += 2)
+  {
+    const uint8_t* pRow0 = pRow + y * iStep;
+    // replicate the last row for odd heights
+    const bool bPair = (y + 1 < m_iHeight);
+    const uint8_t* pRow1 = bPair ? pRow0 + iStep : pRow0;
+    uint8_t* pY0 = pY + y * iYStride;
+    uint8_t* pY1 = bPair ? pY0 + iYStride : pY0;
+    m_pKernel(pRow0, pRow1, pY0, pY1, pU + (y >> 1) * iUvStride, pV + (y >> 1) * iUvStride, m_iWidth);
+  }
+}
+
+bool SimdRgb24ToI420Converter::convertBlocks(const uint8_t* pRgb, unsigned uiRgbSize, int iRgbStride, uint8_t* pYuv, unsigned uiYuvSize, const uint8_t* pChanged, int iBlockSize)
+{
+  if (!checkBufferSizes(uiRgbSize, iRgbStride, uiYuvSize))
+  {
+    return false;
+  }
+  const int iUvStride = (m_iWidth + 1) / 2;
+  uint8_t* pU = pYuv + m_iWidth * m_iHeight;
+  uint8_t* pV = pU + iUvStride * ((m_iHeight + 1) / 2);
+  return convertBlocks(pRgb, iRgbStride, pYuv, m_iWidth, pU, pV, iUvStride, pChanged, iBlockSize);
+}
+
+bool SimdRgb24ToI420Converter::convertBlocks(const uint8_t* pRgb, int iRgbStride, uint8_t* pY, int iYStride, uint8_t* pU, uint8_t* pV, int iUvStride, const uint8_t* pChanged, int iBlockSize)
+{
+  if (iBlockSize <= 0 || (iBlockSize & 1))
+  {
+    m_sLastError = "Invalid block size: " + std::to_string(iBlockSize);
+    return false;
+  }
+  const int iColumns = (m_iWidth + iBlockSize - 1) / iBlockSize;
+  const uint8_t* pRow = m_bFlip ? pRgb + (m_iHeight - 1) * iRgbStride : pRgb;
+  const int iStep = m_bFlip ? -iRgbStride : iRgbStride;
+
+  // row pairs never straddle blocks, so each run of changed blocks converts like the whole row
+  for (int y = 0; y < m_iHeight; y += 2)
+  {
+    const uint8_t* pRowChanged = pChanged + (y / iBlockSize) * iColumns;
+    const uint8_t* pRow0 = pRow + y * iStep;
+    const bool bPair = (y + 1 < m_iHeight);
+    const uint8_t* pRow1 = bPair ? pRow0 + iStep : pRow0;
+    uint8_t* pY0 = pY + y * iYStride;
+    uint8_t* pY1 = bPair ? pY0 + iYStride : pY0;
+    uint8_t* pURow = pU + (y >> 1) * iUvStride;
+    uint8_t* pVRow = pV + (y >> 1) * iUvStride;
+    int iColumn = 0;
+    while (iColumn < iColumns)
+    {
+      if (!pRowChanged[iColumn])
+      {
+        ++iColumn;
+        continue;
+      }
+      const int iFirst = iColumn;
+      while (iColumn < iColumns && pRowChanged[iColumn]) ++iColumn;
+      const int x = iFirst * iBlockSize;
+      const int iRunWidth = (std::min)(iColumn * iBlockSize, m_iWidth) - x;
+      m_pKernel(pRow0 + 3 * x, pRow1 + 3 * x, pY0 + x, pY1 + x, pURow + (x >> 1), pVRow + (x >> 1), iRunWidth);
+    }
+  }
+  return true;
+}
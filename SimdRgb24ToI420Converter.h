@@ -0,0 +1,83 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief Single pass RGB24 (DIB, BGR byte order) to I420 converter.
+ *
+ * The bottom-up flip, the colour matrix and the 2x2 chroma subsampling are done
+ * in one pass over each pair of source rows. The row kernel is selected at runtime:
+ * AVX2 and SSE4.1 kernels are used when the CPU supports them, otherwise the scalar
+ * kernel is used. All kernels use the same fixed point arithmetic and produce
+ * identical output. The VPP converter computes in floating point, so its samples may
+ * differ from these by rounding. X265EncoderBench --mode convert checks both.
+ */
+class SimdRgb24ToI420Converter
+{
+public:
+  enum InstructionSet
+  {
+    IS_SCALAR = 0,
+    IS_SSE41 = 1,
+    IS_AVX2 = 2
+  };
+
+  SimdRgb24ToI420Converter(int iWidth, int iHeight);
+
+  /// Source DIBs are stored bottom-up: set to true to write the picture top-down
+  void setFlip(bool bFlip) { m_bFlip = bFlip; }
+  bool getFlip() const { return m_bFlip; }
+
+  int getWidth() const { return m_iWidth; }
+  int getHeight() const { return m_iHeight; }
+
+  /// Size of a contiguous I420 picture of the configured dimensions
+  unsigned getI420Size() const;
+
+  /// Restricts the kernel to at most eInstructionSet (e.g. to compare kernels)
+  void setInstructionSet(InstructionSet eInstructionSet);
+  InstructionSet getInstructionSet() const { return m_eInstructionSet; }
+  static InstructionSet detectInstructionSet();
+  static const char* toString(InstructionSet eInstructionSet);
+
+  /**
+   * @brief Converts into a contiguous I420 buffer.
+   * @param pRgb The RGB24 source. iRgbStride is the distance in bytes between rows in memory.
+   * @return false if either buffer is too small. See getLastError().
+   */
+  bool convert(const uint8_t* pRgb, unsigned uiRgbSize, int iRgbStride, uint8_t* pYuv, unsigned uiYuvSize);
+  /**
+   * @brief Converts into separate planes.
+   */
+  void convert(const uint8_t* pRgb, int iRgbStride, uint8_t* pY, int iYStride, uint8_t* pU, uint8_t* pV, int iUvStride) const;
+  /**
+   * @brief Converts only the changed blocks into a contiguous I420 buffer that holds the
+   * previous picture. The result is the same as that of convert().
+   * @param pChanged One entry per block of iBlockSize x iBlockSize pixels in raster order from
+   * the top left of the picture, non-zero if the block has to be converted.
+   * @param iBlockSize An even block size.
+   */
+  bool convertBlocks(const uint8_t* pRgb, unsigned uiRgbSize, int iRgbStride, uint8_t* pYuv, unsigned uiYuvSize, const uint8_t* pChanged, int iBlockSize);
+  /**
+   * @brief Converts only the changed blocks into separate planes.
+   * @return false if iBlockSize is not even.
+   */
+  bool convertBlocks(const uint8_t* pRgb, int iRgbStride, uint8_t* pY, int iYStride, uint8_t* pU, uint8_t* pV, int iUvStride, const uint8_t* pChanged, int iBlockSize);
+
+  const std::string& getLastError() const { return m_sLastError; }
+
+  /// Row stride of a DIB: rows are padded to a multiple of 4 bytes
+  static int getDibStride(int iWidth) { return ((iWidth * 3) + 3) & ~3; }
+
+  typedef void (*RowPairKernel)(const uint8_t* pRgb0, const uint8_t* pRgb1, uint8_t* pY0, uint8_t* pY1, uint8_t* pU, uint8_t* pV, int iWidth);
+
+private:
+  bool checkBufferSizes(unsigned uiRgbSize, int iRgbStride, unsigned uiYuvSize);
+
+  int m_iWidth;
+  int m_iHeight;
+  bool m_bFlip;
+  InstructionSet m_eInstructionSet;
+  RowPairKernel m_pKernel;
+  std::string m_sLastError;
+};
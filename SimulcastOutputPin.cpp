@@ -0,0 +1,25 @@
+#include "stdafx.h"
+#include "SimulcastOutputPin.h"
+#include "X265EncoderFilter.h"
+
+SimulcastOutputPin::SimulcastOutputPin(X265EncoderFilter* pFilter, CCritSec* pLock, HRESULT* phr, LPCWSTR szName, unsigned uiLayer)
+  : CBaseOutputPin(NAME("Simulcast Output Pin"), pFilter, pLock, phr, szName),
+  m_pEncoder(pFilter),
+  m_uiLayer(uiLayer)
+{
+}
+
+HRESULT SimulcastOutputPin::CheckMediaType(const CMediaType* pMediaType)
+{
+  return m_pEncoder->checkLayerMediaType(m_uiLayer, pMediaType);
+}
+
+HRESULT SimulcastOutputPin::GetMediaType(int iPosition, CMediaType* pMediaType)
+{
+  return m_pEncoder->getLayerMediaType(m_uiLayer, iPosition, pMediaType);
+}
+
+HRESULT SimulcastOutputPin::DecideBufferSize(IMemAllocator* pAlloc, ALLOCATOR_PROPERTIES* pProp)
+{
+  return m_pEncoder->decideLayerBufferSize(m_uiLayer, pAlloc, pProp);
+}
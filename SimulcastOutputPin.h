@@ -0,0 +1,26 @@
+#pragma once
+
+class X265EncoderFilter;
+
+/**
+ * @brief Output pin of a simulcast layer of X265EncoderFilter.
+ *
+ * Like CTransformOutputPin for the main output, the pin leaves media type negotiation and
+ * allocator sizing to the filter. Samples are delivered by the filter's streaming thread.
+ */
+class SimulcastOutputPin : public CBaseOutputPin
+{
+public:
+  SimulcastOutputPin(X265EncoderFilter* pFilter, CCritSec* pLock, HRESULT* phr, LPCWSTR szName, unsigned uiLayer);
+
+  HRESULT CheckMediaType(const CMediaType* pMediaType);
+  HRESULT GetMediaType(int iPosition, CMediaType* pMediaType);
+  HRESULT DecideBufferSize(IMemAllocator* pAlloc, ALLOCATOR_PROPERTIES* pProp);
+
+  /// Index of the layer in X265EncoderFilter's simulcast_layers
+  unsigned getLayer() const { return m_uiLayer; }
+
+private:
+  X265EncoderFilter* m_pEncoder;
+  unsigned m_uiLayer;
+};
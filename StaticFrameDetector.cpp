@@ -0,0 +1,265 @@
+#include "StaticFrameDetector.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define STATIC_DETECTOR_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define SIMD_TARGET_SSE42
+#else
+#include <nmmintrin.h>
+#define SIMD_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+// Castagnoli polynomial, bit reversed as used by the SSE4.2 crc32 instruction
+static const uint32_t CRC32C_POLYNOMIAL = 0x82F63B78;
+
+struct Crc32cTable
+{
+  Crc32cTable()
+  {
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+      uint32_t uiCrc = i;
+      for (int j = 0; j < 8; ++j)
+      {
+        uiCrc = (uiCrc >> 1) ^ ((uiCrc & 1) ? CRC32C_POLYNOMIAL : 0);
+      }
+      entries[i] = uiCrc;
+    }
+  }
+  uint32_t entries[256];
+};
+
+static inline uint32_t crc32cByte(const uint32_t* pTable, uint32_t uiCrc, uint8_t uiByte)
+{
+  return pTable[(uiCrc ^ uiByte) & 0xFF] ^ (uiCrc >> 8);
+}
+
+static void rowScalar(const uint8_t* pRow, unsigned uiRowBytes, uint32_t* pCrc)
+{
+  static const Crc32cTable table;
+  uint32_t uiCrc = *pCrc;
+  for (unsigned i = 0; i < uiRowBytes; ++i)
+  {
+    uiCrc = crc32cByte(table.entries, uiCrc, pRow[i]);
+  }
+  *pCrc = uiCrc;
+}
+
+static void rowsScalar(const uint8_t* pRow, int iStride, unsigned uiRowBytes, uint32_t* pCrc)
+{
+  for (unsigned i = 0; i < StaticFrameDetector::LANES; ++i)
+  {
+    rowScalar(pRow + static_cast<int>(i) * iStride, uiRowBytes, pCrc + i);
+  }
+}
+
+#ifdef STATIC_DETECTOR_X86
+
+SIMD_TARGET_SSE42 static inline uint32_t crc32cTailSse42(const uint8_t* p, unsigned uiBytes, uint32_t uiCrc)
+{
+  for (unsigned i = 0; i < uiBytes; ++i)
+  {
+    uiCrc = _mm_crc32_u8(uiCrc, p[i]);
+  }
+  return uiCrc;
+}
+
+#if defined(_M_X64) || defined(__x86_64__)
+SIMD_TARGET_SSE42 static inline uint32_t crc32cWordSse42(uint32_t uiCrc, const uint8_t* p)
+{
+  uint64_t ullWord;
+  memcpy(&ullWord, p, 8);
+  return static_cast<uint32_t>(_mm_crc32_u64(uiCrc, ullWord));
+}
+#else
+SIMD_TARGET_SSE42 static inline uint32_t crc32cWordSse42(uint32_t uiCrc, const uint8_t* p)
+{
+  uint32_t uiLow, uiHigh;
+  memcpy(&uiLow, p, 4);
+  memcpy(&uiHigh, p + 4, 4);
+  return _mm_crc32_u32(_mm_crc32_u32(uiCrc, uiLow), uiHigh);
+}
+#endif
+
+SIMD_TARGET_SSE42 static void rowSse42(const uint8_t* pRow, unsigned uiRowBytes, uint32_t* pCrc)
+{
+  uint32_t uiCrc = *pCrc;
+  unsigned i = 0;
+  for (; i + 8 <= uiRowBytes; i += 8)
+  {
+    uiCrc = crc32cWordSse42(uiCrc, pRow + i);
+  }
+  *pCrc = crc32cTailSse42(pRow + i, uiRowBytes - i, uiCrc);
+}
+
+/// The crc32 instruction has a latency of 3 cycles: four rows keep it busy
+SIMD_TARGET_SSE42 static void rowsSse42(const uint8_t* pRow, int iStride, unsigned uiRowBytes, uint32_t* pCrc)
+{
+  const uint8_t* p0 = pRow;
+  const uint8_t* p1 = pRow + iStride;
+  const uint8_t* p2 = p1 + iStride;
+  const uint8_t* p3 = p2 + iStride;
+  uint32_t c0 = pCrc[0], c1 = pCrc[1], c2 = pCrc[2], c3 = pCrc[3];
+  unsigned i = 0;
+  for (; i + 8 <= uiRowBytes; i += 8)
+  {
+    c0 = crc32cWordSse42(c0, p0 + i);
+    c1 = crc32cWordSse42(c1, p1 + i);
+    c2 = crc32cWordSse42(c2, p2 + i);
+    c3 = crc32cWordSse42(c3, p3 + i);
+  }
+  const unsigned uiTail = uiRowBytes - i;
+  pCrc[0] = crc32cTailSse42(p0 + i, uiTail, c0);
+  pCrc[1] = crc32cTailSse42(p1 + i, uiTail, c1);
+  pCrc[2] = crc32cTailSse42(p2 + i, uiTail, c2);
+  pCrc[3] = crc32cTailSse42(p3 + i, uiTail, c3);
+}
+#endif
+
+StaticFrameDetector::StaticFrameDetector(const InputPictureLayout& layout, int iBlockSize)
+  :m_uiPlanes(0),
+  m_iBlockSize(iBlockSize),
+  m_iBlockColumns(1),
+  m_iBlockRows(1),
+  m_eInstructionSet(IS_SCALAR),
+  m_pRowsKernel(&rowsScalar),
+  m_pRowKernel(&rowScalar),
+  m_uiChangedBlocks(0),
+  m_bHasPrevious(false)
+{
+  // a single block spans the picture
+  const int iBlockWidth = iBlockSize > 0 ? iBlockSize : layout.iWidth;
+  const int iBlockHeight = iBlockSize > 0 ? iBlockSize : layout.iHeight;
+  if (iBlockSize > 0)
+  {
+    m_iBlockColumns = (layout.iWidth + iBlockSize - 1) / iBlockSize;
+    m_iBlockRows = (layout.iHeight + iBlockSize - 1) / iBlockSize;
+  }
+  if (layout.eFormat == InputPictureLayout::FMT_RGB24)
+  {
+    const bool bBottomUp = layout.bBottomUp;
+    const unsigned uiTop = bBottomUp ? layout.uiYOffset + (layout.iHeight - 1) * layout.iYStride : layout.uiYOffset;
+    addPlane(uiTop, bBottomUp ? -layout.iYStride : layout.iYStride, layout.iWidth * 3, layout.iHeight, iBlockWidth * 3, iBlockHeight);
+  }
+  else
+  {
+    const unsigned uiUvWidth = static_cast<unsigned>((layout.iWidth + 1) / 2);
+    const int iUvHeight = (layout.iHeight + 1) / 2;
+    const unsigned uiUvBlockWidth = static_cast<unsigned>((iBlockWidth + 1) / 2);
+    const int iUvBlockHeight = (iBlockHeight + 1) / 2;
+    addPlane(layout.uiYOffset, layout.iYStride, layout.iWidth, layout.iHeight, iBlockWidth, iBlockHeight);
+    addPlane(layout.uiUOffset, layout.iUvStride, uiUvWidth, iUvHeight, uiUvBlockWidth, iUvBlockHeight);
+    addPlane(layout.uiVOffset, layout.iUvStride, uiUvWidth, iUvHeight, uiUvBlockWidth, iUvBlockHeight);
+  }
+  const size_t uiBlocks = static_cast<size_t>(m_iBlockColumns) * m_iBlockRows;
+  m_vHash.resize(uiBlocks * LANES);
+  m_vPrevious.resize(uiBlocks * LANES);
+  m_vChanged.assign(uiBlocks, 1);
+  m_uiChangedBlocks = static_cast<unsigned>(uiBlocks);
+  setInstructionSet(detectInstructionSet());
+}
+
+void StaticFrameDetector::addPlane(unsigned uiOffset, int iStride, unsigned uiRowBytes, int iRows, unsigned uiBlockBytes, int iBlockRows)
+{
+  const Plane plane = { uiOffset, iStride, uiRowBytes, iRows, uiBlockBytes, iBlockRows };
+  m_planes[m_uiPlanes++] = plane;
+}
+
+void StaticFrameDetector::setInstructionSet(InstructionSet eInstructionSet)
+{
+  m_eInstructionSet = std::min(eInstructionSet, detectInstructionSet());
+  switch (m_eInstructionSet)
+  {
+#ifdef STATIC_DETECTOR_X86
+  case IS_SSE42:
+    m_pRowsKernel = &rowsSse42;
+    m_pRowKernel = &rowSse42;
+    break;
+#endif
+  default:
+    m_eInstructionSet = IS_SCALAR;
+    m_pRowsKernel = &rowsScalar;
+    m_pRowKernel = &rowScalar;
+    break;
+  }
+}
+
+StaticFrameDetector::InstructionSet StaticFrameDetector::detectInstructionSet()
+{
+#ifdef STATIC_DETECTOR_X86
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  const bool bSse42 = (info[2] & (1 << 20)) != 0;
+#else
+  __builtin_cpu_init();
+  const bool bSse42 = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+  if (bSse42) return IS_SSE42;
+#endif
+  return IS_SCALAR;
+}
+
+const char* StaticFrameDetector::toString(InstructionSet eInstructionSet)
+{
+  return eInstructionSet == IS_SSE42 ? "sse4.2" : "scalar";
+}
+
+void StaticFrameDetector::hash(const uint8_t* pSample, uint32_t* pCrc) const
+{
+  const size_t uiCrcs = static_cast<size_t>(m_iBlockColumns) * m_iBlockRows * LANES;
+  for (size_t i = 0; i < uiCrcs; ++i)
+  {
+    pCrc[i] = 0xFFFFFFFF;
+  }
+  for (unsigned i = 0; i < m_uiPlanes; ++i)
+  {
+    const Plane& plane = m_planes[i];
+    const uint8_t* pPlane = pSample + plane.uiOffset;
+    for (int iBlockRow = 0; iBlockRow < m_iBlockRows; ++iBlockRow)
+    {
+      const int iTop = iBlockRow * plane.iBlockRows;
+      const int iBottom = (std::min)(iTop + plane.iBlockRows, plane.iRows);
+      uint32_t* pRowCrc = pCrc + static_cast<size_t>(iBlockRow) * m_iBlockColumns * LANES;
+      int y = iTop;
+      for (; y + static_cast<int>(LANES) <= iBottom; y += LANES)
+      {
+        const uint8_t* pRow = pPlane + y * plane.iStride;
+        for (int iColumn = 0; iColumn < m_iBlockColumns; ++iColumn)
+        {
+          const unsigned uiStart = iColumn * plane.uiBlockBytes;
+          m_pRowsKernel(pRow + uiStart, plane.iStride, (std::min)(plane.uiBlockBytes, plane.uiRowBytes - uiStart), pRowCrc + iColumn * LANES);
+        }
+      }
+      // the last rows go to the lanes they would have had in a full group
+      for (; y < iBottom; ++y)
+      {
+        const uint8_t* pRow = pPlane + y * plane.iStride;
+        for (int iColumn = 0; iColumn < m_iBlockColumns; ++iColumn)
+        {
+          const unsigned uiStart = iColumn * plane.uiBlockBytes;
+          m_pRowKernel(pRow + uiStart, (std::min)(plane.uiBlockBytes, plane.uiRowBytes - uiStart), pRowCrc + iColumn * LANES + (y - iTop) % LANES);
+        }
+      }
+    }
+  }
+}
+
+bool StaticFrameDetector::isStatic(const uint8_t* pSample)
+{
+  hash(pSample, &m_vHash[0]);
+  m_uiChangedBlocks = 0;
+  for (size_t i = 0; i < m_vChanged.size(); ++i)
+  {
+    m_vChanged[i] = (!m_bHasPrevious || memcmp(&m_vHash[i * LANES], &m_vPrevious[i * LANES], LANES * sizeof(uint32_t)) != 0) ? 1 : 0;
+    m_uiChangedBlocks += m_vChanged[i];
+  }
+  m_vHash.swap(m_vPrevious);
+  m_bHasPrevious = true;
+  return m_uiChangedBlocks == 0;
+}
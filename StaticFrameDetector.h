@@ -0,0 +1,92 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "InputPictureLayout.h"
+
+/**
+ * @brief Tells which blocks of the visible picture of an input sample differ from the previous
+ * sample, or whether the picture is identical as a whole.
+ *
+ * Each block is hashed with CRC32C. Its rows are dealt to four independent CRCs in turn, so
+ * that the SSE4.2 kernel can run four CRC chains side by side, and a block counts as unchanged
+ * only if all four match. Blocks are square in picture pixels and numbered in raster order from
+ * the top left, whatever the row order in memory; the chroma planes of I420 contribute the rows
+ * under the luma block. Padding and cropped areas are ignored. The kernel is selected at
+ * runtime; the scalar kernel computes the same CRCs.
+ */
+class StaticFrameDetector
+{
+public:
+  enum InstructionSet
+  {
+    IS_SCALAR = 0,
+    IS_SSE42 = 1
+  };
+
+  static const unsigned LANES = 4;
+
+  /**
+   * @param iBlockSize Block width and height in pixels, a multiple of 4, e.g. the CTU size.
+   * 0 treats the whole picture as one block.
+   */
+  explicit StaticFrameDetector(const InputPictureLayout& layout, int iBlockSize = 0);
+
+  void setInstructionSet(InstructionSet eInstructionSet);
+  InstructionSet getInstructionSet() const { return m_eInstructionSet; }
+  static InstructionSet detectInstructionSet();
+  static const char* toString(InstructionSet eInstructionSet);
+
+  /**
+   * @brief Hashes the picture of pSample and compares each block with the previous call.
+   * @param pSample A sample at least InputPictureLayout::uiMinSampleSize bytes long.
+   * @return true if no block changed. Always false for the first call after reset().
+   */
+  bool isStatic(const uint8_t* pSample);
+  /// Forgets the previous picture, e.g. when the picture derived from it was lost
+  void reset() { m_bHasPrevious = false; }
+
+  int getBlockSize() const { return m_iBlockSize; }
+  int getBlockColumns() const { return m_iBlockColumns; }
+  int getBlockRows() const { return m_iBlockRows; }
+  /// 1 for each block that changed in the last call to isStatic(), all 1 after reset()
+  const std::vector<uint8_t>& getChangedBlocks() const { return m_vChanged; }
+  unsigned getChangedBlockCount() const { return m_uiChangedBlocks; }
+
+  /// LANES CRCs per block of the picture of pSample
+  void hash(const uint8_t* pSample, uint32_t* pCrc) const;
+
+  /// Adds uiRowBytes of each of LANES rows, iStride apart, to pCrc[0] to pCrc[LANES - 1]
+  typedef void (*RowsKernel)(const uint8_t* pRow, int iStride, unsigned uiRowBytes, uint32_t* pCrc);
+  /// Adds uiRowBytes of one row to *pCrc
+  typedef void (*RowKernel)(const uint8_t* pRow, unsigned uiRowBytes, uint32_t* pCrc);
+
+private:
+  struct Plane
+  {
+    /// offset of the top row of the picture
+    unsigned uiOffset;
+    /// from one row of the picture to the next below it, negative for bottom-up DIBs
+    int iStride;
+    unsigned uiRowBytes;
+    int iRows;
+    /// bytes and rows of the plane per block
+    unsigned uiBlockBytes;
+    int iBlockRows;
+  };
+
+  void addPlane(unsigned uiOffset, int iStride, unsigned uiRowBytes, int iRows, unsigned uiBlockBytes, int iBlockRows);
+
+  Plane m_planes[3];
+  unsigned m_uiPlanes;
+  int m_iBlockSize;
+  int m_iBlockColumns;
+  int m_iBlockRows;
+  InstructionSet m_eInstructionSet;
+  RowsKernel m_pRowsKernel;
+  RowKernel m_pRowKernel;
+  std::vector<uint32_t> m_vHash;
+  std::vector<uint32_t> m_vPrevious;
+  std::vector<uint8_t> m_vChanged;
+  unsigned m_uiChangedBlocks;
+  bool m_bHasPrevious;
+};
@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+/**
+ * @brief Lock-free histogram of unsigned 32 bit samples such as durations or sizes.
+ *
+ * Values below 16 have a bucket each. Above that every power of two is split into 8
+ * buckets, so a percentile is reported to within 12.5% of the true value. add() may be
+ * called from any thread while others read percentiles.
+ */
+class StatsHistogram
+{
+public:
+  static const unsigned BUCKETS = 240;
+
+  StatsHistogram()
+  {
+    reset();
+  }
+
+  void add(uint32_t uiValue)
+  {
+    m_buckets[toBucket(uiValue)].fetch_add(1, std::memory_order_relaxed);
+    m_uiCount.fetch_add(1, std::memory_order_relaxed);
+    uint32_t uiMax = m_uiMax.load(std::memory_order_relaxed);
+    while (uiValue > uiMax && !m_uiMax.compare_exchange_weak(uiMax, uiValue, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  /// Returns the upper bound of the bucket holding the given percentile (0-100), 0 if empty
+  uint32_t getPercentile(double dPercentile) const
+  {
+    const uint64_t uiCount = m_uiCount.load(std::memory_order_relaxed);
+    if (uiCount == 0) return 0;
+    const uint64_t uiRank = static_cast<uint64_t>(dPercentile / 100.0 * uiCount + 0.5);
+    uint64_t uiSeen = 0;
+    for (unsigned i = 0; i < BUCKETS; ++i)
+    {
+      uiSeen += m_buckets[i].load(std::memory_order_relaxed);
+      if (uiSeen >= uiRank && uiSeen > 0)
+      {
+        const uint32_t uiUpper = getBucketUpperBound(i);
+        const uint32_t uiMax = getMax();
+        return uiUpper < uiMax ? uiUpper : uiMax;
+      }
+    }
+    return getMax();
+  }
+
+  uint32_t getMax() const { return m_uiMax.load(std::memory_order_relaxed); }
+  uint64_t getCount() const { return m_uiCount.load(std::memory_order_relaxed); }
+
+  void reset()
+  {
+    for (unsigned i = 0; i < BUCKETS; ++i)
+    {
+      m_buckets[i].store(0, std::memory_order_relaxed);
+    }
+    m_uiCount.store(0, std::memory_order_relaxed);
+    m_uiMax.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  static unsigned toBucket(uint32_t uiValue)
+  {
+    if (uiValue < 16) return uiValue;
+    unsigned uiMsb = 4;
+    while (uiMsb < 31 && (uiValue >> (uiMsb + 1)) != 0) ++uiMsb;
+    const unsigned uiSub = (uiValue >> (uiMsb - 3)) & 7;
+    return 16 + (uiMsb - 4) * 8 + uiSub;
+  }
+
+  static uint32_t getBucketUpperBound(unsigned uiBucket)
+  {
+    if (uiBucket < 16) return uiBucket;
+    const unsigned uiMsb = (uiBucket - 16) / 8 + 4;
+    const unsigned uiSub = (uiBucket - 16) % 8;
+    const uint64_t uiLower = static_cast<uint64_t>(8 + uiSub) << (uiMsb - 3);
+    return static_cast<uint32_t>(uiLower + (static_cast<uint64_t>(1) << (uiMsb - 3)) - 1);
+  }
+
+  std::atomic<uint32_t> m_buckets[BUCKETS];
+  std::atomic<uint64_t> m_uiCount;
+  std::atomic<uint32_t> m_uiMax;
+};
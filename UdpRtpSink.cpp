@@ -0,0 +1,201 @@
+#include "UdpRtpSink.h"
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+static const uintptr_t INVALID = INVALID_SOCKET;
+#else
+#include <cerrno>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+static const int INVALID = -1;
+#endif
+
+UdpRtpSink::UdpRtpSink()
+  :m_socket(INVALID), m_ullSendCalls(0), m_ullSendErrors(0)
+{
+}
+
+UdpRtpSink::~UdpRtpSink()
+{
+  close();
+}
+
+bool UdpRtpSink::parseDestination(const std::string& sDestination, std::string& sHost, uint16_t& usPort)
+{
+  const size_t uiColon = sDestination.rfind(':');
+  if (uiColon == std::string::npos || uiColon == 0 || uiColon + 1 == sDestination.length())
+  {
+    return false;
+  }
+  char* pEnd = NULL;
+  const long lPort = strtol(sDestination.c_str() + uiColon + 1, &pEnd, 10);
+  if (*pEnd != '\0' || lPort <= 0 || lPort > 65535)
+  {
+    return false;
+  }
+  sHost = sDestination.substr(0, uiColon);
+  usPort = static_cast<uint16_t>(lPort);
+  return true;
+}
+
+bool UdpRtpSink::open(const std::string& sDestination)
+{
+  close();
+  std::string sHost;
+  uint16_t usPort = 0;
+  if (!parseDestination(sDestination, sHost, usPort))
+  {
+    m_sLastError = "Invalid RTP destination: " + sDestination + ". Use host:port.";
+    return false;
+  }
+#if defined(_WIN32)
+  WSADATA wsaData;
+  if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+  {
+    m_sLastError = "WSAStartup failed";
+    return false;
+  }
+#endif
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo* pAddresses = NULL;
+  if (getaddrinfo(sHost.c_str(), std::to_string(usPort).c_str(), &hints, &pAddresses) != 0 || !pAddresses)
+  {
+    m_sLastError = "Cannot resolve RTP destination " + sHost;
+#if defined(_WIN32)
+    WSACleanup();
+#endif
+    return false;
+  }
+  m_socket = socket(pAddresses->ai_family, pAddresses->ai_socktype, pAddresses->ai_protocol);
+  const bool bConnected = m_socket != INVALID && connect(m_socket, pAddresses->ai_addr, static_cast<int>(pAddresses->ai_addrlen)) == 0;
+  freeaddrinfo(pAddresses);
+  if (!bConnected)
+  {
+    m_sLastError = "Cannot open a UDP socket to " + sDestination;
+    close();
+    return false;
+  }
+  // a large send buffer absorbs the burst of packets of an IDR
+  int iBufferSize = 4 * 1024 * 1024;
+  setsockopt(m_socket, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&iBufferSize), sizeof(iBufferSize));
+#if defined(__linux__)
+  m_vMessages.assign(BATCH_SIZE * sizeof(mmsghdr), 0);
+  m_vIovecs.assign(BATCH_SIZE * sizeof(iovec), 0);
+#endif
+  m_ullSendCalls = 0;
+  m_ullSendErrors = 0;
+  return true;
+}
+
+void UdpRtpSink::close()
+{
+  if (m_socket == INVALID)
+  {
+    return;
+  }
+#if defined(_WIN32)
+  closesocket(m_socket);
+  WSACleanup();
+#else
+  ::close(m_socket);
+#endif
+  m_socket = INVALID;
+}
+
+bool UdpRtpSink::isOpen() const
+{
+  return m_socket != INVALID;
+}
+
+unsigned UdpRtpSink::send(RtpPacketRing& ring)
+{
+  unsigned uiSent = 0;
+  if (m_socket == INVALID)
+  {
+    return 0;
+  }
+#if defined(__linux__)
+  mmsghdr* pMessages = reinterpret_cast<mmsghdr*>(&m_vMessages[0]);
+  iovec* pIovecs = reinterpret_cast<iovec*>(&m_vIovecs[0]);
+  while (ring.getCount() > 0)
+  {
+    const unsigned uiBatch = ring.getCount() < BATCH_SIZE ? ring.getCount() : BATCH_SIZE;
+    for (unsigned i = 0; i < uiBatch; ++i)
+    {
+      unsigned uiLength = 0;
+      pIovecs[i].iov_base = const_cast<uint8_t*>(ring.getPacket(i, uiLength));
+      pIovecs[i].iov_len = uiLength;
+      memset(&pMessages[i], 0, sizeof(mmsghdr));
+      pMessages[i].msg_hdr.msg_iov = &pIovecs[i];
+      pMessages[i].msg_hdr.msg_iovlen = 1;
+    }
+    ++m_ullSendCalls;
+    const int iSent = sendmmsg(m_socket, pMessages, uiBatch, 0);
+    if (iSent < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        break;
+      }
+      // e.g. ECONNREFUSED after an ICMP port unreachable: the access unit of the packet it
+      // failed on cannot be decoded any more
+      ++m_ullSendErrors;
+      m_sLastError = std::string("sendmmsg failed: ") + strerror(errno);
+      dropAccessUnit(ring);
+      continue;
+    }
+    ring.pop(static_cast<unsigned>(iSent));
+    uiSent += static_cast<unsigned>(iSent);
+  }
+#else
+  while (ring.getCount() > 0)
+  {
+    unsigned uiLength = 0;
+    const uint8_t* pPacket = ring.getPacket(0, uiLength);
+    ++m_ullSendCalls;
+    if (::send(m_socket, reinterpret_cast<const char*>(pPacket), static_cast<int>(uiLength), 0) < 0)
+    {
+#if defined(_WIN32)
+      if (WSAGetLastError() == WSAEWOULDBLOCK) break;
+#else
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+#endif
+      ++m_ullSendErrors;
+      m_sLastError = "send failed";
+      dropAccessUnit(ring);
+      continue;
+    }
+    ++uiSent;
+    ring.pop(1);
+  }
+#endif
+  return uiSent;
+}
+
+void UdpRtpSink::dropAccessUnit(RtpPacketRing& ring)
+{
+  while (ring.getCount() > 0)
+  {
+    unsigned uiLength = 0;
+    const uint8_t* pPacket = ring.getPacket(0, uiLength);
+    const bool bMarker = uiLength > 1 && (pPacket[1] & 0x80) != 0;
+    ring.pop(1);
+    if (bMarker)
+    {
+      break;
+    }
+  }
+}
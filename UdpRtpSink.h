@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "H265RtpPacketizer.h"
+
+/**
+ * @brief Sends the packets of an RtpPacketRing to one UDP destination. On Linux a batch of up
+ * to BATCH_SIZE packets goes out with a single sendmmsg call; elsewhere each packet is sent on
+ * its own.
+ */
+class UdpRtpSink
+{
+public:
+  static const unsigned BATCH_SIZE = 64;
+
+  UdpRtpSink();
+  ~UdpRtpSink();
+
+  /**
+   * @brief Opens a socket connected to sDestination.
+   * @param sDestination "host:port" with an IPv4 address or host name.
+   */
+  bool open(const std::string& sDestination);
+  void close();
+  bool isOpen() const;
+
+  /**
+   * @brief Sends and removes the packets in ring. When the socket refuses a packet, the rest of
+   * its access unit is dropped with it and counted, except when it would block: those packets
+   * stay in the ring for the next call.
+   * @return The number of packets sent.
+   */
+  unsigned send(RtpPacketRing& ring);
+
+  uint64_t getSendCalls() const { return m_ullSendCalls; }
+  uint64_t getSendErrors() const { return m_ullSendErrors; }
+  const std::string& getLastError() const { return m_sLastError; }
+
+  /// Splits "host:port". Returns false if the port is missing or out of range.
+  static bool parseDestination(const std::string& sDestination, std::string& sHost, uint16_t& usPort);
+
+private:
+  UdpRtpSink(const UdpRtpSink&);
+  UdpRtpSink& operator=(const UdpRtpSink&);
+
+#if defined(_WIN32)
+  typedef uintptr_t Socket;
+#else
+  typedef int Socket;
+#endif
+  /// Removes packets from the front up to and including the next one with the marker bit
+  static void dropAccessUnit(RtpPacketRing& ring);
+
+  Socket m_socket;
+  /// the mmsghdr and iovec arrays of sendmmsg, allocated when the sink is opened
+  std::vector<uint8_t> m_vMessages;
+  std::vector<uint8_t> m_vIovecs;
+  uint64_t m_ullSendCalls;
+  uint64_t m_ullSendErrors;
+  std::string m_sLastError;
+};
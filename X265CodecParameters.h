@@ -0,0 +1,210 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <CodecUtils/ICodecv2.h>
+#include <DirectShowExt/FilterParameterStringConstants.h>
+#include <GeneralUtils/Conversion.h>
+
+// Input plane layout understood by X265v2. Strides are in bytes, offsets in bytes relative
+// to the luma pointer passed to ICodecv2::Code. This lets padded or cropped I420 samples be
+// encoded straight from the media sample.
+const char* const CODEC_PARAM_IN_Y_STRIDE = "in_y_stride";
+const char* const CODEC_PARAM_IN_UV_STRIDE = "in_uv_stride";
+const char* const CODEC_PARAM_IN_U_OFFSET = "in_u_offset";
+const char* const CODEC_PARAM_IN_V_OFFSET = "in_v_offset";
+// Presentation timestamp of the next picture passed to ICodecv2::Code, and of the picture
+// the last call returned. Encoders with lookahead or B-frames return pictures late and
+// out of order, so output times are looked up by these.
+const char* const CODEC_PARAM_IN_PTS = "in_pts";
+const char* const CODEC_PARAM_OUT_PTS = "out_pts";
+// Unit of in_pts and out_pts as NUM/DEN seconds. With a time base X265v2 passes the pts on to
+// x265 so that rate control budgets by the time between pictures rather than by the fps.
+const char* const CODEC_PARAM_TIMEBASE = "timebase";
+// x265 VBV settings, in kbps and kbits: a buffer of one frame caps the size of each access unit
+const char* const CODEC_PARAM_VBV_MAXRATE = "vbv-maxrate";
+const char* const CODEC_PARAM_VBV_BUFSIZE = "vbv-bufsize";
+// x265 keyframe interval and periodic intra refresh
+const char* const CODEC_PARAM_KEYINT = "keyint";
+const char* const CODEC_PARAM_INTRA_REFRESH = "intra-refresh";
+// x265 speed preset, e.g. "veryfast". X265v2 applies the analysis settings of a preset to a
+// running encoder and leaves rate control and the picture format as they are.
+const char* const CODEC_PARAM_PRESET = "preset";
+// Makes the next picture passed to ICodecv2::Code an IDR without resetting the encoder
+const char* const CODEC_PARAM_FORCE_IDR = "force_idr";
+// x265 threading: frame threads, wavefront parallel processing and the worker thread pools.
+// pools holds one entry per NUMA node: "+" for all of the node's CPUs, "-" for none or a
+// thread count. x265 binds the workers of a pool to the CPUs of its node.
+const char* const CODEC_PARAM_FRAME_THREADS = "frame-threads";
+const char* const CODEC_PARAM_WPP = "wpp";
+const char* const CODEC_PARAM_POOLS = "pools";
+// QP offsets of the CTUs of the next picture passed to ICodecv2::Code, in raster order
+// separated by commas. X265v2 hands them to x265 as the picture's quantOffsets. Empty for none.
+const char* const CODEC_PARAM_IN_CTU_QP_OFFSETS = "in_ctu_qp_offsets";
+// x265 slices per picture. x265 splits pictures on CTU row boundaries, so there are at most
+// as many slices as CTU rows.
+const char* const CODEC_PARAM_SLICES = "slices";
+// x265 CTU size in pixels
+const int CTU_SIZE = 64;
+
+/**
+ * @brief Builds in_ctu_qp_offsets from a map of changed CTUs: iUnchangedOffset for each
+ * unchanged CTU and 0 for the others. Empty if every CTU changed.
+ */
+inline std::string toCtuQpOffsetsString(const std::vector<uint8_t>& vChanged, int iUnchangedOffset)
+{
+  bool bUnchanged = false;
+  for (uint8_t uiChanged : vChanged)
+  {
+    if (!uiChanged) bUnchanged = true;
+  }
+  if (!bUnchanged)
+  {
+    return std::string();
+  }
+  const std::string sOffset = std::to_string(iUnchangedOffset);
+  std::string sOffsets;
+  sOffsets.reserve(vChanged.size() * (sOffset.length() + 1));
+  for (size_t i = 0; i < vChanged.size(); ++i)
+  {
+    if (i) sOffsets += ',';
+    sOffsets += vChanged[i] ? "0" : sOffset;
+  }
+  return sOffsets;
+}
+
+/**
+ * @brief Formats a frame rate of uiFpsNum / uiFpsDen frames per second as x265 takes it:
+ * "60" or "30000/1001".
+ */
+inline std::string toFpsString(uint64_t ullFpsNum, uint64_t ullFpsDen)
+{
+  uint64_t a = ullFpsNum, b = ullFpsDen ? ullFpsDen : 1;
+  while (b)
+  {
+    const uint64_t r = a % b;
+    a = b;
+    b = r;
+  }
+  const uint64_t ullGcd = a ? a : 1;
+  ullFpsNum /= ullGcd;
+  ullFpsDen = ullFpsDen ? ullFpsDen / ullGcd : 1;
+  return ullFpsDen == 1 ? std::to_string(ullFpsNum) : std::to_string(ullFpsNum) + "/" + std::to_string(ullFpsDen);
+}
+
+/**
+ * @brief Slices per picture so that an average picture at the bitrate splits into slices of
+ * at most uiMaxSliceBytes. x265 has no byte limit per slice: larger pictures such as IDRs
+ * give larger slices.
+ */
+inline unsigned toSliceCount(unsigned uiMaxSliceBytes, unsigned uiBitrateKbps, uint64_t ullFpsNum, uint64_t ullFpsDen, int iHeight)
+{
+  const unsigned uiCtuRows = static_cast<unsigned>((iHeight + CTU_SIZE - 1) / CTU_SIZE);
+  if (!uiMaxSliceBytes || !ullFpsNum || !uiCtuRows)
+  {
+    return 1;
+  }
+  const uint64_t ullFrameBytes = static_cast<uint64_t>(uiBitrateKbps) * 125 * (ullFpsDen ? ullFpsDen : 1) / ullFpsNum;
+  const uint64_t ullSlices = (ullFrameBytes + uiMaxSliceBytes - 1) / uiMaxSliceBytes;
+  return static_cast<unsigned>(ullSlices < 1 ? 1 : (ullSlices > uiCtuRows ? uiCtuRows : ullSlices));
+}
+
+/**
+ * @brief Sets the picture format and rate of a closed codec, before ICodecv2::Open.
+ * The filter and the benchmark both start from here so that they encode alike.
+ */
+inline void setCodecFormat(ICodecv2* pCodec, int iWidth, int iHeight, uint64_t ullFpsNum, uint64_t ullFpsDen, unsigned uiTargetBitrateKbps, bool bAnnexB)
+{
+  pCodec->SetParameter(FILTER_PARAM_WIDTH, std::to_string(iWidth).c_str());
+  pCodec->SetParameter(FILTER_PARAM_HEIGHT, std::to_string(iHeight).c_str());
+  pCodec->SetParameter(FILTER_PARAM_FPS, toFpsString(ullFpsNum, ullFpsDen).c_str());
+  pCodec->SetParameter(FILTER_PARAM_TARGET_BITRATE_KBPS, std::to_string(uiTargetBitrateKbps).c_str());
+  pCodec->SetParameter("annexb", vpp::boolToString(bAnnexB).c_str());
+}
+
+/**
+ * @brief Threading of an x265 instance. A count of 0 leaves the choice to x265.
+ */
+struct CodecThreading
+{
+  CodecThreading()
+    :uiFrameThreads(0), bWpp(true), bThreadPool(true), uiPoolThreads(0)
+  {
+  }
+
+  unsigned uiFrameThreads;
+  bool bWpp;
+  /// false runs all of the encoder's work on the thread that calls ICodecv2::Code
+  bool bThreadPool;
+  /// worker threads per NUMA node
+  unsigned uiPoolThreads;
+  /// comma separated NUMA nodes the workers run on, empty for all nodes
+  std::string sNumaNodes;
+};
+
+/**
+ * @brief Builds the x265 pools string for the given nodes, e.g. "-,+" for all CPUs of node 1.
+ * Returns false if sNumaNodes is not a list of node numbers.
+ */
+inline bool toPoolsString(unsigned uiPoolThreads, const std::string& sNumaNodes, std::string& sPools)
+{
+  const std::string sThreads = uiPoolThreads ? std::to_string(uiPoolThreads) : "+";
+  if (sNumaNodes.empty())
+  {
+    // "*" is x265's default of one pool over all nodes
+    sPools = uiPoolThreads ? sThreads : "*";
+    return true;
+  }
+  std::vector<std::string> vNodes;
+  size_t uiStart = 0;
+  while (uiStart <= sNumaNodes.length())
+  {
+    size_t uiEnd = sNumaNodes.find(',', uiStart);
+    if (uiEnd == std::string::npos) uiEnd = sNumaNodes.length();
+    const std::string sNode = sNumaNodes.substr(uiStart, uiEnd - uiStart);
+    char* pEnd = NULL;
+    const long lNode = strtol(sNode.c_str(), &pEnd, 10);
+    // x265 supports up to 32 nodes
+    if (sNode.empty() || *pEnd != 0 || lNode < 0 || lNode >= 32)
+    {
+      return false;
+    }
+    if (vNodes.size() <= static_cast<size_t>(lNode)) vNodes.resize(lNode + 1, "-");
+    vNodes[lNode] = sThreads;
+    uiStart = uiEnd + 1;
+  }
+  sPools.clear();
+  for (size_t i = 0; i < vNodes.size(); ++i)
+  {
+    sPools += (i ? "," : "") + vNodes[i];
+  }
+  return true;
+}
+
+/**
+ * @brief Sets the threading of a closed codec, before ICodecv2::Open.
+ * Returns false with sError set if the codec rejects a setting.
+ */
+inline bool setCodecThreading(ICodecv2* pCodec, const CodecThreading& threading, std::string& sError)
+{
+  std::string sPools;
+  if (!toPoolsString(threading.uiPoolThreads, threading.sNumaNodes, sPools))
+  {
+    sError = "Invalid numa_nodes: " + threading.sNumaNodes + ". Use comma separated node numbers.";
+    return false;
+  }
+  std::vector<std::pair<const char*, std::string> > vSettings;
+  vSettings.push_back(std::make_pair(CODEC_PARAM_FRAME_THREADS, std::to_string(threading.uiFrameThreads)));
+  vSettings.push_back(std::make_pair(CODEC_PARAM_WPP, std::string(threading.bWpp ? "1" : "0")));
+  vSettings.push_back(std::make_pair(CODEC_PARAM_POOLS, threading.bThreadPool ? sPools : std::string("none")));
+  for (const auto& setting : vSettings)
+  {
+    if (!pCodec->SetParameter(setting.first, setting.second.c_str()))
+    {
+      sError = std::string("Codec rejected ") + setting.first + "=" + setting.second + ": " + pCodec->GetErrorStr();
+      return false;
+    }
+  }
+  return true;
+}
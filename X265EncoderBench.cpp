@@ -0,0 +1,2375 @@
+/**
+ * Headless benchmark of the filter's conversion and encode path.
+ *
+ * Runs the RGB24 to I420 conversion and ICodecv2::Code outside of DirectShow, set up the same
+ * way as X265EncoderFilter::SetMediaType and ApplyTransform, and writes one CSV row per case.
+ * With --baseline the run fails if the frame rate of a case drops by more than --threshold
+ * percent against the same case in an earlier CSV.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <X265v2/X265v2.h>
+#include <ImageUtils/RealRGB24toYUV420ConverterStl.h>
+#include "AnnexBRewriter.h"
+#include "BoundedFrameQueue.h"
+#include "EncoderInstancePool.h"
+#include "FramePlaneArena.h"
+#include "H265RtpPacketizer.h"
+#include "I420Downscaler.h"
+#include "InputPictureLayout.h"
+#include "SharedEncoderPool.h"
+#include "SimdRgb24ToI420Converter.h"
+#include "StaticFrameDetector.h"
+#include "StatsHistogram.h"
+#include "UdpRtpSink.h"
+#include "X265CodecParameters.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// same as the filter
+const unsigned BITSTREAM_HEADROOM = 64 * 1024;
+
+// every heap allocation of the process: planes mode checks that none happen per frame
+static std::atomic<uint64_t> g_ullHeapAllocations(0);
+
+// not inlined, so that the compiler does not pair malloc and free across new and delete
+__attribute__((noinline)) void* operator new(std::size_t uiSize)
+{
+  ++g_ullHeapAllocations;
+  if (void* p = std::malloc(uiSize ? uiSize : 1)) return p;
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+struct Resolution
+{
+  const char* szName;
+  int iWidth;
+  int iHeight;
+};
+
+const Resolution RESOLUTIONS[] =
+{
+  { "480p", 854, 480 },
+  { "720p", 1280, 720 },
+  { "1080p", 1920, 1080 },
+  { "2160p", 3840, 2160 }
+};
+
+struct BenchOptions
+{
+  BenchOptions()
+    :sMode("encode"), sInput("synthetic"), sFormat("rgb24"), sKernel("auto"), uiFrames(300),
+    uiFps(30), uiBitrateKbps(2000), uiIdrPeriod(30), uiSharedPoolThreads(0), uiStaticRun(10), uiSliceMaxBytes(1200), uiRtpPacketSize(1200), uiStarts(8), uiLegacyTolerance(1), dThresholdPct(5.0)
+  {
+    const unsigned CHANNELS[] = { 1, 2, 4, 8, 12, 16 };
+    vChannels.assign(CHANNELS, CHANNELS + sizeof(CHANNELS) / sizeof(CHANNELS[0]));
+  }
+
+  std::string sMode;
+  std::string sInput;
+  std::vector<Resolution> vResolutions;
+  std::string sFormat;
+  std::string sKernel;
+  unsigned uiFrames;
+  unsigned uiFps;
+  unsigned uiBitrateKbps;
+  unsigned uiIdrPeriod;
+  std::vector<std::pair<std::string, std::string> > vCodecParameters;
+  CodecThreading threading;
+  /// channel counts of the density mode
+  std::vector<unsigned> vChannels;
+  unsigned uiSharedPoolThreads;
+  /// synthetic pictures stay the same for this many frames in static mode
+  unsigned uiStaticRun;
+  /// slice_max_bytes of the sliced case in slices mode
+  unsigned uiSliceMaxBytes;
+  /// largest RTP packet in rtp mode
+  unsigned uiRtpPacketSize;
+  /// channel starts per case in startup mode
+  unsigned uiStarts;
+  /// largest difference per sample allowed between the legacy converter and the scalar kernel in convert mode
+  unsigned uiLegacyTolerance;
+  std::string sCsv;
+  std::string sBaseline;
+  double dThresholdPct;
+};
+
+struct CaseResult
+{
+  CaseResult()
+    :iWidth(0), iHeight(0), uiFrames(0), dSeconds(0.0), ullBytes(0)
+  {
+  }
+
+  std::string sCase;
+  int iWidth;
+  int iHeight;
+  unsigned uiFrames;
+  double dSeconds;
+  uint64_t ullBytes;
+  /// time of each timed operation in milliseconds
+  std::vector<double> vMs;
+  std::string sDetail;
+
+  double getFps() const { return dSeconds > 0.0 ? uiFrames / dSeconds : 0.0; }
+};
+
+static double elapsedMs(const Clock::time_point& tStart)
+{
+  return std::chrono::duration<double, std::milli>(Clock::now() - tStart).count();
+}
+
+static double percentile(std::vector<double> vValues, double dPercentile)
+{
+  if (vValues.empty()) return 0.0;
+  std::sort(vValues.begin(), vValues.end());
+  const size_t uiIndex = static_cast<size_t>(dPercentile / 100.0 * (vValues.size() - 1) + 0.5);
+  return vValues[(std::min)(uiIndex, vValues.size() - 1)];
+}
+
+/// Peak resident set size of the process so far in KB
+static long getPeakRssKb()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/// User and system CPU time of all threads of the process so far in milliseconds
+static double getCpuMs()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+/**
+ * @brief Moving test pattern: a scrolling gradient with a textured box moving across it,
+ * so that the encoder has both motion and detail to code.
+ */
+class SyntheticSource
+{
+public:
+  SyntheticSource(int iWidth, int iHeight)
+    :m_iWidth(iWidth), m_iHeight(iHeight)
+  {
+  }
+
+  void generateI420(unsigned uiFrame, uint8_t* pI420) const
+  {
+    const int iUvWidth = (m_iWidth + 1) / 2;
+    const int iUvHeight = (m_iHeight + 1) / 2;
+    uint8_t* pU = pI420 + m_iWidth * m_iHeight;
+    uint8_t* pV = pU + iUvWidth * iUvHeight;
+    for (int y = 0; y < m_iHeight; ++y)
+    {
+      for (int x = 0; x < m_iWidth; ++x)
+      {
+        pI420[y * m_iWidth + x] = getLuma(uiFrame, x, y);
+      }
+    }
+    for (int y = 0; y < iUvHeight; ++y)
+    {
+      for (int x = 0; x < iUvWidth; ++x)
+      {
+        pU[y * iUvWidth + x] = static_cast<uint8_t>(128 + ((x + uiFrame) & 0x3F) - 32);
+        pV[y * iUvWidth + x] = static_cast<uint8_t>(128 + ((y + uiFrame) & 0x3F) - 32);
+      }
+    }
+  }
+
+  /// Bottom-up BGR DIB like the filter receives
+  void generateRgb24(unsigned uiFrame, uint8_t* pRgb, int iStride) const
+  {
+    for (int y = 0; y < m_iHeight; ++y)
+    {
+      uint8_t* pRow = pRgb + (m_iHeight - 1 - y) * iStride;
+      for (int x = 0; x < m_iWidth; ++x)
+      {
+        const uint8_t uiLuma = getLuma(uiFrame, x, y);
+        pRow[3 * x] = static_cast<uint8_t>(uiLuma ^ ((x + uiFrame) & 0x3F));
+        pRow[3 * x + 1] = uiLuma;
+        pRow[3 * x + 2] = static_cast<uint8_t>(uiLuma ^ ((y + uiFrame) & 0x3F));
+      }
+    }
+  }
+
+private:
+  uint8_t getLuma(unsigned uiFrame, int x, int y) const
+  {
+    const int iBoxSize = m_iHeight / 4;
+    const int iBoxX = static_cast<int>((uiFrame * 8) % (m_iWidth - iBoxSize));
+    const int iBoxY = m_iHeight / 2 - iBoxSize / 2;
+    if (x >= iBoxX && x < iBoxX + iBoxSize && y >= iBoxY && y < iBoxY + iBoxSize)
+    {
+      // texture that moves with the box
+      uint32_t uiHash = static_cast<uint32_t>((x - iBoxX) * 73856093) ^ static_cast<uint32_t>((y - iBoxY) * 19349663);
+      uiHash ^= uiHash >> 13;
+      return static_cast<uint8_t>(uiHash * 0x5bd1e995 >> 24);
+    }
+    return static_cast<uint8_t>((x + y + 2 * uiFrame) & 0xFF);
+  }
+
+  int m_iWidth;
+  int m_iHeight;
+};
+
+/**
+ * @brief Reads 8 bit 4:2:0 YUV4MPEG2 files. Frames are kept in memory and replayed in a loop
+ * so that disk reads are not timed.
+ */
+class Y4mSource
+{
+public:
+  Y4mSource()
+    :m_iWidth(0), m_iHeight(0)
+  {
+  }
+
+  bool open(const std::string& sFile, unsigned uiMaxFrames, std::string& sError)
+  {
+    std::ifstream in(sFile.c_str(), std::ios::binary);
+    std::string sHeader;
+    if (!in || !std::getline(in, sHeader) || sHeader.compare(0, 10, "YUV4MPEG2 ") != 0)
+    {
+      sError = "Not a YUV4MPEG2 file: " + sFile;
+      return false;
+    }
+    std::istringstream tokens(sHeader.substr(10));
+    std::string sToken;
+    while (tokens >> sToken)
+    {
+      if (sToken[0] == 'W') m_iWidth = atoi(sToken.c_str() + 1);
+      else if (sToken[0] == 'H') m_iHeight = atoi(sToken.c_str() + 1);
+      else if (sToken[0] == 'C' && sToken.compare(0, 4, "C420") != 0)
+      {
+        sError = "Only 8 bit 4:2:0 is supported, got " + sToken;
+        return false;
+      }
+    }
+    if (m_iWidth <= 0 || m_iHeight <= 0)
+    {
+      sError = "Missing picture size in " + sFile;
+      return false;
+    }
+    const size_t uiFrameSize = getFrameSize();
+    std::string sFrameHeader;
+    while (m_vFrames.size() < uiMaxFrames && std::getline(in, sFrameHeader) && sFrameHeader.compare(0, 5, "FRAME") == 0)
+    {
+      std::vector<uint8_t> vFrame(uiFrameSize);
+      if (!in.read(reinterpret_cast<char*>(&vFrame[0]), uiFrameSize)) break;
+      m_vFrames.push_back(vFrame);
+    }
+    if (m_vFrames.empty())
+    {
+      sError = "No frames in " + sFile;
+      return false;
+    }
+    return true;
+  }
+
+  int getWidth() const { return m_iWidth; }
+  int getHeight() const { return m_iHeight; }
+  size_t getFrameSize() const
+  {
+    return m_iWidth * m_iHeight + 2 * (((m_iWidth + 1) / 2) * ((m_iHeight + 1) / 2));
+  }
+  const uint8_t* getFrame(unsigned uiFrame) const { return &m_vFrames[uiFrame % m_vFrames.size()][0]; }
+
+private:
+  int m_iWidth;
+  int m_iHeight;
+  std::vector<std::vector<uint8_t> > m_vFrames;
+};
+
+/**
+ * @brief Produces the I420 pictures of one case, converting from RGB24 if required.
+ * Only the conversion is timed, as the filter receives its input ready made.
+ */
+class FrameSource
+{
+public:
+  FrameSource(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m)
+    :m_options(options), m_synthetic(iWidth, iHeight), m_pY4m(pY4m),
+    m_layout(InputPictureLayout::forRgb24(iWidth, iHeight, 0, 0, 0, 0)),
+    m_vI420(InputPictureLayout::forI420(iWidth, iHeight, 0, 0, 0, 0).getPackedI420Size()),
+    m_vRgb(m_layout.iYStride * iHeight), m_dLastConvertMs(0.0)
+  {
+    if (m_options.sFormat != "rgb24") return;
+    if (m_options.sKernel == "legacy")
+    {
+      // configured as in X265EncoderFilter::SetMediaType
+      m_pLegacyConverter.reset(new RealRGB24toYUV420ConverterStl<uint8_t>(iWidth, iHeight, 128));
+      m_pLegacyConverter->SetFlip(m_layout.bBottomUp);
+      m_pLegacyConverter->SetChrominanceOffset(128);
+    }
+    else
+    {
+      m_pConverter.reset(new SimdRgb24ToI420Converter(iWidth, iHeight));
+      m_pConverter->setFlip(m_layout.bBottomUp);
+      if (m_options.sKernel == "scalar") m_pConverter->setInstructionSet(SimdRgb24ToI420Converter::IS_SCALAR);
+      else if (m_options.sKernel == "sse41") m_pConverter->setInstructionSet(SimdRgb24ToI420Converter::IS_SSE41);
+      else if (m_options.sKernel == "avx2") m_pConverter->setInstructionSet(SimdRgb24ToI420Converter::IS_AVX2);
+    }
+  }
+
+  /// Name of the kernel actually used, which may be lower than requested on older CPUs
+  std::string getKernelName() const
+  {
+    if (m_pLegacyConverter) return "legacy";
+    if (m_pConverter) return SimdRgb24ToI420Converter::toString(m_pConverter->getInstructionSet());
+    return "none";
+  }
+
+  unsigned getI420Size() const { return static_cast<unsigned>(m_vI420.size()); }
+
+  /// Returns the I420 picture of the frame. Sets getLastConvertMs().
+  const uint8_t* getFrame(unsigned uiFrame)
+  {
+    m_dLastConvertMs = 0.0;
+    if (m_options.sFormat != "rgb24")
+    {
+      if (m_pY4m) return m_pY4m->getFrame(uiFrame);
+      m_synthetic.generateI420(uiFrame, &m_vI420[0]);
+      return &m_vI420[0];
+    }
+    m_synthetic.generateRgb24(uiFrame, &m_vRgb[0], m_layout.iYStride);
+    const Clock::time_point tStart = Clock::now();
+    bool bConverted = false;
+    if (m_pLegacyConverter)
+    {
+      bConverted = m_pLegacyConverter->Convert(&m_vRgb[0], static_cast<int>(m_vRgb.size()), &m_vI420[0], static_cast<int>(m_vI420.size()));
+    }
+    else
+    {
+      bConverted = m_pConverter->convert(&m_vRgb[m_layout.uiYOffset], static_cast<unsigned>(m_vRgb.size() - m_layout.uiYOffset), m_layout.iYStride, &m_vI420[0], static_cast<unsigned>(m_vI420.size()));
+    }
+    m_dLastConvertMs = elapsedMs(tStart);
+    return bConverted ? &m_vI420[0] : NULL;
+  }
+
+  double getLastConvertMs() const { return m_dLastConvertMs; }
+
+private:
+  const BenchOptions& m_options;
+  SyntheticSource m_synthetic;
+  const Y4mSource* m_pY4m;
+  InputPictureLayout m_layout;
+  std::vector<uint8_t> m_vI420;
+  std::vector<uint8_t> m_vRgb;
+  std::unique_ptr<SimdRgb24ToI420Converter> m_pConverter;
+  std::unique_ptr<RealRGB24toYUV420ConverterStl<uint8_t> > m_pLegacyConverter;
+  double m_dLastConvertMs;
+};
+
+/**
+ * @brief An X265v2 instance opened like X265EncoderFilter::SetMediaType does.
+ */
+class BenchEncoder
+{
+public:
+  BenchEncoder()
+    :m_pCodec(NULL), m_iNextPts(0)
+  {
+    X265v2Factory factory;
+    m_pCodec = factory.GetCodecInstance();
+  }
+
+  /// Takes over a codec that is already open for iWidth x iHeight, e.g. from EncoderInstancePool
+  BenchEncoder(ICodecv2* pCodec, int iWidth, int iHeight)
+    :m_pCodec(pCodec), m_iNextPts(0)
+  {
+    m_vBitstream.resize(InputPictureLayout::forI420(iWidth, iHeight, 0, 0, 0, 0).getPackedI420Size() + BITSTREAM_HEADROOM);
+  }
+
+  ~BenchEncoder()
+  {
+    if (m_pCodec)
+    {
+      m_pCodec->Close();
+      X265v2Factory factory;
+      factory.ReleaseCodecInstance(m_pCodec);
+    }
+  }
+
+  bool open(const BenchOptions& options, int iWidth, int iHeight, std::string& sError)
+  {
+    if (!m_pCodec)
+    {
+      sError = "Unable to create X265 Encoder from Factory.";
+      return false;
+    }
+    m_pCodec->Close();
+    setCodecFormat(m_pCodec, iWidth, iHeight, options.uiFps, 1, options.uiBitrateKbps, true);
+    if (!setCodecThreading(m_pCodec, options.threading, sError))
+    {
+      return false;
+    }
+    for (const auto& param : options.vCodecParameters)
+    {
+      if (!m_pCodec->SetParameter(param.first.c_str(), param.second.c_str()))
+      {
+        sError = "Codec rejected " + param.first + "=" + param.second + ": " + m_pCodec->GetErrorStr();
+        return false;
+      }
+    }
+    if (!m_pCodec->Open())
+    {
+      sError = m_pCodec->GetErrorStr();
+      return false;
+    }
+    m_vBitstream.resize(InputPictureLayout::forI420(iWidth, iHeight, 0, 0, 0, 0).getPackedI420Size() + BITSTREAM_HEADROOM);
+    m_iNextPts = 0;
+    return true;
+  }
+
+  ICodecv2* getCodec() const { return m_pCodec; }
+  /// Gives up the codec without closing it
+  ICodecv2* detach()
+  {
+    ICodecv2* pCodec = m_pCodec;
+    m_pCodec = NULL;
+    return pCodec;
+  }
+
+  /// Encodes one picture as ApplyTransform does. Returns the size of the access unit, -1 on failure.
+  long encode(const uint8_t* pI420)
+  {
+    m_pCodec->SetParameter(CODEC_PARAM_IN_PTS, std::to_string(m_iNextPts++).c_str());
+    if (!m_pCodec->Code(const_cast<uint8_t*>(pI420), &m_vBitstream[0], static_cast<int>(m_vBitstream.size())))
+    {
+      return -1;
+    }
+    return m_pCodec->GetCompressedByteLength();
+  }
+
+  /// Collects the pictures still inside the encoder. Returns the number of bytes.
+  uint64_t drain(unsigned& uiAccessUnits)
+  {
+    uint64_t ullBytes = 0;
+    uiAccessUnits = 0;
+    // each call returns at most one picture: bound the loop by the pictures passed in
+    for (int64_t i = 0; i < m_iNextPts; ++i)
+    {
+      if (!m_pCodec->Code(NULL, &m_vBitstream[0], static_cast<int>(m_vBitstream.size()))) break;
+      const long lLength = m_pCodec->GetCompressedByteLength();
+      if (lLength <= 0) break;
+      ullBytes += lLength;
+      ++uiAccessUnits;
+    }
+    return ullBytes;
+  }
+
+  const uint8_t* getBitstream() const { return &m_vBitstream[0]; }
+
+  /// pts of the picture the last encode returned, -1 if the codec does not report it
+  int64_t getOutPts() const
+  {
+    char szValue[32];
+    int nLength = 0;
+    if (!m_pCodec->GetParameter(CODEC_PARAM_OUT_PTS, &nLength, szValue)) return -1;
+    return strtoll(std::string(szValue, nLength).c_str(), NULL, 10);
+  }
+
+private:
+  ICodecv2* m_pCodec;
+  std::vector<uint8_t> m_vBitstream;
+  int64_t m_iNextPts;
+};
+
+/**
+ * @brief Cost of the filter's per frame instrumentation: four clock pairs and histogram
+ * updates, measured in a tight loop, in milliseconds per frame.
+ */
+static double measureInstrumentationMs()
+{
+  StatsHistogram histograms[4];
+  const unsigned uiIterations = 100000;
+  const Clock::time_point tStart = Clock::now();
+  for (unsigned i = 0; i < uiIterations; ++i)
+  {
+    for (StatsHistogram& histogram : histograms)
+    {
+      const Clock::time_point tStage = Clock::now();
+      histogram.add(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - tStage).count() + i));
+    }
+  }
+  return elapsedMs(tStart) / uiIterations;
+}
+
+static std::string getCaseName(const BenchOptions& options, const std::string& sSuffix)
+{
+  std::string sInput = options.sInput == "synthetic" ? "synthetic" : "y4m";
+  return options.sMode + "/" + sInput + "/" + options.sFormat + "/" + sSuffix;
+}
+
+/// Converts and encodes every frame. Timed per frame are conversion plus ICodecv2::Code.
+static bool runEncode(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, CaseResult& result, std::string& sError)
+{
+  FrameSource source(options, iWidth, iHeight, pY4m);
+  BenchEncoder encoder;
+  if (!encoder.open(options, iWidth, iHeight, sError)) return false;
+
+  double dConvertMs = 0.0;
+  const Clock::time_point tStart = Clock::now();
+  double dUntimedMs = 0.0;
+  for (unsigned i = 0; i < options.uiFrames; ++i)
+  {
+    // generating synthetic pictures is not part of the measurement
+    const Clock::time_point tGenerate = Clock::now();
+    const uint8_t* pI420 = source.getFrame(i);
+    if (!pI420)
+    {
+      sError = "Conversion failed";
+      return false;
+    }
+    dUntimedMs += elapsedMs(tGenerate) - source.getLastConvertMs();
+
+    const Clock::time_point tEncode = Clock::now();
+    const long lLength = encoder.encode(pI420);
+    const double dEncodeMs = elapsedMs(tEncode);
+    if (lLength < 0)
+    {
+      sError = encoder.getCodec()->GetErrorStr();
+      return false;
+    }
+    result.vMs.push_back(source.getLastConvertMs() + dEncodeMs);
+    dConvertMs += source.getLastConvertMs();
+    result.ullBytes += lLength;
+  }
+  unsigned uiDrained = 0;
+  result.ullBytes += encoder.drain(uiDrained);
+  result.dSeconds = (elapsedMs(tStart) - dUntimedMs) / 1000.0;
+  result.uiFrames = options.uiFrames;
+  result.sCase = getCaseName(options, source.getKernelName());
+
+  const double dFrameMs = result.dSeconds * 1000.0 / result.uiFrames;
+  std::ostringstream detail;
+  detail.precision(3);
+  detail << std::fixed << "convert_ms=" << dConvertMs / result.uiFrames
+    << ";stats_overhead_pct=" << 100.0 * measureInstrumentationMs() / dFrameMs;
+  result.sDetail = detail.str();
+  return true;
+}
+
+/**
+ * @brief Times the RGB24 to I420 conversion alone with every kernel the CPU supports and
+ * compares the output of each with the scalar kernel. The SIMD kernels have to match it byte
+ * for byte. The legacy converter computes in floating point and may round differently: it has
+ * to stay within --legacy-tolerance of every sample.
+ */
+static bool runConvert(const BenchOptions& options, int iWidth, int iHeight, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  BenchOptions referenceOptions = options;
+  referenceOptions.sFormat = "rgb24";
+  referenceOptions.sKernel = "scalar";
+  std::vector<std::string> vKernels;
+  vKernels.push_back("scalar");
+  if (SimdRgb24ToI420Converter::detectInstructionSet() >= SimdRgb24ToI420Converter::IS_SSE41) vKernels.push_back("sse41");
+  if (SimdRgb24ToI420Converter::detectInstructionSet() >= SimdRgb24ToI420Converter::IS_AVX2) vKernels.push_back("avx2");
+  vKernels.push_back("legacy");
+  for (const std::string& sKernel : vKernels)
+  {
+    BenchOptions kernelOptions = options;
+    kernelOptions.sFormat = "rgb24";
+    kernelOptions.sKernel = sKernel;
+    FrameSource source(kernelOptions, iWidth, iHeight, NULL);
+    FrameSource reference(referenceOptions, iWidth, iHeight, NULL);
+    const unsigned uiTolerance = sKernel == "legacy" ? options.uiLegacyTolerance : 0;
+    unsigned uiMaxDiff = 0;
+    uint64_t ullDiffSamples = 0;
+    CaseResult result;
+    for (unsigned i = 0; i < options.uiFrames; ++i)
+    {
+      const uint8_t* pI420 = source.getFrame(i);
+      if (!pI420)
+      {
+        sError = "Conversion failed with kernel " + sKernel;
+        return false;
+      }
+      result.vMs.push_back(source.getLastConvertMs());
+      result.dSeconds += source.getLastConvertMs() / 1000.0;
+      const uint8_t* pExpected = reference.getFrame(i);
+      if (!pExpected)
+      {
+        sError = "Conversion failed with the scalar kernel";
+        return false;
+      }
+      for (unsigned j = 0; j < source.getI420Size(); ++j)
+      {
+        const unsigned uiDiff = static_cast<unsigned>(std::abs(pI420[j] - pExpected[j]));
+        if (uiDiff) ++ullDiffSamples;
+        uiMaxDiff = (std::max)(uiMaxDiff, uiDiff);
+      }
+    }
+    result.sCase = getCaseName(kernelOptions, source.getKernelName());
+    result.iWidth = iWidth;
+    result.iHeight = iHeight;
+    result.uiFrames = options.uiFrames;
+    result.ullBytes = static_cast<uint64_t>(source.getI420Size()) * options.uiFrames;
+    std::ostringstream detail;
+    detail << "max_diff=" << uiMaxDiff << ";diff_samples=" << ullDiffSamples;
+    result.sDetail = detail.str();
+    vResults.push_back(result);
+    if (uiMaxDiff > uiTolerance)
+    {
+      sError = "Kernel " + source.getKernelName() + " differs from the scalar kernel by up to " + std::to_string(uiMaxDiff) +
+        " in " + std::to_string(ullDiffSamples) + " samples, allowed is " + std::to_string(uiTolerance);
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Cost of an IDR every --idr-period frames, once flagged with force_idr and once by
+ * restarting the codec as the filter did before. Timed are only the frames that start a GOP.
+ */
+static bool runIdr(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  const char* const METHODS[] = { "force", "restart" };
+  for (const char* szMethod : METHODS)
+  {
+    FrameSource source(options, iWidth, iHeight, pY4m);
+    BenchEncoder encoder;
+    if (!encoder.open(options, iWidth, iHeight, sError)) return false;
+    const bool bForce = strcmp(szMethod, "force") == 0;
+    CaseResult result;
+    for (unsigned i = 0; i < options.uiFrames; ++i)
+    {
+      const uint8_t* pI420 = source.getFrame(i);
+      const bool bIdr = i > 0 && options.uiIdrPeriod && i % options.uiIdrPeriod == 0;
+      const Clock::time_point tStart = Clock::now();
+      if (bIdr)
+      {
+        if (bForce && !encoder.getCodec()->SetParameter(CODEC_PARAM_FORCE_IDR, "1"))
+        {
+          sError = std::string("Codec does not support ") + CODEC_PARAM_FORCE_IDR;
+          return false;
+        }
+        if (!bForce) encoder.getCodec()->Restart();
+      }
+      const long lLength = encoder.encode(pI420);
+      const double dMs = elapsedMs(tStart);
+      if (lLength < 0)
+      {
+        sError = encoder.getCodec()->GetErrorStr();
+        return false;
+      }
+      if (bIdr)
+      {
+        result.vMs.push_back(dMs);
+        result.dSeconds += dMs / 1000.0;
+        result.ullBytes += lLength;
+        ++result.uiFrames;
+      }
+    }
+    result.sCase = getCaseName(options, szMethod);
+    result.iWidth = iWidth;
+    result.iHeight = iHeight;
+    vResults.push_back(result);
+  }
+  return true;
+}
+
+/**
+ * @brief Halves the bitrate half way through and counts the frames until the output rate
+ * over one second is within 10% of the new target, as the filter's stats_bitrate_convergence_frames.
+ */
+static bool runBitrate(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, CaseResult& result, std::string& sError)
+{
+  FrameSource source(options, iWidth, iHeight, pY4m);
+  BenchEncoder encoder;
+  if (!encoder.open(options, iWidth, iHeight, sError)) return false;
+  const unsigned uiWindow = (std::max)(options.uiFps, 1u);
+  const unsigned uiSwitchFrame = options.uiFrames / 2;
+  const unsigned uiNewBitrate = (std::max)(options.uiBitrateKbps / 2, 1u);
+  std::vector<long> vSizes;
+  unsigned uiConvergenceFrames = 0;
+  bool bConverging = false;
+  for (unsigned i = 0; i < options.uiFrames; ++i)
+  {
+    const uint8_t* pI420 = source.getFrame(i);
+    if (i == uiSwitchFrame)
+    {
+      encoder.getCodec()->SetParameter(FILTER_PARAM_TARGET_BITRATE_KBPS, std::to_string(uiNewBitrate).c_str());
+      bConverging = true;
+    }
+    const Clock::time_point tStart = Clock::now();
+    const long lLength = encoder.encode(pI420);
+    const double dMs = elapsedMs(tStart) + source.getLastConvertMs();
+    if (lLength < 0)
+    {
+      sError = encoder.getCodec()->GetErrorStr();
+      return false;
+    }
+    result.vMs.push_back(dMs);
+    result.dSeconds += dMs / 1000.0;
+    result.ullBytes += lLength;
+    vSizes.push_back(lLength);
+    if (bConverging && i - uiSwitchFrame + 1 >= uiWindow)
+    {
+      uint64_t ullWindowBytes = 0;
+      for (size_t j = vSizes.size() - uiWindow; j < vSizes.size(); ++j) ullWindowBytes += vSizes[j];
+      const double dKbps = ullWindowBytes * 8.0 * options.uiFps / uiWindow / 1000.0;
+      if (dKbps <= uiNewBitrate * 1.1 && dKbps >= uiNewBitrate * 0.9)
+      {
+        uiConvergenceFrames = i - uiSwitchFrame + 1;
+        bConverging = false;
+      }
+    }
+  }
+  result.sCase = getCaseName(options, source.getKernelName());
+  result.uiFrames = options.uiFrames;
+  result.sDetail = bConverging ? "convergence_frames=none" : "convergence_frames=" + std::to_string(uiConvergenceFrames);
+  return true;
+}
+
+/// Encodes one picture per layer and adds the bytes to the result
+static bool encodeLayers(std::vector<std::unique_ptr<BenchEncoder> >& vEncoders, const std::vector<const uint8_t*>& vPictures, CaseResult& result, std::string& sError)
+{
+  for (size_t j = 0; j < vEncoders.size(); ++j)
+  {
+    const long lLength = vEncoders[j]->encode(vPictures[j]);
+    if (lLength < 0)
+    {
+      sError = vEncoders[j]->getCodec()->GetErrorStr();
+      return false;
+    }
+    result.ullBytes += lLength;
+  }
+  return true;
+}
+
+/**
+ * @brief Compares simulcast as the filter does it, one conversion of the full picture scaled
+ * down per layer, against converting each layer's picture separately. Each layer is encoded
+ * at the same share of the bitrate in both setups. The measure is process CPU time, since the
+ * encoders run threads of their own.
+ */
+static bool runSimulcast(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  if (pY4m)
+  {
+    sError = "simulcast mode needs synthetic input to build each layer's picture";
+    return false;
+  }
+  // full size, two thirds and one third as in a 1080p, 720p, 360p ladder
+  std::vector<std::pair<int, int> > vSizes;
+  vSizes.push_back(std::make_pair(iWidth, iHeight));
+  vSizes.push_back(std::make_pair((iWidth * 2 / 3) & ~1, (iHeight * 2 / 3) & ~1));
+  vSizes.push_back(std::make_pair((iWidth / 3) & ~1, (iHeight / 3) & ~1));
+  std::string sLayers;
+  for (const auto& size : vSizes)
+  {
+    sLayers += (sLayers.empty() ? "" : " ") + std::to_string(size.first) + "x" + std::to_string(size.second);
+  }
+  BenchOptions layerOptions = options;
+  layerOptions.uiBitrateKbps = (std::max)(options.uiBitrateKbps / static_cast<unsigned>(vSizes.size()), 1u);
+
+  double dSeparateCpuMs = 0.0;
+  for (int iShared = 0; iShared < 2; ++iShared)
+  {
+    const bool bShared = iShared == 1;
+    std::vector<std::unique_ptr<FrameSource> > vSources;
+    std::vector<std::unique_ptr<BenchEncoder> > vEncoders;
+    std::vector<std::unique_ptr<I420Downscaler> > vScalers;
+    std::vector<std::vector<uint8_t> > vScaled;
+    for (size_t j = 0; j < vSizes.size(); ++j)
+    {
+      vEncoders.push_back(std::unique_ptr<BenchEncoder>(new BenchEncoder()));
+      if (!vEncoders.back()->open(layerOptions, vSizes[j].first, vSizes[j].second, sError)) return false;
+      if (!bShared || j == 0)
+      {
+        vSources.push_back(std::unique_ptr<FrameSource>(new FrameSource(options, vSizes[j].first, vSizes[j].second, NULL)));
+      }
+      else
+      {
+        vScalers.push_back(std::unique_ptr<I420Downscaler>(new I420Downscaler(iWidth, iHeight, vSizes[j].first, vSizes[j].second)));
+        vScaled.push_back(std::vector<uint8_t>(vScalers.back()->getDstSize()));
+      }
+    }
+
+    CaseResult result;
+    result.iWidth = iWidth;
+    result.iHeight = iHeight;
+    double dScaleMs = 0.0;
+    double dUntimedMs = 0.0;
+    const double dCpuStartMs = getCpuMs();
+    const Clock::time_point tStart = Clock::now();
+    for (unsigned i = 0; i < options.uiFrames; ++i)
+    {
+      std::vector<const uint8_t*> vPictures;
+      double dFrameMs = 0.0;
+      for (std::unique_ptr<FrameSource>& pSource : vSources)
+      {
+        // generating synthetic pictures is single threaded and not part of the measurement
+        const Clock::time_point tGenerate = Clock::now();
+        vPictures.push_back(pSource->getFrame(i));
+        if (!vPictures.back())
+        {
+          sError = "Conversion failed";
+          return false;
+        }
+        dUntimedMs += elapsedMs(tGenerate) - pSource->getLastConvertMs();
+        dFrameMs += pSource->getLastConvertMs();
+      }
+      const Clock::time_point tFrame = Clock::now();
+      for (size_t j = 0; j < vScalers.size(); ++j)
+      {
+        const uint8_t* pY = vPictures[0];
+        const uint8_t* pU = pY + iWidth * iHeight;
+        const uint8_t* pV = pU + ((iWidth + 1) / 2) * ((iHeight + 1) / 2);
+        vScalers[j]->scale(pY, iWidth, pU, pV, (iWidth + 1) / 2, &vScaled[j][0]);
+        vPictures.push_back(&vScaled[j][0]);
+      }
+      dScaleMs += elapsedMs(tFrame);
+      if (!encodeLayers(vEncoders, vPictures, result, sError)) return false;
+      result.vMs.push_back(dFrameMs + elapsedMs(tFrame));
+    }
+    for (std::unique_ptr<BenchEncoder>& pEncoder : vEncoders)
+    {
+      unsigned uiDrained = 0;
+      result.ullBytes += pEncoder->drain(uiDrained);
+    }
+    const double dCpuMs = getCpuMs() - dCpuStartMs - dUntimedMs;
+    result.dSeconds = (elapsedMs(tStart) - dUntimedMs) / 1000.0;
+    result.uiFrames = options.uiFrames;
+    result.sCase = getCaseName(options, std::string(bShared ? "shared/" : "separate/") + vSources[0]->getKernelName());
+
+    std::ostringstream detail;
+    detail.precision(3);
+    detail << std::fixed << "layers=" << sLayers << ";cpu_ms_per_frame=" << dCpuMs / result.uiFrames;
+    if (bShared)
+    {
+      detail << ";scale_kernel=" << vScalers[0]->getKernelName() << ";scale_ms=" << dScaleMs / result.uiFrames
+        << ";cpu_saving_pct=" << (dSeparateCpuMs > 0.0 ? 100.0 * (dSeparateCpuMs - dCpuMs) / dSeparateCpuMs : 0.0);
+    }
+    else
+    {
+      dSeparateCpuMs = dCpuMs;
+    }
+    result.sDetail = detail.str();
+    vResults.push_back(result);
+  }
+  return true;
+}
+
+/**
+ * @brief Encodes each resolution with every combination of frame threads and WPP, keeping
+ * the pool settings of the command line, and flags the fastest combination with best=1.
+ */
+static bool runThreads(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  // 0 lets x265 choose from the number of CPUs
+  const unsigned FRAME_THREADS[] = { 1, 2, 4, 8, 0 };
+  size_t uiBest = vResults.size();
+  for (unsigned uiFrameThreads : FRAME_THREADS)
+  {
+    for (int iWpp = 1; iWpp >= 0; --iWpp)
+    {
+      BenchOptions caseOptions = options;
+      caseOptions.threading.uiFrameThreads = uiFrameThreads;
+      caseOptions.threading.bWpp = iWpp == 1;
+      CaseResult result;
+      if (!runEncode(caseOptions, iWidth, iHeight, pY4m, result, sError)) return false;
+      const std::string sThreads = uiFrameThreads ? std::to_string(uiFrameThreads) : "auto";
+      result.sCase = getCaseName(options, "ft" + sThreads + "/wpp" + std::to_string(iWpp));
+      result.iWidth = iWidth;
+      result.iHeight = iHeight;
+      std::string sPools;
+      toPoolsString(options.threading.uiPoolThreads, options.threading.sNumaNodes, sPools);
+      // keep the CSV columns intact
+      std::replace(sPools.begin(), sPools.end(), ',', ' ');
+      result.sDetail += ";pools=" + sPools;
+      if (uiBest == vResults.size() || result.getFps() > vResults[uiBest].getFps())
+      {
+        uiBest = vResults.size();
+      }
+      vResults.push_back(result);
+    }
+  }
+  vResults[uiBest].sDetail += ";best=1";
+  return true;
+}
+
+/**
+ * @brief One encoder of the density mode with the queue that feeds it in real time
+ */
+struct DensityChannel
+{
+  DensityChannel() :uiPoolChannel(0), uiMisses(0), uiDrops(0), ullBytes(0), bFailed(false) {}
+
+  BenchEncoder encoder;
+  BoundedFrameQueue<unsigned> queue;
+  std::thread thread;
+  unsigned uiPoolChannel;
+  /// time from arrival to the end of the encode of each picture
+  std::vector<double> vLatencyMs;
+  unsigned uiMisses;
+  unsigned uiDrops;
+  uint64_t ullBytes;
+  bool bFailed;
+};
+
+/// Encodes one queued picture of a channel as the filter's queue consumers do
+static void encodeDensityPicture(DensityChannel& channel, const std::vector<std::vector<uint8_t> >& vPictures, double dIntervalMs, unsigned uiPicture, uint64_t uiWaitUs)
+{
+  const Clock::time_point tStart = Clock::now();
+  const long lLength = channel.encoder.encode(&vPictures[uiPicture % vPictures.size()][0]);
+  const double dLatencyMs = uiWaitUs / 1000.0 + elapsedMs(tStart);
+  if (lLength < 0) channel.bFailed = true;
+  else channel.ullBytes += lLength;
+  channel.vLatencyMs.push_back(dLatencyMs);
+  if (dLatencyMs > dIntervalMs) ++channel.uiMisses;
+}
+
+/**
+ * @brief Runs more and more channels at --fps in real time, each with its own x265 thread
+ * pool and then as single threaded encoders on SharedEncoderPool, as with the filter's
+ * shared_encoder_pool. A channel count keeps up if at most 1% of the pictures take longer
+ * than a frame interval from arrival to the end of their encode. Pictures are prepared
+ * before the run, so conversion is not included.
+ */
+static bool runDensity(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  // two seconds of distinct pictures, replayed in a loop
+  FrameSource source(options, iWidth, iHeight, pY4m);
+  std::vector<std::vector<uint8_t> > vPictures;
+  for (unsigned i = 0; i < (std::min)(options.uiFrames, 2 * options.uiFps); ++i)
+  {
+    const uint8_t* pI420 = source.getFrame(i);
+    if (!pI420)
+    {
+      sError = "Conversion failed";
+      return false;
+    }
+    vPictures.push_back(std::vector<uint8_t>(pI420, pI420 + source.getI420Size()));
+  }
+  const double dIntervalMs = 1000.0 / options.uiFps;
+  const std::chrono::microseconds interval(1000000 / options.uiFps);
+
+  const char* const SETUPS[] = { "instance", "shared" };
+  for (const char* szSetup : SETUPS)
+  {
+    const bool bShared = std::string(szSetup) == "shared";
+    BenchOptions channelOptions = options;
+    if (bShared)
+    {
+      // as X265EncoderFilter::configureThreading with shared_encoder_pool
+      channelOptions.threading.uiFrameThreads = 1;
+      channelOptions.threading.bWpp = false;
+      channelOptions.threading.bThreadPool = false;
+    }
+    unsigned uiMaxChannels = 0;
+    for (unsigned uiChannels : options.vChannels)
+    {
+      std::vector<std::unique_ptr<DensityChannel> > vChannels;
+      for (unsigned j = 0; j < uiChannels; ++j)
+      {
+        vChannels.push_back(std::unique_ptr<DensityChannel>(new DensityChannel()));
+        DensityChannel& channel = *vChannels.back();
+        if (!channel.encoder.open(channelOptions, iWidth, iHeight, sError)) return false;
+        // a second of backlog before pictures are dropped
+        channel.queue.open(options.uiFps, QOP_DROP_NEWEST);
+        if (bShared)
+        {
+          channel.uiPoolChannel = SharedEncoderPool::getInstance().addChannel([&channel, &vPictures, dIntervalMs]()
+          {
+            unsigned uiPicture = 0;
+            uint64_t uiWaitUs = 0;
+            if (channel.queue.tryPop(uiPicture, uiWaitUs))
+            {
+              encodeDensityPicture(channel, vPictures, dIntervalMs, uiPicture, uiWaitUs);
+              channel.queue.finish();
+            }
+          }, options.uiSharedPoolThreads);
+        }
+        else
+        {
+          channel.thread = std::thread([&channel, &vPictures, dIntervalMs]()
+          {
+            unsigned uiPicture = 0;
+            uint64_t uiWaitUs = 0;
+            while (channel.queue.pop(uiPicture, uiWaitUs))
+            {
+              encodeDensityPicture(channel, vPictures, dIntervalMs, uiPicture, uiWaitUs);
+            }
+          });
+        }
+      }
+      const unsigned uiPoolThreads = SharedEncoderPool::getInstance().getThreadCount();
+
+      const double dCpuStartMs = getCpuMs();
+      const Clock::time_point tStart = Clock::now();
+      for (unsigned i = 0; i < options.uiFrames; ++i)
+      {
+        std::this_thread::sleep_until(tStart + i * interval);
+        for (std::unique_ptr<DensityChannel>& pChannel : vChannels)
+        {
+          unsigned uiEvicted = 0;
+          if (pChannel->queue.push(i, uiEvicted) != BoundedFrameQueue<unsigned>::PR_QUEUED)
+          {
+            ++pChannel->uiDrops;
+            continue;
+          }
+          if (bShared)
+          {
+            SharedEncoderPool::getInstance().submit(pChannel->uiPoolChannel, SharedEncoderPool::Clock::now() + interval);
+          }
+        }
+      }
+      for (std::unique_ptr<DensityChannel>& pChannel : vChannels)
+      {
+        pChannel->queue.waitUntilIdle();
+      }
+      const double dSeconds = elapsedMs(tStart) / 1000.0;
+      const double dCpuMs = getCpuMs() - dCpuStartMs;
+      for (std::unique_ptr<DensityChannel>& pChannel : vChannels)
+      {
+        pChannel->queue.close();
+        if (bShared) SharedEncoderPool::getInstance().removeChannel(pChannel->uiPoolChannel);
+        else pChannel->thread.join();
+      }
+
+      CaseResult result;
+      result.iWidth = iWidth;
+      result.iHeight = iHeight;
+      result.dSeconds = dSeconds;
+      unsigned uiMisses = 0;
+      unsigned uiDrops = 0;
+      for (std::unique_ptr<DensityChannel>& pChannel : vChannels)
+      {
+        if (pChannel->bFailed)
+        {
+          sError = pChannel->encoder.getCodec()->GetErrorStr();
+          return false;
+        }
+        result.vMs.insert(result.vMs.end(), pChannel->vLatencyMs.begin(), pChannel->vLatencyMs.end());
+        result.ullBytes += pChannel->ullBytes;
+        uiMisses += pChannel->uiMisses;
+        uiDrops += pChannel->uiDrops;
+      }
+      result.uiFrames = static_cast<unsigned>(result.vMs.size());
+      result.sCase = getCaseName(options, std::string(szSetup) + "/ch" + std::to_string(uiChannels));
+      const double dMissPct = 100.0 * (uiMisses + uiDrops) / (static_cast<double>(options.uiFrames) * uiChannels);
+      const bool bRealtime = dMissPct <= 1.0;
+      if (bRealtime) uiMaxChannels = (std::max)(uiMaxChannels, uiChannels);
+
+      std::ostringstream detail;
+      detail.precision(3);
+      detail << std::fixed << "channels=" << uiChannels << ";miss_pct=" << dMissPct << ";drops=" << uiDrops
+        << ";realtime=" << (bRealtime ? 1 : 0) << ";cpu_pct=" << 100.0 * dCpuMs / (dSeconds * 1000.0);
+      if (bShared) detail << ";pool_threads=" << uiPoolThreads;
+      result.sDetail = detail.str();
+      vResults.push_back(result);
+    }
+    vResults.back().sDetail += ";max_channels=" + std::to_string(uiMaxChannels);
+  }
+  return true;
+}
+
+/**
+ * @brief Compares the filter's static_frame_policy values on input whose picture only changes
+ * every --static-run frames, or on a recorded Y4M as is. Timed per frame are detection,
+ * conversion and encoding; the CPU time includes the encoder's threads.
+ */
+static bool runStatic(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  const bool bRgb = options.sFormat == "rgb24";
+  const InputPictureLayout layout = bRgb ? InputPictureLayout::forRgb24(iWidth, iHeight, 0, 0, 0, 0) : InputPictureLayout::forI420(iWidth, iHeight, 0, 0, 0, 0);
+  SyntheticSource synthetic(iWidth, iHeight);
+  std::vector<uint8_t> vSample(layout.uiMinSampleSize);
+  std::vector<uint8_t> vI420(layout.getPackedI420Size());
+  SimdRgb24ToI420Converter converter(iWidth, iHeight);
+  converter.setFlip(layout.bBottomUp);
+
+  const char* const POLICIES[] = { "encode", "repeat", "drop" };
+  double dEncodeCpuMs = 0.0;
+  for (const char* szPolicy : POLICIES)
+  {
+    const std::string sPolicy = szPolicy;
+    std::unique_ptr<StaticFrameDetector> pDetector;
+    if (sPolicy != "encode") pDetector.reset(new StaticFrameDetector(layout));
+    BenchEncoder encoder;
+    if (!encoder.open(options, iWidth, iHeight, sError)) return false;
+
+    CaseResult result;
+    result.iWidth = iWidth;
+    result.iHeight = iHeight;
+    unsigned uiStatic = 0;
+    double dCheckMs = 0.0;
+    double dUntimedMs = 0.0;
+    const double dCpuStartMs = getCpuMs();
+    const Clock::time_point tStart = Clock::now();
+    for (unsigned i = 0; i < options.uiFrames; ++i)
+    {
+      // a new sample arrives for every frame even if the picture is the same
+      const Clock::time_point tGenerate = Clock::now();
+      const uint8_t* pSample = &vSample[0];
+      if (pY4m) pSample = pY4m->getFrame(i);
+      else if (bRgb) synthetic.generateRgb24(i / options.uiStaticRun, &vSample[0], layout.iYStride);
+      else synthetic.generateI420(i / options.uiStaticRun, &vSample[0]);
+      dUntimedMs += elapsedMs(tGenerate);
+
+      const Clock::time_point tFrame = Clock::now();
+      bool bStatic = false;
+      if (pDetector)
+      {
+        bStatic = pDetector->isStatic(pSample);
+        dCheckMs += elapsedMs(tFrame);
+      }
+      if (bStatic) ++uiStatic;
+      if (!(bStatic && sPolicy == "drop"))
+      {
+        // repeat encodes the picture converted last
+        const uint8_t* pI420 = bRgb ? &vI420[0] : pSample;
+        if (bRgb && !bStatic && !converter.convert(pSample, static_cast<unsigned>(vSample.size()), layout.iYStride, &vI420[0], static_cast<unsigned>(vI420.size())))
+        {
+          sError = converter.getLastError();
+          return false;
+        }
+        const long lLength = encoder.encode(pI420);
+        if (lLength < 0)
+        {
+          sError = encoder.getCodec()->GetErrorStr();
+          return false;
+        }
+        result.ullBytes += lLength;
+      }
+      result.vMs.push_back(elapsedMs(tFrame));
+    }
+    unsigned uiDrained = 0;
+    result.ullBytes += encoder.drain(uiDrained);
+    const double dCpuMs = getCpuMs() - dCpuStartMs - dUntimedMs;
+    result.dSeconds = (elapsedMs(tStart) - dUntimedMs) / 1000.0;
+    result.uiFrames = options.uiFrames;
+    result.sCase = getCaseName(options, sPolicy);
+    if (sPolicy == "encode") dEncodeCpuMs = dCpuMs;
+
+    std::ostringstream detail;
+    detail.precision(3);
+    detail << std::fixed << "static_frames=" << uiStatic << ";cpu_ms_per_frame=" << dCpuMs / result.uiFrames;
+    if (pDetector)
+    {
+      detail << ";check_kernel=" << StaticFrameDetector::toString(pDetector->getInstructionSet())
+        << ";check_ms=" << dCheckMs / result.uiFrames
+        << ";cpu_saving_pct=" << (dEncodeCpuMs > 0.0 ? 100.0 * (dEncodeCpuMs - dCpuMs) / dEncodeCpuMs : 0.0);
+    }
+    result.sDetail = detail.str();
+    vResults.push_back(result);
+  }
+  return true;
+}
+
+/**
+ * @brief The filter's steady state with conversion planes from FramePlaneArena, packed and
+ * with rows padded to 64 bytes. Counts heap allocations during conversion and encoding after
+ * a warm up of a tenth of the frames, which should be 0, and arena allocations over a few
+ * simulated reconnects, which should be 0 once the first planes were allocated. The padded
+ * case needs a codec that takes in_y_stride and the plane offsets.
+ */
+static bool runPlanes(const BenchOptions& options, int iWidth, int iHeight, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  const InputPictureLayout layout = InputPictureLayout::forRgb24(iWidth, iHeight, 0, 0, 0, 0);
+  SyntheticSource synthetic(iWidth, iHeight);
+  std::vector<uint8_t> vSample(layout.uiMinSampleSize);
+  SimdRgb24ToI420Converter converter(iWidth, iHeight);
+  converter.setFlip(layout.bBottomUp);
+  FramePlaneArena& arena = FramePlaneArena::getInstance();
+  const unsigned RECONNECTS = 4;
+  const unsigned uiWarmUp = options.uiFrames / 10;
+
+  for (int iPadded = 0; iPadded < 2; ++iPadded)
+  {
+    const bool bPadded = iPadded == 1;
+    FramePlanes planes = arena.acquire(iWidth, iHeight, bPadded);
+    if (!planes.pY)
+    {
+      sError = "Out of memory for the conversion planes";
+      return false;
+    }
+    // as the filter does on every SetMediaType
+    const uint64_t ullReconnectStart = arena.getAllocationCount();
+    for (unsigned i = 0; i < RECONNECTS; ++i)
+    {
+      arena.release(planes);
+      planes = arena.acquire(iWidth, iHeight, bPadded);
+    }
+    const uint64_t ullReconnectAllocations = arena.getAllocationCount() - ullReconnectStart;
+
+    BenchOptions planeOptions = options;
+    planeOptions.vCodecParameters.push_back(std::make_pair(CODEC_PARAM_IN_Y_STRIDE, std::to_string(planes.iYStride)));
+    planeOptions.vCodecParameters.push_back(std::make_pair(CODEC_PARAM_IN_UV_STRIDE, std::to_string(planes.iUvStride)));
+    planeOptions.vCodecParameters.push_back(std::make_pair(CODEC_PARAM_IN_U_OFFSET, std::to_string(planes.pU - planes.pY)));
+    planeOptions.vCodecParameters.push_back(std::make_pair(CODEC_PARAM_IN_V_OFFSET, std::to_string(planes.pV - planes.pY)));
+    BenchEncoder encoder;
+    if (!encoder.open(planeOptions, iWidth, iHeight, sError))
+    {
+      arena.release(planes);
+      if (!bPadded) return false;
+      std::cerr << "Skipping padded planes: " << sError << std::endl;
+      sError.clear();
+      break;
+    }
+
+    CaseResult result;
+    result.iWidth = iWidth;
+    result.iHeight = iHeight;
+    result.vMs.reserve(options.uiFrames);
+    uint64_t ullHeapAllocations = 0;
+    double dUntimedMs = 0.0;
+    const Clock::time_point tStart = Clock::now();
+    for (unsigned i = 0; i < options.uiFrames; ++i)
+    {
+      const Clock::time_point tGenerate = Clock::now();
+      synthetic.generateRgb24(i, &vSample[0], layout.iYStride);
+      dUntimedMs += elapsedMs(tGenerate);
+
+      const uint64_t ullAllocationsBefore = g_ullHeapAllocations;
+      const Clock::time_point tFrame = Clock::now();
+      converter.convert(&vSample[0], layout.iYStride, planes.pY, planes.iYStride, planes.pU, planes.pV, planes.iUvStride);
+      const long lLength = encoder.encode(planes.pY);
+      if (lLength < 0)
+      {
+        arena.release(planes);
+        sError = encoder.getCodec()->GetErrorStr();
+        return false;
+      }
+      result.vMs.push_back(elapsedMs(tFrame));
+      if (i >= uiWarmUp) ullHeapAllocations += g_ullHeapAllocations - ullAllocationsBefore;
+      result.ullBytes += lLength;
+    }
+    unsigned uiDrained = 0;
+    result.ullBytes += encoder.drain(uiDrained);
+    result.dSeconds = (elapsedMs(tStart) - dUntimedMs) / 1000.0;
+    result.uiFrames = options.uiFrames;
+    result.sCase = getCaseName(options, bPadded ? "padded" : "packed");
+
+    std::ostringstream detail;
+    detail.precision(3);
+    detail << std::fixed << "heap_allocs_per_frame=" << static_cast<double>(ullHeapAllocations) / (options.uiFrames - uiWarmUp)
+      << ";reconnect_allocs=" << ullReconnectAllocations
+      << ";y_stride=" << planes.iYStride << ";large_pages=" << (planes.bLargePages ? 1 : 0);
+    result.sDetail = detail.str();
+    vResults.push_back(result);
+    arena.release(planes);
+  }
+  return true;
+}
+
+/**
+ * @brief Appends an Annex B NAL unit with a payload of uiPayload pseudo random bytes, escaped
+ * with emulation prevention bytes like a real slice.
+ */
+static void appendSyntheticNal(std::vector<uint8_t>& vAccessUnit, bool bLongStartCode, uint8_t uiType, size_t uiPayload, uint32_t& uiSeed)
+{
+  if (bLongStartCode) vAccessUnit.push_back(0);
+  vAccessUnit.push_back(0);
+  vAccessUnit.push_back(0);
+  vAccessUnit.push_back(1);
+  vAccessUnit.push_back(static_cast<uint8_t>(uiType << 1));
+  vAccessUnit.push_back(1);
+  unsigned uiZeros = 0;
+  for (size_t i = 0; i < uiPayload; ++i)
+  {
+    uiSeed = uiSeed * 1664525u + 1013904223u;
+    // plenty of zeros, as in CABAC output of flat content
+    uint8_t uiByte = (uiSeed >> 28) < 4 ? 0 : static_cast<uint8_t>(uiSeed >> 20);
+    if (uiZeros >= 2 && uiByte <= 3)
+    {
+      vAccessUnit.push_back(3);
+      uiZeros = 0;
+    }
+    vAccessUnit.push_back(uiByte);
+    uiZeros = uiByte == 0 ? uiZeros + 1 : 0;
+  }
+  // rbsp_stop_one_bit
+  vAccessUnit.push_back(0x80);
+}
+
+/**
+ * @brief Access units laid out as x265 writes them: parameter sets and SEI before each IDR
+ * behind 4 byte start codes, then uiSlices slice segments of which only the first has a 4 byte
+ * start code. Sized for the bitrate, with IDRs five times the average.
+ */
+static void buildSyntheticAccessUnits(const BenchOptions& options, unsigned uiSlices, std::vector<std::vector<uint8_t> >& vAccessUnits)
+{
+  const size_t uiAverage = static_cast<size_t>(options.uiBitrateKbps) * 1000 / 8 / options.uiFps;
+  uint32_t uiSeed = 1;
+  vAccessUnits.resize(options.uiFrames);
+  for (unsigned i = 0; i < options.uiFrames; ++i)
+  {
+    std::vector<uint8_t>& vAccessUnit = vAccessUnits[i];
+    const bool bIdr = i % options.uiIdrPeriod == 0;
+    if (bIdr)
+    {
+      appendSyntheticNal(vAccessUnit, true, 32, 20, uiSeed);
+      appendSyntheticNal(vAccessUnit, true, 33, 40, uiSeed);
+      appendSyntheticNal(vAccessUnit, true, 34, 8, uiSeed);
+      appendSyntheticNal(vAccessUnit, true, 39, 16, uiSeed);
+    }
+    const size_t uiSlice = (bIdr ? 5 * uiAverage : uiAverage) / uiSlices;
+    for (unsigned j = 0; j < uiSlices; ++j)
+    {
+      // IDR_W_RADL or TRAIL_R
+      appendSyntheticNal(vAccessUnit, j == 0, bIdr ? 19 : 1, uiSlice, uiSeed);
+    }
+  }
+}
+
+/**
+ * @brief What a downstream remuxer does with an Annex B sample: scan byte by byte and copy
+ * each NAL unit behind a 4 byte length into its own output buffer. Returns the output length,
+ * 0 if the data does not start with a start code.
+ */
+static size_t remuxToLengthPrefixed(const uint8_t* pData, size_t uiLength, std::vector<uint8_t>& vOut)
+{
+  size_t uiOut = 0;
+  size_t uiStart = 0;
+  bool bFound = false;
+  size_t i = 0;
+  while (i + 2 < uiLength)
+  {
+    if (pData[i] == 0 && pData[i + 1] == 0 && pData[i + 2] == 1)
+    {
+      if (bFound)
+      {
+        size_t uiEnd = i;
+        while (uiEnd > uiStart && pData[uiEnd - 1] == 0) --uiEnd;
+        const size_t uiNal = uiEnd - uiStart;
+        vOut[uiOut] = static_cast<uint8_t>(uiNal >> 24);
+        vOut[uiOut + 1] = static_cast<uint8_t>(uiNal >> 16);
+        vOut[uiOut + 2] = static_cast<uint8_t>(uiNal >> 8);
+        vOut[uiOut + 3] = static_cast<uint8_t>(uiNal);
+        memcpy(&vOut[uiOut + 4], pData + uiStart, uiNal);
+        uiOut += 4 + uiNal;
+      }
+      else if (std::count(pData, pData + i, 0) != static_cast<std::ptrdiff_t>(i))
+      {
+        return 0;
+      }
+      bFound = true;
+      i += 3;
+      uiStart = i;
+    }
+    else
+    {
+      ++i;
+    }
+  }
+  if (!bFound) return 0;
+  size_t uiEnd = uiLength;
+  while (uiEnd > uiStart && pData[uiEnd - 1] == 0) --uiEnd;
+  const size_t uiNal = uiEnd - uiStart;
+  vOut[uiOut] = static_cast<uint8_t>(uiNal >> 24);
+  vOut[uiOut + 1] = static_cast<uint8_t>(uiNal >> 16);
+  vOut[uiOut + 2] = static_cast<uint8_t>(uiNal >> 8);
+  vOut[uiOut + 3] = static_cast<uint8_t>(uiNal);
+  memcpy(&vOut[uiOut + 4], pData + uiStart, uiNal);
+  return uiOut + 4 + uiNal;
+}
+
+/**
+ * @brief The codec's access units of --frames pictures, or synthetic ones with 4 slice
+ * segments if the codec does not write Annex B. sSource tells which.
+ */
+static bool collectAccessUnits(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, std::vector<std::vector<uint8_t> >& vAccessUnits, std::string& sSource, std::string& sError)
+{
+  {
+    FrameSource source(options, iWidth, iHeight, pY4m);
+    BenchEncoder encoder;
+    if (!encoder.open(options, iWidth, iHeight, sError)) return false;
+    for (unsigned i = 0; i < options.uiFrames; ++i)
+    {
+      const long lLength = encoder.encode(source.getFrame(i));
+      if (lLength < 0)
+      {
+        sError = encoder.getCodec()->GetErrorStr();
+        return false;
+      }
+      if (lLength > 0)
+      {
+        vAccessUnits.push_back(std::vector<uint8_t>(encoder.getBitstream(), encoder.getBitstream() + lLength));
+      }
+    }
+  }
+  sSource = "codec";
+  AnnexBRewriter check;
+  std::vector<uint8_t> vCheck;
+  for (const std::vector<uint8_t>& vAccessUnit : vAccessUnits)
+  {
+    vCheck = vAccessUnit;
+    vCheck.resize(vAccessUnit.size() + BITSTREAM_HEADROOM);
+    size_t uiNewLength = 0;
+    if (!check.toLengthPrefixed(&vCheck[0], vAccessUnit.size(), vCheck.size(), uiNewLength) || AnnexBRewriter::isLengthPrefixed(&vAccessUnit[0], vAccessUnit.size()))
+    {
+      std::cerr << "Codec output is not Annex B: using synthetic access units" << std::endl;
+      sSource = "synthetic";
+      vAccessUnits.clear();
+      buildSyntheticAccessUnits(options, 4, vAccessUnits);
+      break;
+    }
+  }
+  if (vAccessUnits.empty())
+  {
+    sError = "The codec produced no access units";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Per frame cost of HVC1 output: the filter's in-place rewrite with each start code
+ * scanner against a downstream remuxer that scans and copies every sample. Uses the codec's
+ * access units when it writes Annex B, else synthetic ones with 4 slice segments. Every
+ * rewritten access unit is checked against the remuxer's. Only the rewrite or remux is timed:
+ * copying the access unit into the work buffer stands in for the codec writing it.
+ */
+static bool runHvc1(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  std::vector<std::vector<uint8_t> > vAccessUnits;
+  std::string sSource;
+  if (!collectAccessUnits(options, iWidth, iHeight, pY4m, vAccessUnits, sSource, sError)) return false;
+
+  size_t uiLargest = 0;
+  uint64_t ullInputBytes = 0;
+  for (const std::vector<uint8_t>& vAccessUnit : vAccessUnits)
+  {
+    uiLargest = (std::max)(uiLargest, vAccessUnit.size());
+    ullInputBytes += vAccessUnit.size();
+  }
+  std::vector<uint8_t> vWork(uiLargest + BITSTREAM_HEADROOM);
+  std::vector<uint8_t> vRemuxed(uiLargest + BITSTREAM_HEADROOM);
+  std::vector<std::vector<uint8_t> > vExpected(vAccessUnits.size());
+  for (size_t i = 0; i < vAccessUnits.size(); ++i)
+  {
+    const size_t uiLength = remuxToLengthPrefixed(&vAccessUnits[i][0], vAccessUnits[i].size(), vRemuxed);
+    vExpected[i].assign(vRemuxed.begin(), vRemuxed.begin() + uiLength);
+  }
+
+  // the remuxer first, then each scanner the CPU supports
+  const int iLastKernel = AnnexBRewriter::detectInstructionSet();
+  for (int iKernel = -1; iKernel <= iLastKernel; ++iKernel)
+  {
+    AnnexBRewriter rewriter;
+    if (iKernel >= 0) rewriter.setInstructionSet(static_cast<AnnexBRewriter::InstructionSet>(iKernel));
+    CaseResult result;
+    result.iWidth = iWidth;
+    result.iHeight = iHeight;
+    result.vMs.reserve(vAccessUnits.size());
+    for (size_t i = 0; i < vAccessUnits.size(); ++i)
+    {
+      const std::vector<uint8_t>& vAccessUnit = vAccessUnits[i];
+      memcpy(&vWork[0], &vAccessUnit[0], vAccessUnit.size());
+      size_t uiNewLength = 0;
+      const Clock::time_point tFrame = Clock::now();
+      if (iKernel < 0)
+      {
+        uiNewLength = remuxToLengthPrefixed(&vWork[0], vAccessUnit.size(), vRemuxed);
+      }
+      else if (!rewriter.toLengthPrefixed(&vWork[0], vAccessUnit.size(), vWork.size(), uiNewLength))
+      {
+        sError = "Rewrite failed: " + rewriter.getLastError();
+        return false;
+      }
+      result.vMs.push_back(elapsedMs(tFrame));
+      const uint8_t* pResult = iKernel < 0 ? &vRemuxed[0] : &vWork[0];
+      if (uiNewLength != vExpected[i].size() || memcmp(pResult, &vExpected[i][0], uiNewLength) != 0)
+      {
+        sError = "Access unit " + std::to_string(i) + " differs from the remuxed one";
+        return false;
+      }
+      result.ullBytes += uiNewLength;
+    }
+    for (double dMs : result.vMs) result.dSeconds += dMs / 1000.0;
+    result.uiFrames = static_cast<unsigned>(vAccessUnits.size());
+    result.sCase = getCaseName(options, iKernel < 0 ? std::string("remux") : std::string("inplace_") + AnnexBRewriter::toString(rewriter.getInstructionSet()));
+
+    std::ostringstream detail;
+    detail.precision(1);
+    detail << std::fixed << "source=" << sSource << ";bytes_per_frame=" << static_cast<double>(ullInputBytes) / vAccessUnits.size()
+      << ";growth_per_frame=" << static_cast<double>(result.ullBytes - ullInputBytes) / vAccessUnits.size();
+    result.sDetail = detail.str();
+    vResults.push_back(result);
+  }
+  return true;
+}
+
+/**
+ * @brief RTP output over loopback: packetizes each access unit into the ring and sends it with
+ * UdpRtpSink to a socket bound to 127.0.0.1, where a receiver thread depacketizes the packets
+ * and checks that every access unit comes back bit-exact in length-prefixed form. Timed per
+ * frame are packetizing and sending. Uses the access units of hvc1 mode.
+ */
+static bool runRtp(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  std::vector<std::vector<uint8_t> > vAccessUnits;
+  std::string sSource;
+  if (!collectAccessUnits(options, iWidth, iHeight, pY4m, vAccessUnits, sSource, sError)) return false;
+
+  // what the depacketizer has to give back
+  AnnexBRewriter rewriter;
+  std::vector<std::vector<uint8_t> > vExpected(vAccessUnits.size());
+  size_t uiLargest = 0;
+  for (size_t i = 0; i < vAccessUnits.size(); ++i)
+  {
+    vExpected[i] = vAccessUnits[i];
+    vExpected[i].resize(vAccessUnits[i].size() + BITSTREAM_HEADROOM);
+    size_t uiLength = 0;
+    rewriter.toLengthPrefixed(&vExpected[i][0], vAccessUnits[i].size(), vExpected[i].size(), uiLength);
+    vExpected[i].resize(uiLength);
+    uiLargest = (std::max)(uiLargest, vAccessUnits[i].size());
+  }
+
+  const int iReceiver = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addressLength = sizeof(address);
+  int iBufferSize = 16 * 1024 * 1024;
+  if (iReceiver < 0 || bind(iReceiver, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+    getsockname(iReceiver, reinterpret_cast<sockaddr*>(&address), &addressLength) != 0)
+  {
+    if (iReceiver >= 0) close(iReceiver);
+    sError = "Cannot bind a UDP socket on loopback";
+    return false;
+  }
+  setsockopt(iReceiver, SOL_SOCKET, SO_RCVBUF, &iBufferSize, sizeof(iBufferSize));
+
+  UdpRtpSink sink;
+  if (!sink.open("127.0.0.1:" + std::to_string(ntohs(address.sin_port))))
+  {
+    close(iReceiver);
+    sError = sink.getLastError();
+    return false;
+  }
+  H265RtpPacketizer packetizer;
+  packetizer.reset(options.uiRtpPacketSize, 96);
+  RtpPacketRing ring;
+  ring.allocate(static_cast<unsigned>(uiLargest / (options.uiRtpPacketSize - H265RtpPacketizer::RTP_HEADER_SIZE - 3)) + 64, options.uiRtpPacketSize);
+  const uint32_t uiFrameTicks = 90000 / options.uiFps;
+
+  // the receiver gives up once the sender is done and nothing arrived for a while
+  std::atomic<bool> bSent(false);
+  unsigned uiMatched = 0;
+  unsigned uiMismatched = 0;
+  uint64_t ullReceivedPackets = 0;
+  H265RtpDepacketizer depacketizer;
+  std::thread receiver([&]()
+  {
+    std::vector<uint8_t> vPacket(65536);
+    pollfd fd = { iReceiver, POLLIN, 0 };
+    while (uiMatched + uiMismatched < vAccessUnits.size())
+    {
+      if (poll(&fd, 1, 200) <= 0)
+      {
+        if (bSent) break;
+        continue;
+      }
+      const ssize_t iLength = recv(iReceiver, &vPacket[0], vPacket.size(), 0);
+      if (iLength <= 0) continue;
+      ++ullReceivedPackets;
+      if (!depacketizer.addPacket(&vPacket[0], static_cast<size_t>(iLength))) continue;
+      const size_t uiIndex = (depacketizer.getTimestamp() - packetizer.getTimestampOffset()) / uiFrameTicks;
+      if (uiIndex < vExpected.size() && depacketizer.getAccessUnit() == vExpected[uiIndex]) ++uiMatched;
+      else ++uiMismatched;
+    }
+  });
+
+  CaseResult result;
+  result.iWidth = iWidth;
+  result.iHeight = iHeight;
+  result.vMs.reserve(vAccessUnits.size());
+  uint64_t ullPackets = 0;
+  unsigned uiOverflows = 0;
+  for (size_t i = 0; i < vAccessUnits.size(); ++i)
+  {
+    const Clock::time_point tFrame = Clock::now();
+    if (!packetizer.packetize(&vAccessUnits[i][0], vAccessUnits[i].size(), false, static_cast<uint32_t>(i) * uiFrameTicks, ring)) ++uiOverflows;
+    ullPackets += sink.send(ring);
+    result.vMs.push_back(elapsedMs(tFrame));
+    result.ullBytes += vAccessUnits[i].size();
+  }
+  bSent = true;
+  receiver.join();
+  close(iReceiver);
+  for (double dMs : result.vMs) result.dSeconds += dMs / 1000.0;
+  result.uiFrames = static_cast<unsigned>(vAccessUnits.size());
+  result.sCase = getCaseName(options, "rtp_" + std::to_string(options.uiRtpPacketSize));
+
+  std::ostringstream detail;
+  detail.precision(2);
+  detail << std::fixed << "source=" << sSource << ";packets_per_frame=" << static_cast<double>(ullPackets) / vAccessUnits.size()
+    << ";sendmmsg_per_frame=" << static_cast<double>(sink.getSendCalls()) / vAccessUnits.size()
+    << ";single=" << packetizer.getSinglePackets() << ";ap=" << packetizer.getAggregationPackets() << ";fu=" << packetizer.getFragmentationUnits()
+    << ";received=" << ullReceivedPackets << ";bit_exact=" << uiMatched << "/" << vAccessUnits.size()
+    << ";ring_overflows=" << uiOverflows << ";send_errors=" << sink.getSendErrors();
+  result.sDetail = detail.str();
+  vResults.push_back(result);
+  if (uiMatched != vAccessUnits.size())
+  {
+    sError = "Only " + std::to_string(uiMatched) + " of " + std::to_string(vAccessUnits.size()) + " access units came back bit-exact: " + depacketizer.getLastError();
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Capture resolution switch half way through: from each resolution to half its size.
+ * "teardown" closes and reopens the encoder at the switch like SetMediaType did for every
+ * format change, "prepared" opens a second encoder in the background from a second before
+ * the switch, as the filter does for a sample with the new type that is queued behind others. The
+ * switch time covers draining the old encoder, waiting for the new one and the first picture.
+ */
+static bool runSwitch(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  const int iNewWidth = (iWidth / 2) & ~1;
+  const int iNewHeight = (iHeight / 2) & ~1;
+  const unsigned uiSwitch = options.uiFrames / 2;
+  const unsigned uiAnnounce = uiSwitch > options.uiFps ? uiSwitch - options.uiFps : 0;
+  const char* const METHODS[] = { "teardown", "prepared" };
+  for (const char* szMethod : METHODS)
+  {
+    const bool bPrepared = strcmp(szMethod, "prepared") == 0;
+    FrameSource source(options, iWidth, iHeight, pY4m);
+    FrameSource next(options, iNewWidth, iNewHeight, NULL);
+    std::unique_ptr<BenchEncoder> pEncoder(new BenchEncoder());
+    if (!pEncoder->open(options, iWidth, iHeight, sError)) return false;
+    std::unique_ptr<BenchEncoder> pNext;
+    std::thread opener;
+    std::thread retirer;
+    bool bOpened = false;
+    std::string sOpenError;
+    double dOpenMs = 0.0;
+    double dWaitMs = 0.0;
+    double dSwitchMs = 0.0;
+    CaseResult result;
+    for (unsigned i = 0; i < options.uiFrames; ++i)
+    {
+      if (bPrepared && i == uiAnnounce)
+      {
+        pNext.reset(new BenchEncoder());
+        opener = std::thread([&]()
+        {
+          const Clock::time_point tOpen = Clock::now();
+          bOpened = pNext->open(options, iNewWidth, iNewHeight, sOpenError);
+          dOpenMs = elapsedMs(tOpen);
+        });
+      }
+      const uint8_t* pI420 = i < uiSwitch ? source.getFrame(i) : next.getFrame(i);
+      const Clock::time_point tStart = Clock::now();
+      if (i == uiSwitch)
+      {
+        // the pictures of the old size go out first
+        unsigned uiDrained = 0;
+        result.ullBytes += pEncoder->drain(uiDrained);
+        if (bPrepared)
+        {
+          const Clock::time_point tWait = Clock::now();
+          opener.join();
+          dWaitMs = elapsedMs(tWait);
+          if (!bOpened)
+          {
+            sError = sOpenError;
+            return false;
+          }
+          // closed off the encoding thread
+          BenchEncoder* pOld = pEncoder.release();
+          retirer = std::thread([pOld]() { delete pOld; });
+          pEncoder.reset(pNext.release());
+        }
+        else
+        {
+          const Clock::time_point tOpen = Clock::now();
+          if (!pEncoder->open(options, iNewWidth, iNewHeight, sError)) return false;
+          dOpenMs = elapsedMs(tOpen);
+        }
+      }
+      const long lLength = pEncoder->encode(pI420);
+      const double dMs = elapsedMs(tStart);
+      if (lLength < 0)
+      {
+        sError = pEncoder->getCodec()->GetErrorStr();
+        return false;
+      }
+      if (i == uiSwitch) dSwitchMs = dMs;
+      result.vMs.push_back(dMs);
+      result.dSeconds += dMs / 1000.0;
+      result.ullBytes += lLength;
+      ++result.uiFrames;
+    }
+    if (retirer.joinable()) retirer.join();
+    unsigned uiDrained = 0;
+    result.ullBytes += pEncoder->drain(uiDrained);
+    result.sCase = getCaseName(options, std::string("switch_") + szMethod);
+    result.iWidth = iWidth;
+    result.iHeight = iHeight;
+    std::ostringstream detail;
+    detail.precision(3);
+    detail << std::fixed << "to=" << iNewWidth << "x" << iNewHeight << ";switch_frame=" << uiSwitch << ";switch_ms=" << dSwitchMs
+      << ";open_ms=" << dOpenMs << ";wait_ms=" << dWaitMs;
+    result.sDetail = detail.str();
+    vResults.push_back(result);
+  }
+  return true;
+}
+
+/**
+ * @brief Channel start latency with and without EncoderInstancePool, from asking for an encoder
+ * to the first access unit. "cold" creates and opens an encoder for each start like SetMediaType
+ * without a pool, "warm" takes one from a pool filled beforehand, as encoder_pool_profiles does
+ * before the graph is built. Each channel then stops: a warm encoder is restarted and given back
+ * to the pool, a cold one is closed.
+ */
+static bool runStartup(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  // one profile: the bench opens every encoder alike
+  const std::string sProfile = std::to_string(iWidth) + "x" + std::to_string(iHeight);
+  EncoderInstancePool& pool = EncoderInstancePool::getInstance();
+  const char* const METHODS[] = { "cold", "warm" };
+  for (const char* szMethod : METHODS)
+  {
+    const bool bWarm = strcmp(szMethod, "warm") == 0;
+    FrameSource source(options, iWidth, iHeight, pY4m);
+    CaseResult result;
+    result.iWidth = iWidth;
+    result.iHeight = iHeight;
+    double dFillMs = 0.0;
+    if (bWarm)
+    {
+      pool.setCapacity(options.uiStarts);
+      const Clock::time_point tFill = Clock::now();
+      for (unsigned i = 0; i < options.uiStarts; ++i)
+      {
+        BenchEncoder encoder;
+        if (!encoder.open(options, iWidth, iHeight, sError)) return false;
+        PooledEncoder pooled;
+        pooled.pCodec = encoder.detach();
+        pool.release(sProfile, pooled);
+      }
+      dFillMs = elapsedMs(tFill);
+    }
+    const uint64_t ullHits = pool.getHitCount();
+    double dOpenMs = 0.0;
+    double dStopMs = 0.0;
+    unsigned uiFramesToOutput = 0;
+    unsigned uiFrame = 0;
+    for (unsigned uiStart = 0; uiStart < options.uiStarts; ++uiStart)
+    {
+      const Clock::time_point tStart = Clock::now();
+      std::unique_ptr<BenchEncoder> pEncoder;
+      PooledEncoder pooled;
+      if (bWarm && pool.acquire(sProfile, pooled))
+      {
+        pEncoder.reset(new BenchEncoder(pooled.pCodec, iWidth, iHeight));
+      }
+      else
+      {
+        pEncoder.reset(new BenchEncoder());
+        if (!pEncoder->open(options, iWidth, iHeight, sError)) return false;
+      }
+      dOpenMs += elapsedMs(tStart);
+      // pictures until the encoder gives the first one back, more with lookahead or frame threads
+      double dUntimedMs = 0.0;
+      long lLength = 0;
+      for (unsigned i = 0; lLength == 0 && i < options.uiFrames; ++i, ++uiFrame)
+      {
+        const Clock::time_point tGenerate = Clock::now();
+        const uint8_t* pI420 = source.getFrame(uiFrame);
+        if (!pI420)
+        {
+          sError = "Conversion failed";
+          return false;
+        }
+        dUntimedMs += elapsedMs(tGenerate) - source.getLastConvertMs();
+        lLength = pEncoder->encode(pI420);
+        if (lLength < 0)
+        {
+          sError = pEncoder->getCodec()->GetErrorStr();
+          return false;
+        }
+        ++uiFramesToOutput;
+      }
+      unsigned uiDrained = 0;
+      if (lLength == 0) lLength = static_cast<long>(pEncoder->drain(uiDrained));
+      const double dMs = elapsedMs(tStart) - dUntimedMs;
+      result.vMs.push_back(dMs);
+      result.dSeconds += dMs / 1000.0;
+      result.ullBytes += lLength;
+      ++result.uiFrames;
+
+      const Clock::time_point tStop = Clock::now();
+      if (bWarm)
+      {
+        pEncoder->getCodec()->Restart();
+        PooledEncoder returned;
+        returned.pCodec = pEncoder->detach();
+        pool.release(sProfile, returned);
+      }
+      pEncoder.reset();
+      dStopMs += elapsedMs(tStop);
+    }
+    const uint64_t ullStartHits = pool.getHitCount() - ullHits;
+    pool.setCapacity(0);
+    result.sCase = getCaseName(options, std::string("startup_") + szMethod);
+    std::ostringstream detail;
+    detail.precision(3);
+    detail << std::fixed << "open_ms=" << dOpenMs / options.uiStarts << ";frames_to_output=" << static_cast<double>(uiFramesToOutput) / options.uiStarts
+      << ";stop_ms=" << dStopMs / options.uiStarts << ";fill_ms=" << dFillMs << ";pool_hits=" << ullStartHits;
+    result.sDetail = detail.str();
+    vResults.push_back(result);
+  }
+  return true;
+}
+
+/**
+ * @brief Glass-to-wire latency of whole access units against slice_max_bytes: from the arrival
+ * of a picture's sample, before conversion, to the first and the last output sample of its
+ * access unit, split into slice groups and copied into samples as the filter's slice mode
+ * does. Pictures leave the encoder late with lookahead or frame threads, so latencies follow
+ * out_pts where the codec reports it. Pictures still in the encoder at the end are not counted.
+ */
+static bool runSlices(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  for (int iSliced = 0; iSliced < 2; ++iSliced)
+  {
+    const bool bSliced = iSliced == 1;
+    const unsigned uiSlices = bSliced ? toSliceCount(options.uiSliceMaxBytes, options.uiBitrateKbps, options.uiFps, 1, iHeight) : 1;
+    BenchOptions sliceOptions = options;
+    if (bSliced) sliceOptions.vCodecParameters.push_back(std::make_pair(CODEC_PARAM_SLICES, std::to_string(uiSlices)));
+    FrameSource source(options, iWidth, iHeight, pY4m);
+    BenchEncoder encoder;
+    if (!encoder.open(sliceOptions, iWidth, iHeight, sError)) return false;
+
+    AnnexBRewriter rewriter;
+    std::vector<size_t> vEnds;
+    std::vector<uint8_t> vSample(source.getI420Size() + BITSTREAM_HEADROOM);
+    std::vector<Clock::time_point> vArrival(options.uiFrames);
+    std::vector<double> vFirstMs;
+    CaseResult result;
+    result.iWidth = iWidth;
+    result.iHeight = iHeight;
+    uint64_t ullSamples = 0;
+    uint64_t ullOversized = 0;
+    size_t uiLargest = 0;
+    unsigned uiOutput = 0;
+    const Clock::time_point tStart = Clock::now();
+    double dUntimedMs = 0.0;
+    for (unsigned i = 0; i < options.uiFrames; ++i)
+    {
+      const Clock::time_point tGenerate = Clock::now();
+      const uint8_t* pI420 = source.getFrame(i);
+      if (!pI420)
+      {
+        sError = "Conversion failed";
+        return false;
+      }
+      // the sample arrived when its conversion started
+      const double dConvertMs = source.getLastConvertMs();
+      vArrival[i] = Clock::now() - std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(dConvertMs));
+      dUntimedMs += elapsedMs(tGenerate) - dConvertMs;
+
+      const long lLength = encoder.encode(pI420);
+      if (lLength < 0)
+      {
+        sError = encoder.getCodec()->GetErrorStr();
+        return false;
+      }
+      if (lLength == 0) continue;
+      int64_t iPts = encoder.getOutPts();
+      // without out_pts pictures come out in input order
+      if (iPts < 0 || iPts > static_cast<int64_t>(i)) iPts = uiOutput;
+      ++uiOutput;
+
+      if (bSliced) rewriter.findSliceEnds(encoder.getBitstream(), lLength, false, vEnds);
+      else vEnds.assign(1, static_cast<size_t>(lLength));
+      size_t uiStart = 0;
+      for (size_t j = 0; j < vEnds.size(); ++j)
+      {
+        const size_t uiSample = vEnds[j] - uiStart;
+        memcpy(&vSample[0], encoder.getBitstream() + uiStart, uiSample);
+        if (j == 0) vFirstMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - vArrival[iPts]).count());
+        uiLargest = (std::max)(uiLargest, uiSample);
+        if (bSliced && uiSample > options.uiSliceMaxBytes) ++ullOversized;
+        uiStart = vEnds[j];
+      }
+      result.vMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - vArrival[iPts]).count());
+      ullSamples += vEnds.size();
+      result.ullBytes += lLength;
+    }
+    if (!uiOutput)
+    {
+      sError = "The codec produced no access units";
+      return false;
+    }
+    result.dSeconds = (elapsedMs(tStart) - dUntimedMs) / 1000.0;
+    result.uiFrames = uiOutput;
+    result.sCase = getCaseName(options, bSliced ? "slices_" + std::to_string(uiSlices) : std::string("frame"));
+
+    std::ostringstream detail;
+    detail.precision(3);
+    detail << std::fixed << "first_sample_ms_p50=" << percentile(vFirstMs, 50.0) << ";first_sample_ms_p95=" << percentile(vFirstMs, 95.0)
+      << ";samples_per_frame=" << static_cast<double>(ullSamples) / uiOutput << ";largest_sample=" << uiLargest
+      << ";oversized_pct=" << (ullSamples ? 100.0 * ullOversized / ullSamples : 0.0);
+    result.sDetail = detail.str();
+    vResults.push_back(result);
+  }
+  return true;
+}
+
+/**
+ * @brief Screen content for dirty mode: a still desktop with a text area that changes every
+ * frame, covering a quarter of the width and a sixteenth of the height.
+ */
+static void paintDesktopRgb24(const std::vector<uint8_t>& vDesktop, unsigned uiFrame, const InputPictureLayout& layout, std::vector<uint8_t>& vSample)
+{
+  vSample = vDesktop;
+  for (int y = layout.iHeight / 4; y < layout.iHeight / 4 + layout.iHeight / 16; ++y)
+  {
+    uint8_t* pRow = &vSample[layout.uiYOffset + (layout.bBottomUp ? layout.iHeight - 1 - y : y) * layout.iYStride];
+    for (int x = layout.iWidth / 8; x < layout.iWidth / 8 + layout.iWidth / 4; ++x)
+    {
+      const uint8_t uiValue = static_cast<uint8_t>(((x / 6 + y / 12 + uiFrame) & 3) ? 240 : 16);
+      pRow[3 * x] = pRow[3 * x + 1] = pRow[3 * x + 2] = uiValue;
+    }
+  }
+}
+
+/**
+ * @brief Compares converting and encoding every picture in full with the filter's dirty_blocks
+ * mode, which converts only the CTUs that changed and gives the codec a QP offset for the
+ * others. Synthetic input is a desktop with a small changing area; a recorded screen capture
+ * can be given as Y4M, in which case nothing needs converting. The measure is process CPU time.
+ */
+static bool runDirty(const BenchOptions& options, int iWidth, int iHeight, const Y4mSource* pY4m, std::vector<CaseResult>& vResults, std::string& sError)
+{
+  const bool bRgb = !pY4m;
+  const InputPictureLayout layout = bRgb ? InputPictureLayout::forRgb24(iWidth, iHeight, 0, 0, 0, 0) : InputPictureLayout::forI420(iWidth, iHeight, 0, 0, 0, 0);
+  std::vector<uint8_t> vDesktop(layout.uiMinSampleSize);
+  if (bRgb) SyntheticSource(iWidth, iHeight).generateRgb24(0, &vDesktop[0], layout.iYStride);
+  std::vector<uint8_t> vSample;
+  std::vector<uint8_t> vI420(layout.getPackedI420Size());
+  SimdRgb24ToI420Converter converter(iWidth, iHeight);
+  converter.setFlip(layout.bBottomUp);
+  // the QP offset the filter uses by default
+  const int UNCHANGED_CTU_QP_OFFSET = 10;
+
+  double dFullCpuMs = 0.0;
+  for (int iBlocks = 0; iBlocks < 2; ++iBlocks)
+  {
+    const bool bBlocks = iBlocks == 1;
+    StaticFrameDetector detector(layout, CTU_SIZE);
+    BenchEncoder encoder;
+    if (!encoder.open(options, iWidth, iHeight, sError)) return false;
+    const bool bHints = bBlocks && encoder.getCodec()->SetParameter(CODEC_PARAM_IN_CTU_QP_OFFSETS, "");
+
+    CaseResult result;
+    result.iWidth = iWidth;
+    result.iHeight = iHeight;
+    uint64_t ullChanged = 0;
+    double dCheckMs = 0.0;
+    double dConvertMs = 0.0;
+    double dUntimedMs = 0.0;
+    const double dCpuStartMs = getCpuMs();
+    const Clock::time_point tStart = Clock::now();
+    for (unsigned i = 0; i < options.uiFrames; ++i)
+    {
+      const Clock::time_point tGenerate = Clock::now();
+      if (bRgb) paintDesktopRgb24(vDesktop, i, layout, vSample);
+      const uint8_t* pSample = bRgb ? &vSample[0] : pY4m->getFrame(i);
+      dUntimedMs += elapsedMs(tGenerate);
+
+      const Clock::time_point tFrame = Clock::now();
+      if (bBlocks)
+      {
+        detector.isStatic(pSample);
+        ullChanged += detector.getChangedBlockCount();
+        dCheckMs += elapsedMs(tFrame);
+      }
+      const Clock::time_point tConvert = Clock::now();
+      if (bRgb)
+      {
+        const bool bConverted = bBlocks ?
+          converter.convertBlocks(pSample, static_cast<unsigned>(vSample.size()), layout.iYStride, &vI420[0], static_cast<unsigned>(vI420.size()), &detector.getChangedBlocks()[0], CTU_SIZE) :
+          converter.convert(pSample, static_cast<unsigned>(vSample.size()), layout.iYStride, &vI420[0], static_cast<unsigned>(vI420.size()));
+        if (!bConverted)
+        {
+          sError = converter.getLastError();
+          return false;
+        }
+        dConvertMs += elapsedMs(tConvert);
+      }
+      if (bHints)
+      {
+        encoder.getCodec()->SetParameter(CODEC_PARAM_IN_CTU_QP_OFFSETS, toCtuQpOffsetsString(detector.getChangedBlocks(), UNCHANGED_CTU_QP_OFFSET).c_str());
+      }
+      const long lLength = encoder.encode(bRgb ? &vI420[0] : pSample);
+      if (lLength < 0)
+      {
+        sError = encoder.getCodec()->GetErrorStr();
+        return false;
+      }
+      result.ullBytes += lLength;
+      result.vMs.push_back(elapsedMs(tFrame));
+    }
+    unsigned uiDrained = 0;
+    result.ullBytes += encoder.drain(uiDrained);
+    const double dCpuMs = getCpuMs() - dCpuStartMs - dUntimedMs;
+    result.dSeconds = (elapsedMs(tStart) - dUntimedMs) / 1000.0;
+    result.uiFrames = options.uiFrames;
+    result.sCase = getCaseName(options, bBlocks ? "blocks" : "full");
+    if (!bBlocks) dFullCpuMs = dCpuMs;
+
+    std::ostringstream detail;
+    detail.precision(3);
+    detail << std::fixed << "cpu_ms_per_frame=" << dCpuMs / result.uiFrames << ";convert_ms=" << dConvertMs / result.uiFrames;
+    if (bBlocks)
+    {
+      const uint64_t ullCtus = static_cast<uint64_t>(detector.getChangedBlocks().size()) * result.uiFrames;
+      detail << ";check_ms=" << dCheckMs / result.uiFrames << ";changed_ctus_pct=" << 100.0 * ullChanged / ullCtus
+        << ";ctu_hints=" << (bHints ? 1 : 0)
+        << ";cpu_saving_pct=" << (dFullCpuMs > 0.0 ? 100.0 * (dFullCpuMs - dCpuMs) / dFullCpuMs : 0.0);
+    }
+    result.sDetail = detail.str();
+    vResults.push_back(result);
+  }
+  return true;
+}
+
+static const char* const CSV_HEADER = "case,width,height,frames,fps,ms_p50,ms_p95,ms_p99,ms_max,bytes_per_frame,peak_rss_kb,detail";
+
+static void writeRow(std::ostream& out, const CaseResult& result)
+{
+  char szRow[512];
+  snprintf(szRow, sizeof(szRow), "%s,%d,%d,%u,%.2f,%.3f,%.3f,%.3f,%.3f,%.0f,%ld,%s",
+    result.sCase.c_str(), result.iWidth, result.iHeight, result.uiFrames, result.getFps(),
+    percentile(result.vMs, 50), percentile(result.vMs, 95), percentile(result.vMs, 99), percentile(result.vMs, 100),
+    result.uiFrames ? static_cast<double>(result.ullBytes) / result.uiFrames : 0.0, getPeakRssKb(), result.sDetail.c_str());
+  out << szRow << std::endl;
+}
+
+/// Reads the fps column of an earlier CSV, keyed by case and picture size
+static bool readBaseline(const std::string& sFile, std::map<std::string, double>& mFps)
+{
+  std::ifstream in(sFile.c_str());
+  if (!in) return false;
+  std::string sLine;
+  while (std::getline(in, sLine))
+  {
+    std::vector<std::string> vFields;
+    std::istringstream fields(sLine);
+    std::string sField;
+    while (std::getline(fields, sField, ',')) vFields.push_back(sField);
+    if (vFields.size() < 5 || vFields[0] == "case") continue;
+    mFps[vFields[0] + "@" + vFields[1] + "x" + vFields[2]] = atof(vFields[4].c_str());
+  }
+  return true;
+}
+
+static void usage()
+{
+  std::cerr <<
+    "Usage: X265EncoderBench [options]\n"
+    "  --mode encode|convert|idr|bitrate|simulcast|threads|density|static|dirty|planes|hvc1|slices|rtp|switch|startup  what to measure (default encode)\n"
+    "  --input synthetic|<file.y4m>       source pictures (default synthetic)\n"
+    "  --resolutions 480p,720p,1080p,2160p synthetic picture sizes (default all)\n"
+    "  --format rgb24|i420                synthetic input format (default rgb24)\n"
+    "  --kernel auto|scalar|sse41|avx2|legacy  RGB24 conversion (default auto)\n"
+    "  --frames N                         frames per case (default 300)\n"
+    "  --fps N                            frame rate given to the codec (default 30)\n"
+    "  --bitrate KBPS                     target bitrate (default 2000)\n"
+    "  --idr-period N                     frames between IDRs in idr mode (default 30)\n"
+    "  --param NAME=VALUE                 extra codec parameter, may be repeated\n"
+    "  --frame-threads N                  x265 frame threads, 0 for auto (default 0)\n"
+    "  --wpp 0|1                          wavefront parallel processing (default 1)\n"
+    "  --pool-threads N                   worker threads per NUMA node, 0 for all CPUs (default 0)\n"
+    "  --numa-nodes LIST                  NUMA nodes for the workers, e.g. 0 or 0,1 (default all)\n"
+    "  --channels LIST                    channel counts in density mode (default 1,2,4,8,12,16)\n"
+    "  --shared-pool-threads N            SharedEncoderPool size in density mode, 0 for one per CPU\n"
+    "  --static-run N                     frames per synthetic picture in static mode (default 10)\n"
+    "  --slice-max-bytes N                slice_max_bytes in slices mode (default 1200)\n"
+    "  --rtp-packet-size N                largest RTP packet in rtp mode (default 1200)\n"
+    "  --starts N                         channel starts per case in startup mode (default 8)\n"
+    "  --legacy-tolerance N               largest sample difference of the legacy converter in convert\n"
+    "                                     mode (default 1); SIMD kernels have to match scalar exactly\n"
+    "  --csv FILE                         write results to FILE instead of stdout\n"
+    "  --baseline FILE                    fail if fps drops against this earlier CSV\n"
+    "  --threshold PCT                    allowed fps drop in percent (default 5)\n"
+    "peak_rss_kb is the peak of the process up to the end of the case.\n"
+    "convert times each RGB24 kernel and fails if its output differs from the scalar kernel.\n"
+    "simulcast encodes 3 layers of each resolution at a third of the bitrate each.\n"
+    "threads encodes each resolution with frame threads 1, 2, 4, 8 and auto, with and without WPP.\n"
+    "density runs the channels in real time at --fps with per instance and shared pools;\n"
+    "ms_* columns are arrival to encoded latencies and max_channels the most that kept up.\n"
+    "static runs each static_frame_policy: encode every picture, repeat the last converted\n"
+    "picture for an unchanged input, or drop unchanged pictures.\n"
+    "dirty compares full conversion and encoding with converting changed CTUs only and QP\n"
+    "offsets for the others, on a synthetic desktop or a screen capture given as Y4M.\n"
+    "planes converts synthetic RGB24 into packed and 64 byte padded arena planes and counts\n"
+    "heap allocations per frame after a warm up and arena allocations over reconnects.\n"
+    "hvc1 rewrites each access unit to length-prefixed NAL units in place with each start code\n"
+    "scanner and compares with a downstream remuxer that scans and copies every sample.\n"
+    "slices compares whole access units with one sample per slice group: ms_* columns are\n"
+    "arrival to last sample of a picture, the detail has arrival to first sample.\n"
+    "rtp packetizes the access units of hvc1 mode and sends them to a loopback receiver that\n"
+    "depacketizes them; it fails unless every access unit comes back bit-exact.\n"
+    "switch halves the resolution half way through, reopening the encoder at the switch or\n"
+    "switching to one opened in the background a second before; the detail has the stall.\n"
+    "startup starts channels one after another with encoders opened on demand or taken from a\n"
+    "pool filled beforehand; ms_* columns are the time from each start to its first access unit.\n";
+}
+
+static bool parseOptions(int argc, char** argv, BenchOptions& options)
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string sOption = argv[i];
+    if (i + 1 >= argc) return false;
+    const std::string sValue = argv[++i];
+    if (sOption == "--mode") options.sMode = sValue;
+    else if (sOption == "--input") options.sInput = sValue;
+    else if (sOption == "--format") options.sFormat = sValue;
+    else if (sOption == "--kernel") options.sKernel = sValue;
+    else if (sOption == "--frames") options.uiFrames = static_cast<unsigned>(atoi(sValue.c_str()));
+    else if (sOption == "--fps") options.uiFps = static_cast<unsigned>(atoi(sValue.c_str()));
+    else if (sOption == "--bitrate") options.uiBitrateKbps = static_cast<unsigned>(atoi(sValue.c_str()));
+    else if (sOption == "--idr-period") options.uiIdrPeriod = static_cast<unsigned>(atoi(sValue.c_str()));
+    else if (sOption == "--frame-threads") options.threading.uiFrameThreads = static_cast<unsigned>(atoi(sValue.c_str()));
+    else if (sOption == "--wpp") options.threading.bWpp = atoi(sValue.c_str()) != 0;
+    else if (sOption == "--pool-threads") options.threading.uiPoolThreads = static_cast<unsigned>(atoi(sValue.c_str()));
+    else if (sOption == "--numa-nodes") options.threading.sNumaNodes = sValue;
+    else if (sOption == "--shared-pool-threads") options.uiSharedPoolThreads = static_cast<unsigned>(atoi(sValue.c_str()));
+    else if (sOption == "--static-run") options.uiStaticRun = static_cast<unsigned>(atoi(sValue.c_str()));
+    else if (sOption == "--slice-max-bytes") options.uiSliceMaxBytes = static_cast<unsigned>(atoi(sValue.c_str()));
+    else if (sOption == "--rtp-packet-size") options.uiRtpPacketSize = static_cast<unsigned>(atoi(sValue.c_str()));
+    else if (sOption == "--starts") options.uiStarts = static_cast<unsigned>(atoi(sValue.c_str()));
+    else if (sOption == "--legacy-tolerance") options.uiLegacyTolerance = static_cast<unsigned>(atoi(sValue.c_str()));
+    else if (sOption == "--channels")
+    {
+      options.vChannels.clear();
+      std::istringstream counts(sValue);
+      std::string sCount;
+      while (std::getline(counts, sCount, ','))
+      {
+        const int iCount = atoi(sCount.c_str());
+        if (iCount <= 0) return false;
+        options.vChannels.push_back(static_cast<unsigned>(iCount));
+      }
+      if (options.vChannels.empty()) return false;
+    }
+    else if (sOption == "--csv") options.sCsv = sValue;
+    else if (sOption == "--baseline") options.sBaseline = sValue;
+    else if (sOption == "--threshold") options.dThresholdPct = atof(sValue.c_str());
+    else if (sOption == "--param")
+    {
+      const size_t uiPos = sValue.find('=');
+      if (uiPos == std::string::npos) return false;
+      options.vCodecParameters.push_back(std::make_pair(sValue.substr(0, uiPos), sValue.substr(uiPos + 1)));
+    }
+    else if (sOption == "--resolutions")
+    {
+      std::istringstream names(sValue);
+      std::string sName;
+      while (std::getline(names, sName, ','))
+      {
+        bool bFound = false;
+        for (const Resolution& resolution : RESOLUTIONS)
+        {
+          if (sName == resolution.szName)
+          {
+            options.vResolutions.push_back(resolution);
+            bFound = true;
+          }
+        }
+        if (!bFound) return false;
+      }
+    }
+    else return false;
+  }
+  if (options.vResolutions.empty())
+  {
+    options.vResolutions.assign(RESOLUTIONS, RESOLUTIONS + sizeof(RESOLUTIONS) / sizeof(RESOLUTIONS[0]));
+  }
+  return options.uiFrames > 0 && options.uiFps > 0 && options.uiStaticRun > 0 && options.uiSliceMaxBytes > 0 && options.uiStarts > 0 &&
+    options.uiRtpPacketSize >= 64 && options.uiRtpPacketSize <= 65535 &&
+    (options.sFormat == "rgb24" || options.sFormat == "i420") &&
+    (options.sMode == "encode" || options.sMode == "convert" || options.sMode == "idr" || options.sMode == "bitrate" ||
+    options.sMode == "simulcast" || options.sMode == "threads" || options.sMode == "density" || options.sMode == "static" || options.sMode == "dirty" ||
+    options.sMode == "planes" || options.sMode == "hvc1" || options.sMode == "slices" || options.sMode == "rtp" || options.sMode == "switch" ||
+    options.sMode == "startup");
+}
+
+int main(int argc, char** argv)
+{
+  BenchOptions options;
+  if (!parseOptions(argc, argv, options))
+  {
+    usage();
+    return 1;
+  }
+
+  // a Y4M file brings its own picture size and is already I420
+  std::unique_ptr<Y4mSource> pY4m;
+  if (options.sInput != "synthetic")
+  {
+    std::string sError;
+    pY4m.reset(new Y4mSource());
+    if (!pY4m->open(options.sInput, options.uiFrames, sError))
+    {
+      std::cerr << sError << std::endl;
+      return 1;
+    }
+    options.sFormat = "i420";
+    Resolution resolution = { "y4m", pY4m->getWidth(), pY4m->getHeight() };
+    options.vResolutions.assign(1, resolution);
+  }
+
+  std::ofstream csvFile;
+  if (!options.sCsv.empty())
+  {
+    csvFile.open(options.sCsv.c_str());
+    if (!csvFile)
+    {
+      std::cerr << "Cannot write " << options.sCsv << std::endl;
+      return 1;
+    }
+  }
+  std::ostream& out = options.sCsv.empty() ? std::cout : csvFile;
+  out << CSV_HEADER << std::endl;
+
+  std::vector<CaseResult> vResults;
+  for (const Resolution& resolution : options.vResolutions)
+  {
+    std::string sError;
+    std::vector<CaseResult> vCases;
+    bool bSuccess = false;
+    if (options.sMode == "convert")
+    {
+      bSuccess = runConvert(options, resolution.iWidth, resolution.iHeight, vCases, sError);
+    }
+    else if (options.sMode == "idr")
+    {
+      bSuccess = runIdr(options, resolution.iWidth, resolution.iHeight, pY4m.get(), vCases, sError);
+    }
+    else if (options.sMode == "density")
+    {
+      bSuccess = runDensity(options, resolution.iWidth, resolution.iHeight, pY4m.get(), vCases, sError);
+    }
+    else if (options.sMode == "threads")
+    {
+      bSuccess = runThreads(options, resolution.iWidth, resolution.iHeight, pY4m.get(), vCases, sError);
+    }
+    else if (options.sMode == "planes")
+    {
+      bSuccess = runPlanes(options, resolution.iWidth, resolution.iHeight, vCases, sError);
+    }
+    else if (options.sMode == "startup")
+    {
+      bSuccess = runStartup(options, resolution.iWidth, resolution.iHeight, pY4m.get(), vCases, sError);
+    }
+    else if (options.sMode == "switch")
+    {
+      bSuccess = runSwitch(options, resolution.iWidth, resolution.iHeight, pY4m.get(), vCases, sError);
+    }
+    else if (options.sMode == "rtp")
+    {
+      bSuccess = runRtp(options, resolution.iWidth, resolution.iHeight, pY4m.get(), vCases, sError);
+    }
+    else if (options.sMode == "slices")
+    {
+      bSuccess = runSlices(options, resolution.iWidth, resolution.iHeight, pY4m.get(), vCases, sError);
+    }
+    else if (options.sMode == "hvc1")
+    {
+      bSuccess = runHvc1(options, resolution.iWidth, resolution.iHeight, pY4m.get(), vCases, sError);
+    }
+    else if (options.sMode == "dirty")
+    {
+      bSuccess = runDirty(options, resolution.iWidth, resolution.iHeight, pY4m.get(), vCases, sError);
+    }
+    else if (options.sMode == "static")
+    {
+      bSuccess = runStatic(options, resolution.iWidth, resolution.iHeight, pY4m.get(), vCases, sError);
+    }
+    else if (options.sMode == "simulcast")
+    {
+      bSuccess = runSimulcast(options, resolution.iWidth, resolution.iHeight, pY4m.get(), vCases, sError);
+    }
+    else
+    {
+      CaseResult result;
+      bSuccess = options.sMode == "bitrate" ?
+        runBitrate(options, resolution.iWidth, resolution.iHeight, pY4m.get(), result, sError) :
+        runEncode(options, resolution.iWidth, resolution.iHeight, pY4m.get(), result, sError);
+      result.iWidth = resolution.iWidth;
+      result.iHeight = resolution.iHeight;
+      vCases.push_back(result);
+    }
+    if (!bSuccess)
+    {
+      std::cerr << resolution.szName << ": " << sError << std::endl;
+      return 1;
+    }
+    for (const CaseResult& result : vCases)
+    {
+      writeRow(out, result);
+      vResults.push_back(result);
+    }
+  }
+
+  if (options.sBaseline.empty())
+  {
+    return 0;
+  }
+  std::map<std::string, double> mBaselineFps;
+  if (!readBaseline(options.sBaseline, mBaselineFps))
+  {
+    std::cerr << "Cannot read baseline " << options.sBaseline << std::endl;
+    return 1;
+  }
+  int iRegressions = 0;
+  for (const CaseResult& result : vResults)
+  {
+    const std::string sKey = result.sCase + "@" + std::to_string(result.iWidth) + "x" + std::to_string(result.iHeight);
+    std::map<std::string, double>::const_iterator it = mBaselineFps.find(sKey);
+    if (it == mBaselineFps.end()) continue;
+    if (result.getFps() < it->second * (1.0 - options.dThresholdPct / 100.0))
+    {
+      std::cerr << "Regression: " << sKey << " " << result.getFps() << " fps, baseline " << it->second << " fps" << std::endl;
+      ++iRegressions;
+    }
+  }
+  return iRegressions ? 2 : 0;
+}
@@ -1,6 +1,10 @@
 #include "stdafx.h"
 #include "X265EncoderFilter.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <climits>
+#include <cstdio>
 #include <dvdmedia.h>
 #include <wmcodecdsp.h>
 #include <X265v2/X265v2.h>
@@ -9,14 +13,116 @@
 #include <CodecUtils/CodecConfigurationUtil.h>
 #include <CodecUtils/H265Util.h>
 #include <GeneralUtils/Conversion.h>
+#include "SharedEncoderPool.h"
+#include "SimdRgb24ToI420Converter.h"
+#include "SimulcastOutputPin.h"
+#include "StaticFrameDetector.h"
+#include "X265CodecParameters.h"
 
 const unsigned char g_startCode[] = { 0, 0, 0, 1};
 
+/**
+ * Parses a non-negative decimal that fits an int, the form of the filter's unsigned parameters
+ */
+static bool parseNonNegative(const char* szValue, int& iValue)
+{
+  char* pEnd = NULL;
+  const long lValue = strtol(szValue, &pEnd, 10);
+  if (pEnd == szValue || *pEnd != 0 || lValue < 0 || lValue > INT_MAX)
+  {
+    return false;
+  }
+  iValue = static_cast<int>(lValue);
+  return true;
+}
+
+/**
+ * Returns the type of the first VCL NAL unit of the Annex B or 4 byte length-prefixed access unit, -1 if there is none
+ */
+static int getFirstVclNalType(const BYTE* pData, long lLength, bool bLengthPrefixed)
+{
+  if (bLengthPrefixed)
+  {
+    long lPos = 0;
+    while (lPos + static_cast<long>(AnnexBRewriter::LENGTH_SIZE) < lLength)
+    {
+      const unsigned uiNalLength = (pData[lPos] << 24) | (pData[lPos + 1] << 16) | (pData[lPos + 2] << 8) | pData[lPos + 3];
+      lPos += AnnexBRewriter::LENGTH_SIZE;
+      const int iNalType = (pData[lPos] >> 1) & 0x3F;
+      if (iNalType < 32)
+      {
+        return iNalType;
+      }
+      if (uiNalLength > static_cast<unsigned long>(lLength - lPos))
+      {
+        break;
+      }
+      lPos += uiNalLength;
+    }
+    return -1;
+  }
+  for (long i = 0; i + 3 < lLength; ++i)
+  {
+    if (pData[i] == 0 && pData[i + 1] == 0 && pData[i + 2] == 1)
+    {
+      const int iNalType = (pData[i + 3] >> 1) & 0x3F;
+      if (iNalType < 32)
+      {
+        return iNalType;
+      }
+      i += 2;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Returns true if the first VCL NAL unit of the access unit is an IRAP picture
+ */
+static bool isRandomAccessPoint(const BYTE* pData, long lLength, bool bLengthPrefixed)
+{
+  // IRAP pictures are NAL types 16 to 23
+  const int iNalType = getFirstVclNalType(pData, lLength, bLengthPrefixed);
+  return iNalType >= 16 && iNalType <= 23;
+}
+
+// Stage names of the histograms, read as stats_<stage>_<statistic>
+const char* const STATS_STAGE_CONVERT_US = "convert_us";
+const char* const STATS_STAGE_ENCODE_US = "encode_us";
+const char* const STATS_STAGE_OUTPUT_BYTES = "output_bytes";
+const char* const STATS_STAGE_QUEUE_WAIT_US = "queue_wait_us";
+const char* const STATS_STAGE_SCALE_US = "scale_us";
+const char* const STATS_STAGE_STATIC_CHECK_US = "static_check_us";
+const char* const STATS_STAGES[] = { STATS_STAGE_CONVERT_US, STATS_STAGE_ENCODE_US, STATS_STAGE_OUTPUT_BYTES, STATS_STAGE_QUEUE_WAIT_US, STATS_STAGE_SCALE_US, STATS_STAGE_STATIC_CHECK_US };
+const char* const STATS_RESET = "stats_reset";
+
+typedef std::chrono::steady_clock StatsClock;
+
+/// RTP packets for an access unit of uiBitstreamSize bytes: FUs, plus single and aggregation packets of its other NAL units
+static unsigned toRtpRingSlots(size_t uiBitstreamSize, unsigned uiSlotSize)
+{
+  return static_cast<unsigned>(uiBitstreamSize / (uiSlotSize - H265RtpPacketizer::RTP_HEADER_SIZE - 3)) + 64;
+}
+
+static uint32_t elapsedUs(const StatsClock::time_point& tStart)
+{
+  return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(StatsClock::now() - tStart).count());
+}
+
 const REFERENCE_TIME FPS_25 = UNITS / 25;
+// codec pts are sample times, in units of 100ns
+const std::string DIRECTSHOW_TIMEBASE = "1/" + std::to_string(UNITS);
+const int64_t NO_CODEC_PTS = INT64_MIN;
 
 using vpp::boolToString;
 
 const unsigned MINIMUM_BUFFER_SIZE = 5024;
+// room for parameter sets and SEI on top of the picture data in the encoder's output buffer
+const unsigned BITSTREAM_HEADROOM = 64 * 1024;
+// oversized access units in flight downstream at a time before getOverflowSample() waits
+const long OVERFLOW_BUFFER_COUNT = 2;
+// codec parameter names GetParameter keeps track of beyond those the codec enumerates
+const size_t MAX_WATCHED_CODEC_PARAMETERS = 32;
 X265EncoderFilter::X265EncoderFilter()
   : CCustomBaseFilter(NAME("CSIR VPP X265 Encoder"), 0, CLSID_VPP_X265Encoder),
   m_pCodec(nullptr),
@@ -26,18 +132,117 @@ X265EncoderFilter::X265EncoderFilter()
   m_pPicParamSet(0),
   m_uiPicParamSetLen(0),
   m_uiIFramePeriod(0),
+  m_iPendingIFramePeriod(-1),
   m_uiCurrentFrame(0),
   m_uiTargetBitrate(0),
   m_rtFrameLength(FPS_25),
-  m_tStart(0),
-  m_tStop(m_rtFrameLength),
   m_pConverter(nullptr),
-  m_pYuvConversionBuffer(nullptr),
-  m_uiConversionBufferSize(0)
+  m_pSimdConverter(nullptr),
+  m_bSimdRgbConversion(true),
+  m_bConversionLargePages(false),
+  m_uiStatsPlaneAllocations(0),
+  m_eStaticFramePolicy(SFP_ENCODE),
+  m_uiLastConvertUs(0),
+  m_uiLastEncodeUs(0),
+  m_llStaticSavedUs(0),
+  m_uiStatsStaticFrames(0),
+  m_uiStatsStaticSavedMs(0),
+  m_bDirtyBlocks(false),
+  m_uiUnchangedCtuQpOffset(10),
+  m_bCodecCtuHints(false),
+  m_ullChangedCtus(0),
+  m_ullCtus(0),
+  m_uiStatsChangedCtusPct(0),
+  m_bCodecStridedInput(false),
+  m_uiSettingsGeneration(0),
+  m_bPrepareDone(true),
+  m_bOutputTypeChanged(false),
+  m_uiStatsFormatChanges(0),
+  m_uiStatsFormatChangesKept(0),
+  m_uiStatsEncoderOpenMs(0),
+  m_uiStatsFormatSwitchMs(0),
+  m_uiStatsFormatSwitchWaitMs(0),
+  m_uiEncoderPoolSize(0),
+  m_bStopWarming(false),
+  m_uiStatsEncoderPoolHits(0),
+  m_uiStatsEncoderPoolIdle(0),
+  m_bAsyncEncode(false),
+  m_uiAsyncQueueDepth(4),
+  m_bAsyncActive(false),
+  m_hrAsyncError(S_OK),
+  m_bSharedEncoderPool(false),
+  m_uiSharedPoolThreads(0),
+  m_uiPoolChannel(0),
+  m_bPoolChannelActive(false),
+  m_uiStatsSharedPoolThreads(0),
+  m_uiStatsDeadlineMisses(0),
+  m_bPresetControl(false),
+  m_uiCpuBudgetPct(80),
+  m_bPresetControlActive(false),
+  m_uiStatsPresetLevel(0),
+  m_uiStatsPresetSpeedups(0),
+  m_uiStatsPresetSlowdowns(0),
+  m_uiStatsPresetLastSwitchMs(0),
+  m_uiStatsEncodeLoadPct(0),
+  m_uiStatsQueueDepth(0),
+  m_uiStatsQueueWaitUs(0),
+  m_uiStatsQueueWaitMaxUs(0),
+  m_uiStatsFramesDropped(0),
+  m_iNextCodecPts(0),
+  m_iLastCodecPts(NO_CODEC_PTS),
+  m_llDecodeIndex(0),
+  m_bDiscontinuity(false),
+  m_uiStatsFramesPending(0),
+  m_uiIntraFrameSizeFactor(10),
+  m_pOverflowAllocator(NULL),
+  m_ullOutputBytes(0),
+  m_ullOutputFrames(0),
+  m_uiStatsOutputBufferSize(0),
+  m_uiStatsOutputBufferCount(0),
+  m_uiStatsOutputBufferWaste(0),
+  m_uiStatsOutputBufferRetries(0),
+  m_uiStatsOutputOverflowDrops(0),
+  m_iPendingBitrateKbps(0),
+  m_ullRecentBytes(0),
+  m_uiFramesSinceBitrateChange(0),
+  m_bBitrateConverging(false),
+  m_uiStatsOutputBitrateKbps(0),
+  m_uiStatsBitrateChanges(0),
+  m_uiStatsBitrateConvergenceFrames(0),
+  m_uiFrameBitLimit(0),
+  m_iPendingFrameBitLimit(-1),
+  m_uiStatsFrameBitLimitExceeded(0),
+  m_uiStatsLargestFrameBits(0),
+  m_uiSliceMaxBytes(0),
+  m_uiSlices(1),
+  m_uiStatsSlicesPerFrame(0),
+  m_uiStatsSlicesOversized(0),
+  m_uiRtpMaxPacketSize(1200),
+  m_uiRtpPayloadType(96),
+  m_uiStatsRtpPackets(0),
+  m_uiStatsRtpSendErrors(0),
+  m_uiStatsRtpRingOverflows(0),
+  m_sKeyframePolicy("gop"),
+  m_bIntraRefresh(false),
+  m_bCodecKeyframes(false),
+  m_uiStatsRefreshColumnEstimate(0),
+  m_uiStatsRefreshColumns(0),
+  m_uiStatsPeakToAveragePct(0),
+  m_bIdrRequested(false),
+  m_uiStatsIdrRequests(0),
+  m_uiStatsIdrForced(0),
+  m_uiStatsIdrRestarts(0),
+  m_bCodecParametersStale(false),
+  m_uiStatsFramesIntra(0),
+  m_uiStatsFramesReference(0),
+  m_uiStatsFramesNonReference(0),
+  m_uiStatsSimulcastLayers(0),
+  m_uiStatsSimulcastDrops(0)
 {
 	//Call the initialise input method to load all acceptable input types for this filter
 	InitialiseInputTypes();
 	initParameters();
+  EncoderInstancePool::getInstance().addUser();
   X265v2Factory factory;
 	m_pCodec = factory.GetCodecInstance();
 	// Set default codec properties 
@@ -53,11 +258,15 @@ X265EncoderFilter::X265EncoderFilter()
 
 X265EncoderFilter::~X265EncoderFilter()
 {
-  if (m_pYuvConversionBuffer)
-  {
-    delete[] m_pYuvConversionBuffer;
-    m_pYuvConversionBuffer = NULL;
-  }
+  stopWarmingEncoderPool();
+  discardPreparedEncoder();
+  // the open encoder is kept for the next filter if the pool has room
+  recycleEncoder();
+  if (m_retireThread.joinable()) m_retireThread.join();
+  // closes the idle encoders if this was the last filter
+  EncoderInstancePool::getInstance().removeUser();
+  destroySimulcastLayers();
+  FramePlaneArena::getInstance().release(m_conversionPlanes);
 
   if (m_pConverter)
   {
@@ -65,12 +274,13 @@ X265EncoderFilter::~X265EncoderFilter()
     m_pConverter = NULL;
   }
 
-	if (m_pCodec)
-	{
-		m_pCodec->Close();
-		X265v2Factory factory;
-		factory.ReleaseCodecInstance(m_pCodec);
-	}
+  if (m_pSimdConverter)
+  {
+    delete m_pSimdConverter;
+    m_pSimdConverter = NULL;
+  }
+
+  releaseOverflowAllocator(m_pOverflowAllocator);
 
   if (m_pSeqParamSet) delete[] m_pSeqParamSet; m_pSeqParamSet = NULL;
   if (m_pPicParamSet) delete[] m_pPicParamSet; m_pPicParamSet = NULL;
@@ -99,120 +309,666 @@ HRESULT X265EncoderFilter::SetMediaType( PIN_DIRECTION direction, const CMediaTy
 	HRESULT hr = CCustomBaseFilter::SetMediaType(direction, pmt);
 	if (direction == PINDIR_INPUT)
 	{
-    if (m_pConverter) delete m_pConverter;
-    if (m_pYuvConversionBuffer)
+    ASSERT(pmt->formattype == FORMAT_VideoInfo);
+    EncoderInput input;
+    if (!describeInput(pmt, input))
     {
-      delete[] m_pYuvConversionBuffer;
-      m_pYuvConversionBuffer = NULL;
+      return VFW_E_INVALIDMEDIATYPE;
     }
-
-    if (pmt->subtype == MEDIASUBTYPE_RGB24)
+    ++m_uiStatsFormatChanges;
+    {
+      CAutoLock lck(&m_csPrepare);
+      if (input == m_activeInput)
+      {
+        // e.g. a reconnect, or only rcTarget, dwBitRate or the aspect ratio changed
+        ++m_uiStatsFormatChangesKept;
+        DbgLog((LOG_TRACE, 0, TEXT("Input format change keeps the open encoder")));
+        return hr;
+      }
+    }
+    if (m_State != State_Stopped)
     {
-      // MERGE from VPP
-      // TODO: RTVC/artist code based has changed in mean-time.
-      // It seems like it defaults to 128 which is the desired value in any case
-      // TESTME/FIXME
-      m_pConverter = new RealRGB24toYUV420ConverterStl<uint8_t>(m_nInWidth, m_nInHeight, 128);
-      m_pConverter->SetFlip(true);
-      m_pConverter->SetChrominanceOffset(128);
+      return switchEncoder(input);
+    }
 
-      m_uiConversionBufferSize = static_cast<int>(m_nInWidth * m_nInHeight * 1.5);
-      m_pYuvConversionBuffer = new unsigned char[m_uiConversionBufferSize];
+    discardPreparedEncoder();
+    {
+      CAutoLock lck(&m_csPrepare);
+      m_activeInput = EncoderInput();
+    }
+    m_sEncoderProfile.clear();
+    applyInputFormat(input);
+    if (!configurePresetControl() || !configureStaticFrames() || !configureKeyframePolicy() || !configureSlices())
+    {
+      return E_INVALIDARG;
+    }
+    // VBV can only be enabled when the encoder is opened
+    m_iPendingFrameBitLimit = -1;
+    // reopened in place, which keeps the codec parameters set on it while stopped
+    PreparedEncoder encoder;
+    encoder.input = input;
+    encoder.pCodec = m_pCodec;
+    snapshotEncoderSettings(encoder);
+    if (FAILED(openEncoder(encoder, true)))
+    {
+      //Houston: we have a failure
+      m_pCodec = encoder.pCodec;
+      printf("%s\n", encoder.sError.c_str());
+      SetLastError(encoder.sError.c_str(), true);
+      return encoder.hr;
     }
+    installEncoder(encoder);
+    openSimulcastLayers();
+	}
+	return hr;
+}
+
+bool X265EncoderFilter::describeInput(const CMediaType* pmt, EncoderInput& input) const
+{
+  if (pmt->formattype != FORMAT_VideoInfo || pmt->cbFormat < sizeof(VIDEOINFOHEADER))
+  {
+    return false;
+  }
+  // biWidth is the row pitch of the buffer, rcSource the part of it that is the picture
+  const VIDEOINFOHEADER* pVih = (const VIDEOINFOHEADER*)pmt->pbFormat;
+  const BITMAPINFOHEADER& bmi = pVih->bmiHeader;
+  const RECT& rcSource = pVih->rcSource;
+  // variable frame rate sources may leave this at 0: their timestamps still reach the codec
+  input.rtFrameLength = pVih->AvgTimePerFrame > 0 ? pVih->AvgTimePerFrame : FPS_25;
+  if (pmt->subtype == MEDIASUBTYPE_RGB24)
+  {
+    input.layout = InputPictureLayout::forRgb24(bmi.biWidth, bmi.biHeight, rcSource.left, rcSource.top, rcSource.right, rcSource.bottom);
+  }
+  else
+  {
+    input.layout = InputPictureLayout::forI420(bmi.biWidth, bmi.biHeight, rcSource.left, rcSource.top, rcSource.right, rcSource.bottom);
+  }
+  input.uiSettingsGeneration = m_uiSettingsGeneration;
+  return true;
+}
 
-    // try close just in case
-    m_pCodec->Close();
+void X265EncoderFilter::applyInputFormat(const EncoderInput& input)
+{
+  if (m_pConverter) delete m_pConverter;
+  m_pConverter = NULL;
+  if (m_pSimdConverter) delete m_pSimdConverter;
+  m_pSimdConverter = NULL;
+  m_vPackedRgb.clear();
+  m_sRgbConversionKernel.clear();
+  // back to the arena, where the planes for the new format most likely come from again
+  FramePlaneArena::getInstance().release(m_conversionPlanes);
+  m_bConversionLargePages = false;
+
+  m_rtFrameLength = input.rtFrameLength;
+  m_inputLayout = input.layout;
+  // from here on the input dimensions are those of the visible picture
+  m_nInWidth = m_inputLayout.iWidth;
+  m_nInHeight = m_inputLayout.iHeight;
+  // the encoder writes here and access units are copied into right-sized output samples
+  m_vBitstreamBuffer.resize(m_inputLayout.getPackedI420Size() + BITSTREAM_HEADROOM);
+  if (m_rtpRing.getSlotSize() > 0)
+  {
+    // the ring has to take the largest access unit of the new format as well
+    m_rtpRing.grow(toRtpRingSlots(m_vBitstreamBuffer.size(), m_rtpRing.getSlotSize()));
+  }
+  m_sNalScanKernel = m_bAnnexB ? "" : AnnexBRewriter::toString(m_annexBRewriter.getInstructionSet());
 
-    // m_pCodec->SetParameter(D_IN_COLOUR, D_IN_COLOUR_YUV420P8);
-    m_pCodec->SetParameter(FILTER_PARAM_WIDTH, std::to_string(m_nInWidth).c_str());
-    m_pCodec->SetParameter(FILTER_PARAM_HEIGHT, std::to_string(m_nInHeight).c_str());
-    m_pCodec->SetParameter(FILTER_PARAM_FPS, "30");
-    m_pCodec->SetParameter(FILTER_PARAM_TARGET_BITRATE_KBPS, std::to_string(m_uiTargetBitrate).c_str());
-    m_pCodec->SetParameter("annexb", vpp::boolToString(m_bAnnexB).c_str());
-    // generate sequence and picture parameter sets
-#if 0
-    if (m_pSeqParamSet) delete[] m_pSeqParamSet; m_pSeqParamSet = NULL;
-    if (m_pPicParamSet) delete[] m_pPicParamSet; m_pPicParamSet = NULL;
+  const bool bRgb24 = m_inputLayout.eFormat == InputPictureLayout::FMT_RGB24;
+  if (bRgb24 && m_bSimdRgbConversion)
+  {
+    m_pSimdConverter = new SimdRgb24ToI420Converter(m_nInWidth, m_nInHeight);
+    m_pSimdConverter->setFlip(m_inputLayout.bBottomUp);
+    m_sRgbConversionKernel = SimdRgb24ToI420Converter::toString(m_pSimdConverter->getInstructionSet());
+  }
+  else if (bRgb24)
+  {
+    // MERGE from VPP
+    // TODO: RTVC/artist code based has changed in mean-time.
+    // It seems like it defaults to 128 which is the desired value in any case
+    // TESTME/FIXME
+    m_pConverter = new RealRGB24toYUV420ConverterStl<uint8_t>(m_nInWidth, m_nInHeight, 128);
+    m_pConverter->SetFlip(m_inputLayout.bBottomUp);
+    m_pConverter->SetChrominanceOffset(128);
+    // the VPP converter only reads whole packed DIBs: a cropped picture is repacked first
+    if (m_inputLayout.iWidth != m_inputLayout.iBufferWidth || m_inputLayout.iHeight != m_inputLayout.iBufferHeight)
+    {
+      m_vPackedRgb.resize(SimdRgb24ToI420Converter::getDibStride(m_nInWidth) * m_nInHeight);
+    }
+  }
+}
 
-    // set the selected parameter set numbers 
-    m_pCodec->SetParameter((char *)"seq param set",  "0");
-    m_pCodec->SetParameter((char *)"pic param set",  "0");
+void X265EncoderFilter::snapshotEncoderSettings(PreparedEncoder& encoder)
+{
+  EncoderSettings& settings = encoder.settings;
+  CAutoLock lck(&m_csControl);
+  settings.sKeyframePolicy = m_sKeyframePolicy;
+  settings.threading = m_threading;
+  settings.uiFrameBitLimit = m_uiFrameBitLimit;
+  settings.uiIFramePeriod = m_uiIFramePeriod;
+  settings.uiSliceMaxBytes = m_uiSliceMaxBytes;
+  settings.bAnnexB = m_bAnnexB;
+  settings.bPresetControlActive = m_bPresetControlActive;
+  settings.bDirtyBlocks = m_bDirtyBlocks;
+  settings.bSimdRgbConversion = m_bSimdRgbConversion;
+  settings.bSharedEncoderPool = m_bSharedEncoderPool;
+  settings.vCodecSettings = m_vCodecSettings;
+  encoder.uiBitrateKbps = m_uiTargetBitrate;
+  encoder.uiPresetLevel = m_presetController.getLevel();
+}
 
-    m_pCodec->SetParameter((char *)("generate param set on open"),  "0");
-    m_pCodec->SetParameter((char *)("picture coding type"),         "2");	///< Seq param set = H264V2_SEQ_PARAM.
-    m_pSeqParamSet = new unsigned char[100];
-    if(!m_pCodec->Code(NULL, m_pSeqParamSet, 100 * 8))
+HRESULT X265EncoderFilter::openEncoder(PreparedEncoder& encoder, bool bFromPool)
+{
+  const StatsClock::time_point tStart = StatsClock::now();
+  const InputPictureLayout& layout = encoder.input.layout;
+  const EncoderSettings& settings = encoder.settings;
+  encoder.sProfile = getEncoderProfile(encoder);
+  PooledEncoder pooled;
+  if (bFromPool && EncoderInstancePool::getInstance().acquire(encoder.sProfile, pooled))
+  {
+    encoder.pCodec = pooled.pCodec;
+    encoder.planes = pooled.planes;
+    encoder.bCodecStridedInput = pooled.bStridedInput;
+    encoder.bCodecKeyframes = pooled.bKeyframes;
+    encoder.bCodecCtuHints = pooled.bCtuHints;
+    encoder.sVps = pooled.sVps;
+    encoder.sSps = pooled.sSps;
+    encoder.sPps = pooled.sPps;
+    encoder.bFromPool = true;
+    encoder.uiOpenUs = elapsedUs(tStart);
+    return encoder.hr = S_OK;
+  }
+  if (!encoder.pCodec)
+  {
+    X265v2Factory factory;
+    encoder.pCodec = factory.GetCodecInstance();
+    if (!encoder.pCodec)
     {
-      if (m_pSeqParamSet) delete[] m_pSeqParamSet; m_pSeqParamSet = NULL;
-      SetLastError(m_pCodec->GetErrorStr(), true);
-      return hr;
+      encoder.sError = "Unable to create X265 Encoder from Factory.";
+      return encoder.hr = E_FAIL;
     }
-    else
+    // a new instance has none of the parameters set on the codec it replaces
+    for (const auto& param : settings.vCodecSettings)
     {
-      m_uiSeqParamSetLen = m_pCodec->GetCompressedByteLength();
-      m_pSeqParamSet[m_uiSeqParamSetLen] = 0;
-      m_sSeqParamSet = std::string((const char*)m_pSeqParamSet, m_uiSeqParamSetLen);
-      int nCheck = strlen((char*)m_pSeqParamSet);
+      encoder.pCodec->SetParameter(param.first.c_str(), param.second.c_str());
     }
+  }
+  ICodecv2* pCodec = encoder.pCodec;
+  // try close just in case
+  pCodec->Close();
+
+  // a preset replaces the settings made before it
+  if (settings.bPresetControlActive && !pCodec->SetParameter(CODEC_PARAM_PRESET, PresetController::toPreset(encoder.uiPresetLevel)))
+  {
+    encoder.sError = "The codec does not support presets.";
+    return encoder.hr = E_INVALIDARG;
+  }
+  // probe with an empty map, which the codec also takes for pictures without hints
+  encoder.bCodecCtuHints = settings.bDirtyBlocks && pCodec->SetParameter(CODEC_PARAM_IN_CTU_QP_OFFSETS, "");
+  // m_pCodec->SetParameter(D_IN_COLOUR, D_IN_COLOUR_YUV420P8);
+  setCodecFormat(pCodec, layout.iWidth, layout.iHeight, UNITS, encoder.input.rtFrameLength, encoder.uiBitrateKbps, settings.bAnnexB);
+  pCodec->SetParameter(CODEC_PARAM_TIMEBASE, DIRECTSHOW_TIMEBASE.c_str());
+  configureFrameBitLimit(pCodec, settings.uiFrameBitLimit, encoder.uiBitrateKbps);
+  if (!configureThreading(pCodec, settings, encoder.sError))
+  {
+    return encoder.hr = E_INVALIDARG;
+  }
 
-    m_pCodec->SetParameter((char *)("picture coding type"),	  "3");	///< Pic param set = H264V2_PIC_PARAM.
-    m_pPicParamSet = new unsigned char[100];
-    if(!m_pCodec->Code(NULL, m_pPicParamSet, 100 * 8))
+  // With intra refresh the key frame interval is the number of frames a refresh takes
+  const bool bIntraRefresh = settings.sKeyframePolicy == "intra_refresh";
+  encoder.bCodecKeyframes = pCodec->SetParameter(CODEC_PARAM_INTRA_REFRESH, bIntraRefresh ? "1" : "0");
+  if (settings.uiIFramePeriod)
+  {
+    encoder.bCodecKeyframes = pCodec->SetParameter(CODEC_PARAM_KEYINT, std::to_string(settings.uiIFramePeriod).c_str()) && encoder.bCodecKeyframes;
+  }
+  if (bIntraRefresh && !encoder.bCodecKeyframes)
+  {
+    encoder.sError = "The codec does not support intra refresh.";
+    return encoder.hr = E_INVALIDARG;
+  }
+  if (settings.uiSliceMaxBytes)
+  {
+    const unsigned uiSlices = toSliceCount(settings.uiSliceMaxBytes, encoder.uiBitrateKbps, UNITS, encoder.input.rtFrameLength, layout.iHeight);
+    if (!pCodec->SetParameter(CODEC_PARAM_SLICES, std::to_string(uiSlices).c_str()))
     {
-      if (m_pSeqParamSet) delete[] m_pSeqParamSet; m_pSeqParamSet = NULL;
-      if (m_pPicParamSet) delete[] m_pPicParamSet; m_pPicParamSet = NULL;
-      SetLastError(m_pCodec->GetErrorStr(), true);
-      return E_FAIL;
+      encoder.sError = "The codec does not support slices: " + std::string(pCodec->GetErrorStr());
+      return encoder.hr = E_INVALIDARG;
     }
-    else
+  }
+
+  bool bPlanes = true;
+  bool bPadded = false;
+  if (layout.eFormat == InputPictureLayout::FMT_I420)
+  {
+    encoder.bCodecStridedInput = configureCodecInputLayout(pCodec, layout);
+    // the codec only takes packed pictures: repack padded or cropped samples
+    bPlanes = !encoder.bCodecStridedInput && !layout.isPackedI420();
+  }
+  else
+  {
+    encoder.bCodecStridedInput = false;
+    // the legacy converter only writes packed pictures
+    bPadded = settings.bSimdRgbConversion;
+  }
+  if (bPlanes && !acquireConversionPlanes(pCodec, layout.iWidth, layout.iHeight, bPadded, encoder.planes))
+  {
+    encoder.sError = "Out of memory for the conversion buffer.";
+    return encoder.hr = E_OUTOFMEMORY;
+  }
+
+  if (!pCodec->Open())
+  {
+    encoder.sError = pCodec->GetErrorStr();
+    FramePlaneArena::getInstance().release(encoder.planes);
+    return encoder.hr = E_FAIL;
+  }
+  char szParamValue[256];
+  memset(szParamValue, 0, 256);
+  int nLenValue = 0;
+  pCodec->GetParameter("annexb_vps", &nLenValue, szParamValue);
+  encoder.sVps = std::string(szParamValue, nLenValue);
+  pCodec->GetParameter("annexb_sps", &nLenValue, szParamValue);
+  encoder.sSps = std::string(szParamValue, nLenValue);
+  pCodec->GetParameter("annexb_pps", &nLenValue, szParamValue);
+  encoder.sPps = std::string(szParamValue, nLenValue);
+  encoder.uiOpenUs = elapsedUs(tStart);
+  return encoder.hr = S_OK;
+}
+
+std::string X265EncoderFilter::getEncoderProfile(const PreparedEncoder& encoder)
+{
+  const InputPictureLayout& layout = encoder.input.layout;
+  const EncoderSettings& settings = encoder.settings;
+  std::string sProfile = std::to_string(layout.iWidth) + "x" + std::to_string(layout.iHeight) + "@" + std::to_string(encoder.uiBitrateKbps) +
+    " frame=" + std::to_string(encoder.input.rtFrameLength);
+  if (layout.eFormat == InputPictureLayout::FMT_I420)
+  {
+    // the codec may have been told to read the samples in place
+    sProfile += " i420=" + std::to_string(layout.iYStride) + "," + std::to_string(layout.iUvStride) + "," +
+      std::to_string(layout.uiUOffset - layout.uiYOffset) + "," + std::to_string(layout.uiVOffset - layout.uiYOffset);
+  }
+  else
+  {
+    // decides whether the conversion planes are padded
+    sProfile += std::string(" rgb24 simd=") + (settings.bSimdRgbConversion ? "1" : "0");
+  }
+  const CodecThreading& threading = settings.threading;
+  sProfile += " preset=" + (settings.bPresetControlActive ? std::to_string(encoder.uiPresetLevel) : std::string("-")) +
+    " annexb=" + (settings.bAnnexB ? "1" : "0") +
+    " vbv=" + std::to_string(settings.uiFrameBitLimit) +
+    " threads=" + std::to_string(threading.uiFrameThreads) + "," + (threading.bWpp ? "1" : "0") + "," +
+    std::to_string(threading.uiPoolThreads) + "," + threading.sNumaNodes + "," + (settings.bSharedEncoderPool ? "shared" : "own") +
+    " keyframes=" + settings.sKeyframePolicy + "," + std::to_string(settings.uiIFramePeriod) +
+    " slice_max_bytes=" + std::to_string(settings.uiSliceMaxBytes) +
+    " ctu_hints=" + (settings.bDirtyBlocks ? "1" : "0");
+  for (const auto& param : settings.vCodecSettings)
+  {
+    sProfile += " " + param.first + "=" + param.second;
+  }
+  return sProfile;
+}
+
+void X265EncoderFilter::installEncoder(PreparedEncoder& encoder)
+{
+  if (encoder.pCodec != m_pCodec)
+  {
+    recycleEncoder();
+    m_pCodec = encoder.pCodec;
+  }
+  encoder.pCodec = NULL;
+  m_sEncoderProfile = encoder.sProfile;
+  if (encoder.bFromPool)
+  {
+    ++m_uiStatsEncoderPoolHits;
+  }
+  m_uiStatsEncoderPoolIdle = EncoderInstancePool::getInstance().getIdleCount();
+  FramePlaneArena& arena = FramePlaneArena::getInstance();
+  arena.release(m_conversionPlanes);
+  m_conversionPlanes = encoder.planes;
+  encoder.planes = FramePlanes();
+  m_bConversionLargePages = m_conversionPlanes.bLargePages;
+  m_uiStatsPlaneAllocations = static_cast<unsigned>(arena.getAllocationCount());
+  m_bCodecStridedInput = encoder.bCodecStridedInput;
+  m_bCodecKeyframes = encoder.bCodecKeyframes;
+  m_bCodecCtuHints = encoder.bCodecCtuHints;
+  if (m_bDirtyBlocks && !m_bCodecCtuHints)
+  {
+    DbgLog((LOG_TRACE, 0, TEXT("The codec does not take CTU QP offsets: only the conversion is limited to changed CTUs")));
+  }
+  m_sVps = encoder.sVps;
+  m_sSps = encoder.sSps;
+  m_sPps = encoder.sPps;
+  m_uiStatsEncoderOpenMs = encoder.uiOpenUs / 1000;
+  if (encoder.uiBitrateKbps != m_uiTargetBitrate)
+  {
+    // the bitrate changed while the encoder was being opened: unless a newer one is pending
+    int iNone = 0;
+    m_iPendingBitrateKbps.compare_exchange_strong(iNone, static_cast<int>(m_uiTargetBitrate));
+  }
+  {
+    CAutoLock lck(&m_csPrepare);
+    m_activeInput = encoder.input;
+  }
+  publishCodecParameters();
+}
+
+void X265EncoderFilter::releaseEncoder(PreparedEncoder& encoder)
+{
+  FramePlaneArena::getInstance().release(encoder.planes);
+  if (encoder.pCodec)
+  {
+    encoder.pCodec->Close();
+    X265v2Factory factory;
+    factory.ReleaseCodecInstance(encoder.pCodec);
+    encoder.pCodec = NULL;
+  }
+}
+
+void X265EncoderFilter::retireCodec(ICodecv2* pCodec)
+{
+  if (m_retireThread.joinable()) m_retireThread.join();
+  if (!pCodec)
+  {
+    return;
+  }
+  m_retireThread = std::thread([pCodec]()
+  {
+    pCodec->Close();
+    X265v2Factory factory;
+    factory.ReleaseCodecInstance(pCodec);
+  });
+}
+
+void X265EncoderFilter::recycleEncoder()
+{
+  ICodecv2* pCodec = m_pCodec;
+  m_pCodec = NULL;
+  const std::string sProfile = m_sEncoderProfile;
+  m_sEncoderProfile.clear();
+  if (!pCodec)
+  {
+    return;
+  }
+  PreparedEncoder current;
+  {
+    CAutoLock lck(&m_csPrepare);
+    current.input = m_activeInput;
+  }
+  snapshotEncoderSettings(current);
+  // a bitrate, frame bit limit, keyframe period, preset or codec parameter applied while streaming changes the
+  // profile, as do settings that only take effect with the next encoder
+  const bool bUnchanged = !sProfile.empty() && current.input.layout.iWidth > 0 && m_iPendingBitrateKbps == 0 && m_iPendingFrameBitLimit < 0 &&
+    m_iPendingIFramePeriod < 0 &&
+    getEncoderProfile(current) == sProfile;
+  if (!bUnchanged || EncoderInstancePool::getInstance().getCapacity() == 0)
+  {
+    retireCodec(pCodec);
+    return;
+  }
+  PooledEncoder pooled;
+  pooled.pCodec = pCodec;
+  pooled.planes = m_conversionPlanes;
+  m_conversionPlanes = FramePlanes();
+  pooled.bStridedInput = m_bCodecStridedInput;
+  pooled.bKeyframes = m_bCodecKeyframes;
+  pooled.bCtuHints = m_bCodecCtuHints;
+  pooled.sVps = m_sVps;
+  pooled.sSps = m_sSps;
+  pooled.sPps = m_sPps;
+  if (m_retireThread.joinable()) m_retireThread.join();
+  m_retireThread = std::thread([pooled, sProfile]() mutable
+  {
+    // the next owner starts a new stream: drops the pictures and references of this one
+    pooled.pCodec->Restart();
+    EncoderInstancePool::getInstance().release(sProfile, pooled);
+  });
+}
+
+void X265EncoderFilter::prepareEncoder(const EncoderInput& input)
+{
+  CAutoLock lck(&m_csPrepare);
+  if (input == m_activeInput)
+  {
+    return;
+  }
+  if (m_prepareThread.joinable())
+  {
+    // the format of an earlier sample, or one still opening: the switch opens its own if it
+    // does not match rather than holding up the caller here
+    if (input == m_preparedEncoder.input || !m_bPrepareDone) return;
+    m_prepareThread.join();
+  }
+  releaseEncoder(m_preparedEncoder);
+  m_preparedEncoder = PreparedEncoder();
+  m_preparedEncoder.input = input;
+  snapshotEncoderSettings(m_preparedEncoder);
+  DbgLog((LOG_TRACE, 0, TEXT("Opening an encoder for %dx%d in the background"), input.layout.iWidth, input.layout.iHeight));
+  m_bPrepareDone = false;
+  m_prepareThread = std::thread([this]()
+  {
+    openEncoder(m_preparedEncoder, true);
+    m_bPrepareDone = true;
+  });
+}
+
+bool X265EncoderFilter::takePreparedEncoder(const EncoderInput& input, PreparedEncoder& encoder)
+{
+  CAutoLock lck(&m_csPrepare);
+  if (!m_prepareThread.joinable())
+  {
+    return false;
+  }
+  m_prepareThread.join();
+  if (!(input == m_preparedEncoder.input))
+  {
+    // upstream settled on another format, or the settings have changed since
+    releaseEncoder(m_preparedEncoder);
+    return false;
+  }
+  encoder = m_preparedEncoder;
+  m_preparedEncoder = PreparedEncoder();
+  return true;
+}
+
+void X265EncoderFilter::discardPreparedEncoder()
+{
+  CAutoLock lck(&m_csPrepare);
+  if (m_prepareThread.joinable()) m_prepareThread.join();
+  releaseEncoder(m_preparedEncoder);
+}
+
+HRESULT X265EncoderFilter::switchEncoder(const EncoderInput& input)
+{
+  const StatsClock::time_point tStart = StatsClock::now();
+  // the pictures of the old format that the encoder still holds go out first
+  flushEncoder(true, false);
+  PreparedEncoder encoder;
+  const StatsClock::time_point tWaitStart = StatsClock::now();
+  if (takePreparedEncoder(input, encoder))
+  {
+    m_uiStatsFormatSwitchWaitMs = elapsedUs(tWaitStart) / 1000;
+  }
+  else
+  {
+    // the sample with the new type was not queued ahead: encoding waits for the open
+    m_uiStatsFormatSwitchWaitMs = 0;
+    encoder.input = input;
+    snapshotEncoderSettings(encoder);
+    openEncoder(encoder, true);
+  }
+  if (SUCCEEDED(encoder.hr) && m_pOutput->IsConnected())
+  {
+    CMediaType mtOut;
+    if (FAILED(getOutputMediaType(&mtOut, input.layout.iWidth, input.layout.iHeight, encoder.sVps, encoder.sSps, encoder.sPps)) ||
+      m_pOutput->GetConnected()->QueryAccept(&mtOut) != S_OK)
+    {
+      encoder.sError = "Downstream does not accept " + std::to_string(input.layout.iWidth) + "x" + std::to_string(input.layout.iHeight) + " output.";
+      encoder.hr = VFW_E_TYPE_NOT_ACCEPTED;
+    }
+  }
+  if (FAILED(encoder.hr))
+  {
+    releaseEncoder(encoder);
     {
-      m_uiPicParamSetLen = m_pCodec->GetCompressedByteLength();
-      m_pPicParamSet[m_uiPicParamSetLen] = 0;
-      m_sPicParamSet = std::string((const char*)m_pPicParamSet, m_uiPicParamSetLen);
-      int nCheck = strlen((char*)m_pPicParamSet);
+      // the drained encoder takes pictures of the old format again
+      CAutoLock lck(&m_csCodec);
+      restartEncoder();
     }
+    SetLastError(encoder.sError.c_str(), true);
+    return encoder.hr;
+  }
 
-    // RG: copied from codec anayser, do we need this?
-    // reset codec for standard operation
-    m_pCodec->SetParameter((char *)("picture coding type"),	  "0");	///< I-frame = H264V2_INTRA.
-    m_pCodec->SetParameter((char *)("generate param set on open"),  "1");
+  {
+    CAutoLock lck(&m_csCodec);
+    applyInputFormat(input);
+    if (!configureStaticFrames() || !configureKeyframePolicy() || !configureSlices())
+    {
+      // the old encoder cannot take the new pictures either
+      releaseEncoder(encoder);
+      retireCodec(m_pCodec);
+      m_pCodec = NULL;
+      m_sEncoderProfile.clear();
+      CAutoLock lckPrepare(&m_csPrepare);
+      m_activeInput = EncoderInput();
+      return E_INVALIDARG;
+    }
+    installEncoder(encoder);
+    m_bOutputTypeChanged = true;
+    if (!m_vLayers.empty())
+    {
+      // the layers scale from the new input size
+      openSimulcastLayers();
+    }
+  }
+  m_uiStatsFormatSwitchMs = elapsedUs(tStart) / 1000;
+  DbgLog((LOG_TRACE, 0, TEXT("Switched to %dx%d in %u ms, %u ms of it waiting for the encoder"), m_nInWidth, m_nInHeight, m_uiStatsFormatSwitchMs, m_uiStatsFormatSwitchWaitMs));
+  return S_OK;
+}
 
-		if (!m_pCodec->Open())
-		{
-			//Houston: we have a failure
-			char* szErrorStr = m_pCodec->GetErrorStr();
-			printf("%s\n", szErrorStr);
-			SetLastError(szErrorStr, true);
-      return E_FAIL;
-		}
-#else
-    if (!m_pCodec->Open())
+/**
+ * Parses encoder_pool_profiles: WIDTHxHEIGHT@KBPS entries separated by commas, each optionally
+ * followed by /FPS and by :rgb24 for RGB24 input. The default is I420 at the filter's frame rate.
+ */
+static bool parseEncoderPoolProfiles(const std::string& sProfiles, std::vector<InputPictureLayout>& vLayouts, std::vector<std::pair<unsigned, unsigned> >& vRates)
+{
+  size_t uiStart = 0;
+  while (uiStart < sProfiles.length())
+  {
+    size_t uiEnd = sProfiles.find(',', uiStart);
+    if (uiEnd == std::string::npos) uiEnd = sProfiles.length();
+    std::string sProfile = sProfiles.substr(uiStart, uiEnd - uiStart);
+    bool bRgb24 = false;
+    const size_t uiColon = sProfile.find(':');
+    if (uiColon != std::string::npos)
     {
-      //Houston: we have a failure
-      char* szErrorStr = m_pCodec->GetErrorStr();
-      printf("%s\n", szErrorStr);
-      SetLastError(szErrorStr, true);
-      return E_FAIL;
+      if (sProfile.compare(uiColon, std::string::npos, ":rgb24") != 0) return false;
+      bRgb24 = true;
+      sProfile.resize(uiColon);
     }
-    else
+    int iWidth = 0, iHeight = 0, iRead = 0;
+    unsigned uiBitrateKbps = 0, uiFps = 0;
+    if (sscanf(sProfile.c_str(), "%dx%d@%u%n", &iWidth, &iHeight, &uiBitrateKbps, &iRead) != 3 ||
+      iWidth <= 0 || iHeight <= 0 || uiBitrateKbps == 0 || (iWidth & 1) || (iHeight & 1))
+    {
+      return false;
+    }
+    if (static_cast<size_t>(iRead) < sProfile.length())
     {
-      char szParamValue[256];
-      memset(szParamValue, 0, 256);
-      int nLenName = 0, nLenValue = 0;
-      // Now get the value
-      int res = m_pCodec->GetParameter("annexb_vps", &nLenValue, szParamValue);
-      m_sVps = std::string(szParamValue, nLenValue);
-      res = m_pCodec->GetParameter("annexb_sps", &nLenValue, szParamValue);
-      m_sSps = std::string(szParamValue, nLenValue);
-      res = m_pCodec->GetParameter("annexb_pps", &nLenValue, szParamValue);
-      m_sPps = std::string(szParamValue, nLenValue);
+      int iFpsRead = 0;
+      if (sscanf(sProfile.c_str() + iRead, "/%u%n", &uiFps, &iFpsRead) != 1 || uiFps == 0 ||
+        static_cast<size_t>(iRead + iFpsRead) != sProfile.length())
+      {
+        return false;
+      }
     }
+    // laid out as a source of the format would deliver it
+    vLayouts.push_back(bRgb24 ? InputPictureLayout::forRgb24(iWidth, iHeight, 0, 0, 0, 0) : InputPictureLayout::forI420(iWidth, iHeight, 0, 0, 0, 0));
+    vRates.push_back(std::make_pair(uiBitrateKbps, uiFps));
+    uiStart = uiEnd + 1;
+  }
+  return true;
+}
 
-    // TODO: now read parameter sets
+bool X265EncoderFilter::configureEncoderPool(bool bCapacity)
+{
+  std::vector<InputPictureLayout> vLayouts;
+  std::vector<std::pair<unsigned, unsigned> > vRates;
+  if (!parseEncoderPoolProfiles(m_sEncoderPoolProfiles, vLayouts, vRates))
+  {
+    SetLastError(("Invalid encoder_pool_profiles: " + m_sEncoderPoolProfiles + ". Use WIDTHxHEIGHT@KBPS[/FPS][:rgb24] separated by commas.").c_str(), true);
+    return false;
+  }
+  stopWarmingEncoderPool();
+  EncoderInstancePool& pool = EncoderInstancePool::getInstance();
+  if (bCapacity)
+  {
+    // process-wide: the last filter to set it wins
+    pool.setCapacity(m_uiEncoderPoolSize);
+  }
+  m_uiStatsEncoderPoolIdle = pool.getIdleCount();
+  if (vLayouts.empty() || pool.getCapacity() == 0 || m_State != State_Stopped)
+  {
+    return true;
+  }
+  // the encoders are opened with the settings made so far and the preset preset_control starts at
+  if (!configurePresetControl())
+  {
+    return false;
+  }
+  // the warm thread reads nothing of the filter but m_bStopWarming
+  PreparedEncoder prototype;
+  prototype.input.rtFrameLength = m_rtFrameLength;
+  snapshotEncoderSettings(prototype);
+  m_bStopWarming = false;
+  m_warmThread = std::thread(&X265EncoderFilter::warmEncoderPool, this, m_sEncoderPoolProfiles, prototype);
+  return true;
+}
 
-#endif
-	}
-	return hr;
+void X265EncoderFilter::warmEncoderPool(std::string sProfiles, PreparedEncoder prototype)
+{
+  std::vector<InputPictureLayout> vLayouts;
+  std::vector<std::pair<unsigned, unsigned> > vRates;
+  parseEncoderPoolProfiles(sProfiles, vLayouts, vRates);
+  EncoderInstancePool& pool = EncoderInstancePool::getInstance();
+  const unsigned uiShare = (std::max)(pool.getCapacity() / static_cast<unsigned>(vLayouts.size()), 1u);
+  for (size_t i = 0; i < vLayouts.size() && !m_bStopWarming; ++i)
+  {
+    PreparedEncoder encoder = prototype;
+    encoder.input.layout = vLayouts[i];
+    if (vRates[i].second) encoder.input.rtFrameLength = UNITS / vRates[i].second;
+    encoder.uiBitrateKbps = vRates[i].first;
+    const std::string sProfile = getEncoderProfile(encoder);
+    for (unsigned uiIdle = pool.getIdleCount(sProfile); uiIdle < uiShare && !m_bStopWarming; ++uiIdle)
+    {
+      if (FAILED(openEncoder(encoder, false)))
+      {
+        DbgLog((LOG_TRACE, 0, TEXT("Cannot open an encoder for the pool: %s"), encoder.sError.c_str()));
+        releaseEncoder(encoder);
+        return;
+      }
+      PooledEncoder pooled;
+      pooled.pCodec = encoder.pCodec;
+      pooled.planes = encoder.planes;
+      pooled.bStridedInput = encoder.bCodecStridedInput;
+      pooled.bKeyframes = encoder.bCodecKeyframes;
+      pooled.bCtuHints = encoder.bCodecCtuHints;
+      pooled.sVps = encoder.sVps;
+      pooled.sSps = encoder.sSps;
+      pooled.sPps = encoder.sPps;
+      encoder.pCodec = NULL;
+      encoder.planes = FramePlanes();
+      if (!pool.release(sProfile, pooled))
+      {
+        // filled up by other filters meanwhile
+        return;
+      }
+    }
+  }
+}
+
+void X265EncoderFilter::stopWarmingEncoderPool()
+{
+  m_bStopWarming = true;
+  if (m_warmThread.joinable()) m_warmThread.join();
 }
 
 HRESULT X265EncoderFilter::GetMediaType( int iPosition, CMediaType *pMediaType )
@@ -223,6 +979,13 @@ HRESULT X265EncoderFilter::GetMediaType( int iPosition, CMediaType *pMediaType )
 	}
 	else if (iPosition == 0)
 	{
+    return getOutputMediaType(pMediaType, m_nInWidth, m_nInHeight, m_sVps, m_sSps, m_sPps);
+	}
+	return VFW_S_NO_MORE_ITEMS;
+}
+
+HRESULT X265EncoderFilter::getOutputMediaType(CMediaType* pMediaType, int iWidth, int iHeight, const std::string& sVps, const std::string& sSps, const std::string& sPps)
+{
     //if (m_nH264Type == H264_VPP)
     //{
     //  // Get the input pin's media type and return this as the output media type - we want to retain
@@ -310,16 +1073,16 @@ HRESULT X265EncoderFilter::GetMediaType( int iPosition, CMediaType *pMediaType )
     pvi2->bmiHeader.biBitCount = 24;
     pvi2->bmiHeader.biSize = 40;
     pvi2->bmiHeader.biPlanes = 1;
-    pvi2->bmiHeader.biWidth = m_nInWidth;
-    pvi2->bmiHeader.biHeight = m_nInHeight;
+    pvi2->bmiHeader.biWidth = iWidth;
+    pvi2->bmiHeader.biHeight = iHeight;
     pvi2->bmiHeader.biSizeImage = DIBSIZE(pvi2->bmiHeader);
     pvi2->bmiHeader.biCompression = DWORD('1cvh');
     const REFERENCE_TIME FPS_25 = UNITS / 25;
     pvi2->AvgTimePerFrame = FPS_25;
-    SetRect(&pvi2->rcSource, 0, 0, m_nInWidth, m_nInHeight);
+    SetRect(&pvi2->rcSource, 0, 0, iWidth, iHeight);
     pvi2->rcTarget = pvi2->rcSource;
-    pvi2->dwPictAspectRatioX = m_nInWidth;
-    pvi2->dwPictAspectRatioY = m_nInHeight;
+    pvi2->dwPictAspectRatioX = iWidth;
+    pvi2->dwPictAspectRatioY = iHeight;
 #else
     if (m_bAnnexB)
     {
@@ -358,9 +1121,9 @@ HRESULT X265EncoderFilter::GetMediaType( int iPosition, CMediaType *pMediaType )
       pvi2->bmiHeader.biBitCount = 24;
       pvi2->bmiHeader.biSize = 40;
       pvi2->bmiHeader.biPlanes = 1;
-      pvi2->bmiHeader.biWidth = m_nInWidth;
-      pvi2->bmiHeader.biHeight = m_nInHeight;
-      pvi2->bmiHeader.biSize = m_nInWidth * m_nInHeight * 3;
+      pvi2->bmiHeader.biWidth = iWidth;
+      pvi2->bmiHeader.biHeight = iHeight;
+      pvi2->bmiHeader.biSize = iWidth * iHeight * 3;
       pvi2->bmiHeader.biSizeImage = DIBSIZE(pvi2->bmiHeader);
       pvi2->bmiHeader.biCompression = DWORD('1cvh');
       //pvi2->AvgTimePerFrame = m_tFrame;
@@ -368,11 +1131,11 @@ HRESULT X265EncoderFilter::GetMediaType( int iPosition, CMediaType *pMediaType )
       const REFERENCE_TIME FPS_25 = UNITS / 25;
       pvi2->AvgTimePerFrame = FPS_25;
       //SetRect(&pvi2->rcSource, 0, 0, m_cx, m_cy);
-      SetRect(&pvi2->rcSource, 0, 0, m_nInWidth, m_nInHeight);
+      SetRect(&pvi2->rcSource, 0, 0, iWidth, iHeight);
       pvi2->rcTarget = pvi2->rcSource;
 
-      pvi2->dwPictAspectRatioX = m_nInWidth;
-      pvi2->dwPictAspectRatioY = m_nInHeight;
+      pvi2->dwPictAspectRatioX = iWidth;
+      pvi2->dwPictAspectRatioY = iHeight;
 #else
 #if 0
       pMediaType->SetFormatType(&FORMAT_VideoInfo2);
@@ -381,9 +1144,9 @@ HRESULT X265EncoderFilter::GetMediaType( int iPosition, CMediaType *pMediaType )
       pvi2->bmiHeader.biBitCount = 24;
       pvi2->bmiHeader.biSize = 40;
       pvi2->bmiHeader.biPlanes = 1;
-      pvi2->bmiHeader.biWidth = m_nInWidth;
-      pvi2->bmiHeader.biHeight = m_nInHeight;
-      pvi2->bmiHeader.biSize = m_nInWidth * m_nInHeight * 3;
+      pvi2->bmiHeader.biWidth = iWidth;
+      pvi2->bmiHeader.biHeight = iHeight;
+      pvi2->bmiHeader.biSize = iWidth * iHeight * 3;
       pvi2->bmiHeader.biSizeImage = DIBSIZE(pvi2->bmiHeader);
       pvi2->bmiHeader.biCompression = DWORD('1cvh');
       //pvi2->AvgTimePerFrame = m_tFrame;
@@ -391,11 +1154,11 @@ HRESULT X265EncoderFilter::GetMediaType( int iPosition, CMediaType *pMediaType )
       const REFERENCE_TIME FPS_25 = UNITS / 25;
       pvi2->AvgTimePerFrame = FPS_25;
       //SetRect(&pvi2->rcSource, 0, 0, m_cx, m_cy);
-      SetRect(&pvi2->rcSource, 0, 0, m_nInWidth, m_nInHeight);
+      SetRect(&pvi2->rcSource, 0, 0, iWidth, iHeight);
       pvi2->rcTarget = pvi2->rcSource;
 
-      pvi2->dwPictAspectRatioX = m_nInWidth;
-      pvi2->dwPictAspectRatioY = m_nInHeight;
+      pvi2->dwPictAspectRatioX = iWidth;
+      pvi2->dwPictAspectRatioY = iHeight;
 #else
       //VIDEOINFOHEADER* pvi2 = (VIDEOINFOHEADER*)pMediaType->AllocFormatBuffer(sizeof(VIDEOINFOHEADER));
       // ZeroMemory(pvi2, sizeof(VIDEOINFOHEADER));
@@ -405,12 +1168,16 @@ HRESULT X265EncoderFilter::GetMediaType( int iPosition, CMediaType *pMediaType )
       pvi->bmiHeader.biBitCount = 24;
       pvi->bmiHeader.biSize = 40;
       pvi->bmiHeader.biPlanes = 1;
-      pvi->bmiHeader.biWidth = m_nInWidth;
-      pvi->bmiHeader.biHeight = m_nInHeight;
+      pvi->bmiHeader.biWidth = iWidth;
+      pvi->bmiHeader.biHeight = iHeight;
       pvi->bmiHeader.biSizeImage = DIBSIZE(pvi->bmiHeader);
       pMediaType->SetSampleSize(DIBSIZE(pvi->bmiHeader));
+      // the input's rectangles describe the input buffer, not the encoded picture
+      SetRect(&pvi->rcSource, 0, 0, iWidth, iHeight);
+      pvi->rcTarget = pvi->rcSource;
       pvi->bmiHeader.biCompression = DWORD('1cvh');
       //pvi->bmiHeader.biCompression = BI_RGB;
+      pvi->AvgTimePerFrame = m_rtFrameLength;
 
       // assert(inputMediaType.FormatType == FORMAT_VideoInfo);
       // copy original FPS
@@ -422,30 +1189,30 @@ HRESULT X265EncoderFilter::GetMediaType( int iPosition, CMediaType *pMediaType )
       //const REFERENCE_TIME FPS_25 = UNITS / 25;
       //pvi2->AvgTimePerFrame = FPS_25;
       ////SetRect(&pvi2->rcSource, 0, 0, m_cx, m_cy);
-      //SetRect(&pvi2->rcSource, 0, 0, m_nInWidth, m_nInHeight);
+      //SetRect(&pvi2->rcSource, 0, 0, iWidth, iHeight);
       //pvi2->rcTarget = pvi2->rcSource;
 
       // Store SPS and PPS in media format header
       int nCurrentFormatBlockSize = pMediaType->cbFormat;
-      if (!m_sVps.empty())
+      if (!sVps.empty())
       // if (m_uiSeqParamSetLen + m_uiPicParamSetLen > 0)
       {
         // old size + one int to store size of SPS/PPS + SPS/PPS/prepended by start codes
-        int iAdditionalLength = sizeof(int) + m_sVps.length() + m_sSps.length() + m_sPps.length();
+        int iAdditionalLength = sizeof(int) + sVps.length() + sSps.length() + sPps.length();
         int nNewSize = nCurrentFormatBlockSize + iAdditionalLength;
         pMediaType->ReallocFormatBuffer(nNewSize);
         pMediaType->cbFormat = nCurrentFormatBlockSize + iAdditionalLength;
         BYTE* pFormat = pMediaType->Format();
         BYTE* pStartPos = &(pFormat[nCurrentFormatBlockSize]);
         // copy VPS
-        memcpy(pStartPos, m_sVps.c_str(), m_sVps.length());
-        pStartPos += m_sVps.length();
+        memcpy(pStartPos, sVps.c_str(), sVps.length());
+        pStartPos += sVps.length();
         // copy SPS
-        memcpy(pStartPos, m_sSps.c_str(), m_sSps.length());
-        pStartPos += m_sSps.length();
+        memcpy(pStartPos, sSps.c_str(), sSps.length());
+        pStartPos += sSps.length();
         // copy PPS
-        memcpy(pStartPos, m_sPps.c_str(), m_sPps.length());
-        pStartPos += m_sPps.length();
+        memcpy(pStartPos, sPps.c_str(), sPps.length());
+        pStartPos += sPps.length();
         // Copy additional header size
         memcpy(pStartPos, &iAdditionalLength, sizeof(int));
       }
@@ -467,62 +1234,49 @@ HRESULT X265EncoderFilter::GetMediaType( int iPosition, CMediaType *pMediaType )
       pMediaType->SetSubtype(&MEDIASUBTYPE_HVC1);
       pMediaType->SetFormatType(&FORMAT_MPEG2Video);
 
-#if 0
-      ASSERT(m_uiSeqParamSetLen > 0 && m_uiPicParamSetLen > 0);
-
-      // ps have start codes: for this media type we replace each start code with 2 byte lenght prefix
-      int psLen = m_uiSeqParamSetLen + m_uiPicParamSetLen - 4;
-#else
-      int psLen = 0;
-#endif
+      // the sequence header carries the hvcC record once the codec has produced parameter sets
+      std::string sHvcc;
+      unsigned uiProfile = 0, uiLevel = 0;
+      if (!AnnexBRewriter::buildHvcc(sVps, sSps, sPps, sHvcc, uiProfile, uiLevel))
+      {
+        sHvcc.clear();
+      }
+      const int psLen = static_cast<int>(sHvcc.length());
       BYTE* pFormatBuffer = pMediaType->AllocFormatBuffer(sizeof(MPEG2VIDEOINFO) + psLen);
       MPEG2VIDEOINFO* pMpeg2Vih = (MPEG2VIDEOINFO*)pFormatBuffer;
 
       ZeroMemory(pMpeg2Vih, sizeof(MPEG2VIDEOINFO) + psLen);
 
-      pMpeg2Vih->dwFlags = 4;
-      pMpeg2Vih->dwProfile = 66;
-      pMpeg2Vih->dwLevel = 20;
-
+      // size of the NAL unit length prefix
+      pMpeg2Vih->dwFlags = AnnexBRewriter::LENGTH_SIZE;
+      pMpeg2Vih->dwProfile = uiProfile;
+      pMpeg2Vih->dwLevel = uiLevel;
       pMpeg2Vih->cbSequenceHeader = psLen;
-      int iCurPos = 0;
-
       BYTE* pSequenceHeader = (BYTE*)&pMpeg2Vih->dwSequenceHeader[0];
-#if 0
-      // parameter set length includes start code
-      pSequenceHeader[iCurPos] = ((m_uiSeqParamSetLen - 4) >> 8);
-      pSequenceHeader[iCurPos + 1] = ((m_uiSeqParamSetLen - 4) & 0xFF);
-      memcpy(pSequenceHeader + iCurPos + 2, m_pSeqParamSet + 4, m_uiSeqParamSetLen - 4);
-      iCurPos += m_uiSeqParamSetLen - 4 + 2;
-      pSequenceHeader[iCurPos] = ((m_uiPicParamSetLen - 4) >> 8);
-      pSequenceHeader[iCurPos + 1] = ((m_uiPicParamSetLen - 4) & 0xFF);
-      memcpy(pSequenceHeader + iCurPos + 2, m_pPicParamSet + 4, m_uiPicParamSetLen - 4);
-#endif
+      if (psLen > 0)
+      {
+        memcpy(pSequenceHeader, sHvcc.data(), psLen);
+      }
 
       VIDEOINFOHEADER2* pvi2 = &pMpeg2Vih->hdr;
       pvi2->bmiHeader.biBitCount = 24;
       pvi2->bmiHeader.biSize = 40;
       pvi2->bmiHeader.biPlanes = 1;
-      pvi2->bmiHeader.biWidth = m_nInWidth;
-      pvi2->bmiHeader.biHeight = m_nInHeight;
+      pvi2->bmiHeader.biWidth = iWidth;
+      pvi2->bmiHeader.biHeight = iHeight;
       pvi2->bmiHeader.biSizeImage = DIBSIZE(pvi2->bmiHeader);
       pvi2->bmiHeader.biCompression = DWORD('1cvh');
-      //pvi2->AvgTimePerFrame = m_tFrame;
-      //pvi2->AvgTimePerFrame = 1000000;
-      const REFERENCE_TIME FPS_25 = UNITS / 25;
-      pvi2->AvgTimePerFrame = FPS_25;
+      pvi2->AvgTimePerFrame = m_rtFrameLength;
       //SetRect(&pvi2->rcSource, 0, 0, m_cx, m_cy);
-      SetRect(&pvi2->rcSource, 0, 0, m_nInWidth, m_nInHeight);
+      SetRect(&pvi2->rcSource, 0, 0, iWidth, iHeight);
       pvi2->rcTarget = pvi2->rcSource;
 
-      pvi2->dwPictAspectRatioX = m_nInWidth;
-      pvi2->dwPictAspectRatioY = m_nInHeight;
+      pvi2->dwPictAspectRatioX = iWidth;
+      pvi2->dwPictAspectRatioY = iHeight;
     }
 #endif
 
-    return S_OK;
-	}
-	return VFW_S_NO_MORE_ITEMS;
+  return S_OK;
 }
 
 HRESULT X265EncoderFilter::DecideBufferSize( IMemAllocator *pAlloc, ALLOCATOR_PROPERTIES *pProp )
@@ -572,11 +1326,11 @@ HRESULT X265EncoderFilter::DecideBufferSize( IMemAllocator *pAlloc, ALLOCATOR_PR
   //}
 #else
     ASSERT(mt.formattype == FORMAT_VideoInfo);
-    BITMAPINFOHEADER *pbmi = HEADER(mt.pbFormat);
-    //TOREVISE: Should actually change mode and see what the maximum size is per frame?
-    pProp->cbBuffer = DIBSIZE(*pbmi);
   }
 #endif
+  // size for the largest expected access unit rather than an uncompressed frame:
+  // a frame that does not fit is delivered in a sample of getOverflowSample()
+  pProp->cbBuffer = getEstimatedOutputBufferSize();
 	if (pProp->cbAlign == 0)
 	{
 		pProp->cbAlign = 1;
@@ -585,6 +1339,11 @@ HRESULT X265EncoderFilter::DecideBufferSize( IMemAllocator *pAlloc, ALLOCATOR_PR
 	{
 		pProp->cBuffers = 1;
 	}
+  if (m_uiSliceMaxBytes)
+  {
+    // the slices of a picture go out back to back: do not wait for downstream to release each
+    pProp->cBuffers = (std::max)(pProp->cBuffers, static_cast<long>(m_uiSlices) + 1);
+  }
 	// Release the format block.
 	FreeMediaType(mt);
 
@@ -600,9 +1359,145 @@ HRESULT X265EncoderFilter::DecideBufferSize( IMemAllocator *pAlloc, ALLOCATOR_PR
 	{
 		return E_FAIL;
 	}
+  m_uiStatsOutputBufferSize = Actual.cbBuffer;
+  m_uiStatsOutputBufferCount = Actual.cBuffers;
 	return S_OK;
 }
 
+unsigned X265EncoderFilter::getEstimatedOutputBufferSize() const
+{
+  const unsigned uiParameterSets = static_cast<unsigned>(m_sVps.length() + m_sSps.length() + m_sPps.length());
+  return getEstimatedOutputBufferSize(m_uiTargetBitrate, uiParameterSets, m_vBitstreamBuffer.size());
+}
+
+unsigned X265EncoderFilter::getEstimatedOutputBufferSize(unsigned uiBitrateKbps, unsigned uiParameterSets, size_t uiBitstreamBufferSize) const
+{
+  // average access unit at the target bitrate, scaled for intra frames
+  const double dFrameDuration = static_cast<double>(m_rtFrameLength) / UNITS;
+  const double dAverageFrameBytes = uiBitrateKbps * 1000.0 / 8.0 * dFrameDuration;
+  unsigned uiSize = static_cast<unsigned>(dAverageFrameBytes * m_uiIntraFrameSizeFactor) + uiParameterSets;
+  uiSize = (std::max)(uiSize, MINIMUM_BUFFER_SIZE);
+  if (uiBitstreamBufferSize)
+  {
+    uiSize = (std::min)(uiSize, static_cast<unsigned>(uiBitstreamBufferSize));
+  }
+  return uiSize;
+}
+
+HRESULT X265EncoderFilter::getDeliveryBuffer(long lRequiredSize, IMediaSample** ppSample)
+{
+  HRESULT hr = m_pOutput->GetDeliveryBuffer(ppSample, NULL, NULL, 0);
+  if (FAILED(hr) || (*ppSample)->GetSize() >= lRequiredSize)
+  {
+    return hr;
+  }
+
+  // the access unit does not fit. The connection's allocator may belong to downstream and
+  // have samples outstanding, so it is left alone and the sample comes from our own allocator.
+  (*ppSample)->Release();
+  *ppSample = NULL;
+  ++m_uiStatsOutputBufferRetries;
+  return getOverflowSample(m_pOverflowAllocator, lRequiredSize, ppSample);
+}
+
+HRESULT X265EncoderFilter::getOverflowSample(IMemAllocator*& pOverflowAllocator, long lRequiredSize, IMediaSample** ppSample)
+{
+  if (pOverflowAllocator)
+  {
+    ALLOCATOR_PROPERTIES props;
+    if (SUCCEEDED(pOverflowAllocator->GetProperties(&props)) && props.cbBuffer >= lRequiredSize)
+    {
+      return pOverflowAllocator->GetBuffer(ppSample, NULL, NULL, 0);
+    }
+    // samples still held downstream keep the old allocator alive until they come back
+    releaseOverflowAllocator(pOverflowAllocator);
+  }
+
+  HRESULT hr = S_OK;
+  CMemAllocator* pAllocator = new CMemAllocator(NAME("X265 overflow allocator"), NULL, &hr);
+  pAllocator->AddRef();
+  if (SUCCEEDED(hr))
+  {
+    // leave headroom so that the next large frame fits as well
+    ALLOCATOR_PROPERTIES props, actual;
+    props.cBuffers = OVERFLOW_BUFFER_COUNT;
+    props.cbBuffer = lRequiredSize + lRequiredSize / 2;
+    props.cbAlign = 1;
+    props.cbPrefix = 0;
+    hr = pAllocator->SetProperties(&props, &actual);
+    if (SUCCEEDED(hr))
+    {
+      hr = pAllocator->Commit();
+    }
+  }
+  if (FAILED(hr))
+  {
+    pAllocator->Release();
+    return hr;
+  }
+  pOverflowAllocator = pAllocator;
+  return pOverflowAllocator->GetBuffer(ppSample, NULL, NULL, 0);
+}
+
+void X265EncoderFilter::releaseOverflowAllocator(IMemAllocator*& pOverflowAllocator)
+{
+  if (pOverflowAllocator)
+  {
+    pOverflowAllocator->Decommit();
+    pOverflowAllocator->Release();
+    pOverflowAllocator = NULL;
+  }
+}
+
+void X265EncoderFilter::releaseOverflowAllocators()
+{
+  releaseOverflowAllocator(m_pOverflowAllocator);
+  for (SimulcastLayer& layer : m_vLayers)
+  {
+    releaseOverflowAllocator(layer.pOverflowAllocator);
+  }
+}
+
+bool X265EncoderFilter::configureCodecInputLayout(ICodecv2* pCodec, const InputPictureLayout& layout)
+{
+  return configureCodecInputLayout(pCodec, layout.iYStride, layout.iUvStride, layout.uiUOffset - layout.uiYOffset, layout.uiVOffset - layout.uiYOffset);
+}
+
+bool X265EncoderFilter::configureCodecInputLayout(ICodecv2* pCodec, const FramePlanes& planes)
+{
+  return configureCodecInputLayout(pCodec, planes.iYStride, planes.iUvStride, static_cast<unsigned>(planes.pU - planes.pY), static_cast<unsigned>(planes.pV - planes.pY));
+}
+
+bool X265EncoderFilter::configureCodecInputLayout(ICodecv2* pCodec, int iYStride, int iUvStride, unsigned uiUOffset, unsigned uiVOffset)
+{
+  // x265 pads pictures that are not CTU aligned internally, so only the plane geometry is needed
+  return pCodec->SetParameter(CODEC_PARAM_IN_Y_STRIDE, std::to_string(iYStride).c_str()) &&
+    pCodec->SetParameter(CODEC_PARAM_IN_UV_STRIDE, std::to_string(iUvStride).c_str()) &&
+    pCodec->SetParameter(CODEC_PARAM_IN_U_OFFSET, std::to_string(uiUOffset).c_str()) &&
+    pCodec->SetParameter(CODEC_PARAM_IN_V_OFFSET, std::to_string(uiVOffset).c_str());
+}
+
+bool X265EncoderFilter::acquireConversionPlanes(ICodecv2* pCodec, int iWidth, int iHeight, bool bPadded, FramePlanes& planes)
+{
+  FramePlaneArena& arena = FramePlaneArena::getInstance();
+  arena.release(planes);
+  if (bPadded)
+  {
+    planes = arena.acquire(iWidth, iHeight, true);
+    if (planes.pY && !configureCodecInputLayout(pCodec, planes))
+    {
+      arena.release(planes);
+    }
+  }
+  if (!planes.pY)
+  {
+    planes = arena.acquire(iWidth, iHeight, false);
+    // overrides strides that a previous format may have left in the codec
+    if (planes.pY) configureCodecInputLayout(pCodec, planes);
+  }
+  return planes.pY != NULL;
+}
+
 inline unsigned X265EncoderFilter::getParameterSetLength() const
 {
   return m_uiSeqParamSetLen + m_uiPicParamSetLen;
@@ -619,224 +1514,1878 @@ inline unsigned X265EncoderFilter::copySequenceAndPictureParameterSetsIntoBuffer
   return getParameterSetLength();
 }
 
-HRESULT X265EncoderFilter::Transform( IMediaSample *pSource, IMediaSample *pDest )
-{
-  HRESULT hr = CCustomBaseFilter::Transform(pSource, pDest);
-#if 0
-  pDest->SetTime( &m_tStart, &m_tStop );
-  // inc
-  m_tStart = m_tStop;
-  m_tStop += m_rtFrameLength;
-#endif
-  return hr;
-}
-
-HRESULT X265EncoderFilter::ApplyTransform(BYTE* pBufferIn, long lInBufferSize, long lActualDataLength, BYTE* pBufferOut, long lOutBufferSize, long& lOutActualDataLength)
+HRESULT X265EncoderFilter::Receive(IMediaSample *pSample)
 {
-  // lock filter so that it can not be reconfigured during a code operation
-  CAutoLock lck(&m_csCodec);
+  if (!m_bAsyncActive)
+  {
+    return encodeAndDeliver(pSample);
+  }
 
-  BYTE* pInput = pBufferIn;
-  long lInputLength = lInBufferSize;
+  if (FAILED(m_hrAsyncError))
+  {
+    return m_hrAsyncError;
+  }
 
-  if (m_pConverter)
+  AM_MEDIA_TYPE* pmt = NULL;
+  if (pSample->GetMediaType(&pmt) == S_OK && pmt)
   {
-    // we need to convert to YUV first
-    if (!m_pConverter->Convert(pBufferIn, lActualDataLength, m_pYuvConversionBuffer, m_uiConversionBufferSize))
+    // the encoder for the new format opens in the background while the queued samples of the
+    // current one are still being encoded
+    EncoderInput input;
+    CMediaType mt(*pmt);
+    DeleteMediaType(pmt);
+    if (describeInput(&mt, input))
     {
-      DbgLog((LOG_TRACE, 0, TEXT("Conversion failed from RGB to I420: %s"), m_pConverter->getLastError().c_str()));
-      return E_FAIL;
+      prepareEncoder(input);
     }
-    DbgLog((LOG_TRACE, 0, TEXT("Converted to I420 directly")));
-    pInput = m_pYuvConversionBuffer;
-    lInputLength = m_uiConversionBufferSize;
   }
 
-  lOutActualDataLength = 0;
-	//make sure we were able to initialise our Codec
-	if (m_pCodec)
-	{
-		if (m_pCodec->Ready())
-		{
-      if (m_uiIFramePeriod)
-      {
-        ++m_uiCurrentFrame;
-        if (m_uiCurrentFrame%m_uiIFramePeriod == 0)
-        {
-          m_pCodec->Restart();
-        }
-      }
-
-      BYTE* pOutBufferPos = pBufferOut;
-
-#if 0
-      DbgLog((LOG_TRACE, 0, 
-        TEXT("H264 Codec Byte Limit: %d"), nFrameBitLimit));
-#endif
-      int nResult = m_pCodec->Code(pInput, pOutBufferPos, lOutBufferSize);
-      if (nResult)
-      {
-        //Encoding was successful
-        lOutActualDataLength += m_pCodec->GetCompressedByteLength();
-			}
-			else
-			{
-				//An error has occurred
-				DbgLog((LOG_TRACE, 0, TEXT("X265 Codec Error: %s"), m_pCodec->GetErrorStr()));
-				std::string sError = m_pCodec->GetErrorStr();
-        sError += ". Out buffer size=" + std::to_string(lOutBufferSize) + ".";
-        m_pCodec->Restart();
-        SetLastError(sError.c_str(), true);
-        lOutActualDataLength = 0;
-      }
-		}
-	}
+  // the encoder thread releases the sample once it has been encoded
+  pSample->AddRef();
+  IMediaSample* pEvicted = NULL;
+  switch (m_encodeQueue.push(pSample, pEvicted))
+  {
+  case BoundedFrameQueue<IMediaSample*>::PR_QUEUED:
+    break;
+  case BoundedFrameQueue<IMediaSample*>::PR_QUEUED_EVICTED:
+    pEvicted->Release();
+    ++m_uiStatsFramesDropped;
+    break;
+  case BoundedFrameQueue<IMediaSample*>::PR_REJECTED:
+    pSample->Release();
+    ++m_uiStatsFramesDropped;
+    break;
+  case BoundedFrameQueue<IMediaSample*>::PR_CLOSED:
+    pSample->Release();
+    return VFW_E_WRONG_STATE;
+  }
+  m_uiStatsQueueDepth = m_encodeQueue.size();
+  if (m_bPoolChannelActive)
+  {
+    // one job per sample: jobs for evicted samples find the queue empty
+    SharedEncoderPool::getInstance().submit(m_uiPoolChannel, SharedEncoderPool::Clock::now() + std::chrono::microseconds(m_rtFrameLength / 10));
+  }
   return S_OK;
 }
 
-HRESULT X265EncoderFilter::CheckTransform( const CMediaType *mtIn, const CMediaType *mtOut )
+HRESULT X265EncoderFilter::encodeAndDeliver(IMediaSample* pSource)
 {
-	// Check the major type.
-	if (mtOut->majortype != MEDIATYPE_Video)
-	{
-		return VFW_E_TYPE_NOT_ACCEPTED;
-	}
-
-  if (mtOut->subtype != MEDIASUBTYPE_H265 && mtOut->subtype != MEDIASUBTYPE_HVC1 && mtOut->subtype != MEDIASUBTYPE_HEVC)
+  AM_MEDIA_TYPE* pmt = NULL;
+  if (pSource && pSource->GetMediaType(&pmt) == S_OK && pmt)
   {
-    return VFW_E_TYPE_NOT_ACCEPTED;
+    // upstream changed the format from this sample on: the input pin passes it to SetMediaType
+    CMediaType mt(*pmt);
+    DeleteMediaType(pmt);
+    const HRESULT hrFormat = m_pInput->SetMediaType(&mt);
+    if (FAILED(hrFormat))
+    {
+      return hrFormat;
+    }
+  }
+  if (m_vBitstreamBuffer.empty())
+  {
+    return VFW_E_NOT_CONNECTED;
+  }
+  HRESULT hr = S_OK;
+  BYTE* pBitstream = &m_vBitstreamBuffer[0];
+  const long lBitstreamSize = static_cast<long>(m_vBitstreamBuffer.size());
+  long lOutActualDataLength = 0;
+  FrameTimes times;
+  {
+    CAutoLock lck(&m_csCodec);
+    if (pSource)
+    {
+      BYTE* pBufferIn = NULL;
+      pSource->GetPointer(&pBufferIn);
+      addInputTimes(pSource);
+      hr = ApplyTransform(pBufferIn, pSource->GetSize(), pSource->GetActualDataLength(), pBitstream, lBitstreamSize, lOutActualDataLength);
+      // forget the times of a picture that never reached the codec
+      if (m_iLastCodecPts != m_iNextCodecPts)
+      {
+        m_mFrameTimes.erase(m_iNextCodecPts);
+      }
+    }
+    else
+    {
+      hr = drainEncoder(pBitstream, lBitstreamSize, lOutActualDataLength);
+    }
+    if (SUCCEEDED(hr) && lOutActualDataLength > 0)
+    {
+      takeOutputTimes(m_pCodec, m_mFrameTimes, times);
+    }
+    m_uiStatsFramesPending = static_cast<unsigned>(m_mFrameTimes.size());
+  }
+  deliverSimulcastLayers();
+  if (FAILED(hr) || lOutActualDataLength == 0)
+  {
+    return hr;
+  }
+  // in the encoder's buffer, so the access unit is still copied only once
+  lOutActualDataLength = toOutputFormat(m_annexBRewriter, pBitstream, lOutActualDataLength, lBitstreamSize);
+  if (lOutActualDataLength == 0)
+  {
+    return S_OK;
   }
 
-  if (mtOut->formattype != FORMAT_MPEG2Video && mtOut->formattype != FORMAT_VideoInfo)
+  updateOutputBufferStats(lOutActualDataLength);
+  updateBitrateStats(lOutActualDataLength);
+  checkFrameBitLimit(lOutActualDataLength);
+  m_histOutputBytes.add(static_cast<uint32_t>(lOutActualDataLength));
+  updateFrameTypeStats(pBitstream, lOutActualDataLength);
+  const bool bRandomAccess = isRandomAccessPoint(pBitstream, lOutActualDataLength, !m_bAnnexB);
+  if (m_rtpSink.isOpen())
   {
-    return VFW_E_TYPE_NOT_ACCEPTED;
+    // on the wire before downstream gets the samples
+    sendRtp(pBitstream, lOutActualDataLength, times);
   }
 
-  // Everything is good.
-	return S_OK;
+  if (m_uiSliceMaxBytes)
+  {
+    m_annexBRewriter.findSliceEnds(pBitstream, lOutActualDataLength, !m_bAnnexB, m_vSliceEnds);
+  }
+  else
+  {
+    m_vSliceEnds.assign(1, static_cast<size_t>(lOutActualDataLength));
+  }
+  m_uiStatsSlicesPerFrame = static_cast<unsigned>(m_vSliceEnds.size());
+  // Only one thread encodes at a time, so the bitstream buffer stays valid
+  // without holding the codec lock while waiting for free output samples.
+  size_t uiStart = 0;
+  for (size_t i = 0; i < m_vSliceEnds.size() && SUCCEEDED(hr); ++i)
+  {
+    const long lLength = static_cast<long>(m_vSliceEnds[i] - uiStart);
+    if (m_uiSliceMaxBytes && lLength > static_cast<long>(m_uiSliceMaxBytes))
+    {
+      ++m_uiStatsSlicesOversized;
+    }
+    hr = deliverOutputSample(pBitstream + uiStart, lLength, times, bRandomAccess && i == 0, i + 1 == m_vSliceEnds.size());
+    uiStart = m_vSliceEnds[i];
+  }
+  ++m_llDecodeIndex;
+  return hr;
 }
 
-STDMETHODIMP X265EncoderFilter::GetParameter( const char* szParamName, int nBufferSize, char* szValue, int* pLength )
+HRESULT X265EncoderFilter::deliverOutputSample(const BYTE* pData, long lLength, const FrameTimes& times, bool bSyncPoint, bool bEndOfFrame)
 {
-	if (SUCCEEDED(CCustomBaseFilter::GetParameter(szParamName, nBufferSize, szValue, pLength)))
-	{
-		return S_OK;
-	}
-	else
-	{
-    CAutoLock lck(&m_csCodec);
-		// Check if its a codec parameter
-		if (m_pCodec && m_pCodec->GetParameter(szParamName, pLength, szValue))
-		{
-			return S_OK;
-		}
-		return E_FAIL;
-	}
+  IMediaSample* pOutSample = NULL;
+  HRESULT hr = getDeliveryBuffer(lLength, &pOutSample);
+  if (FAILED(hr))
+  {
+    if (hr == VFW_E_NOT_COMMITTED || hr == VFW_E_WRONG_STATE)
+    {
+      // stopping or flushing
+      return hr;
+    }
+    ++m_uiStatsOutputOverflowDrops;
+    std::string sError = "Dropped output sample of " + std::to_string(lLength) + " bytes: no overflow sample could be allocated.";
+    SetLastError(sError.c_str(), true);
+    return S_OK;
+  }
+
+  BYTE* pBufferOut = NULL;
+  pOutSample->GetPointer(&pBufferOut);
+  memcpy(pBufferOut, pData, lLength);
+  pOutSample->SetActualDataLength(lLength);
+  pOutSample->SetTime(times.bTimeValid ? &times.tStart : NULL, times.bTimeValid ? &times.tStop : NULL);
+  // media times are frame numbers in decode order
+  LONGLONG llDecodeEnd = bEndOfFrame ? m_llDecodeIndex + 1 : m_llDecodeIndex;
+  pOutSample->SetMediaTime(&m_llDecodeIndex, &llDecodeEnd);
+  pOutSample->SetSyncPoint(bSyncPoint ? TRUE : FALSE);
+  pOutSample->SetDiscontinuity(m_bDiscontinuity ? TRUE : FALSE);
+  pOutSample->SetPreroll(FALSE);
+  m_bDiscontinuity = false;
+  if (m_bOutputTypeChanged)
+  {
+    // downstream accepted it before the switch
+    CMediaType mt;
+    if (SUCCEEDED(getOutputMediaType(&mt, m_nInWidth, m_nInHeight, m_sVps, m_sSps, m_sPps)))
+    {
+      pOutSample->SetMediaType(&mt);
+      m_pOutput->SetMediaType(&mt);
+    }
+    m_bOutputTypeChanged = false;
+  }
+  hr = m_pOutput->Deliver(pOutSample);
+  pOutSample->Release();
+  return hr;
 }
 
-STDMETHODIMP X265EncoderFilter::SetParameter( const char* type, const char* value )
+void X265EncoderFilter::updateOutputBufferStats(long lAccessUnitSize)
 {
-	if (SUCCEEDED(CCustomBaseFilter::SetParameter(type, value)))
-	{
-		return S_OK;
-	}
-	else
-	{
-    CAutoLock lck(&m_csCodec);
-		// Check if it's a codec parameter
-		if (m_pCodec && m_pCodec->SetParameter(type, value))
-		{
-			return S_OK;
-		}
-		return E_FAIL;
-	}
+  m_ullOutputBytes += lAccessUnitSize;
+  ++m_ullOutputFrames;
+  // allocated but unused bytes across the allocator for an average access unit
+  const uint64_t ullAverage = m_ullOutputBytes / m_ullOutputFrames;
+  const uint64_t ullBufferSize = m_uiStatsOutputBufferSize;
+  m_uiStatsOutputBufferWaste = ullBufferSize > ullAverage ? static_cast<unsigned>((ullBufferSize - ullAverage) * m_uiStatsOutputBufferCount) : 0;
 }
 
-STDMETHODIMP X265EncoderFilter::GetParameterSettings( char* szResult, int nSize )
+void X265EncoderFilter::updateBitrateStats(long lAccessUnitSize)
 {
-	if (SUCCEEDED(CCustomBaseFilter::GetParameterSettings(szResult, nSize)))
-	{
-		// Now add the codec parameters to the output:
-		int nLen = strlen(szResult);
-		char szValue[10];
-		int nParamLength = 0;
-    CAutoLock lck(&m_csCodec);
-		std::string sCodecParams("Codec Parameters:\r\n");
-		if( m_pCodec->GetParameter("parameters", &nParamLength, szValue))
-		{
-			int nParamCount = atoi(szValue);
-			char szParamValue[256];
-			memset(szParamValue, 0, 256);
+  // output rate over the last second worth of frames
+  const size_t uiWindow = (std::max)(static_cast<size_t>(UNITS / (std::max)(m_rtFrameLength, static_cast<REFERENCE_TIME>(1))), static_cast<size_t>(1));
+  m_dqRecentFrameSizes.push_back(lAccessUnitSize);
+  m_ullRecentBytes += lAccessUnitSize;
+  while (m_dqRecentFrameSizes.size() > uiWindow)
+  {
+    m_ullRecentBytes -= m_dqRecentFrameSizes.front();
+    m_dqRecentFrameSizes.pop_front();
+  }
+  const double dWindowSeconds = static_cast<double>(m_dqRecentFrameSizes.size() * m_rtFrameLength) / UNITS;
+  m_uiStatsOutputBitrateKbps = static_cast<unsigned>(m_ullRecentBytes * 8 / dWindowSeconds / 1000.0);
 
-			int nLenName = 0, nLenValue = 0;
-			for (int i = 0; i < nParamCount; i++)
-			{
-				// Get parameter name
-				const char* szParamName;
-				m_pCodec->GetParameterName(i, &szParamName, &nLenName);
-				// Now get the value
-				m_pCodec->GetParameter(szParamName, &nLenValue, szParamValue);
-				sCodecParams += "Parameter: " + std::string(szParamName) + " : Value:" + std::string(szParamValue) + "\r\n";
-			}
-			// now check if the buffer is big enough:
-			int nTotalSize = sCodecParams.length() + nLen;
-			if (nTotalSize < nSize)
-			{
-				memcpy(szResult + nLen, sCodecParams.c_str(), sCodecParams.length());
-				// Set null terminator
-				szResult[nTotalSize] = 0;
-				return S_OK;
-			}
-			else
-			{
-				return E_FAIL;
-			}
-		}
-		else
-		{
-			return E_FAIL;
-		}
-	}
-	else
-	{
-		return E_FAIL;
-	}
+  if (m_bBitrateConverging)
+  {
+    ++m_uiFramesSinceBitrateChange;
+    // converged once a full window since the change is within 10% of the target
+    const unsigned uiTarget = m_uiTargetBitrate;
+    const unsigned uiError = m_uiStatsOutputBitrateKbps > uiTarget ? m_uiStatsOutputBitrateKbps - uiTarget : uiTarget - m_uiStatsOutputBitrateKbps;
+    if (m_uiFramesSinceBitrateChange >= uiWindow && uiError * 10 <= uiTarget)
+    {
+      m_uiStatsBitrateConvergenceFrames = m_uiFramesSinceBitrateChange;
+      m_bBitrateConverging = false;
+    }
+  }
 }
 
-STDMETHODIMP X265EncoderFilter::GetFramebitLimit(int& iFrameBitLimit)
+void X265EncoderFilter::applyPendingBitrate()
 {
-  return E_NOTIMPL;
+  const int iBitrateKbps = m_iPendingBitrateKbps.exchange(0);
+  if (iBitrateKbps <= 0)
+  {
+    return;
+  }
+  // X265v2 reconfigures rate control of an open encoder in place
+  if (!m_pCodec->SetParameter(FILTER_PARAM_TARGET_BITRATE_KBPS, std::to_string(iBitrateKbps).c_str()))
+  {
+    DbgLog((LOG_TRACE, 0, TEXT("Failed to set bitrate to %d kbps: %s"), iBitrateKbps, m_pCodec->GetErrorStr()));
+    return;
+  }
+  {
+    // the encoding thread is the only writer while streaming: it reads without the lock
+    CAutoLock lck(&m_csControl);
+    m_uiTargetBitrate = static_cast<unsigned>(iBitrateKbps);
+  }
+  // the VBV buffer drains at the target bitrate: it has to follow it
+  if (m_uiFrameBitLimit && !configureFrameBitLimit(m_pCodec, m_uiFrameBitLimit, m_uiTargetBitrate))
+  {
+    DbgLog((LOG_TRACE, 0, TEXT("Failed to apply frame bit limit at %d kbps: %s"), iBitrateKbps, m_pCodec->GetErrorStr()));
+  }
+  ++m_uiStatsBitrateChanges;
+  m_uiFramesSinceBitrateChange = 0;
+  m_bBitrateConverging = true;
 }
 
-STDMETHODIMP X265EncoderFilter::SetFramebitLimit(int iFrameBitLimit)
+void X265EncoderFilter::applyPendingKeyframePeriod()
 {
-  return E_NOTIMPL;
+  const int iIFramePeriod = m_iPendingIFramePeriod.exchange(-1);
+  if (iIFramePeriod < 0)
+  {
+    return;
+  }
+  // a codec that places keyframes itself has to take the new interval, or it keeps the old one
+  if (m_bCodecKeyframes && iIFramePeriod > 0 && !m_pCodec->SetParameter(CODEC_PARAM_KEYINT, std::to_string(iIFramePeriod).c_str()))
+  {
+    DbgLog((LOG_TRACE, 0, TEXT("Failed to set keyframe period to %d: %s"), iIFramePeriod, m_pCodec->GetErrorStr()));
+    return;
+  }
+  CAutoLock lck(&m_csControl);
+  m_uiIFramePeriod = static_cast<unsigned>(iIFramePeriod);
+  // the next period starts with the next frame
+  m_uiCurrentFrame = 0;
 }
 
-STDMETHODIMP X265EncoderFilter::GetGroupId(int& iGroupId)
+bool X265EncoderFilter::configureFrameBitLimit(ICodecv2* pCodec, unsigned uiFrameBitLimit, unsigned uiBitrateKbps)
 {
-  return E_NOTIMPL;
+  if (uiFrameBitLimit == 0)
+  {
+    // 0 turns VBV off again
+    return pCodec->SetParameter(CODEC_PARAM_VBV_BUFSIZE, "0") &&
+      pCodec->SetParameter(CODEC_PARAM_VBV_MAXRATE, "0");
+  }
+  // The buffer holds one frame, so no access unit can be larger than the limit. It drains
+  // at the target bitrate: the limit caps single frames, rate control the average.
+  const unsigned uiBufferKbits = (std::max)(uiFrameBitLimit / 1000, 1u);
+  const unsigned uiMaxRateKbps = (std::max)(uiBitrateKbps, 1u);
+  return pCodec->SetParameter(CODEC_PARAM_VBV_BUFSIZE, std::to_string(uiBufferKbits).c_str()) &&
+    pCodec->SetParameter(CODEC_PARAM_VBV_MAXRATE, std::to_string(uiMaxRateKbps).c_str());
 }
 
-STDMETHODIMP X265EncoderFilter::SetGroupId(int iGroupId)
+void X265EncoderFilter::checkFrameBitLimit(long lAccessUnitSize)
 {
-  return E_NOTIMPL;
-}
-
+  const unsigned uiBits = static_cast<unsigned>(lAccessUnitSize) * 8;
+  m_uiStatsLargestFrameBits = (std::max)(m_uiStatsLargestFrameBits, uiBits);
+  const uint64_t ullAverageBits = m_ullOutputBytes * 8 / (std::max)(m_ullOutputFrames, static_cast<uint64_t>(1));
+  if (ullAverageBits)
+  {
+    m_uiStatsPeakToAveragePct = static_cast<unsigned>(m_uiStatsLargestFrameBits * 100 / ullAverageBits);
+  }
+  const unsigned uiFrameBitLimit = m_uiFrameBitLimit;
+  // parameter sets at the start of a stream do not count against the limit
+  const unsigned uiParameterSetBits = static_cast<unsigned>(m_sVps.length() + m_sSps.length() + m_sPps.length()) * 8;
+  if (uiFrameBitLimit && uiBits > uiFrameBitLimit + uiParameterSetBits)
+  {
+    // the encoder cannot redo a frame it has returned: report it
+    ++m_uiStatsFrameBitLimitExceeded;
+    DbgLog((LOG_TRACE, 0, TEXT("Access unit of %u bits exceeds frame bit limit of %u"), uiBits, uiFrameBitLimit));
+  }
+}
+
+bool X265EncoderFilter::configureKeyframePolicy()
+{
+  if (m_sKeyframePolicy != "gop" && m_sKeyframePolicy != "intra_refresh")
+  {
+    SetLastError(("Invalid keyframe_policy: " + m_sKeyframePolicy + ". Use gop or intra_refresh.").c_str(), true);
+    return false;
+  }
+  m_bIntraRefresh = m_sKeyframePolicy == "intra_refresh";
+  m_uiCurrentFrame = 0;
+  m_uiStatsRefreshColumnEstimate = 0;
+  m_uiStatsRefreshColumns = m_bIntraRefresh ? (m_nInWidth + CTU_SIZE - 1) / CTU_SIZE : 0;
+  return true;
+}
+
+bool X265EncoderFilter::configureSlices()
+{
+  m_uiSlices = 1;
+  m_uiStatsSlicesPerFrame = 0;
+  if (!m_uiSliceMaxBytes)
+  {
+    return true;
+  }
+  m_uiSlices = toSliceCount(m_uiSliceMaxBytes, m_uiTargetBitrate, UNITS, m_rtFrameLength, m_nInHeight);
+  return true;
+}
+
+bool X265EncoderFilter::configureRtp()
+{
+  m_rtpSink.close();
+  m_uiStatsRtpPackets = 0;
+  m_uiStatsRtpSendErrors = 0;
+  m_uiStatsRtpRingOverflows = 0;
+  if (m_sRtpDestination.empty())
+  {
+    return true;
+  }
+  if (m_uiRtpPayloadType < 96 || m_uiRtpPayloadType > 127)
+  {
+    SetLastError(("Invalid rtp_payload_type: " + std::to_string(m_uiRtpPayloadType) + ". Use a dynamic payload type from 96 to 127.").c_str(), true);
+    return false;
+  }
+  if (!m_rtpSink.open(m_sRtpDestination))
+  {
+    SetLastError(m_rtpSink.getLastError().c_str(), true);
+    return false;
+  }
+  m_rtpPacketizer.reset(m_uiRtpMaxPacketSize, static_cast<uint8_t>(m_uiRtpPayloadType));
+  const unsigned uiSlotSize = (std::max)(m_uiRtpMaxPacketSize, 64u);
+  m_rtpRing.allocate(toRtpRingSlots(m_vBitstreamBuffer.size(), uiSlotSize), uiSlotSize);
+  return true;
+}
+
+void X265EncoderFilter::sendRtp(const BYTE* pData, long lLength, const FrameTimes& times)
+{
+  // 90 kHz; without sample times pictures are a frame interval apart
+  const REFERENCE_TIME rtTime = times.bTimeValid ? times.tStart : m_llDecodeIndex * m_rtFrameLength;
+  const uint32_t uiTimestamp = static_cast<uint32_t>(rtTime * 9 / 1000);
+  if (!m_rtpPacketizer.packetize(pData, lLength, !m_bAnnexB, uiTimestamp, m_rtpRing))
+  {
+    ++m_uiStatsRtpRingOverflows;
+  }
+  m_uiStatsRtpPackets += m_rtpSink.send(m_rtpRing);
+  m_uiStatsRtpSendErrors = static_cast<unsigned>(m_rtpSink.getSendErrors());
+}
+
+bool X265EncoderFilter::configureThreading(ICodecv2* pCodec, const EncoderSettings& settings, std::string& sError)
+{
+  CodecThreading threading = settings.threading;
+  if (settings.bSharedEncoderPool)
+  {
+    // the pool provides the parallelism across channels: one thread per encoder avoids
+    // oversubscribing the CPUs with a private x265 pool per channel
+    threading.uiFrameThreads = 1;
+    threading.bWpp = false;
+    threading.bThreadPool = false;
+  }
+  return setCodecThreading(pCodec, threading, sError);
+}
+
+bool X265EncoderFilter::configurePresetControl()
+{
+  {
+    CAutoLock lck(&m_csControl);
+    m_bPresetControlActive = false;
+  }
+  m_uiStatsEncodeLoadPct = 0;
+  if (!m_bPresetControl)
+  {
+    return true;
+  }
+  unsigned uiFastest = 0, uiSlowest = 0;
+  if (!PresetController::toLevel(m_sPresetFastest, uiFastest) || !PresetController::toLevel(m_sPresetSlowest, uiSlowest) || uiFastest > uiSlowest)
+  {
+    SetLastError(("Invalid preset range: " + m_sPresetFastest + " to " + m_sPresetSlowest + ". Use x265 presets from fastest to slowest.").c_str(), true);
+    return false;
+  }
+  // decide once per second of frames
+  const unsigned uiWindowFrames = static_cast<unsigned>(UNITS / (std::max)(m_rtFrameLength, static_cast<REFERENCE_TIME>(1)));
+  CAutoLock lck(&m_csControl);
+  m_presetController.reset(uiFastest, uiSlowest, m_uiCpuBudgetPct, uiWindowFrames);
+  // the codec is given the preset when it is opened
+  m_bPresetControlActive = true;
+  m_uiStatsPresetLevel = m_presetController.getLevel();
+  return true;
+}
+
+void X265EncoderFilter::updatePresetControl(uint32_t uiFrameUs)
+{
+  if (!m_bPresetControlActive)
+  {
+    return;
+  }
+  int iStep = 0;
+  {
+    // snapshotEncoderSettings reads the level from other threads
+    CAutoLock lck(&m_csControl);
+    iStep = m_presetController.addFrame(uiFrameUs, static_cast<uint64_t>(m_rtFrameLength / 10));
+  }
+  m_uiStatsEncodeLoadPct = m_presetController.getLoadPct();
+  if (iStep == 0)
+  {
+    return;
+  }
+  const char* szPreset = PresetController::toPreset(m_presetController.getLevel());
+  DbgLog((LOG_TRACE, 0, TEXT("Load %u%% of the frame interval: switching to preset %s"), m_uiStatsEncodeLoadPct, szPreset));
+  if (!m_pCodec->SetParameter(CODEC_PARAM_PRESET, szPreset))
+  {
+    DbgLog((LOG_TRACE, 0, TEXT("Failed to set preset %s: %s"), szPreset, m_pCodec->GetErrorStr()));
+  }
+  for (SimulcastLayer& layer : m_vLayers)
+  {
+    if (layer.pCodec) layer.pCodec->SetParameter(CODEC_PARAM_PRESET, szPreset);
+  }
+  m_uiStatsPresetLevel = m_presetController.getLevel();
+  if (iStep < 0) ++m_uiStatsPresetSpeedups;
+  else ++m_uiStatsPresetSlowdowns;
+  m_uiStatsPresetLastSwitchMs = static_cast<unsigned>(m_iNextCodecPts / (UNITS / 1000));
+}
+
+bool X265EncoderFilter::configureStaticFrames()
+{
+  m_pStaticDetector.reset();
+  m_sStaticFrameKernel.clear();
+  if (m_sStaticFramePolicy == "encode") m_eStaticFramePolicy = SFP_ENCODE;
+  else if (m_sStaticFramePolicy == "repeat") m_eStaticFramePolicy = SFP_REPEAT;
+  else if (m_sStaticFramePolicy == "drop") m_eStaticFramePolicy = SFP_DROP;
+  else
+  {
+    SetLastError(("Invalid static_frame_policy: " + m_sStaticFramePolicy + ". Use encode, repeat or drop.").c_str(), true);
+    return false;
+  }
+  m_uiLastConvertUs = 0;
+  m_uiLastEncodeUs = 0;
+  if (m_eStaticFramePolicy != SFP_ENCODE || m_bDirtyBlocks)
+  {
+    m_pStaticDetector.reset(new StaticFrameDetector(m_inputLayout, m_bDirtyBlocks ? CTU_SIZE : 0));
+    m_sStaticFrameKernel = StaticFrameDetector::toString(m_pStaticDetector->getInstructionSet());
+  }
+  return true;
+}
+
+void X265EncoderFilter::updateStaticFrameStats(bool bStatic, uint32_t uiCheckUs, uint32_t uiConvertUs, uint32_t uiEncodeUs)
+{
+  if (bStatic)
+  {
+    ++m_uiStatsStaticFrames;
+    m_llStaticSavedUs += static_cast<int64_t>(m_uiLastConvertUs) + m_uiLastEncodeUs - uiConvertUs - uiEncodeUs;
+  }
+  else
+  {
+    m_uiLastConvertUs = uiConvertUs;
+    m_uiLastEncodeUs = uiEncodeUs;
+  }
+  if (m_pStaticDetector->getBlockSize() > 0)
+  {
+    m_ullChangedCtus += bStatic ? 0 : m_pStaticDetector->getChangedBlockCount();
+    m_ullCtus += m_pStaticDetector->getChangedBlocks().size();
+    m_uiStatsChangedCtusPct = static_cast<unsigned>(100 * m_ullChangedCtus / m_ullCtus);
+  }
+  m_llStaticSavedUs -= uiCheckUs;
+  m_uiStatsStaticSavedMs = m_llStaticSavedUs > 0 ? static_cast<unsigned>(m_llStaticSavedUs / 1000) : 0;
+}
+
+void X265EncoderFilter::forceIdr()
+{
+  if (m_pCodec->SetParameter(CODEC_PARAM_FORCE_IDR, "1"))
+  {
+    ++m_uiStatsIdrForced;
+  }
+  else
+  {
+    // codec cannot flag a picture: fall back to resetting it
+    restartEncoder();
+    ++m_uiStatsIdrRestarts;
+  }
+}
+
+void X265EncoderFilter::addInputTimes(IMediaSample* pSource)
+{
+  FrameTimes times;
+  HRESULT hr = pSource->GetTime(&times.tStart, &times.tStop);
+  times.bTimeValid = SUCCEEDED(hr);
+  if (pSource->IsDiscontinuity() == S_OK)
+  {
+    m_bDiscontinuity = true;
+  }
+  const bool bFirst = m_iLastCodecPts == NO_CODEC_PTS;
+  int64_t iPts = times.bTimeValid ? times.tStart : (bFirst ? 0 : m_iLastCodecPts + m_rtFrameLength);
+  if (!bFirst && iPts <= m_iLastCodecPts)
+  {
+    // the codec needs increasing timestamps
+    iPts = m_iLastCodecPts + 1;
+  }
+  if (!times.bTimeValid)
+  {
+    times.tStart = iPts;
+    times.bTimeValid = true;
+  }
+  if (hr == VFW_S_NO_STOP_TIME || FAILED(hr))
+  {
+    times.tStop = times.tStart + m_rtFrameLength;
+  }
+  m_iNextCodecPts = iPts;
+  m_mFrameTimes[m_iNextCodecPts] = times;
+}
+
+void X265EncoderFilter::takeOutputTimes(ICodecv2* pCodec, std::map<int64_t, FrameTimes>& mFrameTimes, FrameTimes& times)
+{
+  if (mFrameTimes.empty())
+  {
+    times = FrameTimes();
+    return;
+  }
+
+  std::map<int64_t, FrameTimes>::iterator it = mFrameTimes.end();
+  char szValue[32];
+  int nLength = 0;
+  if (pCodec->GetParameter(CODEC_PARAM_OUT_PTS, &nLength, szValue))
+  {
+    it = mFrameTimes.find(strtoll(std::string(szValue, nLength).c_str(), NULL, 10));
+  }
+  if (it == mFrameTimes.end())
+  {
+    // codec does not report timestamps: pictures come out in input order
+    it = mFrameTimes.begin();
+  }
+  times = it->second;
+  mFrameTimes.erase(it);
+}
+
+HRESULT X265EncoderFilter::drainEncoder(BYTE* pBufferOut, long lOutBufferSize, long& lOutActualDataLength)
+{
+  lOutActualDataLength = 0;
+  if (!m_pCodec || !m_pCodec->Ready() || m_mFrameTimes.empty())
+  {
+    return S_OK;
+  }
+  // no picture: ask the encoder for the frames it is still holding
+  if (m_pCodec->Code(NULL, pBufferOut, lOutBufferSize))
+  {
+    lOutActualDataLength = m_pCodec->GetCompressedByteLength();
+  }
+  else
+  {
+    DbgLog((LOG_TRACE, 0, TEXT("X265 Codec Error while draining: %s"), m_pCodec->GetErrorStr()));
+  }
+  return S_OK;
+}
+
+HRESULT X265EncoderFilter::flushEncoder(bool bDeliver, bool bRestart)
+{
+  HRESULT hr = S_OK;
+  bool bDrained = false;
+  while (bDeliver)
+  {
+    size_t uiPending = 0;
+    {
+      CAutoLock lck(&m_csCodec);
+      uiPending = m_mFrameTimes.size();
+    }
+    if (uiPending == 0) break;
+    hr = encodeAndDeliver(NULL);
+    bDrained = true;
+    // each call returns at most one picture: stop once the encoder has nothing left to give
+    CAutoLock lck(&m_csCodec);
+    if (FAILED(hr) || m_mFrameTimes.size() == uiPending) break;
+  }
+
+  flushSimulcastLayers(bDeliver);
+
+  // a drained encoder does not accept new pictures: start over for the next run
+  CAutoLock lck(&m_csCodec);
+  if (bRestart && (bDrained || !m_mFrameTimes.empty()))
+  {
+    restartEncoder();
+  }
+  else if (!bRestart)
+  {
+    // pictures the encoder did not give back are lost with it
+    m_mFrameTimes.clear();
+    m_iLastCodecPts = NO_CODEC_PTS;
+    m_uiStatsFramesPending = 0;
+  }
+  return hr;
+}
+
+void X265EncoderFilter::restartEncoder()
+{
+  if (m_pCodec) m_pCodec->Restart();
+  // pictures inside the encoder are lost
+  m_mFrameTimes.clear();
+  m_iLastCodecPts = NO_CODEC_PTS;
+  m_uiStatsFramesPending = 0;
+}
+
+void X265EncoderFilter::encodeLoop()
+{
+  IMediaSample* pSample = NULL;
+  uint64_t uiWaitUs = 0;
+  while (m_encodeQueue.pop(pSample, uiWaitUs))
+  {
+    encodeQueuedSample(pSample, uiWaitUs);
+  }
+}
+
+void X265EncoderFilter::encodeNextQueued()
+{
+  IMediaSample* pSample = NULL;
+  uint64_t uiWaitUs = 0;
+  if (m_encodeQueue.tryPop(pSample, uiWaitUs))
+  {
+    encodeQueuedSample(pSample, uiWaitUs);
+    m_encodeQueue.finish();
+  }
+}
+
+void X265EncoderFilter::encodeQueuedSample(IMediaSample* pSample, uint64_t uiWaitUs)
+{
+  m_uiStatsQueueDepth = m_encodeQueue.size();
+  m_uiStatsQueueWaitUs = static_cast<unsigned>(uiWaitUs);
+  if (m_uiStatsQueueWaitUs > m_uiStatsQueueWaitMaxUs)
+  {
+    m_uiStatsQueueWaitMaxUs = m_uiStatsQueueWaitUs;
+  }
+  m_histQueueWaitUs.add(m_uiStatsQueueWaitUs);
+
+  const StatsClock::time_point tStart = StatsClock::now();
+  HRESULT hr = encodeAndDeliver(pSample);
+  pSample->Release();
+  if (uiWaitUs + elapsedUs(tStart) > static_cast<uint64_t>(m_rtFrameLength / 10))
+  {
+    ++m_uiStatsDeadlineMisses;
+  }
+  if (FAILED(hr) && SUCCEEDED(m_hrAsyncError))
+  {
+    // same as a failed Receive in synchronous mode: upstream stops on the next sample
+    DbgLog((LOG_TRACE, 0, TEXT("Async encode failed: %x"), hr));
+    m_hrAsyncError = hr;
+  }
+}
+
+void X265EncoderFilter::releaseQueuedSamples()
+{
+  std::vector<IMediaSample*> vSamples;
+  m_encodeQueue.drain(vSamples);
+  for (IMediaSample* pSample : vSamples)
+  {
+    pSample->Release();
+  }
+  m_uiStatsQueueDepth = 0;
+}
+
+HRESULT X265EncoderFilter::StartStreaming()
+{
+  // encoders still being opened for the pool would compete with the stream for the CPUs
+  stopWarmingEncoderPool();
+  m_uiStatsEncoderPoolIdle = EncoderInstancePool::getInstance().getIdleCount();
+  flushEncoder(false);
+  m_iLastCodecPts = NO_CODEC_PTS;
+  // the first picture of a run is always encoded
+  if (m_pStaticDetector) m_pStaticDetector->reset();
+  m_llDecodeIndex = 0;
+  m_ullOutputBytes = 0;
+  m_ullOutputFrames = 0;
+  m_bDiscontinuity = false;
+  m_hrAsyncError = S_OK;
+  if (!configureRtp())
+  {
+    return E_INVALIDARG;
+  }
+  m_bAsyncActive = m_bAsyncEncode || m_bSharedEncoderPool;
+  if (m_bAsyncActive)
+  {
+    QueueOverflowPolicy ePolicy;
+    if (!parseQueueOverflowPolicy(m_sAsyncOverflowPolicy, ePolicy))
+    {
+      m_bAsyncActive = false;
+      SetLastError(("Invalid async_overflow_policy: " + m_sAsyncOverflowPolicy + ". Use block, drop_oldest or drop_newest.").c_str(), true);
+      return E_INVALIDARG;
+    }
+    m_uiStatsQueueWaitMaxUs = 0;
+    m_uiStatsDeadlineMisses = 0;
+    m_encodeQueue.open(m_uiAsyncQueueDepth, ePolicy);
+    if (m_bSharedEncoderPool)
+    {
+      SharedEncoderPool& pool = SharedEncoderPool::getInstance();
+      m_uiPoolChannel = pool.addChannel(std::bind(&X265EncoderFilter::encodeNextQueued, this), m_uiSharedPoolThreads);
+      m_bPoolChannelActive = true;
+      m_uiStatsSharedPoolThreads = pool.getThreadCount();
+    }
+    else
+    {
+      m_encodeThread = std::thread(&X265EncoderFilter::encodeLoop, this);
+    }
+  }
+  return CCustomBaseFilter::StartStreaming();
+}
+
+HRESULT X265EncoderFilter::StopStreaming()
+{
+  if (m_encodeThread.joinable())
+  {
+    m_encodeQueue.close();
+    m_encodeThread.join();
+    releaseQueuedSamples();
+  }
+  if (m_bPoolChannelActive)
+  {
+    m_encodeQueue.close();
+    // waits for a job of this filter that is still running
+    SharedEncoderPool::getInstance().removeChannel(m_uiPoolChannel);
+    m_bPoolChannelActive = false;
+    releaseQueuedSamples();
+  }
+  m_bAsyncActive = false;
+  m_rtpSink.close();
+  // upstream will not switch to it any more
+  discardPreparedEncoder();
+  releaseOverflowAllocators();
+  return CCustomBaseFilter::StopStreaming();
+}
+
+STDMETHODIMP X265EncoderFilter::Stop()
+{
+  // wake up a streaming thread that is blocked on a full queue: the base class
+  // takes the receive lock before calling StopStreaming
+  m_encodeQueue.close();
+  // the base class only deactivates its own pins, which releases a thread waiting for a buffer
+  {
+    CAutoLock lck(&m_csFilter);
+    for (SimulcastLayer& layer : m_vLayers)
+    {
+      if (layer.pPin->IsConnected()) layer.pPin->Inactive();
+    }
+  }
+  return CCustomBaseFilter::Stop();
+}
+
+HRESULT X265EncoderFilter::EndOfStream()
+{
+  if (m_bAsyncActive)
+  {
+    m_encodeQueue.waitUntilIdle();
+  }
+  // deliver the pictures still held by the encoder before passing the end of stream on
+  flushEncoder(true);
+  for (SimulcastLayer& layer : m_vLayers)
+  {
+    if (layer.pPin->IsConnected()) layer.pPin->DeliverEndOfStream();
+  }
+  return CCustomBaseFilter::EndOfStream();
+}
+
+HRESULT X265EncoderFilter::BeginFlush()
+{
+  if (m_bAsyncActive)
+  {
+    releaseQueuedSamples();
+  }
+  HRESULT hr = CCustomBaseFilter::BeginFlush();
+  for (SimulcastLayer& layer : m_vLayers)
+  {
+    if (layer.pPin->IsConnected()) layer.pPin->DeliverBeginFlush();
+  }
+  // downstream is flushing: discard what the encoder is holding
+  flushEncoder(false);
+  return hr;
+}
+
+HRESULT X265EncoderFilter::EndFlush()
+{
+  for (SimulcastLayer& layer : m_vLayers)
+  {
+    if (layer.pPin->IsConnected()) layer.pPin->DeliverEndFlush();
+  }
+  return CCustomBaseFilter::EndFlush();
+}
+
+HRESULT X265EncoderFilter::NewSegment(REFERENCE_TIME tStart, REFERENCE_TIME tStop, double dRate)
+{
+  for (SimulcastLayer& layer : m_vLayers)
+  {
+    if (layer.pPin->IsConnected()) layer.pPin->DeliverNewSegment(tStart, tStop, dRate);
+  }
+  return CCustomBaseFilter::NewSegment(tStart, tStop, dRate);
+}
+
+HRESULT X265EncoderFilter::ApplyTransform(BYTE* pBufferIn, long lInBufferSize, long lActualDataLength, BYTE* pBufferOut, long lOutBufferSize, long& lOutActualDataLength)
+{
+  // lock filter so that it can not be reconfigured during a code operation
+  CAutoLock lck(&m_csCodec);
+
+  if (lActualDataLength < static_cast<long>(m_inputLayout.uiMinSampleSize))
+  {
+    DbgLog((LOG_TRACE, 0, TEXT("Input sample too small: %d < %d"), lActualDataLength, m_inputLayout.uiMinSampleSize));
+    return E_FAIL;
+  }
+
+  // I420 samples are encoded in place unless the codec can only take packed pictures
+  BYTE* pInput = pBufferIn + m_inputLayout.uiYOffset;
+  const FramePlanes& planes = m_conversionPlanes;
+
+  const StatsClock::time_point tCheckStart = StatsClock::now();
+  bool bStatic = false;
+  uint32_t uiCheckUs = 0;
+  if (m_pStaticDetector)
+  {
+    bStatic = m_pStaticDetector->isStatic(pBufferIn);
+    uiCheckUs = elapsedUs(tCheckStart);
+    m_histStaticCheckUs.add(uiCheckUs);
+  }
+  lOutActualDataLength = 0;
+  // an IDR has to be encoded even if nothing changed
+  if (bStatic && m_eStaticFramePolicy == SFP_DROP && !m_bIdrRequested)
+  {
+    // the picture never reaches the codec: rate control sees the gap in the pts
+    updateStaticFrameStats(true, uiCheckUs, 0, 0);
+    return S_OK;
+  }
+
+  const StatsClock::time_point tConvertStart = StatsClock::now();
+  if (bStatic && planes.pY)
+  {
+    // the conversion buffer still holds the picture converted from the same input
+    pInput = planes.pY;
+  }
+  else if (m_pSimdConverter)
+  {
+    // the sample size was checked against the layout above
+    bool bConverted = true;
+    if (m_pStaticDetector && m_pStaticDetector->getBlockSize() > 0)
+    {
+      // with dirty_blocks the planes keep the unchanged CTUs of the previous picture
+      bConverted = m_pSimdConverter->convertBlocks(pInput, m_inputLayout.iYStride, planes.pY, planes.iYStride, planes.pU, planes.pV, planes.iUvStride,
+        &m_pStaticDetector->getChangedBlocks()[0], m_pStaticDetector->getBlockSize());
+    }
+    else
+    {
+      m_pSimdConverter->convert(pInput, m_inputLayout.iYStride, planes.pY, planes.iYStride, planes.pU, planes.pV, planes.iUvStride);
+    }
+    if (!bConverted)
+    {
+      DbgLog((LOG_TRACE, 0, TEXT("Conversion failed from RGB to I420: %s"), m_pSimdConverter->getLastError().c_str()));
+      if (m_pStaticDetector) m_pStaticDetector->reset();
+      return E_FAIL;
+    }
+    pInput = planes.pY;
+  }
+  else if (m_pConverter)
+  {
+    // we need to convert to YUV first
+    BYTE* pRgb = pBufferIn;
+    long lRgbSize = lActualDataLength;
+    if (!m_vPackedRgb.empty())
+    {
+      // rows keep their order in memory so that the flip still applies
+      const int iPackedStride = SimdRgb24ToI420Converter::getDibStride(m_nInWidth);
+      InputPictureLayout::copyPlane(pInput, m_inputLayout.iYStride, &m_vPackedRgb[0], iPackedStride, m_nInWidth * 3, m_nInHeight);
+      pRgb = &m_vPackedRgb[0];
+      lRgbSize = static_cast<long>(m_vPackedRgb.size());
+    }
+    if (!m_pConverter->Convert(pRgb, lRgbSize, planes.pY, planes.uiSize))
+    {
+      DbgLog((LOG_TRACE, 0, TEXT("Conversion failed from RGB to I420: %s"), m_pConverter->getLastError().c_str()));
+      if (m_pStaticDetector) m_pStaticDetector->reset();
+      return E_FAIL;
+    }
+    DbgLog((LOG_TRACE, 0, TEXT("Converted to I420 directly")));
+    pInput = planes.pY;
+  }
+  else if (planes.pY)
+  {
+    m_inputLayout.packI420(pBufferIn, planes.pY);
+    pInput = planes.pY;
+  }
+  uint32_t uiConvertUs = 0;
+  if (pInput == planes.pY && !bStatic)
+  {
+    uiConvertUs = elapsedUs(tConvertStart);
+    m_histConvertUs.add(uiConvertUs);
+  }
+
+  uint32_t uiEncodeUs = 0;
+	//make sure we were able to initialise our Codec
+	if (m_pCodec)
+	{
+		if (m_pCodec->Ready())
+		{
+      applyPendingKeyframePeriod();
+      unsigned uiIFramePeriod = 0;
+      {
+        CAutoLock lckControl(&m_csControl);
+        uiIFramePeriod = m_uiIFramePeriod;
+      }
+      if (uiIFramePeriod)
+      {
+        ++m_uiCurrentFrame;
+        // request a new GOP only if the codec does not place keyframes itself
+        if (!m_bCodecKeyframes && m_uiCurrentFrame%uiIFramePeriod == 0)
+        {
+          m_bIdrRequested = true;
+        }
+        if (m_bIntraRefresh)
+        {
+          // the refresh column sweeps the picture once per period
+          m_uiStatsRefreshColumnEstimate = ((m_uiCurrentFrame % uiIFramePeriod) * m_uiStatsRefreshColumns) / uiIFramePeriod;
+        }
+      }
+
+      BYTE* pOutBufferPos = pBufferOut;
+
+      // control plane changes take effect on a frame boundary
+      applyPendingCodecParameters();
+      applyPendingBitrate();
+      const int iFrameBitLimit = m_iPendingFrameBitLimit.exchange(-1);
+      if (iFrameBitLimit >= 0)
+      {
+        {
+          CAutoLock lckControl(&m_csControl);
+          m_uiFrameBitLimit = static_cast<unsigned>(iFrameBitLimit);
+        }
+        if (!configureFrameBitLimit(m_pCodec, m_uiFrameBitLimit, m_uiTargetBitrate))
+        {
+          DbgLog((LOG_TRACE, 0, TEXT("Failed to apply frame bit limit: %s"), m_pCodec->GetErrorStr()));
+        }
+        for (SimulcastLayer& layer : m_vLayers)
+        {
+          if (layer.pCodec) configureFrameBitLimit(layer.pCodec, m_uiFrameBitLimit, layer.uiBitrateKbps);
+        }
+      }
+      // all requests since the last frame result in one IDR
+      const bool bIdr = m_bIdrRequested.exchange(false);
+      if (bIdr)
+      {
+        forceIdr();
+      }
+      const int64_t iPts = m_iNextCodecPts;
+      m_iLastCodecPts = iPts;
+      m_pCodec->SetParameter(CODEC_PARAM_IN_PTS, std::to_string(iPts).c_str());
+      if (m_bCodecCtuHints)
+      {
+        // an IDR is coded in full quality
+        const std::string sOffsets = bIdr ? std::string() : toCtuQpOffsetsString(m_pStaticDetector->getChangedBlocks(), static_cast<int>(m_uiUnchangedCtuQpOffset));
+        m_pCodec->SetParameter(CODEC_PARAM_IN_CTU_QP_OFFSETS, sOffsets.c_str());
+      }
+      const StatsClock::time_point tEncodeStart = StatsClock::now();
+      int nResult = m_pCodec->Code(pInput, pOutBufferPos, lOutBufferSize);
+      uiEncodeUs = elapsedUs(tEncodeStart);
+      m_histEncodeUs.add(uiEncodeUs);
+      if (nResult)
+      {
+        //Encoding was successful
+        lOutActualDataLength += m_pCodec->GetCompressedByteLength();
+			}
+			else
+			{
+				//An error has occurred
+				DbgLog((LOG_TRACE, 0, TEXT("X265 Codec Error: %s"), m_pCodec->GetErrorStr()));
+				std::string sError = m_pCodec->GetErrorStr();
+        sError += ". Out buffer size=" + std::to_string(lOutBufferSize) + ".";
+        restartEncoder();
+        SetLastError(sError.c_str(), true);
+        lOutActualDataLength = 0;
+      }
+      encodeSimulcastLayers(pBufferIn, pInput, iPts, bIdr);
+      updatePresetControl(elapsedUs(tConvertStart));
+		}
+	}
+  if (m_pStaticDetector)
+  {
+    updateStaticFrameStats(bStatic, uiCheckUs, uiConvertUs, uiEncodeUs);
+  }
+  return S_OK;
+}
+
+HRESULT X265EncoderFilter::CheckTransform( const CMediaType *mtIn, const CMediaType *mtOut )
+{
+	// Check the major type.
+	if (mtOut->majortype != MEDIATYPE_Video)
+	{
+		return VFW_E_TYPE_NOT_ACCEPTED;
+	}
+
+  if (mtOut->subtype != MEDIASUBTYPE_H265 && mtOut->subtype != MEDIASUBTYPE_HVC1 && mtOut->subtype != MEDIASUBTYPE_HEVC)
+  {
+    return VFW_E_TYPE_NOT_ACCEPTED;
+  }
+
+  if (mtOut->formattype != FORMAT_MPEG2Video && mtOut->formattype != FORMAT_VideoInfo)
+  {
+    return VFW_E_TYPE_NOT_ACCEPTED;
+  }
+
+  // Everything is good.
+	return S_OK;
+}
+
+STDMETHODIMP X265EncoderFilter::GetParameter( const char* szParamName, int nBufferSize, char* szValue, int* pLength )
+{
+	if (SUCCEEDED(CCustomBaseFilter::GetParameter(szParamName, nBufferSize, szValue, pLength)))
+	{
+		return S_OK;
+	}
+	else
+	{
+    std::string sStatsValue;
+    if (getHistogramValue(szParamName, sStatsValue))
+    {
+      const int nLength = static_cast<int>(sStatsValue.length());
+      if (nLength >= nBufferSize)
+      {
+        return E_FAIL;
+      }
+      memcpy(szValue, sStatsValue.c_str(), nLength + 1);
+      *pLength = nLength;
+      return S_OK;
+    }
+    // Codec parameters are read from the last published snapshot so that this never
+    // waits for an encode in progress
+    std::shared_ptr<const CodecParameterList> pParameters = std::atomic_load(&m_pCodecParameters);
+    if (pParameters)
+    {
+      for (const auto& param : *pParameters)
+      {
+        if (param.first != szParamName) continue;
+        const int nLength = static_cast<int>(param.second.length());
+        if (nLength >= nBufferSize)
+        {
+          return E_FAIL;
+        }
+        memcpy(szValue, param.second.c_str(), nLength + 1);
+        *pLength = nLength;
+        return S_OK;
+      }
+    }
+    if (!m_pCodec)
+    {
+      return E_FAIL;
+    }
+    if (m_State == State_Stopped)
+    {
+      // not streaming: nothing holds the codec lock for long
+      CAutoLock lck(&m_csCodec);
+      return m_pCodec->GetParameter(szParamName, pLength, szValue) ? S_OK : E_FAIL;
+    }
+    // not in the snapshot: include it from the next one on, unless the codec already
+    // failed to return it or too many names are watched
+    CAutoLock lck(&m_csControl);
+    if (std::find(m_vUnknownCodecParameters.begin(), m_vUnknownCodecParameters.end(), szParamName) != m_vUnknownCodecParameters.end())
+    {
+      return E_FAIL;
+    }
+    if (std::find(m_vWatchedCodecParameters.begin(), m_vWatchedCodecParameters.end(), szParamName) == m_vWatchedCodecParameters.end())
+    {
+      if (m_vWatchedCodecParameters.size() >= MAX_WATCHED_CODEC_PARAMETERS)
+      {
+        return E_FAIL;
+      }
+      m_vWatchedCodecParameters.push_back(szParamName);
+    }
+    m_bCodecParametersStale = true;
+    return E_PENDING;
+	}
+}
+
+STDMETHODIMP X265EncoderFilter::SetParameter( const char* type, const char* value )
+{
+  if (m_State != State_Stopped)
+  {
+    // The encoding thread owns these while streaming: they take the path of the interface
+    // calls and are written once it has applied them.
+    const bool bBitrate = strcmp(type, FILTER_PARAM_TARGET_BITRATE_KBPS) == 0;
+    const bool bFrameBitLimit = strcmp(type, "framebit_limit") == 0;
+    const bool bIFramePeriod = strcmp(type, "keyframe_period") == 0;
+    if (bBitrate || bFrameBitLimit || bIFramePeriod)
+    {
+      int iValue = 0;
+      if (!parseNonNegative(value, iValue))
+      {
+        return E_INVALIDARG;
+      }
+      HRESULT hr = S_OK;
+      if (bBitrate)
+      {
+        hr = SetBitrateKbps(iValue);
+      }
+      else if (bFrameBitLimit)
+      {
+        hr = SetFramebitLimit(iValue);
+      }
+      else
+      {
+        m_iPendingIFramePeriod = iValue;
+      }
+      if (SUCCEEDED(hr))
+      {
+        ++m_uiSettingsGeneration;
+      }
+      return hr;
+    }
+  }
+  HRESULT hrFilter = E_FAIL;
+  {
+    // snapshotEncoderSettings copies the filter's settings under the same lock
+    CAutoLock lck(&m_csControl);
+    hrFilter = CCustomBaseFilter::SetParameter(type, value);
+  }
+	if (SUCCEEDED(hrFilter))
+	{
+    // an encoder opened before may not match the settings any more
+    ++m_uiSettingsGeneration;
+    const bool bPoolSize = strcmp(type, "encoder_pool_size") == 0;
+    if (bPoolSize || strcmp(type, "encoder_pool_profiles") == 0)
+    {
+      return configureEncoderPool(bPoolSize) ? S_OK : E_INVALIDARG;
+    }
+		return S_OK;
+	}
+  else if (strcmp(type, STATS_RESET) == 0)
+  {
+    resetStats();
+    return S_OK;
+  }
+	else if (m_pCodec && m_State != State_Stopped)
+	{
+    // only names the codec has published are queued: others fail here, not on the encoding thread
+    std::shared_ptr<const CodecParameterList> pParameters = std::atomic_load(&m_pCodecParameters);
+    const bool bKnown = pParameters && std::any_of(pParameters->begin(), pParameters->end(),
+      [type](const CodecParameterList::value_type& param) { return param.first == type; });
+    if (!bKnown)
+    {
+      return E_FAIL;
+    }
+    // queued for the encoding thread, which applies it between frames
+    CAutoLock lck(&m_csControl);
+    m_vPendingCodecParameters.push_back(std::make_pair(std::string(type), std::string(value)));
+    m_bCodecParametersStale = true;
+    return S_OK;
+  }
+  else
+  {
+    // not streaming: nothing holds the codec lock for long
+    CAutoLock lck(&m_csCodec);
+		// Check if it's a codec parameter
+		if (m_pCodec && m_pCodec->SetParameter(type, value))
+		{
+      publishCodecParameters();
+      {
+        CAutoLock lckControl(&m_csControl);
+        addCodecSetting(type, value);
+      }
+      // takes effect when the codec is next opened
+      ++m_uiSettingsGeneration;
+			return S_OK;
+		}
+		return E_FAIL;
+	}
+}
+
+STDMETHODIMP X265EncoderFilter::GetParameterSettings( char* szResult, int nSize )
+{
+	if (SUCCEEDED(CCustomBaseFilter::GetParameterSettings(szResult, nSize)))
+	{
+		// Now add the codec parameters to the output:
+		int nLen = strlen(szResult);
+    std::shared_ptr<const CodecParameterList> pParameters = std::atomic_load(&m_pCodecParameters);
+    if (!pParameters)
+    {
+      return E_FAIL;
+    }
+		std::string sCodecParams("Codec Parameters:\r\n");
+    for (const auto& param : *pParameters)
+    {
+      sCodecParams += "Parameter: " + param.first + " : Value:" + param.second + "\r\n";
+    }
+    sCodecParams += "Statistics:\r\n";
+    for (const char* szStage : STATS_STAGES)
+    {
+      const StatsHistogram* pHistogram = getHistogram(szStage);
+      sCodecParams += std::string("Stage: ") + szStage +
+        " : p50:" + std::to_string(pHistogram->getPercentile(50)) +
+        " p95:" + std::to_string(pHistogram->getPercentile(95)) +
+        " p99:" + std::to_string(pHistogram->getPercentile(99)) +
+        " max:" + std::to_string(pHistogram->getMax()) +
+        " count:" + std::to_string(pHistogram->getCount()) + "\r\n";
+    }
+    // now check if the buffer is big enough:
+    int nTotalSize = sCodecParams.length() + nLen;
+    if (nTotalSize < nSize)
+    {
+      memcpy(szResult + nLen, sCodecParams.c_str(), sCodecParams.length());
+      // Set null terminator
+      szResult[nTotalSize] = 0;
+      return S_OK;
+    }
+    else
+    {
+      return E_FAIL;
+    }
+	}
+	else
+	{
+		return E_FAIL;
+	}
+}
+
+void X265EncoderFilter::addCodecSetting(const char* szName, const char* szValue)
+{
+  for (auto& param : m_vCodecSettings)
+  {
+    if (param.first == szName)
+    {
+      param.second = szValue;
+      return;
+    }
+  }
+  m_vCodecSettings.push_back(std::make_pair(std::string(szName), std::string(szValue)));
+}
+
+void X265EncoderFilter::applyPendingCodecParameters()
+{
+  std::vector<std::pair<std::string, std::string> > vPending;
+  {
+    CAutoLock lck(&m_csControl);
+    if (!m_bCodecParametersStale) return;
+    vPending.swap(m_vPendingCodecParameters);
+    m_bCodecParametersStale = false;
+  }
+  for (const auto& param : vPending)
+  {
+    if (!m_pCodec->SetParameter(param.first.c_str(), param.second.c_str()))
+    {
+      DbgLog((LOG_TRACE, 0, TEXT("Failed to set codec parameter %s: %s"), param.first.c_str(), m_pCodec->GetErrorStr()));
+      continue;
+    }
+    {
+      // replayed on codec instances created later only once the codec took it
+      CAutoLock lck(&m_csControl);
+      addCodecSetting(param.first.c_str(), param.second.c_str());
+    }
+    ++m_uiSettingsGeneration;
+    for (SimulcastLayer& layer : m_vLayers)
+    {
+      if (layer.pCodec) layer.pCodec->SetParameter(param.first.c_str(), param.second.c_str());
+    }
+  }
+  publishCodecParameters();
+}
+
+void X265EncoderFilter::publishCodecParameters()
+{
+  std::shared_ptr<CodecParameterList> pParameters = std::make_shared<CodecParameterList>();
+  char szValue[256];
+  int nLength = 0;
+  std::vector<std::string> vNames;
+  if (m_pCodec->GetParameter("parameters", &nLength, szValue))
+  {
+    const int nParamCount = atoi(std::string(szValue, nLength).c_str());
+    for (int i = 0; i < nParamCount; i++)
+    {
+      const char* szParamName = NULL;
+      int nLenName = 0;
+      m_pCodec->GetParameterName(i, &szParamName, &nLenName);
+      vNames.push_back(szParamName);
+    }
+  }
+  const size_t uiEnumerated = vNames.size();
+  {
+    CAutoLock lck(&m_csControl);
+    vNames.insert(vNames.end(), m_vWatchedCodecParameters.begin(), m_vWatchedCodecParameters.end());
+  }
+  std::vector<std::string> vUnknown;
+  for (size_t i = 0; i < vNames.size(); ++i)
+  {
+    memset(szValue, 0, sizeof(szValue));
+    if (m_pCodec->GetParameter(vNames[i].c_str(), &nLength, szValue))
+    {
+      pParameters->push_back(std::make_pair(vNames[i], std::string(szValue, nLength)));
+    }
+    else if (i >= uiEnumerated)
+    {
+      vUnknown.push_back(vNames[i]);
+    }
+  }
+  if (!vUnknown.empty())
+  {
+    // GetParameter fails for these from now on instead of waiting for them
+    CAutoLock lck(&m_csControl);
+    for (const std::string& sName : vUnknown)
+    {
+      m_vWatchedCodecParameters.erase(std::remove(m_vWatchedCodecParameters.begin(), m_vWatchedCodecParameters.end(), sName), m_vWatchedCodecParameters.end());
+      m_vUnknownCodecParameters.push_back(sName);
+    }
+    if (m_vUnknownCodecParameters.size() > MAX_WATCHED_CODEC_PARAMETERS)
+    {
+      // the oldest are asked for again if they come up
+      m_vUnknownCodecParameters.erase(m_vUnknownCodecParameters.begin(), m_vUnknownCodecParameters.end() - MAX_WATCHED_CODEC_PARAMETERS);
+    }
+  }
+  std::atomic_store(&m_pCodecParameters, std::shared_ptr<const CodecParameterList>(pParameters));
+}
+
+STDMETHODIMP X265EncoderFilter::GetFramebitLimit(int& iFrameBitLimit)
+{
+  iFrameBitLimit = m_iPendingFrameBitLimit;
+  if (iFrameBitLimit < 0)
+  {
+    CAutoLock lck(&m_csControl);
+    iFrameBitLimit = static_cast<int>(m_uiFrameBitLimit);
+  }
+  return S_OK;
+}
+
+STDMETHODIMP X265EncoderFilter::SetFramebitLimit(int iFrameBitLimit)
+{
+  if (iFrameBitLimit < 0)
+  {
+    return E_INVALIDARG;
+  }
+  if (m_State == State_Stopped)
+  {
+    // taken by the next encoder that is opened
+    CAutoLock lck(&m_csControl);
+    m_uiFrameBitLimit = static_cast<unsigned>(iFrameBitLimit);
+  }
+  // applied by the encoding thread before the next frame, which then updates m_uiFrameBitLimit
+  m_iPendingFrameBitLimit = iFrameBitLimit;
+  return S_OK;
+}
+
+STDMETHODIMP X265EncoderFilter::GetGroupId(int& iGroupId)
+{
+  return E_NOTIMPL;
+}
+
+STDMETHODIMP X265EncoderFilter::SetGroupId(int iGroupId)
+{
+  return E_NOTIMPL;
+}
+
 STDMETHODIMP X265EncoderFilter::GenerateIdr()
 {
-  // lock filter so that it can not be reconfigured during a code operation
-  CAutoLock lck(&m_csCodec);
-  m_pCodec->Restart();
+  // Does not wait for an encode in progress: the next picture passed to the codec is
+  // flagged as an IDR. Requests that arrive before then are merged.
+  ++m_uiStatsIdrRequests;
+  m_bIdrRequested = true;
   return S_OK;
 }
 
 STDMETHODIMP X265EncoderFilter::GetBitrateKbps(int& uiBitrateKbps)
 {
-  return E_NOTIMPL;
+  uiBitrateKbps = m_iPendingBitrateKbps;
+  if (uiBitrateKbps <= 0)
+  {
+    CAutoLock lck(&m_csControl);
+    uiBitrateKbps = static_cast<int>(m_uiTargetBitrate);
+  }
+  return S_OK;
 }
 
 STDMETHODIMP X265EncoderFilter::SetBitrateKbps(int uiBitrateKbps)
 {
-  return E_NOTIMPL;
+  if (uiBitrateKbps <= 0)
+  {
+    return E_INVALIDARG;
+  }
+  // Does not take the codec lock: the encoding thread picks the new rate up before the
+  // next frame, and only the latest of several calls in one frame interval is applied.
+  // m_uiTargetBitrate follows once it has been applied.
+  if (m_State == State_Stopped)
+  {
+    // taken by the next encoder that is opened
+    CAutoLock lck(&m_csControl);
+    m_uiTargetBitrate = static_cast<unsigned>(uiBitrateKbps);
+  }
+  m_iPendingBitrateKbps = uiBitrateKbps;
+  return S_OK;
+}
+
+const StatsHistogram* X265EncoderFilter::getHistogram(const std::string& sStage) const
+{
+  if (sStage == STATS_STAGE_CONVERT_US) return &m_histConvertUs;
+  if (sStage == STATS_STAGE_ENCODE_US) return &m_histEncodeUs;
+  if (sStage == STATS_STAGE_OUTPUT_BYTES) return &m_histOutputBytes;
+  if (sStage == STATS_STAGE_QUEUE_WAIT_US) return &m_histQueueWaitUs;
+  if (sStage == STATS_STAGE_SCALE_US) return &m_histScaleUs;
+  if (sStage == STATS_STAGE_STATIC_CHECK_US) return &m_histStaticCheckUs;
+  return NULL;
+}
+
+bool X265EncoderFilter::getHistogramValue(const std::string& sName, std::string& sValue) const
+{
+  const std::string sPrefix("stats_");
+  const size_t uiSuffix = sName.rfind('_');
+  if (sName.compare(0, sPrefix.length(), sPrefix) != 0 || uiSuffix == std::string::npos || uiSuffix <= sPrefix.length())
+  {
+    return false;
+  }
+  const StatsHistogram* pHistogram = getHistogram(sName.substr(sPrefix.length(), uiSuffix - sPrefix.length()));
+  if (!pHistogram)
+  {
+    return false;
+  }
+  const std::string sStatistic = sName.substr(uiSuffix + 1);
+  if (sStatistic == "p50") sValue = std::to_string(pHistogram->getPercentile(50));
+  else if (sStatistic == "p95") sValue = std::to_string(pHistogram->getPercentile(95));
+  else if (sStatistic == "p99") sValue = std::to_string(pHistogram->getPercentile(99));
+  else if (sStatistic == "max") sValue = std::to_string(pHistogram->getMax());
+  else if (sStatistic == "count") sValue = std::to_string(pHistogram->getCount());
+  else return false;
+  return true;
+}
+
+void X265EncoderFilter::updateFrameTypeStats(const BYTE* pData, long lLength)
+{
+  const int iNalType = getFirstVclNalType(pData, lLength, !m_bAnnexB);
+  if (iNalType < 0) return;
+  if (iNalType >= 16)
+  {
+    ++m_uiStatsFramesIntra;
+  }
+  else if (iNalType % 2 == 0)
+  {
+    // TRAIL_N, TSA_N, STSA_N, RADL_N and RASL_N are even
+    ++m_uiStatsFramesNonReference;
+  }
+  else
+  {
+    ++m_uiStatsFramesReference;
+  }
+}
+
+long X265EncoderFilter::toOutputFormat(AnnexBRewriter& rewriter, BYTE* pData, long lLength, long lCapacity)
+{
+  if (m_bAnnexB)
+  {
+    return lLength;
+  }
+  size_t uiNewLength = 0;
+  if (!rewriter.toLengthPrefixed(pData, lLength, lCapacity, uiNewLength))
+  {
+    DbgLog((LOG_TRACE, 0, TEXT("Dropped access unit of %d bytes: %s"), lLength, rewriter.getLastError().c_str()));
+    std::string sError = "Dropped access unit of " + std::to_string(lLength) + " bytes: " + rewriter.getLastError();
+    SetLastError(sError.c_str(), true);
+    return 0;
+  }
+  return static_cast<long>(uiNewLength);
+}
+
+void X265EncoderFilter::resetStats()
+{
+  m_histConvertUs.reset();
+  m_histEncodeUs.reset();
+  m_histOutputBytes.reset();
+  m_histQueueWaitUs.reset();
+  m_histScaleUs.reset();
+  m_histStaticCheckUs.reset();
+  m_uiStatsStaticFrames = 0;
+  m_llStaticSavedUs = 0;
+  m_uiStatsStaticSavedMs = 0;
+  m_ullChangedCtus = 0;
+  m_ullCtus = 0;
+  m_uiStatsChangedCtusPct = 0;
+  m_uiStatsSimulcastDrops = 0;
+  m_uiStatsPresetSpeedups = 0;
+  m_uiStatsPresetSlowdowns = 0;
+  m_uiStatsDeadlineMisses = 0;
+  m_uiStatsFramesIntra = 0;
+  m_uiStatsFramesReference = 0;
+  m_uiStatsFramesNonReference = 0;
+  m_uiStatsFramesDropped = 0;
+  m_uiStatsQueueWaitMaxUs = 0;
+  m_uiStatsOutputOverflowDrops = 0;
+  m_uiStatsFrameBitLimitExceeded = 0;
+  m_uiStatsLargestFrameBits = 0;
+  m_uiStatsSlicesOversized = 0;
+  m_uiStatsFormatChanges = 0;
+  m_uiStatsFormatChangesKept = 0;
+  m_uiStatsEncoderPoolHits = 0;
+}
+
+/**
+ * Parses simulcast_layers: WIDTHxHEIGHT@KBPS entries separated by commas
+ */
+static bool parseSimulcastLayers(const std::string& sLayers, std::vector<std::pair<std::pair<int, int>, unsigned> >& vLayers)
+{
+  size_t uiStart = 0;
+  while (uiStart < sLayers.length())
+  {
+    size_t uiEnd = sLayers.find(',', uiStart);
+    if (uiEnd == std::string::npos) uiEnd = sLayers.length();
+    const std::string sLayer = sLayers.substr(uiStart, uiEnd - uiStart);
+    int iWidth = 0, iHeight = 0;
+    unsigned uiBitrateKbps = 0;
+    if (sscanf(sLayer.c_str(), "%dx%d@%u", &iWidth, &iHeight, &uiBitrateKbps) != 3 ||
+      iWidth <= 0 || iHeight <= 0 || uiBitrateKbps == 0 || (iWidth & 1) || (iHeight & 1))
+    {
+      return false;
+    }
+    vLayers.push_back(std::make_pair(std::make_pair(iWidth, iHeight), uiBitrateKbps));
+    uiStart = uiEnd + 1;
+  }
+  return true;
+}
+
+int X265EncoderFilter::GetPinCount()
+{
+  CAutoLock lck(&m_csFilter);
+  updateSimulcastPins();
+  return CCustomBaseFilter::GetPinCount() + static_cast<int>(m_vLayers.size());
+}
+
+CBasePin* X265EncoderFilter::GetPin(int n)
+{
+  CAutoLock lck(&m_csFilter);
+  updateSimulcastPins();
+  const int nBasePins = CCustomBaseFilter::GetPinCount();
+  if (n < nBasePins)
+  {
+    return CCustomBaseFilter::GetPin(n);
+  }
+  const size_t uiLayer = static_cast<size_t>(n - nBasePins);
+  return uiLayer < m_vLayers.size() ? m_vLayers[uiLayer].pPin : NULL;
+}
+
+void X265EncoderFilter::updateSimulcastPins()
+{
+  if (m_sSimulcastLayers == m_sSimulcastPins || m_State != State_Stopped)
+  {
+    return;
+  }
+  // keep connected pins until they are disconnected
+  for (const SimulcastLayer& layer : m_vLayers)
+  {
+    if (layer.pPin->IsConnected()) return;
+  }
+  destroySimulcastLayers();
+  m_sSimulcastPins = m_sSimulcastLayers;
+
+  std::vector<std::pair<std::pair<int, int>, unsigned> > vLayers;
+  if (!parseSimulcastLayers(m_sSimulcastLayers, vLayers))
+  {
+    SetLastError(("Invalid simulcast_layers: " + m_sSimulcastLayers + ". Use WIDTHxHEIGHT@KBPS with even dimensions, separated by commas.").c_str(), true);
+    return;
+  }
+  for (size_t i = 0; i < vLayers.size(); ++i)
+  {
+    SimulcastLayer layer;
+    layer.iWidth = vLayers[i].first.first;
+    layer.iHeight = vLayers[i].first.second;
+    layer.uiBitrateKbps = vLayers[i].second;
+    HRESULT hr = S_OK;
+    const std::wstring sName = L"Layer " + std::to_wstring(i + 1);
+    layer.pPin = new SimulcastOutputPin(this, &m_csFilter, &hr, sName.c_str(), static_cast<unsigned>(i));
+    if (FAILED(hr))
+    {
+      delete layer.pPin;
+      break;
+    }
+    m_vLayers.push_back(layer);
+  }
+  IncrementPinVersion();
+  if (m_pInput && m_pInput->IsConnected())
+  {
+    CAutoLock lck(&m_csCodec);
+    openSimulcastLayers();
+  }
+}
+
+void X265EncoderFilter::destroySimulcastLayers()
+{
+  X265v2Factory factory;
+  for (SimulcastLayer& layer : m_vLayers)
+  {
+    if (layer.pCodec)
+    {
+      layer.pCodec->Close();
+      factory.ReleaseCodecInstance(layer.pCodec);
+    }
+    releaseOverflowAllocator(layer.pOverflowAllocator);
+    delete layer.pPin;
+  }
+  m_vLayers.clear();
+  m_uiStatsSimulcastLayers = 0;
+}
+
+bool X265EncoderFilter::openSimulcastLayers()
+{
+  X265v2Factory factory;
+  bool bSuccess = true;
+  m_uiStatsSimulcastLayers = 0;
+  PreparedEncoder prototype;
+  prototype.input.rtFrameLength = m_rtFrameLength;
+  snapshotEncoderSettings(prototype);
+  for (SimulcastLayer& layer : m_vLayers)
+  {
+    if (layer.iWidth > m_nInWidth || layer.iHeight > m_nInHeight)
+    {
+      // layers are only ever scaled down
+      if (layer.pCodec)
+      {
+        layer.pCodec->Close();
+        factory.ReleaseCodecInstance(layer.pCodec);
+        layer.pCodec = NULL;
+      }
+      SetLastError(("Simulcast layer " + std::to_string(layer.iWidth) + "x" + std::to_string(layer.iHeight) + " is larger than the input.").c_str(), true);
+      bSuccess = false;
+      continue;
+    }
+    // configured like the main encoder: preset, VBV, threading, keyframe policy, slices and
+    // the codec parameters set through SetParameter, at the layer's size and bitrate
+    PreparedEncoder encoder = prototype;
+    encoder.input.layout = InputPictureLayout::forI420(layer.iWidth, layer.iHeight, 0, 0, 0, 0);
+    encoder.uiBitrateKbps = layer.uiBitrateKbps;
+    encoder.pCodec = layer.pCodec;
+    const HRESULT hr = openEncoder(encoder, false);
+    layer.pCodec = encoder.pCodec;
+    // the downscaler writes packed pictures, which the codec reads in place
+    FramePlaneArena::getInstance().release(encoder.planes);
+    if (FAILED(hr))
+    {
+      SetLastError(encoder.sError.c_str(), true);
+      bSuccess = false;
+      continue;
+    }
+    layer.sVps = encoder.sVps;
+    layer.sSps = encoder.sSps;
+    layer.sPps = encoder.sPps;
+
+    layer.pScaler = std::make_shared<I420Downscaler>(m_nInWidth, m_nInHeight, layer.iWidth, layer.iHeight);
+    layer.vPicture.resize(layer.pScaler->getDstSize());
+    layer.vBitstream.resize(layer.pScaler->getDstSize() + BITSTREAM_HEADROOM);
+    layer.lLength = 0;
+    layer.mFrameTimes.clear();
+    layer.llDecodeIndex = 0;
+    ++m_uiStatsSimulcastLayers;
+  }
+  return bSuccess;
+}
+
+void X265EncoderFilter::encodeSimulcastLayers(const BYTE* pBufferIn, const BYTE* pInput, int64_t iPts, bool bIdr)
+{
+  if (m_vLayers.empty())
+  {
+    return;
+  }
+  // the picture the main codec was given: either in the conversion planes or inside the sample
+  const BYTE* pY = pInput;
+  const BYTE* pU = NULL;
+  const BYTE* pV = NULL;
+  int iYStride = 0;
+  int iUvStride = 0;
+  if (pInput == m_conversionPlanes.pY)
+  {
+    iYStride = m_conversionPlanes.iYStride;
+    iUvStride = m_conversionPlanes.iUvStride;
+    pU = m_conversionPlanes.pU;
+    pV = m_conversionPlanes.pV;
+  }
+  else
+  {
+    iYStride = m_inputLayout.iYStride;
+    iUvStride = m_inputLayout.iUvStride;
+    pU = pBufferIn + m_inputLayout.uiUOffset;
+    pV = pBufferIn + m_inputLayout.uiVOffset;
+  }
+  std::map<int64_t, FrameTimes>::const_iterator itTimes = m_mFrameTimes.find(iPts);
+  const FrameTimes inputTimes = itTimes != m_mFrameTimes.end() ? itTimes->second : FrameTimes();
+
+  for (SimulcastLayer& layer : m_vLayers)
+  {
+    layer.lLength = 0;
+    if (!layer.pCodec || !layer.pCodec->Ready() || !layer.pPin->IsConnected())
+    {
+      continue;
+    }
+    const StatsClock::time_point tScaleStart = StatsClock::now();
+    layer.pScaler->scale(pY, iYStride, pU, pV, iUvStride, &layer.vPicture[0]);
+    m_histScaleUs.add(elapsedUs(tScaleStart));
+
+    // keep the layers' GOPs aligned with the main output
+    if (bIdr && !layer.pCodec->SetParameter(CODEC_PARAM_FORCE_IDR, "1"))
+    {
+      layer.pCodec->Restart();
+      layer.mFrameTimes.clear();
+    }
+    layer.mFrameTimes[iPts] = inputTimes;
+    layer.pCodec->SetParameter(CODEC_PARAM_IN_PTS, std::to_string(iPts).c_str());
+    if (layer.pCodec->Code(&layer.vPicture[0], &layer.vBitstream[0], static_cast<int>(layer.vBitstream.size())))
+    {
+      layer.lLength = layer.pCodec->GetCompressedByteLength();
+      if (layer.lLength > 0)
+      {
+        takeOutputTimes(layer.pCodec, layer.mFrameTimes, layer.times);
+      }
+    }
+    else
+    {
+      DbgLog((LOG_TRACE, 0, TEXT("X265 Codec Error in simulcast layer %dx%d: %s"), layer.iWidth, layer.iHeight, layer.pCodec->GetErrorStr()));
+      layer.pCodec->Restart();
+      layer.mFrameTimes.clear();
+    }
+  }
+}
+
+void X265EncoderFilter::deliverSimulcastLayers()
+{
+  // as with the main output, only the encoding thread touches the layers' bitstream buffers
+  for (SimulcastLayer& layer : m_vLayers)
+  {
+    if (layer.lLength <= 0)
+    {
+      continue;
+    }
+    const long lLength = toOutputFormat(layer.rewriter, &layer.vBitstream[0], layer.lLength, static_cast<long>(layer.vBitstream.size()));
+    layer.lLength = 0;
+    if (lLength == 0)
+    {
+      continue;
+    }
+    IMediaSample* pOutSample = NULL;
+    if (FAILED(layer.pPin->GetDeliveryBuffer(&pOutSample, NULL, NULL, 0)))
+    {
+      continue;
+    }
+    if (pOutSample->GetSize() < lLength)
+    {
+      // as on the main output: the pin's allocator is left alone
+      pOutSample->Release();
+      pOutSample = NULL;
+      if (FAILED(getOverflowSample(layer.pOverflowAllocator, lLength, &pOutSample)))
+      {
+        ++m_uiStatsSimulcastDrops;
+        continue;
+      }
+    }
+    BYTE* pBufferOut = NULL;
+    pOutSample->GetPointer(&pBufferOut);
+    memcpy(pBufferOut, &layer.vBitstream[0], lLength);
+    pOutSample->SetActualDataLength(lLength);
+    pOutSample->SetTime(layer.times.bTimeValid ? &layer.times.tStart : NULL, layer.times.bTimeValid ? &layer.times.tStop : NULL);
+    LONGLONG llDecodeEnd = layer.llDecodeIndex + 1;
+    pOutSample->SetMediaTime(&layer.llDecodeIndex, &llDecodeEnd);
+    ++layer.llDecodeIndex;
+    pOutSample->SetSyncPoint(isRandomAccessPoint(pBufferOut, lLength, !m_bAnnexB) ? TRUE : FALSE);
+    pOutSample->SetPreroll(FALSE);
+    layer.pPin->Deliver(pOutSample);
+    pOutSample->Release();
+  }
+}
+
+void X265EncoderFilter::flushSimulcastLayers(bool bDeliver)
+{
+  for (SimulcastLayer& layer : m_vLayers)
+  {
+    bool bDrained = false;
+    while (bDeliver && layer.pCodec && layer.pPin->IsConnected())
+    {
+      {
+        CAutoLock lck(&m_csCodec);
+        if (layer.mFrameTimes.empty() || !layer.pCodec->Code(NULL, &layer.vBitstream[0], static_cast<int>(layer.vBitstream.size())))
+        {
+          break;
+        }
+        layer.lLength = layer.pCodec->GetCompressedByteLength();
+        if (layer.lLength <= 0)
+        {
+          break;
+        }
+        takeOutputTimes(layer.pCodec, layer.mFrameTimes, layer.times);
+        bDrained = true;
+      }
+      deliverSimulcastLayers();
+    }
+
+    CAutoLock lck(&m_csCodec);
+    layer.lLength = 0;
+    if (layer.pCodec && (bDrained || !layer.mFrameTimes.empty()))
+    {
+      layer.pCodec->Restart();
+    }
+    layer.mFrameTimes.clear();
+  }
+}
+
+HRESULT X265EncoderFilter::checkLayerMediaType(unsigned uiLayer, const CMediaType* pMediaType)
+{
+  if (uiLayer >= m_vLayers.size() || !m_pInput->IsConnected() || !m_vLayers[uiLayer].pCodec)
+  {
+    return VFW_E_NOT_CONNECTED;
+  }
+  return CheckTransform(&m_pInput->CurrentMediaType(), pMediaType);
+}
+
+HRESULT X265EncoderFilter::getLayerMediaType(unsigned uiLayer, int iPosition, CMediaType* pMediaType)
+{
+  if (iPosition < 0)
+  {
+    return E_INVALIDARG;
+  }
+  if (uiLayer >= m_vLayers.size() || !m_pInput->IsConnected() || !m_vLayers[uiLayer].pCodec)
+  {
+    return VFW_E_NOT_CONNECTED;
+  }
+  if (iPosition > 0)
+  {
+    return VFW_S_NO_MORE_ITEMS;
+  }
+  const SimulcastLayer& layer = m_vLayers[uiLayer];
+  return getOutputMediaType(pMediaType, layer.iWidth, layer.iHeight, layer.sVps, layer.sSps, layer.sPps);
+}
+
+HRESULT X265EncoderFilter::decideLayerBufferSize(unsigned uiLayer, IMemAllocator* pAlloc, ALLOCATOR_PROPERTIES* pProp)
+{
+  if (uiLayer >= m_vLayers.size() || m_vLayers[uiLayer].vBitstream.empty())
+  {
+    return VFW_E_NOT_CONNECTED;
+  }
+  // sized like the main output for the layer's bitrate: larger access units get overflow samples
+  const SimulcastLayer& layer = m_vLayers[uiLayer];
+  const unsigned uiParameterSets = static_cast<unsigned>(layer.sVps.length() + layer.sSps.length() + layer.sPps.length());
+  pProp->cbBuffer = getEstimatedOutputBufferSize(layer.uiBitrateKbps, uiParameterSets, layer.vBitstream.size());
+  if (pProp->cbAlign == 0)
+  {
+    pProp->cbAlign = 1;
+  }
+  if (pProp->cBuffers == 0)
+  {
+    pProp->cBuffers = 1;
+  }
+  ALLOCATOR_PROPERTIES Actual;
+  HRESULT hr = pAlloc->SetProperties(pProp, &Actual);
+  if (FAILED(hr))
+  {
+    return hr;
+  }
+  return pProp->cbBuffer > Actual.cbBuffer ? E_FAIL : S_OK;
 }
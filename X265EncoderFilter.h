@@ -1,17 +1,37 @@
 #pragma once
+#include <atomic>
+#include <deque>
 #include <fstream>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
 #include <DirectShowExt/CodecControlInterface.h>
 #include <DirectShowExt/CustomBaseFilter.h>
 #include <DirectShowExt/DirectShowMediaFormats.h>
 #include <DirectShowExt/NotifyCodes.h>
 #include <DirectShowExt/FilterParameterStringConstants.h>
 #include "VersionInfo.h"
+#include "AnnexBRewriter.h"
+#include "H265RtpPacketizer.h"
+#include "UdpRtpSink.h"
+#include "InputPictureLayout.h"
+#include "BoundedFrameQueue.h"
+#include "EncoderInstancePool.h"
+#include "FramePlaneArena.h"
+#include "PresetController.h"
+#include "StatsHistogram.h"
+#include "I420Downscaler.h"
+#include "X265CodecParameters.h"
 
 // Forward
 class ICodecv2;
 // Forward declarations
 template <typename T>
 class RGBtoYUV420ConverterStl;
+class SimdRgb24ToI420Converter;
+class StaticFrameDetector;
+class SimulcastOutputPin;
 
 // {287BE99D-3C3A-4621-B205-A25AF364D19F}
 static const GUID CLSID_VPP_X265Encoder =
@@ -26,6 +46,7 @@ class X265EncoderFilter : public CCustomBaseFilter,
                           public ISpecifyPropertyPages,
                           public ICodecControlInterface
 {
+  friend class SimulcastOutputPin;
 public:
   DECLARE_IUNKNOWN
 
@@ -79,19 +100,109 @@ public:
     addParameter(FILTER_PARAM_PPS, &m_sPps, "", true);
     addParameter(FILTER_PARAM_TARGET_BITRATE_KBPS, &m_uiTargetBitrate, 500);
     addParameter("annexb", &m_bAnnexB, true);
+    addParameter("nal_scan_kernel", &m_sNalScanKernel, "", true);
+    addParameter("simd_rgb_conversion", &m_bSimdRgbConversion, true);
+    addParameter("rgb_conversion_kernel", &m_sRgbConversionKernel, "", true);
+    addParameter("conversion_large_pages", &m_bConversionLargePages, false, true);
+    addParameter("stats_plane_allocations", &m_uiStatsPlaneAllocations, 0, true);
+    addParameter("stats_format_changes", &m_uiStatsFormatChanges, 0, true);
+    addParameter("stats_format_changes_kept", &m_uiStatsFormatChangesKept, 0, true);
+    addParameter("stats_encoder_open_ms", &m_uiStatsEncoderOpenMs, 0, true);
+    addParameter("stats_format_switch_ms", &m_uiStatsFormatSwitchMs, 0, true);
+    addParameter("stats_format_switch_wait_ms", &m_uiStatsFormatSwitchWaitMs, 0, true);
+    addParameter("encoder_pool_size", &m_uiEncoderPoolSize, 0);
+    addParameter("encoder_pool_profiles", &m_sEncoderPoolProfiles, "");
+    addParameter("stats_encoder_pool_hits", &m_uiStatsEncoderPoolHits, 0, true);
+    addParameter("stats_encoder_pool_idle", &m_uiStatsEncoderPoolIdle, 0, true);
+    addParameter("async_encode", &m_bAsyncEncode, false);
+    addParameter("async_queue_depth", &m_uiAsyncQueueDepth, 4);
+    addParameter("async_overflow_policy", &m_sAsyncOverflowPolicy, "block");
+    addParameter("stats_queue_depth", &m_uiStatsQueueDepth, 0, true);
+    addParameter("stats_queue_wait_us", &m_uiStatsQueueWaitUs, 0, true);
+    addParameter("stats_queue_wait_max_us", &m_uiStatsQueueWaitMaxUs, 0, true);
+    addParameter("stats_frames_dropped", &m_uiStatsFramesDropped, 0, true);
+    addParameter("stats_frames_pending", &m_uiStatsFramesPending, 0, true);
+    addParameter("output_buffer_intra_factor", &m_uiIntraFrameSizeFactor, 10);
+    addParameter("stats_output_buffer_size", &m_uiStatsOutputBufferSize, 0, true);
+    addParameter("stats_output_buffer_count", &m_uiStatsOutputBufferCount, 0, true);
+    addParameter("stats_output_buffer_waste", &m_uiStatsOutputBufferWaste, 0, true);
+    addParameter("stats_output_buffer_retries", &m_uiStatsOutputBufferRetries, 0, true);
+    addParameter("stats_output_overflow_drops", &m_uiStatsOutputOverflowDrops, 0, true);
+    addParameter("stats_output_bitrate_kbps", &m_uiStatsOutputBitrateKbps, 0, true);
+    addParameter("stats_bitrate_changes", &m_uiStatsBitrateChanges, 0, true);
+    addParameter("stats_bitrate_convergence_frames", &m_uiStatsBitrateConvergenceFrames, 0, true);
+    addParameter("framebit_limit", &m_uiFrameBitLimit, 0);
+    addParameter("stats_framebit_limit_exceeded", &m_uiStatsFrameBitLimitExceeded, 0, true);
+    addParameter("stats_largest_frame_bits", &m_uiStatsLargestFrameBits, 0, true);
+    addParameter("slice_max_bytes", &m_uiSliceMaxBytes, 0);
+    addParameter("stats_slices_per_frame", &m_uiStatsSlicesPerFrame, 0, true);
+    addParameter("stats_slices_oversized", &m_uiStatsSlicesOversized, 0, true);
+    addParameter("rtp_destination", &m_sRtpDestination, "");
+    addParameter("rtp_max_packet_size", &m_uiRtpMaxPacketSize, 1200);
+    addParameter("rtp_payload_type", &m_uiRtpPayloadType, 96);
+    addParameter("stats_rtp_packets", &m_uiStatsRtpPackets, 0, true);
+    addParameter("stats_rtp_send_errors", &m_uiStatsRtpSendErrors, 0, true);
+    addParameter("stats_rtp_ring_overflows", &m_uiStatsRtpRingOverflows, 0, true);
+    addParameter("keyframe_policy", &m_sKeyframePolicy, "gop");
+    addParameter("keyframe_period", &m_uiIFramePeriod, 0);
+    addParameter("stats_refresh_column_estimate", &m_uiStatsRefreshColumnEstimate, 0, true);
+    addParameter("stats_refresh_columns", &m_uiStatsRefreshColumns, 0, true);
+    addParameter("stats_peak_to_average_pct", &m_uiStatsPeakToAveragePct, 0, true);
+    addParameter("stats_idr_requests", &m_uiStatsIdrRequests, 0, true);
+    addParameter("stats_idr_forced", &m_uiStatsIdrForced, 0, true);
+    addParameter("stats_idr_restarts", &m_uiStatsIdrRestarts, 0, true);
+    addParameter("stats_frames_intra", &m_uiStatsFramesIntra, 0, true);
+    addParameter("stats_frames_reference", &m_uiStatsFramesReference, 0, true);
+    addParameter("stats_frames_non_reference", &m_uiStatsFramesNonReference, 0, true);
+    addParameter("simulcast_layers", &m_sSimulcastLayers, "");
+    addParameter("stats_simulcast_layers", &m_uiStatsSimulcastLayers, 0, true);
+    addParameter("stats_simulcast_drops", &m_uiStatsSimulcastDrops, 0, true);
+    addParameter("frame_threads", &m_threading.uiFrameThreads, 0);
+    addParameter("wpp", &m_threading.bWpp, true);
+    addParameter("pool_threads", &m_threading.uiPoolThreads, 0);
+    addParameter("numa_nodes", &m_threading.sNumaNodes, "");
+    addParameter("shared_encoder_pool", &m_bSharedEncoderPool, false);
+    addParameter("shared_pool_threads", &m_uiSharedPoolThreads, 0);
+    addParameter("stats_shared_pool_threads", &m_uiStatsSharedPoolThreads, 0, true);
+    addParameter("stats_deadline_misses", &m_uiStatsDeadlineMisses, 0, true);
+    addParameter("preset_control", &m_bPresetControl, false);
+    addParameter("cpu_budget_pct", &m_uiCpuBudgetPct, 80);
+    addParameter("preset_fastest", &m_sPresetFastest, "ultrafast");
+    addParameter("preset_slowest", &m_sPresetSlowest, "medium");
+    addParameter("stats_preset_level", &m_uiStatsPresetLevel, 0, true);
+    addParameter("stats_preset_speedups", &m_uiStatsPresetSpeedups, 0, true);
+    addParameter("stats_preset_slowdowns", &m_uiStatsPresetSlowdowns, 0, true);
+    addParameter("stats_preset_last_switch_ms", &m_uiStatsPresetLastSwitchMs, 0, true);
+    addParameter("stats_encode_load_pct", &m_uiStatsEncodeLoadPct, 0, true);
+    addParameter("static_frame_policy", &m_sStaticFramePolicy, "encode");
+    addParameter("static_frame_kernel", &m_sStaticFrameKernel, "", true);
+    addParameter("dirty_blocks", &m_bDirtyBlocks, false);
+    addParameter("unchanged_ctu_qp_offset", &m_uiUnchangedCtuQpOffset, 10);
+    addParameter("stats_changed_ctus_pct", &m_uiStatsChangedCtusPct, 0, true);
+    addParameter("stats_static_frames", &m_uiStatsStaticFrames, 0, true);
+    addParameter("stats_static_saved_ms", &m_uiStatsStaticSavedMs, 0, true);
   }
 
-	/// Overridden from SettingsInterface
+	/// Overridden from SettingsInterface.
+  /// Codec parameters are served from a snapshot published by the encoding thread and never
+  /// wait for an encode. A parameter missing from the snapshot returns E_PENDING while
+  /// streaming and is included from the next frame on. It returns E_FAIL once the codec
+  /// has failed to return it, or if too many such parameters are watched already.
+  /// Per stage histograms are read as stats_<stage>_p50, _p95, _p99, _max and _count.
 	STDMETHODIMP GetParameter( const char* szParamName, int nBufferSize, char* szValue, int* pLength );
+  /// Codec parameters set while streaming are queued and applied between frames.
+  /// Setting stats_reset clears the histograms and counters.
+
 	STDMETHODIMP SetParameter( const char* type, const char* value);
 	STDMETHODIMP GetParameterSettings( char* szResult, int nSize );
 
   /**
-   * @brief Overridden from ICodecControlInterface. Getter for frame bit limit
+   * @brief Overridden from ICodecControlInterface. Getter for frame bit limit in bits, 0 if there is none
    */
   STDMETHODIMP GetFramebitLimit(int& iFrameBitLimit);
   /**
    * @brief @ICodecControlInterface. Overridden from ICodecControlInterface
+   * Caps the size of every access unit through a one frame VBV buffer. 0 removes the cap.
    */
   STDMETHODIMP SetFramebitLimit(int iFrameBitLimit);
   /**
@@ -104,6 +215,7 @@ public:
   STDMETHODIMP SetGroupId(int iGroupId);
   /**
    * @brief @ICodecControlInterface. Overridden from ICodecControlInterface
+   * Flags the next picture as an IDR. The encoder keeps its rate control and lookahead state.
    */
   STDMETHODIMP GenerateIdr();
   /**
@@ -112,7 +224,8 @@ public:
   STDMETHODIMP GetBitrateKbps(int& uiBitrateKbps);
   /**
    * @brief @ICodecControlInterface. Method to set bitrate in kbps
-   * Overridden from ICodecControlInterface
+   * Overridden from ICodecControlInterface. Applied to the running encoder at the next
+   * frame boundary without restarting it.
    */
   STDMETHODIMP SetBitrateKbps(int uiBitrateKbps);
 
@@ -149,7 +262,24 @@ public:
 	/// Overridden from CCustomBaseFilter
 	virtual void InitialiseInputTypes();
 
-  HRESULT Transform(IMediaSample *pSource, IMediaSample *pDest);
+  /**
+   * @brief Queues the sample for the encoder thread when async_encode is set,
+   * otherwise encodes it on the streaming thread.
+   */
+  HRESULT Receive(IMediaSample *pSample);
+  HRESULT StartStreaming();
+  HRESULT StopStreaming();
+  STDMETHODIMP Stop();
+  /// Waits for queued frames to be encoded and drains the encoder before passing the end of stream on
+  HRESULT EndOfStream();
+  /// Discards queued frames and the frames held by the encoder
+  HRESULT BeginFlush();
+  HRESULT EndFlush();
+  HRESULT NewSegment(REFERENCE_TIME tStart, REFERENCE_TIME tStop, double dRate);
+
+  /// One output pin per simulcast layer follows the input and main output pins
+  int GetPinCount();
+  CBasePin* GetPin(int n);
 
 private:
   /**
@@ -158,12 +288,306 @@ private:
   */
   unsigned copySequenceAndPictureParameterSetsIntoBuffer(BYTE* pBuffer);
   unsigned getParameterSetLength() const;
+  typedef std::vector<std::pair<std::string, std::string> > CodecParameterList;
+  /// What an open encoder was configured for
+  struct EncoderInput
+  {
+    EncoderInput() :rtFrameLength(0), uiSettingsGeneration(0) {}
+    InputPictureLayout layout;
+    REFERENCE_TIME rtFrameLength;
+    /// m_uiSettingsGeneration when the encoder was configured
+    unsigned uiSettingsGeneration;
+    /// false if an encoder for one input cannot take the other, e.g. only the aspect ratio differs
+    bool operator==(const EncoderInput& other) const
+    {
+      return layout == other.layout && rtFrameLength == other.rtFrameLength && uiSettingsGeneration == other.uiSettingsGeneration;
+    }
+  };
+  /// The settings openEncoder applies, copied by snapshotEncoderSettings so that it never reads the filter's own
+  struct EncoderSettings
+  {
+    EncoderSettings() :uiFrameBitLimit(0), uiIFramePeriod(0), uiSliceMaxBytes(0), bAnnexB(false), bPresetControlActive(false), bDirtyBlocks(false), bSimdRgbConversion(false), bSharedEncoderPool(false) {}
+    std::string sKeyframePolicy;
+    CodecThreading threading;
+    unsigned uiFrameBitLimit;
+    unsigned uiIFramePeriod;
+    unsigned uiSliceMaxBytes;
+    bool bAnnexB;
+    bool bPresetControlActive;
+    bool bDirtyBlocks;
+    bool bSimdRgbConversion;
+    bool bSharedEncoderPool;
+    /// codec parameters set through SetParameter, for new codec instances
+    CodecParameterList vCodecSettings;
+  };
+  /// An encoder opened for an input, with what the filter needs to switch to it
+  struct PreparedEncoder
+  {
+    PreparedEncoder() :pCodec(NULL), uiPresetLevel(0), uiBitrateKbps(0), bCodecStridedInput(false), bCodecKeyframes(false), bCodecCtuHints(false), bFromPool(false), hr(S_OK), uiOpenUs(0) {}
+    EncoderInput input;
+    EncoderSettings settings;
+    ICodecv2* pCodec;
+    /// preset of the preset controller, if active, when the encoder was configured
+    unsigned uiPresetLevel;
+    unsigned uiBitrateKbps;
+    /// EncoderInstancePool key of the configuration
+    std::string sProfile;
+    /// the conversion planes, NULL pointers if the codec reads samples in place
+    FramePlanes planes;
+    bool bCodecStridedInput;
+    bool bCodecKeyframes;
+    bool bCodecCtuHints;
+    std::string sVps;
+    std::string sSps;
+    std::string sPps;
+    /// taken from EncoderInstancePool instead of opened
+    bool bFromPool;
+    /// S_OK once the encoder is open, otherwise sError says why it is not
+    HRESULT hr;
+    std::string sError;
+    uint32_t uiOpenUs;
+  };
+  /// Reads the input a VIDEOINFOHEADER media type describes. Returns false for other formats.
+  bool describeInput(const CMediaType* pmt, EncoderInput& input) const;
+  /// Copies the settings, bitrate and preset an encoder is opened with. Called on the filter's threads.
+  void snapshotEncoderSettings(PreparedEncoder& encoder);
+  /**
+   * @brief Configures and opens encoder.pCodec for encoder.input with encoder.settings, creating
+   * a codec instance if there is none. Reads nothing else of the filter, so that it can run on a
+   * background thread: settings changed meanwhile show in m_uiSettingsGeneration.
+   * @param bFromPool true to take an idle encoder of the same profile from EncoderInstancePool
+   * if there is one. encoder.pCodec is then replaced and stays with its owner.
+   */
+  static HRESULT openEncoder(PreparedEncoder& encoder, bool bFromPool);
+  /// EncoderInstancePool key of everything openEncoder sets on a codec for the input
+  static std::string getEncoderProfile(const PreparedEncoder& encoder);
+  /// Converters, layout and bitstream buffer for a new input. Called with m_csCodec held or while stopped.
+  void applyInputFormat(const EncoderInput& input);
+  /// Makes encoder the active one: a different codec instance replaces m_pCodec, which is retired
+  void installEncoder(PreparedEncoder& encoder);
+  /// Closes and frees the codec and planes of an encoder that is not used
+  void releaseEncoder(PreparedEncoder& encoder);
+  /// Closes and frees a codec on m_retireThread: closing x265 waits for its worker threads
+  void retireCodec(ICodecv2* pCodec);
+  /**
+   * @brief Takes m_pCodec and the conversion planes away from the filter. They are restarted and
+   * given to EncoderInstancePool on m_retireThread if the codec is still configured as it was
+   * opened, otherwise the codec is retired.
+   */
+  void recycleEncoder();
+  /**
+   * @brief Applies encoder_pool_size to the process-wide EncoderInstancePool and, while stopped,
+   * starts opening encoders for encoder_pool_profiles on m_warmThread.
+   */
+  bool configureEncoderPool(bool bCapacity);
+  /// Opens encoders for the profiles with the settings of prototype until each has its share of the pool
+  void warmEncoderPool(std::string sProfiles, PreparedEncoder prototype);
+  void stopWarmingEncoderPool();
+  /**
+   * @brief Starts opening the encoder for a format a queued sample switches to. Never waits:
+   * nothing is started while an earlier encoder is still being opened.
+   */
+  void prepareEncoder(const EncoderInput& input);
+  /// Waits for the encoder of prepareEncoder and takes it if it was opened for input
+  bool takePreparedEncoder(const EncoderInput& input, PreparedEncoder& encoder);
+  void discardPreparedEncoder();
+  /**
+   * @brief Switches to a new input format while streaming: the pictures of the old format
+   * are encoded and delivered first, then the prepared encoder, or one opened here if the
+   * change was not announced, takes over and downstream gets the new output type with the
+   * next sample. Called from SetMediaType on the thread that encodes, for a sample that carries
+   * a new media type.
+   */
+  HRESULT switchEncoder(const EncoderInput& input);
+  /// Keeps a codec parameter set through SetParameter for codec instances created later. Called with m_csControl held.
+  void addCodecSetting(const char* szName, const char* szValue);
+  /**
+   * @brief Describes the input layout to the codec.
+   * @return true if the codec accepted the strides and plane offsets, i.e. samples can be
+   * passed to ICodecv2::Code without repacking.
+   */
+  static bool configureCodecInputLayout(ICodecv2* pCodec, const InputPictureLayout& layout);
+  /// Describes planes handed out by FramePlaneArena to the codec
+  static bool configureCodecInputLayout(ICodecv2* pCodec, const FramePlanes& planes);
+  static bool configureCodecInputLayout(ICodecv2* pCodec, int iYStride, int iUvStride, unsigned uiUOffset, unsigned uiVOffset);
+  /**
+   * @brief Takes the planes that converted or repacked pictures are written to from the
+   * arena. Rows are padded to the SIMD alignment if the converter and the codec support it.
+   */
+  static bool acquireConversionPlanes(ICodecv2* pCodec, int iWidth, int iHeight, bool bPadded, FramePlanes& planes);
  /**
 	* This method converts the input buffer from RGB24 | 32 to YUV420P
 	* @param pSource The source buffer
 	* @param pDest The destination buffer
 	*/
 	virtual HRESULT ApplyTransform(BYTE* pBufferIn, long lInBufferSize, long lActualDataLength, BYTE* pBufferOut, long lOutBufferSize, long& lOutActualDataLength);
+  /// Sample times of a picture that has gone into the encoder
+  struct FrameTimes
+  {
+    FrameTimes() :tStart(0), tStop(0), bTimeValid(false) {}
+    REFERENCE_TIME tStart;
+    REFERENCE_TIME tStop;
+    bool bTimeValid;
+  };
+
+  /**
+   * @brief Encodes one input sample and delivers the access unit the encoder returns, if any.
+   * @param pSource The input sample or NULL to take a delayed picture out of the encoder.
+   */
+  HRESULT encodeAndDeliver(IMediaSample* pSource);
+  /**
+   * @brief Remembers the times of a sample and picks its codec pts. Samples without times are
+   * placed a frame length after the previous picture.
+   */
+  void addInputTimes(IMediaSample* pSource);
+  /// Removes the times of the picture pCodec returned last from mFrameTimes
+  void takeOutputTimes(ICodecv2* pCodec, std::map<int64_t, FrameTimes>& mFrameTimes, FrameTimes& times);
+  HRESULT drainEncoder(BYTE* pBufferOut, long lOutBufferSize, long& lOutActualDataLength);
+  /**
+   * @brief Empties the encoder pipeline, delivering its pictures if bDeliver is set,
+   * and restarts the encoder so that it accepts new pictures unless it is about to be replaced.
+   */
+  HRESULT flushEncoder(bool bDeliver, bool bRestart = true);
+  /// Restarts the codec, dropping the pictures it holds
+  void restartEncoder();
+  /**
+   * @brief Output buffer size for the target bitrate and frame rate: an average frame
+   * scaled by output_buffer_intra_factor, bounded by the encoder's own output buffer.
+   */
+  unsigned getEstimatedOutputBufferSize() const;
+  /// The same for an encoder of another bitrate, e.g. a simulcast layer
+  unsigned getEstimatedOutputBufferSize(unsigned uiBitrateKbps, unsigned uiParameterSets, size_t uiBitstreamBufferSize) const;
+  /// Gets an output sample of at least lRequiredSize bytes, from getOverflowSample() if the connection's buffers are too small
+  HRESULT getDeliveryBuffer(long lRequiredSize, IMediaSample** ppSample);
+  /// Gets a sample from a filter-owned allocator, which is created or replaced by a larger one if needed
+  static HRESULT getOverflowSample(IMemAllocator*& pOverflowAllocator, long lRequiredSize, IMediaSample** ppSample);
+  static void releaseOverflowAllocator(IMemAllocator*& pOverflowAllocator);
+  /// Releases the overflow allocators of the main output and the layers
+  void releaseOverflowAllocators();
+  void updateOutputBufferStats(long lAccessUnitSize);
+  /// Measures the output rate and how long it takes to settle after a bitrate change
+  void updateBitrateStats(long lAccessUnitSize);
+  /// Passes a bitrate set through SetBitrateKbps to the codec. Called before each frame.
+  void applyPendingBitrate();
+  /// Applies a keyframe_period set while streaming, starting a new period
+  void applyPendingKeyframePeriod();
+  /// Maps a frame bit limit to the codec's VBV settings, draining at uiBitrateKbps
+  static bool configureFrameBitLimit(ICodecv2* pCodec, unsigned uiFrameBitLimit, unsigned uiBitrateKbps);
+  /// Counts access units larger than the frame bit limit
+  void checkFrameBitLimit(long lAccessUnitSize);
+  /// Slice count for slice_max_bytes at the input's height
+  bool configureSlices();
+  /// Opens the RTP sink for rtp_destination, if set. Called from StartStreaming.
+  bool configureRtp();
+  /// Packetizes an access unit as RTP and sends it to rtp_destination
+  void sendRtp(const BYTE* pData, long lLength, const FrameTimes& times);
+  /**
+   * @brief Delivers part of an access unit in its own sample: the whole access unit, or one
+   * slice group in slice mode. The media stop time is the next decode index on the last sample
+   * of a picture only, which marks the end of the frame.
+   */
+  HRESULT deliverOutputSample(const BYTE* pData, long lLength, const FrameTimes& times, bool bSyncPoint, bool bEndOfFrame);
+  /**
+   * @brief Checks keyframe_policy: "gop" for an IDR every keyframe_period frames, "intra_refresh"
+   * for a column of intra blocks that sweeps the picture every keyframe_period frames.
+   */
+  bool configureKeyframePolicy();
+  /**
+   * @brief Sets frame_threads, wpp, pool_threads and numa_nodes on a closed codec, or a single
+   * thread with shared_encoder_pool. They take effect when the input is next connected.
+   */
+  static bool configureThreading(ICodecv2* pCodec, const EncoderSettings& settings, std::string& sError);
+  /**
+   * @brief Starts preset_control at preset_slowest. The frame interval comes from the input's
+   * AvgTimePerFrame.
+   */
+  bool configurePresetControl();
+  /// Feeds the time taken by a frame to the preset controller and applies a new preset
+  void updatePresetControl(uint32_t uiFrameUs);
+  /**
+   * @brief Creates the detector for static_frame_policy: "encode" passes every picture on,
+   * "repeat" encodes the last converted picture again for an unchanged input, which x265 codes
+   * with skipped blocks, and "drop" does not pass unchanged pictures to the codec at all.
+   * With dirty_blocks the detector compares each CTU instead of the whole picture.
+   */
+  bool configureStaticFrames();
+  /**
+   * @brief Counts static frames and the time they saved, estimated from the conversion and
+   * encode time of the last changed picture, less the time spent on detection.
+   */
+  void updateStaticFrameStats(bool bStatic, uint32_t uiCheckUs, uint32_t uiConvertUs, uint32_t uiEncodeUs);
+  /// Makes the next picture an IDR, restarting the codec only if it cannot flag pictures
+  void forceIdr();
+  /// Applies codec parameters queued by SetParameter, keeps those the codec took and publishes a new snapshot
+  void applyPendingCodecParameters();
+  /// Reads all codec parameters into m_pCodecParameters. Called with m_csCodec held.
+  void publishCodecParameters();
+  /// Encoder thread of the async mode
+  void encodeLoop();
+  /// Job of the shared encoder pool: encodes the next queued sample, if any
+  void encodeNextQueued();
+  /// Encodes and delivers a sample taken from the queue and releases it
+  void encodeQueuedSample(IMediaSample* pSample, uint64_t uiWaitUs);
+  void releaseQueuedSamples();
+  /// Returns the histogram for a stage name such as "encode_us", NULL if there is none
+  const StatsHistogram* getHistogram(const std::string& sStage) const;
+  /// Formats stats_<stage>_<p50|p95|p99|max|count>
+  bool getHistogramValue(const std::string& sName, std::string& sValue) const;
+  /// Counts the access unit by the type of its first picture
+  void updateFrameTypeStats(const BYTE* pData, long lLength);
+  /**
+   * @brief Rewrites an Annex B access unit of the codec to length-prefixed NAL units in place
+   * unless annexb is set.
+   * @return The length of the access unit to deliver, 0 if it had to be dropped.
+   */
+  long toOutputFormat(AnnexBRewriter& rewriter, BYTE* pData, long lLength, long lCapacity);
+  void resetStats();
+  /// Output media type for an encoded picture of the given size and parameter sets
+  HRESULT getOutputMediaType(CMediaType* pMediaType, int iWidth, int iHeight, const std::string& sVps, const std::string& sSps, const std::string& sPps);
+
+  /// An extra resolution encoded from the same input and delivered on its own pin
+  struct SimulcastLayer
+  {
+    SimulcastLayer() :iWidth(0), iHeight(0), uiBitrateKbps(0), pCodec(NULL), lLength(0), llDecodeIndex(0), pPin(NULL), pOverflowAllocator(NULL) {}
+    int iWidth;
+    int iHeight;
+    unsigned uiBitrateKbps;
+    /// NULL until the input is connected, and for layers larger than the input
+    ICodecv2* pCodec;
+    std::shared_ptr<I420Downscaler> pScaler;
+    std::vector<BYTE> vPicture;
+    std::vector<BYTE> vBitstream;
+    /// its own, as layers may be flushed while the main output is being rewritten
+    AnnexBRewriter rewriter;
+    /// size of the access unit in vBitstream that is waiting to be delivered
+    long lLength;
+    FrameTimes times;
+    std::map<int64_t, FrameTimes> mFrameTimes;
+    LONGLONG llDecodeIndex;
+    std::string sVps;
+    std::string sSps;
+    std::string sPps;
+    SimulcastOutputPin* pPin;
+    /// for access units larger than the pin's buffers, as m_pOverflowAllocator
+    IMemAllocator* pOverflowAllocator;
+  };
+  /// Recreates the layer pins when simulcast_layers has changed. Called with m_csFilter held.
+  void updateSimulcastPins();
+  void destroySimulcastLayers();
+  /// Opens a codec per layer for the current input size. Called from SetMediaType or while stopped.
+  bool openSimulcastLayers();
+  /**
+   * @brief Scales the picture just passed to the main codec and encodes it for each layer
+   * with a connected pin. Called with m_csCodec held.
+   */
+  void encodeSimulcastLayers(const BYTE* pBufferIn, const BYTE* pInput, int64_t iPts, bool bIdr);
+  /// Delivers the access units produced by encodeSimulcastLayers
+  void deliverSimulcastLayers();
+  /// Empties the layer encoders like flushEncoder
+  void flushSimulcastLayers(bool bDeliver);
+  HRESULT checkLayerMediaType(unsigned uiLayer, const CMediaType* pMediaType);
+  HRESULT getLayerMediaType(unsigned uiLayer, int iPosition, CMediaType* pMediaType);
+  HRESULT decideLayerBufferSize(unsigned uiLayer, IMemAllocator* pAlloc, ALLOCATOR_PROPERTIES* pProp);
 
 	ICodecv2* m_pCodec;
   /// Receive Lock
@@ -177,17 +601,280 @@ private:
   std::string m_sSps;
   std::string m_sPps;
 
-  // For auto i-frame generation
+  // For auto i-frame generation. Written under m_csControl, while streaming only by the encoding thread
   unsigned m_uiIFramePeriod;
+  /// keyframe_period set while streaming and not yet applied, -1 if none
+  std::atomic<int> m_iPendingIFramePeriod;
   // frame counter for i-frame generation
   unsigned m_uiCurrentFrame;
+  /// Written under m_csControl, while streaming only by the encoding thread
   unsigned m_uiTargetBitrate;
 
+  /// AvgTimePerFrame of the input, given to the codec as its frame rate
   REFERENCE_TIME m_rtFrameLength;
-  REFERENCE_TIME m_tStart;
-  REFERENCE_TIME m_tStop;
 
   RGBtoYUV420ConverterStl<unsigned char>* m_pConverter;
-  unsigned m_uiConversionBufferSize;
-  unsigned char* m_pYuvConversionBuffer;
+  /// Visible rows of a cropped RGB24 sample as a packed DIB, since m_pConverter cannot skip a border
+  std::vector<uint8_t> m_vPackedRgb;
+  /// Used instead of m_pConverter for RGB24 input unless simd_rgb_conversion is false
+  SimdRgb24ToI420Converter* m_pSimdConverter;
+  bool m_bSimdRgbConversion;
+  std::string m_sRgbConversionKernel;
+  /// Pictures converted from RGB24 or repacked from I420, NULL pointers if the codec reads samples in place
+  FramePlanes m_conversionPlanes;
+  bool m_bConversionLargePages;
+  /// buffers FramePlaneArena allocated process-wide: constant while streaming
+  unsigned m_uiStatsPlaneAllocations;
+
+  /// Plane geometry of the negotiated input type
+  InputPictureLayout m_inputLayout;
+
+  enum StaticFramePolicy
+  {
+    SFP_ENCODE,
+    SFP_REPEAT,
+    SFP_DROP
+  };
+  std::string m_sStaticFramePolicy;
+  StaticFramePolicy m_eStaticFramePolicy;
+  /// NULL with static_frame_policy encode
+  std::unique_ptr<StaticFrameDetector> m_pStaticDetector;
+  std::string m_sStaticFrameKernel;
+  StatsHistogram m_histStaticCheckUs;
+  // dirty_blocks: only the CTUs that changed are converted from RGB24, and the codec is given
+  // unchanged_ctu_qp_offset for the others so that it spends next to no time or bits on them
+  bool m_bDirtyBlocks;
+  unsigned m_uiUnchangedCtuQpOffset;
+  /// true if the codec takes in_ctu_qp_offsets
+  bool m_bCodecCtuHints;
+  uint64_t m_ullChangedCtus;
+  uint64_t m_ullCtus;
+  /// share of CTUs that changed since the statistics were reset
+  unsigned m_uiStatsChangedCtusPct;
+  /// conversion and encode time of the last picture that had changed
+  uint32_t m_uiLastConvertUs;
+  uint32_t m_uiLastEncodeUs;
+  /// time saved on unchanged pictures less the time spent detecting them
+  int64_t m_llStaticSavedUs;
+  unsigned m_uiStatsStaticFrames;
+  unsigned m_uiStatsStaticSavedMs;
+  /// true if the codec reads I420 samples in place using m_inputLayout
+  bool m_bCodecStridedInput;
+
+  // An input format change that leaves m_activeInput alone keeps the open encoder. Otherwise
+  // a change while streaming switches to an encoder prepared on m_prepareThread when the sample
+  // that carries the new type was queued ahead of it, and the old codec is closed on m_retireThread.
+  /// bumped by SetParameter: settings may have changed since an encoder was configured
+  std::atomic<unsigned> m_uiSettingsGeneration;
+  /// Protects m_activeInput, m_preparedEncoder and the threads
+  CCritSec m_csPrepare;
+  /// input m_pCodec was opened for, empty if it is not open
+  EncoderInput m_activeInput;
+  PreparedEncoder m_preparedEncoder;
+  std::thread m_prepareThread;
+  /// set by m_prepareThread once the encoder is open, so that joining it does not wait
+  std::atomic<bool> m_bPrepareDone;
+  std::thread m_retireThread;
+  /// set by a switch: the next output sample carries the new media type
+  bool m_bOutputTypeChanged;
+  unsigned m_uiStatsFormatChanges;
+  /// format changes that needed no new encoder
+  unsigned m_uiStatsFormatChangesKept;
+  /// time the last encoder took to configure and open
+  unsigned m_uiStatsEncoderOpenMs;
+  /// time the last switch while streaming held up encoding, from the first sample of the new format
+  unsigned m_uiStatsFormatSwitchMs;
+  /// part of it spent waiting for the prepared encoder to open
+  unsigned m_uiStatsFormatSwitchWaitMs;
+
+  // Opened encoders are taken from the process-wide EncoderInstancePool when it has one of the
+  // same profile, and given back to it when they are replaced or the filter goes away.
+  /// idle encoders the pool keeps over all filters, 0 for no pool
+  unsigned m_uiEncoderPoolSize;
+  /// WIDTHxHEIGHT@KBPS[/FPS][:rgb24] entries to open encoders for ahead of time
+  std::string m_sEncoderPoolProfiles;
+  /// EncoderInstancePool key of m_pCodec, empty if it is not open
+  std::string m_sEncoderProfile;
+  std::thread m_warmThread;
+  std::atomic<bool> m_bStopWarming;
+  /// encoders this filter took from the pool
+  unsigned m_uiStatsEncoderPoolHits;
+  /// idle encoders in the pool when this filter last used it
+  unsigned m_uiStatsEncoderPoolIdle;
+
+  // Async mode: the streaming thread queues samples and m_encodeThread encodes and delivers them.
+  // Queued samples are held with AddRef so the upstream allocator also bounds the queue.
+  bool m_bAsyncEncode;
+  unsigned m_uiAsyncQueueDepth;
+  std::string m_sAsyncOverflowPolicy;
+  /// async_encode or shared_encoder_pool as of StartStreaming
+  bool m_bAsyncActive;
+  BoundedFrameQueue<IMediaSample*> m_encodeQueue;
+  std::thread m_encodeThread;
+  // With shared_encoder_pool the queue is served by SharedEncoderPool instead of m_encodeThread,
+  // and the codec runs single threaded on the pool's workers.
+  bool m_bSharedEncoderPool;
+  /// size of the pool if this filter starts it, 0 for one thread per CPU
+  unsigned m_uiSharedPoolThreads;
+  unsigned m_uiPoolChannel;
+  bool m_bPoolChannelActive;
+  unsigned m_uiStatsSharedPoolThreads;
+  /// queued samples whose encode ended more than a frame length after they arrived
+  unsigned m_uiStatsDeadlineMisses;
+  /// first failure on the encoder thread, returned to upstream from Receive
+  HRESULT m_hrAsyncError;
+  unsigned m_uiStatsQueueDepth;
+  unsigned m_uiStatsQueueWaitUs;
+  unsigned m_uiStatsQueueWaitMaxUs;
+  unsigned m_uiStatsFramesDropped;
+
+  /// Times of the pictures inside the encoder, keyed by the pts given to the codec
+  std::map<int64_t, FrameTimes> m_mFrameTimes;
+  /// pts of the picture being added: its start time, kept increasing
+  int64_t m_iNextCodecPts;
+  /// pts of the last picture passed to the codec, NO_CODEC_PTS after a restart
+  int64_t m_iLastCodecPts;
+  /// decode order index of the next delivered access unit
+  LONGLONG m_llDecodeIndex;
+  /// set by a discontinuity on the input, cleared by the next delivery
+  bool m_bDiscontinuity;
+  unsigned m_uiStatsFramesPending;
+
+  /// The encoder writes access units here. Sized for an uncompressed frame.
+  std::vector<BYTE> m_vBitstreamBuffer;
+  /// Turns the access units in m_vBitstreamBuffer into HVC1 samples unless annexb is set
+  AnnexBRewriter m_annexBRewriter;
+  std::string m_sNalScanKernel;
+  /// worst case intra frame size as a multiple of the average frame size
+  unsigned m_uiIntraFrameSizeFactor;
+  /// Allocator for access units larger than the connection's buffers, created on the first one
+  IMemAllocator* m_pOverflowAllocator;
+  uint64_t m_ullOutputBytes;
+  uint64_t m_ullOutputFrames;
+  unsigned m_uiStatsOutputBufferSize;
+  unsigned m_uiStatsOutputBufferCount;
+  /// allocated but unused output bytes for an average access unit
+  unsigned m_uiStatsOutputBufferWaste;
+  unsigned m_uiStatsOutputBufferRetries;
+  unsigned m_uiStatsOutputOverflowDrops;
+
+  /// bitrate requested through SetBitrateKbps and not yet applied, 0 if none
+  std::atomic<int> m_iPendingBitrateKbps;
+  std::deque<long> m_dqRecentFrameSizes;
+  uint64_t m_ullRecentBytes;
+  unsigned m_uiFramesSinceBitrateChange;
+  bool m_bBitrateConverging;
+  unsigned m_uiStatsOutputBitrateKbps;
+  unsigned m_uiStatsBitrateChanges;
+  /// frames it took the output rate to get within 10% of the last new target
+  unsigned m_uiStatsBitrateConvergenceFrames;
+
+  /// maximum access unit size in bits, 0 for none. Written under m_csControl.
+  unsigned m_uiFrameBitLimit;
+  /// limit requested through SetFramebitLimit and not yet applied, -1 if none
+  std::atomic<int> m_iPendingFrameBitLimit;
+  unsigned m_uiStatsFrameBitLimitExceeded;
+  unsigned m_uiStatsLargestFrameBits;
+
+  /// largest slice in bytes, 0 to deliver whole access units
+  unsigned m_uiSliceMaxBytes;
+  /// slices per picture the codec was opened with
+  unsigned m_uiSlices;
+  /// offsets behind the slice groups of the access unit being delivered
+  std::vector<size_t> m_vSliceEnds;
+  unsigned m_uiStatsSlicesPerFrame;
+  /// slice groups larger than slice_max_bytes, e.g. of IDRs
+  unsigned m_uiStatsSlicesOversized;
+
+  /// host:port the access units are sent to as RTP, empty for none
+  std::string m_sRtpDestination;
+  /// largest RTP packet including its header, i.e. the path MTU less the IP and UDP headers
+  unsigned m_uiRtpMaxPacketSize;
+  unsigned m_uiRtpPayloadType;
+  H265RtpPacketizer m_rtpPacketizer;
+  /// sized for the largest access unit the encoder can write
+  RtpPacketRing m_rtpRing;
+  UdpRtpSink m_rtpSink;
+  unsigned m_uiStatsRtpPackets;
+  unsigned m_uiStatsRtpSendErrors;
+  /// access units that did not fit the ring: their last packets were lost
+  unsigned m_uiStatsRtpRingOverflows;
+
+  std::string m_sKeyframePolicy;
+  bool m_bIntraRefresh;
+  /// true if the codec inserts keyframes itself rather than the filter restarting it
+  bool m_bCodecKeyframes;
+  /**
+   * CTU column the current frame should refresh, assuming that the sweep covers the picture
+   * evenly and restarts every keyframe_period frames. x265 does not report the column it
+   * refreshed, so it can be off, e.g. after an IDR.
+   */
+  unsigned m_uiStatsRefreshColumnEstimate;
+  unsigned m_uiStatsRefreshColumns;
+  /// largest access unit as a percentage of the average
+  unsigned m_uiStatsPeakToAveragePct;
+
+  /// set by GenerateIdr and the GOP logic, consumed before the next picture
+  std::atomic<bool> m_bIdrRequested;
+  unsigned m_uiStatsIdrRequests;
+  /// IDRs produced by flagging a picture
+  unsigned m_uiStatsIdrForced;
+  /// IDRs produced by restarting the codec
+  unsigned m_uiStatsIdrRestarts;
+
+  /// Codec parameter values, replaced as a whole with atomic_store
+  std::shared_ptr<const CodecParameterList> m_pCodecParameters;
+  /// Protects the members below. Never held while encoding.
+  CCritSec m_csControl;
+  CodecParameterList m_vPendingCodecParameters;
+  /// codec parameters set through SetParameter, replayed on new codec instances
+  CodecParameterList m_vCodecSettings;
+  /// parameters that are not enumerated by the codec but have been asked for
+  std::vector<std::string> m_vWatchedCodecParameters;
+  /// watched parameters the codec failed to return, most recent last
+  std::vector<std::string> m_vUnknownCodecParameters;
+  bool m_bCodecParametersStale;
+
+  /// Per stage distributions. Written by the encoding thread, read by control calls.
+  StatsHistogram m_histConvertUs;
+  StatsHistogram m_histEncodeUs;
+  StatsHistogram m_histOutputBytes;
+  StatsHistogram m_histQueueWaitUs;
+  /// IRAP access units
+  unsigned m_uiStatsFramesIntra;
+  /// other access units whose pictures are used for reference
+  unsigned m_uiStatsFramesReference;
+  /// access units that no other picture references, i.e. most B-frames
+  unsigned m_uiStatsFramesNonReference;
+
+  /// threading of the main and layer encoders
+  CodecThreading m_threading;
+
+  // preset_control: steps the x265 preset between preset_fastest and preset_slowest so that
+  // converting and encoding a frame takes at most cpu_budget_pct of the frame interval
+  bool m_bPresetControl;
+  unsigned m_uiCpuBudgetPct;
+  std::string m_sPresetFastest;
+  std::string m_sPresetSlowest;
+  /// preset_control as of SetMediaType
+  bool m_bPresetControlActive;
+  PresetController m_presetController;
+  /// index of the current preset from 0 for ultrafast to 9 for placebo
+  unsigned m_uiStatsPresetLevel;
+  unsigned m_uiStatsPresetSpeedups;
+  unsigned m_uiStatsPresetSlowdowns;
+  /// stream time of the picture at which the preset last changed
+  unsigned m_uiStatsPresetLastSwitchMs;
+  unsigned m_uiStatsEncodeLoadPct;
+
+  /// Simulcast layers as WIDTHxHEIGHT@KBPS separated by commas, e.g. "1280x720@1500,640x360@400"
+  std::string m_sSimulcastLayers;
+  /// simulcast_layers as of the last time the pins were created
+  std::string m_sSimulcastPins;
+  std::vector<SimulcastLayer> m_vLayers;
+  StatsHistogram m_histScaleUs;
+  /// layers with an open codec
+  unsigned m_uiStatsSimulcastLayers;
+  /// layer access units that did not fit the downstream buffer
+  unsigned m_uiStatsSimulcastDrops;
 };
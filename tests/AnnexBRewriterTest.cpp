@@ -0,0 +1,242 @@
+/**
+ * AnnexBRewriter: the start code kernels agree, toLengthPrefixed gives the length-prefixed
+ * NAL units for 3 and 4 byte start codes with every kernel, and buildHvcc writes the record
+ * fields from an SPS with emulation prevention bytes.
+ */
+#include "AnnexBRewriter.h"
+#include <string>
+#include <vector>
+#include "TestUtil.h"
+
+/// Writes the RBSP of a parameter set
+class BitWriter
+{
+public:
+  BitWriter() :m_uiBits(0) {}
+
+  void writeBits(uint32_t uiValue, unsigned uiBits)
+  {
+    for (unsigned i = uiBits; i-- > 0;)
+    {
+      if (m_uiBits % 8 == 0) m_vBytes.push_back(0);
+      m_vBytes.back() |= static_cast<uint8_t>(((uiValue >> i) & 1) << (7 - m_uiBits % 8));
+      ++m_uiBits;
+    }
+  }
+
+  void writeUe(uint32_t uiValue)
+  {
+    unsigned uiBits = 0;
+    while (((uiValue + 1) >> uiBits) > 1) ++uiBits;
+    writeBits(0, uiBits);
+    writeBits(uiValue + 1, uiBits + 1);
+  }
+
+  /// Adds the stop bit and emulation prevention bytes
+  std::string toNal()
+  {
+    writeBits(1, 1);
+    std::string sNal;
+    int iZeros = 0;
+    for (uint8_t uiByte : m_vBytes)
+    {
+      if (iZeros >= 2 && uiByte <= 3)
+      {
+        sNal += static_cast<char>(3);
+        iZeros = 0;
+      }
+      sNal += static_cast<char>(uiByte);
+      iZeros = uiByte == 0 ? iZeros + 1 : 0;
+    }
+    return sNal;
+  }
+
+private:
+  std::vector<uint8_t> m_vBytes;
+  size_t m_uiBits;
+};
+
+/// general_profile_space to general_level_idc of a Main 10 stream at level 3.1
+static const uint8_t PROFILE_TIER_LEVEL[12] = { 0x02, 0x20, 0x00, 0x00, 0x00, 0x90, 0x00, 0x00, 0x00, 0x00, 0x00, 93 };
+
+static std::string makeSps()
+{
+  BitWriter sps;
+  // NAL unit header: type 33
+  sps.writeBits(33 << 1, 8);
+  sps.writeBits(1, 8);
+  sps.writeBits(0, 4);
+  // sps_max_sub_layers_minus1 and sps_temporal_id_nesting_flag
+  sps.writeBits(0, 3);
+  sps.writeBits(1, 1);
+  for (uint8_t uiByte : PROFILE_TIER_LEVEL) sps.writeBits(uiByte, 8);
+  sps.writeUe(0);
+  // 4:2:0
+  sps.writeUe(1);
+  sps.writeUe(1280);
+  sps.writeUe(720);
+  sps.writeBits(0, 1);
+  // 10 bit luma and chroma
+  sps.writeUe(2);
+  sps.writeUe(2);
+  return sps.toNal();
+}
+
+static std::string makeNal(uint8_t uiType, size_t uiPayload, unsigned uiSeed)
+{
+  std::string sNal;
+  sNal += static_cast<char>(uiType << 1);
+  sNal += static_cast<char>(1);
+  // no zeros: the payload contains no start code
+  for (uint8_t uiByte : makeRandomBytes(uiPayload, uiSeed)) sNal += static_cast<char>(uiByte | 0x10);
+  return sNal;
+}
+
+static void appendLengthPrefixed(std::vector<uint8_t>& vData, const std::string& sNal)
+{
+  const size_t uiLength = sNal.length();
+  const uint8_t LENGTH[] = { static_cast<uint8_t>(uiLength >> 24), static_cast<uint8_t>(uiLength >> 16), static_cast<uint8_t>(uiLength >> 8), static_cast<uint8_t>(uiLength) };
+  vData.insert(vData.end(), LENGTH, LENGTH + 4);
+  vData.insert(vData.end(), sNal.begin(), sNal.end());
+}
+
+static void testStartCodeKernels()
+{
+  // mostly zeros, so that there are start codes and near misses everywhere
+  std::vector<uint8_t> vData = makeRandomBytes(4096, 5);
+  for (uint8_t& uiByte : vData) uiByte = uiByte < 200 ? 0 : (uiByte < 240 ? 1 : uiByte);
+  AnnexBRewriter scalar;
+  scalar.setInstructionSet(AnnexBRewriter::IS_SCALAR);
+  for (int i = AnnexBRewriter::IS_SSE2; i <= AnnexBRewriter::detectInstructionSet(); ++i)
+  {
+    AnnexBRewriter rewriter;
+    rewriter.setInstructionSet(static_cast<AnnexBRewriter::InstructionSet>(i));
+    bool bSame = true;
+    for (size_t uiLength : { static_cast<size_t>(4096), static_cast<size_t>(4093), static_cast<size_t>(37) })
+    {
+      for (size_t uiPos = 0; uiPos <= uiLength; ++uiPos)
+      {
+        bSame = bSame && rewriter.findStartCode(&vData[0], uiLength, uiPos) == scalar.findStartCode(&vData[0], uiLength, uiPos);
+      }
+    }
+    if (!bSame) fprintf(stderr, "%s finds other start codes than scalar\n", AnnexBRewriter::toString(static_cast<AnnexBRewriter::InstructionSet>(i)));
+    CHECK(bSame);
+  }
+}
+
+static void testToLengthPrefixed()
+{
+  const std::string NALS[] = { makeNal(32, 20, 1), makeSps(), makeNal(34, 5, 2), makeNal(39, 40, 3), makeNal(19, 3000, 4), makeNal(1, 700, 5), makeNal(38, 1, 6) };
+  // x265 writes a 4 byte start code for the first NAL unit and 3 byte ones after it
+  std::vector<uint8_t> vAnnexB;
+  std::vector<uint8_t> vExpected;
+  size_t uiShortStartCodes = 0;
+  for (size_t i = 0; i < sizeof(NALS) / sizeof(NALS[0]); ++i)
+  {
+    const bool bLong = i == 0 || i == 4;
+    if (bLong) vAnnexB.push_back(0);
+    else ++uiShortStartCodes;
+    vAnnexB.push_back(0);
+    vAnnexB.push_back(0);
+    vAnnexB.push_back(1);
+    vAnnexB.insert(vAnnexB.end(), NALS[i].begin(), NALS[i].end());
+    appendLengthPrefixed(vExpected, NALS[i]);
+  }
+  // trailing_zero_8bits are dropped
+  vAnnexB.push_back(0);
+  vAnnexB.push_back(0);
+
+  for (int i = AnnexBRewriter::IS_SCALAR; i <= AnnexBRewriter::detectInstructionSet(); ++i)
+  {
+    AnnexBRewriter rewriter;
+    rewriter.setInstructionSet(static_cast<AnnexBRewriter::InstructionSet>(i));
+    std::vector<uint8_t> vData(vAnnexB);
+    vData.resize(vAnnexB.size() + uiShortStartCodes);
+    size_t uiNewLength = 0;
+    CHECK(rewriter.toLengthPrefixed(&vData[0], vAnnexB.size(), vData.size(), uiNewLength));
+    CHECK_EQ(vExpected.size(), uiNewLength);
+    vData.resize(uiNewLength);
+    CHECK(vData == vExpected);
+    CHECK(AnnexBRewriter::isLengthPrefixed(&vData[0], vData.size()));
+
+    // already length-prefixed: left as it is
+    CHECK(rewriter.toLengthPrefixed(&vData[0], vData.size(), vData.size(), uiNewLength));
+    CHECK_EQ(vExpected.size(), uiNewLength);
+    CHECK(vData == vExpected);
+
+    // too little room for the longer prefixes
+    std::vector<uint8_t> vShort(vAnnexB);
+    CHECK(!rewriter.toLengthPrefixed(&vShort[0], vShort.size() - 2, vShort.size() - 2, uiNewLength));
+    CHECK(!rewriter.getLastError().empty());
+  }
+
+  // data before the first start code
+  AnnexBRewriter rewriter;
+  std::vector<uint8_t> vGarbage(vAnnexB);
+  vGarbage[0] = 0x42;
+  size_t uiNewLength = 0;
+  CHECK(!rewriter.toLengthPrefixed(&vGarbage[0], vGarbage.size(), vGarbage.size() + 8, uiNewLength));
+
+  // each slice with the NAL units before it, the filler data after the last
+  std::vector<size_t> vEnds;
+  rewriter.findSliceEnds(&vExpected[0], vExpected.size(), true, vEnds);
+  CHECK_EQ(2, vEnds.size());
+  size_t uiFirstGroup = 0;
+  for (size_t i = 0; i < 5; ++i) uiFirstGroup += 4 + NALS[i].length();
+  CHECK_EQ(uiFirstGroup, vEnds[0]);
+  CHECK_EQ(vExpected.size(), vEnds[1]);
+}
+
+static void testBuildHvcc()
+{
+  const std::string sVps = makeNal(32, 20, 1);
+  const std::string sSps = makeSps();
+  const std::string sPps = makeNal(34, 5, 2);
+  // the profile bytes need emulation prevention in the NAL unit
+  CHECK(sSps.find(std::string("\x00\x00\x03", 3)) != std::string::npos);
+
+  std::string sHvcc;
+  unsigned uiProfile = 0;
+  unsigned uiLevel = 0;
+  // bare and Annex B parameter sets give the same record
+  CHECK(AnnexBRewriter::buildHvcc(sVps, std::string("\x00\x00\x00\x01", 4) + sSps, sPps, sHvcc, uiProfile, uiLevel));
+  std::string sBareHvcc;
+  CHECK(AnnexBRewriter::buildHvcc(sVps, sSps, sPps, sBareHvcc, uiProfile, uiLevel));
+  CHECK(sHvcc == sBareHvcc);
+  CHECK_EQ(2, uiProfile);
+  CHECK_EQ(93, uiLevel);
+
+  CHECK_EQ(23 + 3 * 5 + sVps.length() + sSps.length() + sPps.length(), sHvcc.length());
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(sHvcc.data());
+  CHECK_EQ(1, p[0]);
+  CHECK(std::string(sHvcc, 1, 12) == std::string(reinterpret_cast<const char*>(PROFILE_TIER_LEVEL), 12));
+  // chroma_format_idc, bit depths, one temporal layer nested, 4 byte lengths, 3 arrays
+  CHECK_EQ(0xFC | 1, p[16]);
+  CHECK_EQ(0xF8 | 2, p[17]);
+  CHECK_EQ(0xF8 | 2, p[18]);
+  CHECK_EQ((1 << 3) | (1 << 2) | 3, p[21]);
+  CHECK_EQ(3, p[22]);
+  size_t uiPos = 23;
+  const std::string* NALS[] = { &sVps, &sSps, &sPps };
+  const uint8_t TYPES[] = { 32, 33, 34 };
+  for (int i = 0; i < 3; ++i)
+  {
+    CHECK_EQ(0x80 | TYPES[i], p[uiPos]);
+    CHECK_EQ(1, (p[uiPos + 1] << 8) | p[uiPos + 2]);
+    CHECK_EQ(NALS[i]->length(), (p[uiPos + 3] << 8) | p[uiPos + 4]);
+    CHECK(sHvcc.compare(uiPos + 5, NALS[i]->length(), *NALS[i]) == 0);
+    uiPos += 5 + NALS[i]->length();
+  }
+
+  CHECK(!AnnexBRewriter::buildHvcc(sVps, sSps, "", sHvcc, uiProfile, uiLevel));
+  // a PPS in place of the SPS
+  CHECK(!AnnexBRewriter::buildHvcc(sVps, sPps, sPps, sHvcc, uiProfile, uiLevel));
+}
+
+int main()
+{
+  testStartCodeKernels();
+  testToLengthPrefixed();
+  testBuildHvcc();
+  return TEST_RESULT();
+}
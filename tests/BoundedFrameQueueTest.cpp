@@ -0,0 +1,102 @@
+/**
+ * BoundedFrameQueue: the overflow policies, FIFO order across threads, close and drain.
+ */
+#include "BoundedFrameQueue.h"
+#include <thread>
+#include <vector>
+#include "TestUtil.h"
+
+static void testPolicies()
+{
+  QueueOverflowPolicy ePolicy = QOP_BLOCK;
+  CHECK(parseQueueOverflowPolicy("drop_oldest", ePolicy) && ePolicy == QOP_DROP_OLDEST);
+  CHECK(parseQueueOverflowPolicy("drop_newest", ePolicy) && ePolicy == QOP_DROP_NEWEST);
+  CHECK(parseQueueOverflowPolicy("block", ePolicy) && ePolicy == QOP_BLOCK);
+  CHECK(!parseQueueOverflowPolicy("drop", ePolicy));
+
+  BoundedFrameQueue<int> queue;
+  int iEvicted = -1;
+  // closed until opened
+  CHECK_EQ(BoundedFrameQueue<int>::PR_CLOSED, queue.push(1, iEvicted));
+
+  queue.open(2, QOP_DROP_OLDEST);
+  CHECK_EQ(BoundedFrameQueue<int>::PR_QUEUED, queue.push(1, iEvicted));
+  CHECK_EQ(BoundedFrameQueue<int>::PR_QUEUED, queue.push(2, iEvicted));
+  CHECK_EQ(BoundedFrameQueue<int>::PR_QUEUED_EVICTED, queue.push(3, iEvicted));
+  CHECK_EQ(1, iEvicted);
+  CHECK_EQ(2, queue.size());
+  int iItem = 0;
+  uint64_t uiWaitUs = 0;
+  CHECK(queue.tryPop(iItem, uiWaitUs));
+  CHECK_EQ(2, iItem);
+  queue.finish();
+  std::vector<int> vDrained;
+  queue.drain(vDrained);
+  CHECK(vDrained == std::vector<int>(1, 3));
+  CHECK(!queue.tryPop(iItem, uiWaitUs));
+  queue.close();
+
+  queue.open(1, QOP_DROP_NEWEST);
+  CHECK_EQ(BoundedFrameQueue<int>::PR_QUEUED, queue.push(1, iEvicted));
+  CHECK_EQ(BoundedFrameQueue<int>::PR_REJECTED, queue.push(2, iEvicted));
+  CHECK(queue.tryPop(iItem, uiWaitUs));
+  CHECK_EQ(1, iItem);
+  queue.finish();
+  queue.close();
+}
+
+/// A blocking producer hands every item over in order and waitUntilIdle returns after the last
+static void testBlockingHandOver()
+{
+  static const int ITEMS = 10000;
+  BoundedFrameQueue<int> queue;
+  queue.open(4, QOP_BLOCK);
+  std::vector<int> vReceived;
+  std::thread consumer([&]() {
+    int iItem = 0;
+    uint64_t uiWaitUs = 0;
+    while (queue.pop(iItem, uiWaitUs))
+    {
+      vReceived.push_back(iItem);
+    }
+  });
+  int iEvicted = -1;
+  for (int i = 0; i < ITEMS; ++i)
+  {
+    CHECK_EQ(BoundedFrameQueue<int>::PR_QUEUED, queue.push(i, iEvicted));
+  }
+  queue.waitUntilIdle();
+  CHECK_EQ(0, queue.size());
+  queue.close();
+  consumer.join();
+  CHECK_EQ(ITEMS, vReceived.size());
+  bool bInOrder = true;
+  for (size_t i = 0; i < vReceived.size(); ++i)
+  {
+    bInOrder = bInOrder && vReceived[i] == static_cast<int>(i);
+  }
+  CHECK(bInOrder);
+}
+
+/// close wakes a producer that waits for space
+static void testCloseWakesProducer()
+{
+  BoundedFrameQueue<int> queue;
+  queue.open(1, QOP_BLOCK);
+  int iEvicted = -1;
+  CHECK_EQ(BoundedFrameQueue<int>::PR_QUEUED, queue.push(1, iEvicted));
+  BoundedFrameQueue<int>::PushResult eResult = BoundedFrameQueue<int>::PR_QUEUED;
+  std::thread producer([&]() { eResult = queue.push(2, iEvicted); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  queue.close();
+  producer.join();
+  CHECK_EQ(BoundedFrameQueue<int>::PR_CLOSED, eResult);
+}
+
+int main()
+{
+  testPolicies();
+  testBlockingHandOver();
+  testCloseWakesProducer();
+  return TEST_RESULT();
+}
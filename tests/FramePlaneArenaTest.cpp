@@ -0,0 +1,107 @@
+/**
+ * FramePlaneArena: plane layout and alignment, and no allocation once a buffer of the size is
+ * in the pool, also with several threads taking and returning buffers.
+ */
+#include "FramePlaneArena.h"
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "TestUtil.h"
+
+static bool isAligned(const void* p)
+{
+  return reinterpret_cast<uintptr_t>(p) % FramePlaneArena::ALIGNMENT == 0;
+}
+
+static void testLayout()
+{
+  FramePlaneArena& arena = FramePlaneArena::getInstance();
+  FramePlanes packed = arena.acquire(641, 361, false);
+  CHECK(packed.pY != NULL);
+  CHECK(isAligned(packed.pY));
+  CHECK_EQ(641, packed.iYStride);
+  CHECK_EQ(321, packed.iUvStride);
+  CHECK(packed.pU == packed.pY + 641 * 361);
+  CHECK(packed.pV == packed.pU + 321 * 181);
+  CHECK_EQ(641 * 361 + 2 * 321 * 181, packed.uiSize);
+  CHECK(packed.uiCapacity >= packed.uiSize);
+  // the whole picture is writable
+  memset(packed.pY, 0x80, packed.uiSize);
+  arena.release(packed);
+  CHECK(packed.pY == NULL && packed.pBlock == NULL);
+
+  FramePlanes padded = arena.acquire(641, 361, true);
+  CHECK(padded.pY != NULL);
+  CHECK_EQ(0, padded.iYStride % FramePlaneArena::ALIGNMENT);
+  CHECK_EQ(0, padded.iUvStride % FramePlaneArena::ALIGNMENT);
+  CHECK(padded.iYStride >= 641 && padded.iUvStride >= 321);
+  CHECK(isAligned(padded.pY) && isAligned(padded.pU) && isAligned(padded.pV));
+  CHECK(padded.pU >= padded.pY + padded.iYStride * 361);
+  CHECK(padded.pV >= padded.pU + padded.iUvStride * 181);
+  CHECK(padded.pV + padded.iUvStride * 181 == padded.pY + padded.uiSize);
+  memset(padded.pY, 0x80, padded.uiSize);
+  arena.release(padded);
+
+  // releasing planes that were never acquired does nothing
+  FramePlanes none;
+  arena.release(none);
+}
+
+static void testReuse()
+{
+  FramePlaneArena& arena = FramePlaneArena::getInstance();
+  FramePlanes planes = arena.acquire(1920, 1080, true);
+  arena.release(planes);
+  const uint64_t ullAllocations = arena.getAllocationCount();
+  const uint64_t ullReuses = arena.getReuseCount();
+  for (int i = 0; i < 1000; ++i)
+  {
+    planes = arena.acquire(1920, 1080, true);
+    CHECK(planes.pY != NULL);
+    arena.release(planes);
+  }
+  CHECK_EQ(ullAllocations, arena.getAllocationCount());
+  CHECK_EQ(ullReuses + 1000, arena.getReuseCount());
+
+  // a slightly smaller picture takes the same buffer, one that would waste half of it does not
+  planes = arena.acquire(1600, 900, true);
+  arena.release(planes);
+  CHECK_EQ(ullAllocations, arena.getAllocationCount());
+  planes = arena.acquire(320, 180, true);
+  arena.release(planes);
+  CHECK_EQ(ullAllocations + 1, arena.getAllocationCount());
+}
+
+/// Threads that each hold one buffer at a time allocate no more buffers than there are threads
+static void testThreads()
+{
+  static const int THREADS = 4;
+  FramePlaneArena& arena = FramePlaneArena::getInstance();
+  const uint64_t ullAllocations = arena.getAllocationCount();
+  std::vector<std::thread> vThreads;
+  for (int t = 0; t < THREADS; ++t)
+  {
+    vThreads.push_back(std::thread([&arena, t]() {
+      for (int i = 0; i < 2000; ++i)
+      {
+        FramePlanes planes = arena.acquire(1280, 720, false);
+        CHECK(planes.pY != NULL);
+        planes.pY[i % planes.uiSize] = static_cast<uint8_t>(t);
+        arena.release(planes);
+      }
+    }));
+  }
+  for (std::thread& thread : vThreads)
+  {
+    thread.join();
+  }
+  CHECK(arena.getAllocationCount() - ullAllocations <= THREADS);
+}
+
+int main()
+{
+  testLayout();
+  testReuse();
+  testThreads();
+  return TEST_RESULT();
+}
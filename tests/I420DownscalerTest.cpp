@@ -0,0 +1,105 @@
+/**
+ * I420Downscaler: the SIMD kernels give the same bytes as the scalar code, halving is a
+ * rounded 2x2 average, flat pictures stay flat and the cached taps give the same result on
+ * every frame.
+ */
+#include "I420Downscaler.h"
+#include <algorithm>
+#include <vector>
+#include "SimdRgb24ToI420Converter.h"
+#include "TestUtil.h"
+
+struct I420Picture
+{
+  I420Picture(int iWidth, int iHeight, int iPadding, unsigned uiSeed)
+    :iYStride(iWidth + iPadding),
+    iUvStride((iWidth + 1) / 2 + iPadding),
+    iUvHeight((iHeight + 1) / 2),
+    vY(makeRandomBytes(static_cast<size_t>(iYStride) * iHeight, uiSeed)),
+    vU(makeRandomBytes(static_cast<size_t>(iUvStride) * iUvHeight, uiSeed + 1)),
+    vV(makeRandomBytes(static_cast<size_t>(iUvStride) * iUvHeight, uiSeed + 2))
+  {
+  }
+  int iYStride;
+  int iUvStride;
+  int iUvHeight;
+  std::vector<uint8_t> vY;
+  std::vector<uint8_t> vU;
+  std::vector<uint8_t> vV;
+};
+
+static std::vector<uint8_t> scale(I420Downscaler& downscaler, const I420Picture& picture)
+{
+  std::vector<uint8_t> vDst(downscaler.getDstSize());
+  downscaler.scale(&picture.vY[0], picture.iYStride, &picture.vU[0], &picture.vV[0], picture.iUvStride, &vDst[0]);
+  return vDst;
+}
+
+static void testKernelsMatchScalar()
+{
+  // exact halvings, halvings followed by bilinear, bilinear only and odd sizes
+  static const int SIZES[][4] = { { 64, 48, 32, 24 }, { 1920, 1080, 640, 360 }, { 1920, 1080, 1280, 720 }, { 1280, 720, 960, 540 },
+    { 101, 77, 33, 25 }, { 35, 17, 34, 16 }, { 640, 360, 160, 90 } };
+  const int iDetected = SimdRgb24ToI420Converter::detectInstructionSet();
+  unsigned uiSeed = 1;
+  for (const auto& size : SIZES)
+  {
+    const I420Picture picture(size[0], size[1], 13, uiSeed);
+    uiSeed += 3;
+    I420Downscaler reference(size[0], size[1], size[2], size[3]);
+    reference.setMaxInstructionSet(SimdRgb24ToI420Converter::IS_SCALAR);
+    const std::vector<uint8_t> vExpected = scale(reference, picture);
+    for (int i = SimdRgb24ToI420Converter::IS_SSE41; i <= iDetected; ++i)
+    {
+      I420Downscaler downscaler(size[0], size[1], size[2], size[3]);
+      downscaler.setMaxInstructionSet(i);
+      const bool bSame = scale(downscaler, picture) == vExpected;
+      if (!bSame)
+      {
+        fprintf(stderr, "%s differs from scalar for %dx%d to %dx%d\n", downscaler.getKernelName(), size[0], size[1], size[2], size[3]);
+      }
+      CHECK(bSame);
+    }
+    // the second frame uses the taps of the first
+    CHECK(scale(reference, picture) == vExpected);
+  }
+}
+
+static void testHalving()
+{
+  const I420Picture picture(16, 8, 0, 7);
+  I420Downscaler downscaler(16, 8, 8, 4);
+  const std::vector<uint8_t> vDst = scale(downscaler, picture);
+  for (int y = 0; y < 4; ++y)
+  {
+    for (int x = 0; x < 8; ++x)
+    {
+      const uint8_t* p = &picture.vY[2 * y * 16 + 2 * x];
+      CHECK_EQ((p[0] + p[1] + p[16] + p[17] + 2) >> 2, vDst[y * 8 + x]);
+    }
+  }
+}
+
+static void testFlatStaysFlat()
+{
+  I420Picture picture(1920, 1080, 0, 1);
+  std::fill(picture.vY.begin(), picture.vY.end(), 200);
+  std::fill(picture.vU.begin(), picture.vU.end(), 16);
+  std::fill(picture.vV.begin(), picture.vV.end(), 240);
+  I420Downscaler downscaler(1920, 1080, 854, 480);
+  const std::vector<uint8_t> vDst = scale(downscaler, picture);
+  const size_t uiLuma = 854 * 480;
+  const size_t uiChroma = 427 * 240;
+  CHECK_EQ(uiLuma + 2 * uiChroma, vDst.size());
+  CHECK(std::count(vDst.begin(), vDst.begin() + uiLuma, 200) == static_cast<long>(uiLuma));
+  CHECK(std::count(vDst.begin() + uiLuma, vDst.begin() + uiLuma + uiChroma, 16) == static_cast<long>(uiChroma));
+  CHECK(std::count(vDst.begin() + uiLuma + uiChroma, vDst.end(), 240) == static_cast<long>(uiChroma));
+}
+
+int main()
+{
+  testKernelsMatchScalar();
+  testHalving();
+  testFlatStaysFlat();
+  return TEST_RESULT();
+}
@@ -0,0 +1,226 @@
+/**
+ * SimdRgb24ToI420Converter: every kernel the CPU supports gives the same bytes as the scalar
+ * kernel, and the output is within 1 of the floating point conversion of the VPP converter.
+ * It is not bit-exact against VPP: the kernels round in Q15 fixed point and take chroma from
+ * the sum of a 2x2 block rather than from its rounded average.
+ */
+#include "SimdRgb24ToI420Converter.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "TestUtil.h"
+#ifdef HAVE_VPP
+#include <ImageUtils/RealRGB24toYUV420ConverterStl.h>
+#endif
+
+/// marks bytes of the destination that must not be written
+static const uint8_t UNTOUCHED = 0xA5;
+
+struct RgbImage
+{
+  int iWidth;
+  int iHeight;
+  int iStride;
+  std::vector<uint8_t> vRgb;
+};
+
+/**
+ * Random pixels with a band of saturated primaries, which take U and V to the clamp. The
+ * row padding is random too: a kernel that reads it changes the output.
+ */
+static RgbImage makeImage(int iWidth, int iHeight, int iStride, unsigned uiSeed)
+{
+  RgbImage image;
+  image.iWidth = iWidth;
+  image.iHeight = iHeight;
+  image.iStride = iStride;
+  image.vRgb = makeRandomBytes(static_cast<size_t>(iStride) * iHeight, uiSeed);
+  static const uint8_t PRIMARIES[][3] = { { 255, 0, 0 }, { 0, 255, 0 }, { 0, 0, 255 }, { 255, 255, 255 }, { 0, 0, 0 } };
+  for (int y = 0; y < iHeight; y += 3)
+  {
+    for (int x = 0; x < iWidth; ++x)
+    {
+      memcpy(&image.vRgb[y * iStride + 3 * x], PRIMARIES[(x / 2 + y) % 5], 3);
+    }
+  }
+  return image;
+}
+
+/// Planes with a margin after each row and after each plane that must stay untouched
+struct I420Planes
+{
+  I420Planes(int iWidth, int iHeight, int iMargin)
+    :iYStride(iWidth + iMargin),
+    iUvStride((iWidth + 1) / 2 + iMargin),
+    vY(static_cast<size_t>(iYStride) * iHeight + iMargin, UNTOUCHED),
+    vU(static_cast<size_t>(iUvStride) * ((iHeight + 1) / 2) + iMargin, UNTOUCHED),
+    vV(vU.size(), UNTOUCHED)
+  {
+  }
+  int iYStride;
+  int iUvStride;
+  std::vector<uint8_t> vY;
+  std::vector<uint8_t> vU;
+  std::vector<uint8_t> vV;
+};
+
+static I420Planes convert(const RgbImage& image, SimdRgb24ToI420Converter::InstructionSet eInstructionSet, bool bFlip, int iMargin)
+{
+  SimdRgb24ToI420Converter converter(image.iWidth, image.iHeight);
+  converter.setInstructionSet(eInstructionSet);
+  converter.setFlip(bFlip);
+  I420Planes planes(image.iWidth, image.iHeight, iMargin);
+  converter.convert(&image.vRgb[0], image.iStride, &planes.vY[0], planes.iYStride, &planes.vU[0], &planes.vV[0], planes.iUvStride);
+  return planes;
+}
+
+/**
+ * BT.601 in floating point as the VPP converter computes it: chroma from the average of
+ * each 2x2 block, the last column and row replicated for odd sizes.
+ */
+static std::vector<uint8_t> convertReference(const RgbImage& image, bool bFlip)
+{
+  const int iWidth = image.iWidth;
+  const int iHeight = image.iHeight;
+  const int iUvWidth = (iWidth + 1) / 2;
+  std::vector<uint8_t> vYuv(iWidth * iHeight + 2 * iUvWidth * ((iHeight + 1) / 2));
+  uint8_t* pU = &vYuv[iWidth * iHeight];
+  uint8_t* pV = pU + iUvWidth * ((iHeight + 1) / 2);
+  auto pixel = [&](int x, int y) { return &image.vRgb[(bFlip ? iHeight - 1 - y : y) * image.iStride + 3 * x]; };
+  for (int y = 0; y < iHeight; ++y)
+  {
+    for (int x = 0; x < iWidth; ++x)
+    {
+      const uint8_t* p = pixel(x, y);
+      vYuv[y * iWidth + x] = static_cast<uint8_t>(std::floor(0.299 * p[2] + 0.587 * p[1] + 0.114 * p[0] + 0.5));
+    }
+  }
+  for (int y = 0; y < iHeight; y += 2)
+  {
+    for (int x = 0; x < iWidth; x += 2)
+    {
+      double b = 0, g = 0, r = 0;
+      for (int i = 0; i < 4; ++i)
+      {
+        const uint8_t* p = pixel((std::min)(x + (i & 1), iWidth - 1), (std::min)(y + (i >> 1), iHeight - 1));
+        b += p[0] / 4.0;
+        g += p[1] / 4.0;
+        r += p[2] / 4.0;
+      }
+      const double u = (std::max)(0.0, (std::min)(255.0, -0.147 * r - 0.289 * g + 0.436 * b + 128));
+      const double v = (std::max)(0.0, (std::min)(255.0, 0.615 * r - 0.515 * g - 0.100 * b + 128));
+      pU[(y / 2) * iUvWidth + x / 2] = static_cast<uint8_t>(std::floor(u + 0.5));
+      pV[(y / 2) * iUvWidth + x / 2] = static_cast<uint8_t>(std::floor(v + 0.5));
+    }
+  }
+  return vYuv;
+}
+
+/// Largest difference between the planes and a contiguous I420 picture
+static int getMaxDiff(const I420Planes& planes, int iWidth, int iHeight, const std::vector<uint8_t>& vYuv)
+{
+  const int iUvWidth = (iWidth + 1) / 2;
+  const int iUvHeight = (iHeight + 1) / 2;
+  const uint8_t* pU = &vYuv[iWidth * iHeight];
+  const uint8_t* pV = pU + iUvWidth * iUvHeight;
+  int iMaxDiff = 0;
+  for (int y = 0; y < iHeight; ++y)
+  {
+    for (int x = 0; x < iWidth; ++x)
+    {
+      iMaxDiff = (std::max)(iMaxDiff, std::abs(planes.vY[y * planes.iYStride + x] - vYuv[y * iWidth + x]));
+    }
+  }
+  for (int y = 0; y < iUvHeight; ++y)
+  {
+    for (int x = 0; x < iUvWidth; ++x)
+    {
+      iMaxDiff = (std::max)(iMaxDiff, std::abs(planes.vU[y * planes.iUvStride + x] - pU[y * iUvWidth + x]));
+      iMaxDiff = (std::max)(iMaxDiff, std::abs(planes.vV[y * planes.iUvStride + x] - pV[y * iUvWidth + x]));
+    }
+  }
+  return iMaxDiff;
+}
+
+/// Counts bytes outside the pictures that were written
+static int countMarginWrites(const I420Planes& planes, int iWidth, int iHeight)
+{
+  int iWrites = 0;
+  auto count = [&](const std::vector<uint8_t>& vPlane, int iStride, int iPlaneWidth, int iPlaneHeight) {
+    for (size_t i = 0; i < vPlane.size(); ++i)
+    {
+      const bool bInside = static_cast<int>(i / iStride) < iPlaneHeight && static_cast<int>(i % iStride) < iPlaneWidth;
+      if (!bInside && vPlane[i] != UNTOUCHED) ++iWrites;
+    }
+  };
+  count(planes.vY, planes.iYStride, iWidth, iHeight);
+  count(planes.vU, planes.iUvStride, (iWidth + 1) / 2, (iHeight + 1) / 2);
+  count(planes.vV, planes.iUvStride, (iWidth + 1) / 2, (iHeight + 1) / 2);
+  return iWrites;
+}
+
+int main()
+{
+  static const int SIZES[][2] = { { 1, 1 }, { 2, 2 }, { 3, 5 }, { 15, 7 }, { 16, 16 }, { 17, 9 }, { 33, 31 }, { 64, 48 }, { 95, 3 }, { 352, 288 }, { 641, 361 } };
+  const SimdRgb24ToI420Converter::InstructionSet eDetected = SimdRgb24ToI420Converter::detectInstructionSet();
+  printf("detected %s\n", SimdRgb24ToI420Converter::toString(eDetected));
+  int iMaxReferenceDiff = 0;
+  unsigned uiSeed = 1;
+  for (const auto& size : SIZES)
+  {
+    const int iWidth = size[0];
+    const int iHeight = size[1];
+    // a DIB and a buffer with rows padded further, e.g. a cropped picture
+    const int STRIDES[] = { SimdRgb24ToI420Converter::getDibStride(iWidth), 3 * iWidth + 61 };
+    for (int iStride : STRIDES)
+    {
+      const RgbImage image = makeImage(iWidth, iHeight, iStride, uiSeed++);
+      for (bool bFlip : { false, true })
+      {
+        const I420Planes expected = convert(image, SimdRgb24ToI420Converter::IS_SCALAR, bFlip, 7);
+        CHECK_EQ(0, countMarginWrites(expected, iWidth, iHeight));
+        for (int i = SimdRgb24ToI420Converter::IS_SSE41; i <= eDetected; ++i)
+        {
+          const I420Planes actual = convert(image, static_cast<SimdRgb24ToI420Converter::InstructionSet>(i), bFlip, 7);
+          const bool bSame = actual.vY == expected.vY && actual.vU == expected.vU && actual.vV == expected.vV;
+          if (!bSame)
+          {
+            fprintf(stderr, "%s differs from scalar at %dx%d, stride %d, flip %d\n",
+              SimdRgb24ToI420Converter::toString(static_cast<SimdRgb24ToI420Converter::InstructionSet>(i)), iWidth, iHeight, iStride, bFlip);
+          }
+          CHECK(bSame);
+        }
+        const int iDiff = getMaxDiff(expected, iWidth, iHeight, convertReference(image, bFlip));
+        CHECK(iDiff <= 1);
+        iMaxReferenceDiff = (std::max)(iMaxReferenceDiff, iDiff);
+
+        // the contiguous overload lays the planes out back to back
+        SimdRgb24ToI420Converter converter(iWidth, iHeight);
+        converter.setFlip(bFlip);
+        std::vector<uint8_t> vYuv(converter.getI420Size());
+        CHECK(converter.convert(&image.vRgb[0], static_cast<unsigned>(image.vRgb.size()), iStride, &vYuv[0], static_cast<unsigned>(vYuv.size())));
+        CHECK_EQ(0, getMaxDiff(expected, iWidth, iHeight, vYuv));
+        CHECK(!converter.convert(&image.vRgb[0], static_cast<unsigned>(image.vRgb.size()), iStride, &vYuv[0], static_cast<unsigned>(vYuv.size()) - 1));
+
+#ifdef HAVE_VPP
+        if (iStride == SimdRgb24ToI420Converter::getDibStride(iWidth))
+        {
+          // the VPP converter takes DIBs only
+          RealRGB24toYUV420ConverterStl<uint8_t> legacy(iWidth, iHeight, 128);
+          legacy.SetFlip(bFlip);
+          legacy.SetChrominanceOffset(128);
+          std::vector<uint8_t> vLegacy(converter.getI420Size());
+          CHECK(legacy.Convert(&image.vRgb[0], static_cast<int>(image.vRgb.size()), &vLegacy[0], static_cast<int>(vLegacy.size())));
+          const int iLegacyDiff = getMaxDiff(expected, iWidth, iHeight, vLegacy);
+          CHECK(iLegacyDiff <= 1);
+        }
+#endif
+      }
+    }
+  }
+  printf("max_diff to the floating point conversion: %d\n", iMaxReferenceDiff);
+  return TEST_RESULT();
+}
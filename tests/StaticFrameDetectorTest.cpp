@@ -0,0 +1,114 @@
+/**
+ * StaticFrameDetector: the SSE4.2 kernel computes the scalar CRCs, a change marks exactly the
+ * block it falls into, counted from the top left of the picture, and bytes outside the
+ * picture are ignored.
+ */
+#include "StaticFrameDetector.h"
+#include <vector>
+#include "TestUtil.h"
+
+static const int BLOCK_SIZE = 16;
+
+/// Offset of pixel (x, y) of the picture, counted from its top left
+static unsigned getRgbOffset(const InputPictureLayout& layout, int x, int y)
+{
+  const int iRow = layout.bBottomUp ? layout.iHeight - 1 - y : y;
+  return layout.uiYOffset + iRow * layout.iYStride + 3 * x;
+}
+
+static void testKernelsMatchScalar(const InputPictureLayout& layout, const std::vector<uint8_t>& vSample)
+{
+  if (StaticFrameDetector::detectInstructionSet() < StaticFrameDetector::IS_SSE42)
+  {
+    printf("no SSE4.2: only the scalar kernel is tested\n");
+    return;
+  }
+  for (int iBlockSize : { 0, BLOCK_SIZE, 64 })
+  {
+    StaticFrameDetector scalar(layout, iBlockSize);
+    scalar.setInstructionSet(StaticFrameDetector::IS_SCALAR);
+    StaticFrameDetector sse42(layout, iBlockSize);
+    sse42.setInstructionSet(StaticFrameDetector::IS_SSE42);
+    const size_t uiHashes = static_cast<size_t>(scalar.getBlockColumns()) * scalar.getBlockRows() * StaticFrameDetector::LANES;
+    std::vector<uint32_t> vExpected(uiHashes);
+    std::vector<uint32_t> vActual(uiHashes);
+    scalar.hash(&vSample[0], &vExpected[0]);
+    sse42.hash(&vSample[0], &vActual[0]);
+    CHECK(vExpected == vActual);
+  }
+}
+
+/// Changes pixel (x, y) and checks that the block it is in, and only that one, is reported
+static void checkChange(StaticFrameDetector& detector, std::vector<uint8_t>& vSample, unsigned uiOffset, int x, int y)
+{
+  vSample[uiOffset] ^= 0x01;
+  CHECK(!detector.isStatic(&vSample[0]));
+  CHECK_EQ(1, detector.getChangedBlockCount());
+  const int iBlock = (y / BLOCK_SIZE) * detector.getBlockColumns() + x / BLOCK_SIZE;
+  CHECK_EQ(1, detector.getChangedBlocks()[iBlock]);
+  CHECK(detector.isStatic(&vSample[0]));
+  CHECK_EQ(0, detector.getChangedBlockCount());
+}
+
+static void testRgb24()
+{
+  // a bottom-up DIB with a crop rectangle: 70x45 of a 83x50 buffer
+  const InputPictureLayout layout = InputPictureLayout::forRgb24(83, 50, 5, 3, 75, 48);
+  CHECK_EQ(70, layout.iWidth);
+  CHECK_EQ(45, layout.iHeight);
+  std::vector<uint8_t> vSample = makeRandomBytes(layout.iYStride * 50, 11);
+  testKernelsMatchScalar(layout, vSample);
+
+  StaticFrameDetector detector(layout, BLOCK_SIZE);
+  CHECK_EQ(5, detector.getBlockColumns());
+  CHECK_EQ(3, detector.getBlockRows());
+  CHECK(!detector.isStatic(&vSample[0]));
+  CHECK(detector.isStatic(&vSample[0]));
+
+  checkChange(detector, vSample, getRgbOffset(layout, 0, 0), 0, 0);
+  checkChange(detector, vSample, getRgbOffset(layout, 69, 44) + 2, 69, 44);
+  checkChange(detector, vSample, getRgbOffset(layout, 17, 40) + 1, 17, 40);
+
+  // the row below the picture in memory and the cropped columns are not hashed
+  vSample[layout.uiYOffset - layout.iYStride] ^= 0xFF;
+  vSample[getRgbOffset(layout, 70, 10)] ^= 0xFF;
+  vSample[getRgbOffset(layout, -1, 10)] ^= 0xFF;
+  CHECK(detector.isStatic(&vSample[0]));
+
+  detector.reset();
+  CHECK(!detector.isStatic(&vSample[0]));
+  CHECK_EQ(15, detector.getChangedBlockCount());
+}
+
+static void testI420()
+{
+  // odd size with a crop: the last block column and row are partial
+  const InputPictureLayout layout = InputPictureLayout::forI420(52, 40, 2, 2, 51, 39);
+  CHECK_EQ(49, layout.iWidth);
+  CHECK_EQ(37, layout.iHeight);
+  std::vector<uint8_t> vSample = makeRandomBytes(52 * 40 * 3 / 2, 12);
+  testKernelsMatchScalar(layout, vSample);
+
+  StaticFrameDetector detector(layout, BLOCK_SIZE);
+  CHECK_EQ(4, detector.getBlockColumns());
+  CHECK_EQ(3, detector.getBlockRows());
+  CHECK(!detector.isStatic(&vSample[0]));
+  CHECK(detector.isStatic(&vSample[0]));
+
+  checkChange(detector, vSample, layout.uiYOffset + 36 * layout.iYStride + 48, 48, 36);
+  // chroma sample (9, 10) lies under luma pixel (18, 20)
+  checkChange(detector, vSample, layout.uiUOffset + 10 * layout.iUvStride + 9, 18, 20);
+  checkChange(detector, vSample, layout.uiVOffset + 0 * layout.iUvStride + 24, 48, 0);
+
+  // the crop margins are not hashed
+  vSample[0] ^= 0xFF;
+  vSample[layout.uiYOffset + 49] ^= 0xFF;
+  CHECK(detector.isStatic(&vSample[0]));
+}
+
+int main()
+{
+  testRgb24();
+  testI420();
+  return TEST_RESULT();
+}
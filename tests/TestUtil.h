@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+/**
+ * Checks for the unit tests, which run without a test framework. A failed check prints where
+ * it failed and the test carries on; main returns TEST_RESULT() so that CTest sees the failure.
+ */
+static int g_iTestFailures = 0;
+
+#define CHECK(condition) \
+  do \
+  { \
+    if (!(condition)) \
+    { \
+      ++g_iTestFailures; \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+    } \
+  } while (0)
+
+#define CHECK_EQ(expected, actual) \
+  do \
+  { \
+    const long long llExpected = static_cast<long long>(expected); \
+    const long long llActual = static_cast<long long>(actual); \
+    if (llExpected != llActual) \
+    { \
+      ++g_iTestFailures; \
+      fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #expected, #actual, llExpected, llActual); \
+    } \
+  } while (0)
+
+#define TEST_RESULT() (g_iTestFailures == 0 ? 0 : 1)
+
+/// Bytes from a fixed seed, so that a failure can be reproduced
+inline std::vector<uint8_t> makeRandomBytes(size_t uiSize, unsigned uiSeed)
+{
+  std::mt19937 generator(uiSeed);
+  std::uniform_int_distribution<int> distribution(0, 255);
+  std::vector<uint8_t> vBytes(uiSize);
+  for (size_t i = 0; i < uiSize; ++i)
+  {
+    vBytes[i] = static_cast<uint8_t>(distribution(generator));
+  }
+  return vBytes;
+}